@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cunit/cunit.h"
+#include "xmalloc.h"
+#include "retry.h"
+#include "util.h"
+#include "libcyr_cfg.h"
+#include "imap/global.h"
+#include "imap/mailbox.h"
+#include "imap/mboxlist.h"
+#include "imap/message.h"
+#include "imap/quota.h"
+#include "testmbox.h"
+
+static void config_read_string(const char *s)
+{
+    char *fname = xstrdup("/tmp/cyrus-cunit-configXXXXXX");
+    int fd = mkstemp(fname);
+    retry_write(fd, s, strlen(s));
+    config_reset();
+    config_read(fname, 0);
+    unlink(fname);
+    free(fname);
+    close(fd);
+}
+
+static int rm_rf(const char *dir)
+{
+    struct buf cmd = BUF_INITIALIZER;
+    int r;
+
+    buf_printf(&cmd, "rm -rf %s", dir);
+    r = system(buf_cstring(&cmd));
+    buf_free(&cmd);
+
+    return r;
+}
+
+int testmbox_set_up(const char *dbdir, const char *config)
+{
+    struct buf path = BUF_INITIALIZER;
+    struct buf conf = BUF_INITIALIZER;
+    int r;
+
+    r = rm_rf(dbdir);
+    if (r)
+	return r;
+
+    r = mkdir(dbdir, 0777);
+    buf_printf(&path, "%s/conf", dbdir);
+    if (!r) r = mkdir(buf_cstring(&path), 0777);
+    buf_reset(&path);
+    buf_printf(&path, "%s/data", dbdir);
+    if (!r) r = mkdir(buf_cstring(&path), 0777);
+    buf_free(&path);
+    if (r < 0) {
+	int e = errno;
+	perror(dbdir);
+	return e;
+    }
+
+    libcyrus_config_setstring(CYRUSOPT_CONFIG_DIR, dbdir);
+    buf_printf(&conf,
+	       "configdirectory: %s/conf\n"
+	       "defaultpartition: "TESTMBOX_PARTITION"\n"
+	       "partition-"TESTMBOX_PARTITION": %s/data\n",
+	       dbdir, dbdir);
+    if (config) buf_appendcstr(&conf, config);
+    config_read_string(buf_cstring(&conf));
+    buf_free(&conf);
+
+    cyrusdb_init();
+    config_mboxlist_db = "skiplist";
+    config_quota_db = "skiplist";
+
+    quotadb_init(0);
+    quotadb_open(NULL);
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+
+    return 0;
+}
+
+int testmbox_tear_down(const char *dbdir)
+{
+    int r;
+
+    mboxlist_close();
+    mboxlist_done();
+
+    quotadb_close();
+    quotadb_done();
+
+    cyrusdb_done();
+    config_mboxlist_db = NULL;
+    config_quota_db = NULL;
+
+    r = rm_rf(dbdir);
+    if (r) r = -1;
+
+    return r;
+}
+
+int testmbox_create(const char *mboxname, const char *acl, int ondisk)
+{
+    struct mboxlist_entry mbentry;
+    struct mailbox *mailbox = NULL;
+    int r;
+
+    memset(&mbentry, 0, sizeof(mbentry));
+    mbentry.name = (char *) mboxname;
+    mbentry.mbtype = 0;
+    mbentry.partition = TESTMBOX_PARTITION;
+    mbentry.acl = (char *) acl;
+    r = mboxlist_update(&mbentry, /*localonly*/1);
+    if (r || !ondisk)
+	return r;
+
+    r = mailbox_create(mboxname, /*mbtype*/0, TESTMBOX_PARTITION, acl,
+		       /*uniqueid*/NULL,
+		       /*options*/0, /*uidvalidity*/0,
+		       &mailbox);
+    if (r)
+	return r;
+    mailbox_close(&mailbox);
+
+    return 0;
+}
+
+uint32_t testmbox_append(const char *mboxname, const char *msg,
+			 time_t internaldate)
+{
+    struct mailbox *mailbox = NULL;
+    struct index_record record;
+    struct buf text = BUF_INITIALIZER;
+    const char *fname;
+    uint32_t uid;
+    int fd, r;
+
+    r = mailbox_open_iwl(mboxname, &mailbox);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+
+    uid = mailbox->i.last_uid + 1;
+    if (msg)
+	buf_appendcstr(&text, msg);
+    else
+	buf_printf(&text,
+		   "From: smurf@example.com\r\nSubject: %u\r\n\r\nbody %u\r\n",
+		   uid, uid);
+
+    fname = mailbox_message_fname(mailbox, uid);
+    fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    CU_ASSERT_FATAL(fd >= 0);
+    retry_write(fd, text.s, text.len);
+    close(fd);
+    buf_free(&text);
+
+    memset(&record, 0, sizeof(struct index_record));
+    r = message_parse(fname, &record);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+    record.uid = uid;
+    record.internaldate = internaldate;
+    r = mailbox_append_index_record(mailbox, &record);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+
+    mailbox_close(&mailbox);
+
+    return uid;
+}
+
+void testmbox_change_flags(const char *mboxname, uint32_t uid,
+			   uint32_t set, uint32_t clear, int silent)
+{
+    struct mailbox *mailbox = NULL;
+    struct index_record record;
+    uint32_t recno;
+    int r;
+
+    r = mailbox_open_iwl(mboxname, &mailbox);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+
+    for (recno = 1; recno <= mailbox->i.num_records; recno++) {
+	r = mailbox_read_index_record(mailbox, recno, &record);
+	CU_ASSERT_EQUAL_FATAL(r, 0);
+	if (record.uid != uid) continue;
+	record.system_flags |= set;
+	record.system_flags &= ~clear;
+	record.silent = silent;
+	r = mailbox_rewrite_index_record(mailbox, &record);
+	CU_ASSERT_EQUAL(r, 0);
+    }
+
+    mailbox_close(&mailbox);
+}
+
+void testmbox_expunge(const char *mboxname, uint32_t uid)
+{
+    testmbox_change_flags(mboxname, uid, FLAG_EXPUNGED, 0, 0);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CUNIT_TESTMBOX_H__
+#define __CUNIT_TESTMBOX_H__ 1
+
+#include <stdint.h>
+#include <time.h>
+
+/* A scratch cyrus configuration under a test's own directory, with
+ * skiplist mailboxes.db and quota databases open, for the tests which
+ * need real mailboxes to work on. */
+
+#define TESTMBOX_PARTITION	"default"
+
+/* 'config' is any extra imapd.conf lines the test needs, or NULL */
+extern int testmbox_set_up(const char *dbdir, const char *config);
+extern int testmbox_tear_down(const char *dbdir);
+
+/* add 'mboxname' to mailboxes.db, and create it on disk if 'ondisk' */
+extern int testmbox_create(const char *mboxname, const char *acl,
+			   int ondisk);
+
+/* append 'msg', or a short message numbered with its uid if NULL, with
+ * the given INTERNALDATE (0 for now), and return its uid */
+extern uint32_t testmbox_append(const char *mboxname, const char *msg,
+				time_t internaldate);
+
+/* set and clear system flags on a message; a 'silent' change leaves
+ * the modseq alone, the way a replica applying its master's does */
+extern void testmbox_change_flags(const char *mboxname, uint32_t uid,
+				  uint32_t set, uint32_t clear, int silent);
+extern void testmbox_expunge(const char *mboxname, uint32_t uid);
+
+#endif /* __CUNIT_TESTMBOX_H__ */
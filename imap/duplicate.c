@@ -88,6 +88,7 @@ static int duplicate_dbopen = 0;
 EXPORTED int duplicate_init(const char *fname)
 {
     int r = 0;
+    int flags = CYRUSDB_CREATE;
     char *tofree = NULL;
 
     if (!fname)
@@ -99,7 +100,10 @@ EXPORTED int duplicate_init(const char *fname)
 	fname = tofree;
     }
 
-    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &dupdb);
+    if (config_getswitch(IMAPOPT_DUPLICATE_DB_BLOOM))
+	flags |= CYRUSDB_BLOOM;
+
+    r = cyrusdb_open(DB, fname, flags, &dupdb);
     if (r != 0) {
 	syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
 	       cyrusdb_strerror(r));
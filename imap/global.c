@@ -309,6 +309,12 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
 				  config_getswitch(IMAPOPT_SQL_USESSL));
 	libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
 				  config_getswitch(IMAPOPT_SKIPLIST_ALWAYS_CHECKPOINT));
+	libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_GROUP_COMMIT,
+				  config_getswitch(IMAPOPT_TWOSKIP_GROUP_COMMIT));
+	libcyrus_config_setint(CYRUSOPT_TWOSKIP_GROUP_COMMIT_DELAY,
+			       config_getint(IMAPOPT_TWOSKIP_GROUP_COMMIT_DELAY));
+	libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_PREFIX_COMPRESSION,
+				  config_getswitch(IMAPOPT_TWOSKIP_PREFIX_COMPRESSION));
 
 	/* Not until all configuration parameters are set! */
 	libcyrus_init();
@@ -0,0 +1,146 @@
+/* hashbench.c -- benchmark the record CRC and message GUID hashing
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measures how many records a second we can checksum the way the
+ * mailbox code does: the CRC32 of an index record, the CRC32 of a
+ * cache record, and the SHA1 GUID of a whole message.  Build it with
+ * "make imap/hashbench".
+ */
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "crc32.h"
+#include "exitcodes.h"
+#include "mailbox.h"
+#include "message_guid.h"
+#include "xmalloc.h"
+
+/* typical sizes, in bytes */
+#define CACHE_RECORD_SIZE 1024
+#define MESSAGE_SIZE (16*1024)
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Checksum 'count' records of 'size' bytes from 'data' */
+static void bench(const char *what, const char *data, size_t datalen,
+		  size_t size, unsigned count, int guid)
+{
+    struct message_guid g;
+    uint32_t crc = 0;
+    size_t offset = 0;
+    double start, secs;
+    unsigned i;
+
+    start = now();
+    for (i = 0; i < count; i++) {
+	if (guid) {
+	    message_guid_generate(&g, data + offset, size);
+	    crc ^= g.value[0];
+	}
+	else
+	    crc ^= crc32_map(data + offset, size);
+
+	/* don't just hash the same bytes out of the cache every time */
+	offset += size;
+	if (offset + size > datalen) offset = 0;
+    }
+    secs = now() - start;
+    if (secs <= 0) secs = 1e-6;
+
+    printf("%-16s %6lu bytes  %12.0f records/sec  %9.1f MB/sec  (%08x)\n",
+	   what, (unsigned long) size, count / secs,
+	   count * (double) size / secs / (1024*1024), crc);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n <records>]\n", name);
+    exit(EC_USAGE);
+}
+
+int main(int argc, char **argv)
+{
+    size_t datalen = 64 * MESSAGE_SIZE;
+    unsigned count = 1000000;
+    char *data;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != EOF) {
+	switch (opt) {
+	case 'n':
+	    count = atoi(optarg);
+	    if (!count) usage(argv[0]);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    data = xmalloc(datalen);
+    for (i = 0; i < datalen; i++)
+	data[i] = (i * 2654435761U) >> 13;
+
+    printf("crc32: %s\n", crc32_implementation());
+    bench("index record", data, datalen, OFFSET_RECORD_CRC, count, 0);
+    bench("cache record", data, datalen, CACHE_RECORD_SIZE, count, 0);
+    bench("message crc32", data, datalen, MESSAGE_SIZE, count / 16, 0);
+    bench("message guid", data, datalen, MESSAGE_SIZE, count / 16, 1);
+
+    free(data);
+    return 0;
+}
@@ -951,9 +951,9 @@ int propfind_creationdate(const xmlChar *name, xmlNsPtr ns,
     else if (fctx->mailbox) {
 	struct stat sbuf;
 
-	fstat(fctx->mailbox->header_fd, &sbuf);
-
-	t = sbuf.st_ctime;
+	/* the header may have come from the metadata cache, unopened */
+	if (!stat(mailbox_meta_fname(fctx->mailbox, META_HEADER), &sbuf))
+	    t = sbuf.st_ctime;
     }
 
     if (!t) return HTTP_NOT_FOUND;
@@ -4815,7 +4815,7 @@ static int map_modseq_cmp(const struct index_map *m1,
 int report_sync_col(struct transaction_t *txn,
 		    xmlNodePtr inroot, struct propfind_ctx *fctx)
 {
-    int ret = 0, r, userflag, i;
+    int ret = 0, r, userflag;
     struct mailbox *mailbox = NULL;
     uint32_t uidvalidity = 0;
     modseq_t syncmodseq = 0;
@@ -4963,8 +4963,6 @@ int report_sync_col(struct transaction_t *txn,
 	istate.map[nresp].uid = record.uid;
 	istate.map[nresp].modseq = record.modseq;
 	istate.map[nresp].system_flags = record.system_flags;
-	for (i = 0; i < MAX_USER_FLAGS/32; i++)
-	    istate.map[nresp].user_flags[i] = record.user_flags[i];
 
 	nresp++;
     }
@@ -54,6 +54,7 @@
 #include <string.h>
 #include <errno.h>
 
+#include "imap/imap_err.h"
 #include "assert.h"
 #include "idle.h"
 #include "idlemsg.h"
@@ -69,6 +70,12 @@ static struct sockaddr_un idle_remote;
  * that we want to be notified of changes */
 static int idle_started;
 
+/* what we heard from idled while waiting for it to answer a PARK */
+static int idle_pending;
+
+/* how long to wait for idled to answer a PARK */
+#define IDLE_PARK_TIMEOUT 5
+
 /* Send the message 'which' about the mailbox 'mboxname' to the idled.
  * Returns 0 on success or an IMAP error code on failure */
 static int idle_send_msg(int which, const char *mboxname)
@@ -185,6 +192,12 @@ EXPORTED int idle_wait(int otherfd)
 
     if (!idle_enabled()) return 0;
 
+    if (idle_pending) {
+	flags = idle_pending;
+	idle_pending = 0;
+	return flags;
+    }
+
     /* If idled was not contacted, we still listen on the socket,
      * because we might get ALERTs, but we won't get mailbox
      * notifications.  The poll timeout controls how quickly
@@ -262,6 +275,126 @@ EXPORTED void idle_stop(const char *mboxname)
     idle_started = 0;
 }
 
+EXPORTED int idle_can_park(void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct stat sbuf;
+
+    if (!idle_started || config_getint(IMAPOPT_IMAPIDLEPARK) <= 0)
+	return 0;
+
+    /* idled only hands connections back to the resume service,
+     * so don't let them go unless it looks to be there */
+    return (stat(config_getstring(IMAPOPT_IDLERESUMESOCKET), &sbuf) == 0);
+#else
+    /* idled can't watch parked connections without epoll */
+    return 0;
+#endif
+}
+
+/*
+ * Wait for idled to answer a PARK, remembering anything else it says
+ * meanwhile for idle_wait().  Returns 0 if it took the connection.
+ * With no answer at all it may well have, and two processes talking
+ * to the client would be worse than none, so that counts as yes.
+ */
+static int idle_park_answer(void)
+{
+    time_t deadline = time(NULL) + IDLE_PARK_TIMEOUT;
+    struct sockaddr_un from;
+    idle_message_t msg;
+    struct timeval timeout;
+    fd_set rfds;
+    int s = idle_get_sock();
+    int r;
+
+    for (;;) {
+	while (idle_recv(&from, &msg)) {
+	    if (strcmp(from.sun_path, idle_remote.sun_path))
+		continue;
+
+	    switch (msg.which) {
+	    case IDLE_MSG_PARK:
+		return 0;
+	    case IDLE_MSG_DONE:
+		return IMAP_SERVER_UNAVAILABLE;
+	    case IDLE_MSG_NOTIFY:
+		idle_pending |= IDLE_MAILBOX;
+		break;
+	    case IDLE_MSG_ALERT:
+		idle_pending |= IDLE_ALERT;
+		break;
+	    }
+	}
+
+	timeout.tv_sec = deadline - time(NULL);
+	timeout.tv_usec = 0;
+	if (s < 0 || timeout.tv_sec <= 0)
+	    break;
+
+	FD_ZERO(&rfds);
+	FD_SET(s, &rfds);
+	r = signals_select(s+1, &rfds, NULL, NULL, &timeout);
+	if (r < 0 && errno != EAGAIN && errno != EINTR) {
+	    syslog(LOG_ERR, "IDLE: select failed: %m");
+	    break;
+	}
+    }
+
+    syslog(LOG_WARNING, "IDLE: no answer from idled to PARK, "
+			"assuming it has the connection");
+    return 0;
+}
+
+EXPORTED int idle_park(const char *mboxname, int fd, const struct buf *state)
+{
+    idle_message_t msg;
+    int r;
+
+    if (!idle_started) return IMAP_SERVER_UNAVAILABLE;
+
+    msg.which = IDLE_MSG_PARK;
+    xstrncpy(msg.mboxname, mboxname, sizeof(msg.mboxname));
+
+    r = idle_send_fd(&idle_remote, &msg, state, fd);
+    if (r) {
+	syslog(LOG_ERR, "IDLE: error sending message "
+			"PARK to idled for mailbox %s: %s.",
+			mboxname, error_message(r));
+	return r;
+    }
+
+    /* the connection is still ours until idled says it has it */
+    r = idle_park_answer();
+    if (r) {
+	syslog(LOG_NOTICE, "IDLE: idled didn't take the connection "
+			   "for mailbox %s, carrying on.", mboxname);
+	return r;
+    }
+
+    /* idled is idling on the mailbox for the connection now */
+    idle_started = 0;
+
+    return 0;
+}
+
+EXPORTED int idle_unpark(int s, struct buf *state, int *fdp)
+{
+    idle_message_t msg;
+
+    if (!idle_takeover(s, &msg, state, fdp))
+	return 0;
+
+    switch (msg.which) {
+    case IDLE_MSG_NOTIFY:
+	return IDLE_MAILBOX;
+    case IDLE_MSG_INPUT:
+	return IDLE_INPUT;
+    default:
+	return IDLE_ALERT;
+    }
+}
+
 EXPORTED void idle_done(void)
 {
     /* close the local socket */
@@ -82,6 +82,20 @@ int idle_wait(int otherfd);
 /* Stop IDLEing on 'mailbox'. */
 void idle_stop(const char *mboxname);
 
+/* Can IDLEs be handed over to idled to wait on? */
+int idle_can_park(void);
+
+/* Hand the client connection 'fd', IDLE on 'mailbox', over to idled along
+ * with the session 'state' needed to carry on.  Returns 0 once idled has
+ * it, in which case the connection is no longer ours to use, or an IMAP
+ * error code if it's still ours. */
+int idle_park(const char *mboxname, int fd, const struct buf *state);
+
+/* Take over a parked connection from idled on the stream 's', filling in
+ * its 'state' and the descriptor.  Returns the flags saying why it's come
+ * back, as for idle_wait(), or 0 if there's nothing usable. */
+int idle_unpark(int s, struct buf *state, int *fdp);
+
 /* Clean up when IDLE is completed. */
 void idle_done(void);
 
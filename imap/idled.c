@@ -54,13 +54,20 @@
 #endif
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "idlemsg.h"
 #include "global.h"
 #include "mboxlist.h"
 #include "xmalloc.h"
+#include "xstrlcpy.h"
 #include "hash.h"
 #include "exitcodes.h"
+#include "dlist.h"
+#include "strarray.h"
 
 extern int optind;
 extern char *optarg;
@@ -72,10 +79,52 @@ static time_t idle_timeout;
 struct ientry {
     struct sockaddr_un remote;
     time_t itime;
+    struct timeval notified;	/* when a NOTIFY was last passed on */
     struct ientry *next;
 };
 static struct hash_table itable;
 
+/* A client connection handed to us by an imapd while it's in IDLE, which
+ * we watch until there's something for an imapd to do with it again */
+struct pentry {
+    int fd;
+    char *mboxname;
+    struct buf state;		/* the session, for the next imapd */
+    time_t ptime;		/* when it was parked or started back */
+    int which;			/* why it's going back */
+    struct pentry *next;	/* others parked on the same mailbox */
+    struct pentry *qprev, *qnext;
+};
+static struct hash_table ptable;
+
+/* parked connections oldest first, and those waiting to go back */
+struct pqueue {
+    struct pentry *head, *tail;
+};
+static struct pqueue parked, returning;
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_fd = -1;
+#endif
+
+/* mailboxes with a change which hasn't been passed on yet */
+static struct idle_pending pending;
+static int notify_delay;	/* milliseconds */
+
+static struct {
+    unsigned long notify_in;	/* NOTIFYs received */
+    unsigned long queued;	/* ... for a mailbox someone is idling on */
+    unsigned long combined;	/* ... which was already pending */
+    unsigned long fanouts;	/* times a pending mailbox was passed on */
+    unsigned long sent;		/* NOTIFYs sent on to imapds */
+    unsigned long failed;	/* ... and those that couldn't be */
+    unsigned long unparked;	/* parked connections sent back */
+} stats;
+static time_t stats_logged;
+static unsigned long stats_logged_in;
+
+#define STATS_INTERVAL 600
+
 EXPORTED void fatal(const char *msg, int err)
 {
     if (debugmode) fprintf(stderr, "dying with %s %d\n",msg,err);
@@ -131,11 +180,307 @@ static void remove_ientry(const char *mboxname,
 
 
 
-static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
+static void pqueue_append(struct pqueue *q, struct pentry *p)
+{
+    p->qprev = q->tail;
+    p->qnext = NULL;
+    if (q->tail) q->tail->qnext = p;
+    else q->head = p;
+    q->tail = p;
+}
+
+static void pqueue_remove(struct pqueue *q, struct pentry *p)
+{
+    if (p->qprev) p->qprev->qnext = p->qnext;
+    else q->head = p->qnext;
+    if (p->qnext) p->qnext->qprev = p->qprev;
+    else q->tail = p->qprev;
+    p->qprev = p->qnext = NULL;
+}
+
+static void free_pentry(struct pentry *p)
+{
+    close(p->fd);
+    free(p->mboxname);
+    buf_free(&p->state);
+    free(p);
+}
+
+/* stop watching a parked connection */
+static void unwatch(struct pentry *p)
+{
+    struct pentry *t, *prev = NULL;
+
+    t = (struct pentry *) hash_lookup(p->mboxname, &ptable);
+    while (t && t != p) {
+	prev = t;
+	t = t->next;
+    }
+    if (t) {
+	if (prev) prev->next = p->next;
+	else hash_insert(p->mboxname, p->next, &ptable);
+    }
+    p->next = NULL;
+
+#ifdef HAVE_SYS_EPOLL_H
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->fd, NULL);
+#endif
+
+    pqueue_remove(&parked, p);
+}
+
+/* queue a parked connection to go back to an imapd */
+static void unpark(struct pentry *p, int which)
+{
+    unwatch(p);
+
+    if (verbose || debugmode)
+	syslog(LOG_DEBUG, "    unpark fd %d on '%s' (%lu)\n",
+	       p->fd, p->mboxname, (unsigned long) which);
+
+    p->which = which;
+    p->ptime = time(NULL);
+    pqueue_append(&returning, p);
+}
+
+/* take over the client connection 'fd' from the imapd at 'remote' */
+static void park(const struct sockaddr_un *remote, const char *mboxname,
+		 const struct buf *state, int fd)
+{
+    struct pentry *p;
+    struct ientry *t;
+    struct dlist *kl = NULL;
+    bit64 checked = 0;
+    int r = -1;
+
+    /* when did we last tell it about a change to the mailbox? */
+    t = (struct ientry *) hash_lookup(mboxname, &itable);
+    while (t && memcmp(&t->remote, remote, sizeof(*remote)))
+	t = t->next;
+    if (t) {
+	bit64 notified = (bit64) t->notified.tv_sec * 1000000 +
+			 t->notified.tv_usec;
+
+	if (!dlist_parsemap(&kl, 1, state->s, state->len) &&
+	    dlist_getnum64(kl, "CHECKED", &checked) && checked > notified)
+	    r = 0;
+	dlist_free(&kl);
+
+	/* the connection stands in for the imapd from now on */
+	remove_ientry(mboxname, remote);
+    }
+
+    p = (struct pentry *) xzmalloc(sizeof(struct pentry));
+    p->fd = fd;
+    p->mboxname = xstrdup(mboxname);
+    buf_copy(&p->state, state);
+    p->ptime = time(NULL);
+
+    p->next = (struct pentry *) hash_lookup(mboxname, &ptable);
+    hash_insert(mboxname, p, &ptable);
+    pqueue_append(&parked, p);
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (!r) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = p;
+	r = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	if (r) syslog(LOG_ERR, "IDLE: epoll_ctl failed: %m");
+    }
+#endif
+
+    if (verbose || debugmode)
+	syslog(LOG_DEBUG, "imapd[%s]: parked fd %d on '%s'%s\n",
+	       idle_id_from_addr(remote), fd, mboxname,
+	       r ? ", sending it straight back" : "");
+
+    /* the mailbox changed while it was on its way here, or we just
+     * can't watch it: give it straight back */
+    if (r) unpark(p, IDLE_MSG_NOTIFY);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* the client has sent something on a parked connection */
+static void parked_input(struct pentry *p)
+{
+    char c;
+    ssize_t n;
+
+    n = recv(p->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+    if (n > 0) {
+	unpark(p, IDLE_MSG_INPUT);
+    }
+    else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+	/* gone away, there's nothing left to give back */
+	if (verbose || debugmode)
+	    syslog(LOG_DEBUG, "    parked fd %d on '%s' closed\n",
+		   p->fd, p->mboxname);
+	unwatch(p);
+	free_pentry(p);
+    }
+}
+#endif
+
+/* hand back as many connections as can be, and drop any which
+ * have been waiting too long to go */
+static void return_parked(void)
+{
+    const char *path = config_getstring(IMAPOPT_IDLERESUMESOCKET);
+    struct pentry *p, *next;
+    idle_message_t msg;
+    int r = 0;
+
+    for (p = returning.head; p; p = next) {
+	next = p->qnext;
+
+	if (r != EAGAIN) {
+	    msg.which = p->which;
+	    strlcpy(msg.mboxname, p->mboxname, sizeof(msg.mboxname));
+	    r = idle_handoff(path, &msg, &p->state, p->fd);
+	    if (!r) {
+		pqueue_remove(&returning, p);
+		free_pentry(p);
+		continue;
+	    }
+	}
+
+	if (p->ptime + idle_timeout < time(NULL)) {
+	    syslog(LOG_ERR, "IDLE: can't return parked connection for "
+			    "mailbox %s to %s: %s, closing.",
+			    p->mboxname, path, error_message(r));
+	    pqueue_remove(&returning, p);
+	    free_pentry(p);
+	}
+    }
+}
+
+/* parked connections get looked at again by an imapd as often as
+ * imapd checks up on an IDLE client which has gone quiet */
+static void expire_parked(void)
+{
+    time_t now = time(NULL);
+
+    while (parked.head && parked.head->ptime + idle_timeout < now)
+	unpark(parked.head, IDLE_MSG_ALERT);
+}
+
+/* tell everyone idling on mboxname that it has changed */
+static void notify_mailbox(const char *mboxname)
 {
+    static struct sockaddr_un *remotes = NULL;
+    static int *errs = NULL;
+    static int alloc = 0;
     struct ientry *t, *n;
+    struct pentry *p;
+    idle_message_t msg;
+    struct timeval now;
+    int i, count = 0;
+
+    msg.which = IDLE_MSG_NOTIFY;
+    strlcpy(msg.mboxname, mboxname, sizeof(msg.mboxname));
+
+    /* send parked connections back to have it looked at */
+    while ((p = (struct pentry *) hash_lookup(mboxname, &ptable))) {
+	unpark(p, IDLE_MSG_NOTIFY);
+	stats.unparked++;
+    }
+
+    gettimeofday(&now, NULL);
+
+    t = (struct ientry *) hash_lookup(mboxname, &itable);
+    for ( ; t ; t = n) {
+	n = t->next;
+	if ((t->itime + idle_timeout) < now.tv_sec) {
+	    /* This process has been idling for longer than the timeout
+	     * period, so it probably died.  Remove it from the list.
+	     */
+	    if (verbose || debugmode)
+		syslog(LOG_DEBUG, "    TIMEOUT %s\n", idle_id_from_addr(&t->remote));
+
+	    remove_ientry(mboxname, &t->remote);
+	    continue;
+	}
+
+	if (verbose || debugmode)
+	    syslog(LOG_DEBUG, "    fwd NOTIFY %s\n", idle_id_from_addr(&t->remote));
+
+	if (count == alloc) {
+	    alloc += 64;
+	    remotes = xrealloc(remotes, alloc * sizeof(struct sockaddr_un));
+	    errs = xrealloc(errs, alloc * sizeof(int));
+	}
+	remotes[count++] = t->remote;
+	t->notified = now;
+    }
+
+    if (!count) return;
+
+    /* signal the processes to update */
+    stats.fanouts++;
+    stats.sent += idle_send_multi(remotes, count, &msg, errs);
+
+    for (i = 0; i < count; i++) {
+	if (!errs[i]) continue;
+
+	/* its queue is full of things it hasn't read yet,
+	 * so it'll be having a look soon enough */
+	if (errs[i] == EAGAIN || errs[i] == EWOULDBLOCK) continue;
+
+	/* ENOENT can happen as result of a race between delivering
+	 * messages and shutting down imapd.  It indicates that the
+	 * imapd's socket was unlinked, which means that imapd went
+	 * through it's graceful shutdown path, so don't syslog. */
+	if (errs[i] != ENOENT)
+	    syslog(LOG_ERR, "IDLE: error sending message "
+			    "NOTIFY to imapd %s for mailbox %s: %s, "
+			    "forgetting.",
+			    idle_id_from_addr(&remotes[i]),
+			    mboxname, error_message(errs[i]));
+	if (verbose || debugmode)
+	    syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&remotes[i]));
+	remove_ientry(mboxname, &remotes[i]);
+	stats.failed++;
+    }
+}
+
+static void log_stats(void)
+{
+    syslog(LOG_INFO, "IDLE: %lu notifications received, %lu for watched "
+		     "mailboxes, %lu combined (%.1f%%), %lu passed on to "
+		     "%lu imapds, %lu failed, %lu parked connections returned",
+		     stats.notify_in, stats.queued, stats.combined,
+		     stats.queued ? 100.0 * stats.combined / stats.queued : 0.0,
+		     stats.fanouts, stats.sent, stats.failed, stats.unparked);
+    stats_logged = time(NULL);
+    stats_logged_in = stats.notify_in;
+}
+
+/* tell the imapd at 'remote' whether we took the connection it parked:
+ * PARK if we did, DONE if it still has it */
+static void answer_park(const struct sockaddr_un *remote,
+			const char *mboxname, int which)
+{
+    idle_message_t msg;
     int r;
 
+    msg.which = which;
+    strlcpy(msg.mboxname, mboxname, sizeof(msg.mboxname));
+
+    r = idle_send(remote, &msg);
+    if (r)
+	syslog(LOG_ERR, "IDLE: error answering PARK from imapd[%s] "
+			"for mailbox %s: %s.",
+			idle_id_from_addr(remote), mboxname, error_message(r));
+}
+
+static void process_message(struct sockaddr_un *remote, idle_message_t *msg,
+			    const struct buf *data, int fd)
+{
+    struct ientry *t, *n;
+
     switch (msg->which) {
     case IDLE_MSG_INIT:
 	if (verbose || debugmode)
@@ -155,42 +500,18 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
 	if (verbose || debugmode)
 	    syslog(LOG_DEBUG, "IDLE_MSG_NOTIFY '%s'\n", msg->mboxname);
 
-	/* send a message to all clients idling on mboxname */
-	t = (struct ientry *) hash_lookup(msg->mboxname, &itable);
-	for ( ; t ; t = n) {
-	    n = t->next;
-	    if ((t->itime + idle_timeout) < time(NULL)) {
-		/* This process has been idling for longer than the timeout
-		 * period, so it probably died.  Remove it from the list.
-		 */
-		if (verbose || debugmode)
-		    syslog(LOG_DEBUG, "    TIMEOUT %s\n", idle_id_from_addr(&t->remote));
-
-		remove_ientry(msg->mboxname, &t->remote);
-	    }
-	    else { /* signal process to update */
-		if (verbose || debugmode)
-		    syslog(LOG_DEBUG, "    fwd NOTIFY %s\n", idle_id_from_addr(&t->remote));
-
-		/* forward the received msg onto our clients */
-		r = idle_send(&t->remote, msg);
-		if (r) {
-		    /* ENOENT can happen as result of a race between delivering
-		     * messages and shutting down imapd.  It indicates that the
-		     * imapd's socket was unlinked, which means that imapd went
-		     * through it's graceful shutdown path, so don't syslog. */
-		    if (r != ENOENT)
-			syslog(LOG_ERR, "IDLE: error sending message "
-					"NOTIFY to imapd %s for mailbox %s: %s, "
-					"forgetting.",
-					idle_id_from_addr(&t->remote),
-					msg->mboxname, error_message(r));
-		    if (verbose || debugmode)
-			syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&t->remote));
-		    remove_ientry(msg->mboxname, &t->remote);
-		}
-	    }
-	}
+	stats.notify_in++;
+
+	/* nobody to tell */
+	if (!hash_lookup(msg->mboxname, &itable) &&
+	    !hash_lookup(msg->mboxname, &ptable))
+	    break;
+
+	stats.queued++;
+
+	/* they'll hear about it along with the change already waiting */
+	if (!idle_pending_add(&pending, msg->mboxname))
+	    stats.combined++;
 	break;
 
     case IDLE_MSG_DONE:
@@ -202,6 +523,29 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
 	remove_ientry(msg->mboxname, remote);
 	break;
 
+    case IDLE_MSG_PARK:
+	if (!idle_is_client_address(remote)) {
+	    syslog(LOG_ERR, "IDLE: invalid PARK from %s", remote->sun_path);
+	    break;
+	}
+
+	if (fd < 0) {
+	    /* the connection got lost on the way, the imapd keeps it */
+	    syslog(LOG_ERR, "IDLE: PARK from imapd[%s] without a connection",
+		   idle_id_from_addr(remote));
+	    answer_park(remote, msg->mboxname, IDLE_MSG_DONE);
+	    break;
+	}
+
+	if (verbose || debugmode)
+	    syslog(LOG_DEBUG, "imapd[%s]: IDLE_MSG_PARK '%s'\n",
+		   idle_id_from_addr(remote), msg->mboxname);
+
+	park(remote, msg->mboxname, data, fd);
+	fd = -1;
+	answer_park(remote, msg->mboxname, IDLE_MSG_PARK);
+	break;
+
     case IDLE_MSG_NOOP:
 	break;
 
@@ -209,6 +553,8 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
 	syslog(LOG_ERR, "unrecognized message: %lx", msg->which);
 	break;
     }
+
+    if (fd >= 0) close(fd);
 }
 
 
@@ -254,7 +600,21 @@ static void send_alert(const char *key,
 static void shut_down(int ec) __attribute__((noreturn));
 static void shut_down(int ec)
 {
+    idle_pending_flush(&pending, notify_mailbox);
+    log_stats();
+
     hash_enumerate(&itable, send_alert, NULL);
+
+    /* give parked connections back to have the ALERT sent */
+    while (parked.head)
+	unpark(parked.head, IDLE_MSG_ALERT);
+    return_parked();
+    while (returning.head) {
+	struct pentry *p = returning.head;
+	pqueue_remove(&returning, p);
+	free_pentry(p);
+    }
+
     idle_done_sock();
     cyrus_done();
     exit(ec);
@@ -298,6 +658,10 @@ int main(int argc, char **argv)
     if (idle_timeout < 30) idle_timeout = 30;
     idle_timeout *= 60;
 
+    notify_delay = config_getint(IMAPOPT_IDLENOTIFYDELAY);
+    if (notify_delay < 0) notify_delay = 0;
+    stats_logged = time(NULL);
+
     /* count the number of mailboxes */
     mboxlist_init(0);
     mboxlist_open(NULL);
@@ -310,6 +674,8 @@ int main(int argc, char **argv)
 
     /* create idle table -- +1 to avoid a zero value */
     construct_hash_table(&itable, nmbox + 1, 1);
+    construct_hash_table(&ptable, nmbox + 1, 1);
+    idle_pending_init(&pending, nmbox);
 
     if (!idle_make_server_address(&local) ||
 	!idle_init_sock(&local)) {
@@ -318,6 +684,9 @@ int main(int argc, char **argv)
     }
     s = idle_get_sock();
 
+    /* so that we can read everything that's waiting in one go */
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+
     /* fork unless we were given the -d option or we're running as a daemon */
     if (debugmode == 0 && !getenv("CYRUS_ISDAEMON")) {
 
@@ -340,6 +709,19 @@ int main(int argc, char **argv)
     FD_SET(s, &read_set);
     nfds = s + 1;
 
+#ifdef HAVE_SYS_EPOLL_H
+    /* parked connections are watched with epoll, which
+     * tells select() when any of them need attention */
+    epoll_fd = epoll_create(1024);
+    if (epoll_fd == -1) {
+	syslog(LOG_ERR, "epoll_create(): %m");
+    }
+    else {
+	FD_SET(epoll_fd, &read_set);
+	if (epoll_fd >= nfds) nfds = epoll_fd + 1;
+    }
+#endif
+
     for (;;) {
 	int n;
 
@@ -351,9 +733,18 @@ int main(int argc, char **argv)
 	    shut_down(1);
 	}
 
-	/* timeout for select is 1 second */
+	/* timeout for select is 1 second, or until changes are due */
 	timeout.tv_sec = 1;
 	timeout.tv_usec = 0;
+	if (pending.list.count) {
+	    long due = idle_pending_due(&pending, notify_delay);
+
+	    if (due < 0) due = 0;
+	    if (due < 1000) {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = due * 1000;
+	    }
+	}
 
 	/* check for the next input */
 	rset = read_set;
@@ -367,15 +758,39 @@ int main(int argc, char **argv)
 	    fatal("select error",-1);
 	}
 
-	/* read and process a message */
+	/* read and process messages, as many as are waiting */
 	if (FD_ISSET(s, &rset)) {
 	    struct sockaddr_un from;
 	    idle_message_t msg;
+	    struct buf data = BUF_INITIALIZER;
+	    int fd, i;
+
+	    for (i = 0; i < 1024 && idle_recv_fd(&from, &msg, &data, &fd); i++)
+		process_message(&from, &msg, &data, fd);
+	    buf_free(&data);
+	}
 
-	    if (idle_recv(&from, &msg))
-		process_message(&from, &msg);
+#ifdef HAVE_SYS_EPOLL_H
+	/* see what's up with parked connections */
+	if (epoll_fd >= 0 && FD_ISSET(epoll_fd, &rset)) {
+	    struct epoll_event events[256];
+	    int i;
+
+	    n = epoll_wait(epoll_fd, events, 256, 0);
+	    for (i = 0; i < n; i++)
+		parked_input((struct pentry *) events[i].data.ptr);
 	}
+#endif
+
+	if (pending.list.count && idle_pending_due(&pending, notify_delay) <= 0)
+	    idle_pending_flush(&pending, notify_mailbox);
+
+	expire_parked();
+	if (returning.head) return_parked();
 
+	if (stats.notify_in != stats_logged_in &&
+	    time(NULL) >= stats_logged + STATS_INTERVAL)
+	    log_stats();
     }
 
     /* NOTREACHED */
@@ -60,6 +60,7 @@
 #include "xstrlcat.h"
 #include "idlemsg.h"
 #include "global.h"
+#include "xmalloc.h"
 
 /* UNIX socket variables */
 static int idle_sock = -1;
@@ -182,31 +183,465 @@ EXPORTED int idle_send(const struct sockaddr_un *remote,
     return 0;
 }
 
+/* most datagrams handed to the kernel in one go */
+#define IDLE_SEND_BATCH 64
+
+/*
+ * Send the same message to 'n' peers.  errs[i] is set to 0 if it was
+ * sent to remotes[i] or the error that stopped it.
+ * Returns the number of peers it was sent to.
+ */
+EXPORTED int idle_send_multi(const struct sockaddr_un *remotes, int n,
+			     const idle_message_t *msg, int *errs)
+{
+    int i, sent = 0;
+
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr mh[IDLE_SEND_BATCH];
+    struct iovec iov;
+    int flags = 0;
+
+#ifdef MSG_DONTWAIT
+    flags |= MSG_DONTWAIT;
+#endif
+
+    if (idle_sock < 0) {
+	for (i = 0; i < n; i++) errs[i] = IMAP_SERVER_UNAVAILABLE;
+	return 0;
+    }
+
+    iov.iov_base = (void *) msg;
+    iov.iov_len = IDLE_MESSAGE_BASE_SIZE+strlen(msg->mboxname)+1;
+
+    i = 0;
+    while (i < n) {
+	int j, batch = n - i;
+	int r;
+
+	if (batch > IDLE_SEND_BATCH) batch = IDLE_SEND_BATCH;
+
+	memset(mh, 0, batch * sizeof(struct mmsghdr));
+	for (j = 0; j < batch; j++) {
+	    mh[j].msg_hdr.msg_name = (void *) &remotes[i+j];
+	    mh[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+	    mh[j].msg_hdr.msg_iov = &iov;
+	    mh[j].msg_hdr.msg_iovlen = 1;
+	}
+
+	r = sendmmsg(idle_sock, mh, batch, flags);
+	if (r == -1) {
+	    if (errno == EINTR) continue;
+
+	    /* the first one failed, skip it and carry on with the rest */
+	    errs[i++] = errno;
+	    continue;
+	}
+
+	for (j = 0; j < r; j++) errs[i+j] = 0;
+	i += r;
+	sent += r;
+    }
+#else
+    for (i = 0; i < n; i++) {
+	errs[i] = idle_send(&remotes[i], msg);
+	if (!errs[i]) sent++;
+    }
+#endif
+
+    return sent;
+}
+
+/* buffer for receiving messages, only allocated when first needed */
+static char *idle_msgbuf(void)
+{
+    static char *buf = NULL;
+
+    if (!buf) buf = xmalloc(IDLE_MESSAGE_MAX_SIZE);
+
+    return buf;
+}
+
+/*
+ * Send a message on socket 's', followed by any 'data', and passing
+ * along 'fd' if it's valid.  Returns 0 on success or an errno.
+ */
+static int idle_sendmsg(int s, const struct sockaddr_un *remote,
+			const idle_message_t *msg, const struct buf *data,
+			int fd)
+{
+    struct msghdr mh;
+    struct iovec iov[2];
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+    int flags = 0;
+
+#ifdef MSG_DONTWAIT
+    flags |= MSG_DONTWAIT;
+#endif
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+
+    iov[0].iov_base = (void *) msg;
+    iov[0].iov_len = IDLE_MESSAGE_BASE_SIZE+strlen(msg->mboxname)+1;
+    iov[1].iov_base = data ? data->s : NULL;
+    iov[1].iov_len = data ? data->len : 0;
+
+    if (iov[0].iov_len + iov[1].iov_len > IDLE_MESSAGE_MAX_SIZE)
+	return EMSGSIZE;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = (void *) remote;
+    mh.msg_namelen = remote ? sizeof(*remote) : 0;
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+
+    if (fd >= 0) {
+	memset(&control, 0, sizeof(control));
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    n = sendmsg(s, &mh, flags);
+    if (n == -1)
+	return errno;
+
+    /* a stream that couldn't take it all in one go */
+    if ((size_t) n < iov[0].iov_len + iov[1].iov_len)
+	return EAGAIN;
+
+    return 0;
+}
+
+/*
+ * Receive up to 'size' bytes from socket 's' into 'buf'.  If 'fdp'
+ * points at -1, a descriptor passed along with the data is returned
+ * there, any others are closed.  Returns the number of bytes read.
+ */
+static ssize_t idle_recvmsg(int s, struct sockaddr_un *remote,
+			    char *buf, size_t size, int *fdp)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = remote;
+    mh.msg_namelen = remote ? sizeof(*remote) : 0;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    do {
+	n = recvmsg(s, &mh, 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1)
+	return n;
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+	const unsigned char *p = CMSG_DATA(cmsg);
+	int fd;
+
+	if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	    continue;
+
+	for (; p + sizeof(int) <= (unsigned char *) cmsg + cmsg->cmsg_len;
+	     p += sizeof(int)) {
+	    memcpy(&fd, p, sizeof(int));
+	    if (fdp && *fdp < 0)
+		*fdp = fd;
+	    else
+		close(fd);
+	}
+    }
+
+    /* some descriptors didn't fit, or we couldn't take any more, so
+     * the one we were sent may be among those lost: don't use any */
+    if (mh.msg_flags & MSG_CTRUNC) {
+	syslog(LOG_ERR, "IDLE: descriptors passed with a message were lost");
+	if (fdp && *fdp >= 0) {
+	    close(*fdp);
+	    *fdp = -1;
+	}
+    }
+
+    return n;
+}
+
+/* split a received message into the fixed part and any data after */
+static int idle_parse(const char *buf, size_t n, idle_message_t *msg,
+		      struct buf *data)
+{
+    size_t len;
+
+    if (n <= IDLE_MESSAGE_BASE_SIZE)
+	return 0;
+
+    len = strnlen(buf + IDLE_MESSAGE_BASE_SIZE, n - IDLE_MESSAGE_BASE_SIZE);
+    if (len == n - IDLE_MESSAGE_BASE_SIZE || len >= sizeof(msg->mboxname))
+	return 0;
+
+    memcpy(msg, buf, IDLE_MESSAGE_BASE_SIZE+len+1);
+
+    if (data) {
+	n -= IDLE_MESSAGE_BASE_SIZE+len+1;
+	buf_setmap(data, buf + IDLE_MESSAGE_BASE_SIZE+len+1, n);
+    }
+
+    return 1;
+}
+
 EXPORTED int idle_recv(struct sockaddr_un *remote, idle_message_t *msg)
 {
-    socklen_t remote_len = sizeof(*remote);
-    int n;
+    return idle_recv_fd(remote, msg, NULL, NULL);
+}
+
+/*
+ * Receive a message, along with any data following the mailbox name
+ * if 'data' is given and any descriptor passed with it if 'fdp' is.
+ * Returns 1 if a message was received, 0 otherwise.
+ */
+EXPORTED int idle_recv_fd(struct sockaddr_un *remote, idle_message_t *msg,
+			  struct buf *data, int *fdp)
+{
+    char *buf = idle_msgbuf();
+    ssize_t n;
+
+    if (fdp) *fdp = -1;
 
     if (idle_sock < 0)
 	return 0;
 
-    memset(remote, 0, remote_len);
+    memset(remote, 0, sizeof(*remote));
     memset(msg, 0, sizeof(idle_message_t));
 
-    n = recvfrom(idle_sock, (void *) msg, sizeof(idle_message_t), 0,
-		 (struct sockaddr *) remote, &remote_len);
+    n = idle_recvmsg(idle_sock, remote, buf, IDLE_MESSAGE_MAX_SIZE, fdp);
 
     if (n < 0) {
-	syslog(LOG_ERR, "IDLE: recvfrom failed: %m");
+	/* nothing (more) waiting on a nonblocking socket */
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    syslog(LOG_ERR, "IDLE: recvmsg failed: %m");
 	return 0;
     }
 
-    if (n <= IDLE_MESSAGE_BASE_SIZE ||
-	msg->mboxname[n - 1 - IDLE_MESSAGE_BASE_SIZE] != '\0') {
-	syslog(LOG_ERR, "IDLE: invalid message received: size=%d", n);
+    if (!idle_parse(buf, n, msg, data)) {
+	syslog(LOG_ERR, "IDLE: invalid message received: size=%d", (int) n);
+	if (fdp && *fdp >= 0) {
+	    close(*fdp);
+	    *fdp = -1;
+	}
+	return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Is this the address of an imapd, as made by idle_make_client_address()?
+ * Only processes which can create files in the socket directory are
+ * able to bind to one of these.
+ */
+EXPORTED int idle_is_client_address(const struct sockaddr_un *mysun)
+{
+    struct sockaddr_un client;
+    size_t len;
+
+    idle_make_client_address(&client);
+    len = strrchr(client.sun_path, '.') + 1 - client.sun_path;
+
+    return (!strncmp(mysun->sun_path, client.sun_path, len) &&
+	    mysun->sun_path[len] &&
+	    strspn(mysun->sun_path + len, "0123456789") ==
+	    strlen(mysun->sun_path + len));
+}
+
+/*
+ * Send a message to a peer (idled) along with a descriptor and some
+ * data to go with it.
+ * Returns 0 on success or an IMAP error code on failure.
+ */
+EXPORTED int idle_send_fd(const struct sockaddr_un *remote,
+			  const idle_message_t *msg, const struct buf *data,
+			  int fd)
+{
+    if (idle_sock < 0)
+	return IMAP_SERVER_UNAVAILABLE;
+
+    return idle_sendmsg(idle_sock, remote, msg, data, fd);
+}
+
+/*
+ * Hand a descriptor, a message and some data over to whoever accepts
+ * connections on the stream socket at 'path', without waiting for
+ * them to do so.  Returns 0 once it has all been handed over, or an
+ * errno if it couldn't be, in which case the descriptor is still ours.
+ */
+EXPORTED int idle_handoff(const char *path, const idle_message_t *msg,
+			  const struct buf *data, int fd)
+{
+    struct sockaddr_un remote;
+    int s, fdflags, r;
+
+    memset(&remote, 0, sizeof(remote));
+    remote.sun_family = AF_UNIX;
+    strlcpy(remote.sun_path, path, sizeof(remote.sun_path));
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1)
+	return errno;
+
+    fdflags = fcntl(s, F_GETFL, 0);
+    if (fdflags == -1 || fcntl(s, F_SETFL, fdflags | O_NONBLOCK) == -1) {
+	r = errno;
+    }
+    else if (connect(s, (struct sockaddr *) &remote, sizeof(remote)) == -1) {
+	r = errno;
+    }
+    else {
+	r = idle_sendmsg(s, NULL, msg, data, fd);
+    }
+
+    close(s);
+
+    return r;
+}
+
+/* is the process at the other end of 's' running as us? */
+static int idle_peer_is_us(int s)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+	return 0;
+    return (cred.uid == geteuid());
+#elif defined(HAVE_GETPEEREID)
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(s, &uid, &gid) == -1)
+	return 0;
+    return (uid == geteuid());
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Receive what idle_handoff() sent from the stream 's'.  Only
+ * accepted from a process running as the same user as us.
+ * Returns 1 with the message, data and descriptor filled in,
+ * or 0 if there's nothing usable.
+ */
+EXPORTED int idle_takeover(int s, idle_message_t *msg, struct buf *data,
+			   int *fdp)
+{
+    char *buf = idle_msgbuf();
+    size_t n = 0;
+    ssize_t r;
+
+    *fdp = -1;
+    memset(msg, 0, sizeof(idle_message_t));
+
+    if (!idle_peer_is_us(s)) {
+	syslog(LOG_ERR, "IDLE: refusing handoff from another user");
 	return 0;
     }
 
+    /* read everything up to EOF, the descriptor comes with the first part */
+    do {
+	r = idle_recvmsg(s, NULL, buf + n, IDLE_MESSAGE_MAX_SIZE - n, fdp);
+	if (r > 0) n += r;
+    } while (r > 0 && n < IDLE_MESSAGE_MAX_SIZE);
+
+    if (r < 0) {
+	syslog(LOG_ERR, "IDLE: recvmsg failed: %m");
+    }
+    else if (*fdp < 0 || !idle_parse(buf, n, msg, data)) {
+	syslog(LOG_ERR, "IDLE: invalid handoff received: size=%d", (int) n);
+    }
+    else {
+	return 1;
+    }
+
+    if (*fdp >= 0) {
+	close(*fdp);
+	*fdp = -1;
+    }
+
+    return 0;
+}
+
+EXPORTED void idle_pending_init(struct idle_pending *pending, int size)
+{
+    memset(pending, 0, sizeof(struct idle_pending));
+    construct_hash_table(&pending->table, size + 1, 0);
+}
+
+/*
+ * Note a change to 'mboxname'.  Returns 1 if it's new, or 0 if it
+ * will be passed on along with the change already waiting.
+ */
+EXPORTED int idle_pending_add(struct idle_pending *pending,
+			      const char *mboxname)
+{
+    if (hash_lookup(mboxname, &pending->table))
+	return 0;
+
+    if (!pending->list.count) gettimeofday(&pending->since, NULL);
+    hash_insert(mboxname, (void *) 1, &pending->table);
+    strarray_append(&pending->list, mboxname);
+
     return 1;
 }
 
+/* milliseconds until changes held for 'delay' are due to be passed on */
+EXPORTED long idle_pending_due(const struct idle_pending *pending, long delay)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    return delay -
+	   ((now.tv_sec - pending->since.tv_sec) * 1000 +
+	    (now.tv_usec - pending->since.tv_usec) / 1000);
+}
+
+/* pass on all the changes that have been waiting */
+EXPORTED void idle_pending_flush(struct idle_pending *pending,
+				 void (*proc)(const char *mboxname))
+{
+    int i;
+
+    for (i = 0; i < pending->list.count; i++) {
+	proc(pending->list.data[i]);
+	hash_del(pending->list.data[i], &pending->table);
+    }
+    strarray_truncate(&pending->list, 0);
+}
+
+EXPORTED void idle_pending_fini(struct idle_pending *pending)
+{
+    free_hash_table(&pending->table, NULL);
+    strarray_fini(&pending->list);
+}
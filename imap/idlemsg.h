@@ -44,8 +44,11 @@
 #define IDLEMSG_H
 
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/un.h>
+#include "hash.h"
 #include "mailbox.h"
+#include "strarray.h"
 
 /* socket to communicate with the idled */
 #define FNAME_IDLE_SOCK_DIR "/socket"
@@ -63,12 +66,18 @@ struct idle_message_s
 
 #define IDLE_MESSAGE_BASE_SIZE	(1 * (int) sizeof(unsigned long))
 
+/* largest message, including any data following the mailbox name,
+ * such as the session state sent with a parked connection */
+#define IDLE_MESSAGE_MAX_SIZE	(64*1024)
+
 enum {
     IDLE_MSG_INIT,
     IDLE_MSG_DONE,
     IDLE_MSG_NOTIFY,
     IDLE_MSG_NOOP,
-    IDLE_MSG_ALERT
+    IDLE_MSG_ALERT,
+    IDLE_MSG_PARK,
+    IDLE_MSG_INPUT
 };
 
 int idle_make_server_address(struct sockaddr_un *);
@@ -79,7 +88,32 @@ void idle_done_sock(void);
 int idle_get_sock(void);
 int idle_send(const struct sockaddr_un *remote,
 	      const idle_message_t *msg);
+int idle_send_multi(const struct sockaddr_un *remotes, int n,
+		    const idle_message_t *msg, int *errs);
 int idle_recv(struct sockaddr_un *remote, idle_message_t *msg);
+int idle_is_client_address(const struct sockaddr_un *);
+int idle_send_fd(const struct sockaddr_un *remote,
+		 const idle_message_t *msg, const struct buf *data, int fd);
+int idle_recv_fd(struct sockaddr_un *remote, idle_message_t *msg,
+		 struct buf *data, int *fdp);
+int idle_handoff(const char *path, const idle_message_t *msg,
+		 const struct buf *data, int fd);
+int idle_takeover(int s, idle_message_t *msg, struct buf *data, int *fdp);
+
+/* mailboxes with a change which hasn't been passed on yet, each just
+ * once however many NOTIFYs came for it, in the order they arrived */
+struct idle_pending {
+    hash_table table;
+    strarray_t list;
+    struct timeval since;	/* when the first of them arrived */
+};
+
+void idle_pending_init(struct idle_pending *pending, int size);
+int idle_pending_add(struct idle_pending *pending, const char *mboxname);
+long idle_pending_due(const struct idle_pending *pending, long delay);
+void idle_pending_flush(struct idle_pending *pending,
+			void (*proc)(const char *mboxname));
+void idle_pending_fini(struct idle_pending *pending);
 
 
 #endif
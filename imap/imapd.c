@@ -58,6 +58,9 @@
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
 
 #include <sasl/sasl.h>
 
@@ -96,6 +99,7 @@
 #include "mboxlist.h"
 #include "mboxname.h"
 #include "mbdump.h"
+#include "metacache.h"
 #include "mupdate-client.h"
 #include "partlist.h"
 #include "proc.h"
@@ -125,6 +129,7 @@ extern char *optarg;
 const int config_need_data = CONFIG_NEED_PARTITION_DATA;
 
 static int imaps = 0;
+static int imapd_resume = 0; /* taking back IDLEs parked with idled */
 static sasl_ssf_t extprops_ssf = 0;
 static int nosaslpasswdcheck = 0;
 
@@ -222,6 +227,9 @@ static const int max_monthdays[] = {
 /* track if we're idling */
 static int idling = 0;
 
+/* set once the connection has been handed over to idled */
+static int imapd_parked = 0;
+
 static const struct mbox_name_attribute {
     int flag;
     const char *id;
@@ -265,6 +273,27 @@ struct list_entry {
     int attributes; /* bitmap of MBOX_ATTRIBUTE_* */
 };
 
+/* A LIST RETURN (STATUS) response held back until the status of
+ * every mailbox has been looked up in one batch */
+struct list_pending {
+    char *name;
+    int attributes;
+    mbentry_t *mbentry;
+};
+
+/* the status of one mailbox in the batch, or why there isn't one */
+struct list_status {
+    int r;
+    struct statusdata sdata;
+};
+
+static struct {
+    int collecting;
+    int flushing;
+    ptrarray_t pending;		/* struct list_pending */
+    hash_table status;		/* internal name => struct list_status */
+} list_statusbatch;
+
 /* structure that list_data_recursivematch passes its callbacks */
 struct list_rock_recursivematch {
     struct listargs *listargs;
@@ -349,7 +378,7 @@ static void motd_file(void);
 void shut_down(int code);
 void fatal(const char *s, int code);
 
-static void cmdloop(void);
+static void cmdloop(const char *idletag, int idleflags);
 static void cmd_login(char *tag, char *user);
 static void cmd_authenticate(char *tag, char *authtype, char *resp);
 static void cmd_noop(char *tag, char *cmd);
@@ -392,7 +421,8 @@ static void cmd_namespace(char* tag);
 static void cmd_mupdatepush(char *tag, char *name);
 static void cmd_id(char* tag);
 
-static void cmd_idle(char* tag);
+static void cmd_idle(const char *tag, int resumed);
+static char *resume_session(const struct buf *state);
 
 static void cmd_starttls(char *tag, int imaps);
 
@@ -701,6 +731,8 @@ static void imapd_reset(void)
     int i;
     int bytes_in = 0;
     int bytes_out = 0;
+    unsigned syscalls = 0, flushes = 0;
+    unsigned long flush_bytes = 0;
     
     proc_cleanup();
 
@@ -724,10 +756,13 @@ static void imapd_reset(void)
     if (imapd_index) index_close(&imapd_index);
 
     if (imapd_in) {
-	/* Flush the incoming buffer */
-	prot_NONBLOCK(imapd_in);
-	prot_fill(imapd_in);
+	/* Flush the incoming buffer, unless it's for idled to look at */
+	if (!imapd_parked) {
+	    prot_NONBLOCK(imapd_in);
+	    prot_fill(imapd_in);
+	}
 	bytes_in = prot_bytes_in(imapd_in);
+	syscalls += prot_syscalls(imapd_in);
 	prot_free(imapd_in);
     }
 
@@ -735,12 +770,17 @@ static void imapd_reset(void)
 	/* Flush the outgoing buffer */
 	prot_flush(imapd_out);
 	bytes_out = prot_bytes_out(imapd_out);
+	syscalls += prot_syscalls(imapd_out);
+	flushes = prot_flushes(imapd_out);
+	flush_bytes = prot_flush_bytes(imapd_out);
 	prot_free(imapd_out);
     }
 
     if (config_auditlog)
-	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d>", 
-			   session_id(), bytes_in, bytes_out);
+	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d> "
+			   "syscalls=<%u> flushes=<%u> flush_bytes=<%lu>",
+			   session_id(), bytes_in, bytes_out,
+			   syscalls, flushes, flush_bytes);
     
     imapd_in = imapd_out = NULL;
 
@@ -755,7 +795,12 @@ static void imapd_reset(void)
     }
 #endif
 
-    cyrus_reset_stdio();
+    /* idled holds the client's connection now, so shutting it
+     * down would hang up on the client */
+    if (imapd_parked)
+	cyrus_release_stdio();
+    else
+	cyrus_reset_stdio();
 
     imapd_clienthost = "[local]";
     if (imapd_logfd != -1) {
@@ -789,6 +834,7 @@ static void imapd_reset(void)
     imapd_compress_done = 0;
     imapd_tls_comp = NULL;
     imapd_starttls_done = 0;
+    imapd_parked = 0;
     plaintextloginalert = NULL;
 
     if(saslprops.iplocalport) {
@@ -827,7 +873,7 @@ int service_init(int argc, char **argv, char **envp)
     global_sasl_init(1, 1, mysasl_cb);
 
     /* open the mboxlist, we'll need it for real work */
-    mboxlist_init(0);
+    mboxlist_init(MBOXLIST_SNAPSHOT);
     mboxlist_open(NULL);
 
     /* open the quota db, we'll need it for real work */
@@ -848,7 +894,7 @@ int service_init(int argc, char **argv, char **envp)
     snmp_connect(); /* ignore return code */
     snmp_set_str(SERVER_NAME_VERSION,cyrus_version());
 
-    while ((opt = getopt(argc, argv, "Np:sq")) != EOF) {
+    while ((opt = getopt(argc, argv, "Np:sqR")) != EOF) {
 	switch (opt) {
 	case 's': /* imaps (do starttls right away) */
 	    imaps = 1;
@@ -868,6 +914,9 @@ int service_init(int argc, char **argv, char **envp)
 	case 'q': /* don't enforce quotas */
 	    ignorequota = 1;
 	    break;
+	case 'R': /* take back connections parked with idled */
+	    imapd_resume = 1;
+	    break;
 	default:
 	    break;
 	}
@@ -906,6 +955,26 @@ int service_main(int argc __attribute__((unused)),
     struct mboxevent *mboxevent = NULL;
     struct io_count *io_count_start = NULL;
     struct io_count *io_count_stop = NULL;
+    struct buf resume_state = BUF_INITIALIZER;
+    int resume_flags = 0;
+    char *resume_tag = NULL;
+
+    if (imapd_resume) {
+	/* idled is handing back a parked IDLE: the client's connection
+	 * and the state of its session come over the stream we were
+	 * given, and the client takes its place from here on */
+	int fd;
+
+	resume_flags = idle_unpark(0, &resume_state, &fd);
+	if (!resume_flags) {
+	    buf_free(&resume_state);
+	    cyrus_reset_stdio();
+	    return 0;
+	}
+	dup2(fd, 0);
+	dup2(fd, 1);
+	close(fd);
+    }
 
     if (config_iolog) {
 	io_count_start = xmalloc (sizeof (struct io_count));
@@ -967,14 +1036,23 @@ int service_main(int argc __attribute__((unused)),
     snmp_increment(TOTAL_CONNECTIONS, 1);
     snmp_increment(ACTIVE_CONNECTIONS, 1);
 
-    cmdloop();
+    if (imapd_resume) {
+	resume_tag = resume_session(&resume_state);
+	if (resume_tag) cmdloop(resume_tag, resume_flags);
+	free(resume_tag);
+	buf_free(&resume_state);
+    }
+    else {
+	cmdloop(NULL, 0);
+    }
 
     /* LOGOUT executed */
     prot_flush(imapd_out);
     snmp_increment(ACTIVE_CONNECTIONS, -1);
 
-    /* send a Logout event notification */
-    if ((mboxevent = mboxevent_new(EVENT_LOGOUT))) {
+    /* send a Logout event notification, unless the
+     * session is being carried on elsewhere */
+    if (!imapd_parked && (mboxevent = mboxevent_new(EVENT_LOGOUT))) {
 	mboxevent_set_access(mboxevent, saslprops.iplocalport,
 			     saslprops.ipremoteport, imapd_userid, NULL);
 
@@ -1046,6 +1124,8 @@ void shut_down(int code)
     int i;
     int bytes_in = 0;
     int bytes_out = 0;
+    unsigned syscalls = 0, flushes = 0;
+    unsigned long flush_bytes = 0;
 
     in_shutdown = 1;
 
@@ -1092,10 +1172,13 @@ void shut_down(int code)
     partlist_local_done();
 
     if (imapd_in) {
-	/* Flush the incoming buffer */
-	prot_NONBLOCK(imapd_in);
-	prot_fill(imapd_in);
+	/* Flush the incoming buffer, unless it's for idled to look at */
+	if (!imapd_parked) {
+	    prot_NONBLOCK(imapd_in);
+	    prot_fill(imapd_in);
+	}
 	bytes_in = prot_bytes_in(imapd_in);
+	syscalls += prot_syscalls(imapd_in);
 	prot_free(imapd_in);
     }
     
@@ -1103,6 +1186,9 @@ void shut_down(int code)
 	/* Flush the outgoing buffer */
 	prot_flush(imapd_out);
 	bytes_out = prot_bytes_out(imapd_out);
+	syscalls += prot_syscalls(imapd_out);
+	flushes = prot_flushes(imapd_out);
+	flush_bytes = prot_flush_bytes(imapd_out);
 	prot_free(imapd_out);
 	
 	/* one less active connection */
@@ -1110,8 +1196,10 @@ void shut_down(int code)
     }
 
     if (config_auditlog)
-	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d>", 
-			   session_id(), bytes_in, bytes_out);
+	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d> "
+			   "syscalls=<%u> flushes=<%u> flush_bytes=<%lu>",
+			   session_id(), bytes_in, bytes_out,
+			   syscalls, flushes, flush_bytes);
 
     if (protin) protgroup_free(protin);
 
@@ -1181,7 +1269,7 @@ static void imapd_check(struct backend *be, int usinguid)
 /*
  * Top-level command loop parsing
  */
-static void cmdloop(void)
+static void cmdloop(const char *idletag, int idleflags)
 {
     int c;
     int usinguid, havepartition, havenamespace, recursive;
@@ -1191,17 +1279,19 @@ static void cmdloop(void)
     const char * commandmintimer;
     double commandmintimerd = 0.0;
 
-    prot_printf(imapd_out, "* OK [CAPABILITY ");
-    capa_response(CAPA_PREAUTH);
-    prot_printf(imapd_out, "]");
-    if (config_serverinfo) prot_printf(imapd_out, " %s", config_servername);
-    if (config_serverinfo == IMAP_ENUM_SERVERINFO_ON) {
-	prot_printf(imapd_out, " Cyrus IMAP%s %s",
-		    config_mupdate_server ? " Murder" : "", cyrus_version());
-    }
-    prot_printf(imapd_out, " server ready\r\n");
+    if (!idletag) {
+	prot_printf(imapd_out, "* OK [CAPABILITY ");
+	capa_response(CAPA_PREAUTH);
+	prot_printf(imapd_out, "]");
+	if (config_serverinfo) prot_printf(imapd_out, " %s", config_servername);
+	if (config_serverinfo == IMAP_ENUM_SERVERINFO_ON) {
+	    prot_printf(imapd_out, " Cyrus IMAP%s %s",
+			config_mupdate_server ? " Murder" : "", cyrus_version());
+	}
+	prot_printf(imapd_out, " server ready\r\n");
 
-    motd_file();
+	motd_file();
+    }
 
     /* Get command timer logging paramater. This string
      * is a time in seconds. Any command that takes >=
@@ -1212,6 +1302,12 @@ static void cmdloop(void)
       commandmintimerd = atof(commandmintimer);
     }
 
+    if (idletag) {
+	/* carry on with the IDLE the session was parked in */
+	cmd_idle(idletag, idleflags);
+	if (imapd_parked) return;
+    }
+
     for (;;) {
 	/* Release any held index */
 	index_release(imapd_index);
@@ -1572,9 +1668,12 @@ static void cmdloop(void)
 	    else if (!strcmp(cmd.s, "Idle") && idle_enabled()) {
 		if (c == '\r') c = prot_getc(imapd_in);
 		if (c != '\n') goto extraargs;
-		cmd_idle(tag.s);
+		cmd_idle(tag.s, 0);
 
 		snmp_increment(IDLE_COUNT, 1);
+
+		/* idled has the connection now */
+		if (imapd_parked) return;
 	    }
 	    else goto badcmd;
 	    break;
@@ -2275,12 +2374,11 @@ static void autocreate_inbox(void)
 }
 #endif // USE_AUTOCREATE
 
-static void authentication_success(void)
+/* set up everything that goes with imapd_userid and imapd_authstate */
+static void authentication_setup(void)
 {
     int r;
-    struct mboxevent *mboxevent;
 
-    /* authstate already created by mysasl_proxy_policy() */
     imapd_userisadmin = global_authisa(imapd_authstate, IMAPOPT_ADMINS);
 
     /* Create telemetry log */
@@ -2304,6 +2402,14 @@ static void authentication_success(void)
     mboxname_hiersep_tointernal(&imapd_namespace, imapd_userid,
 				config_virtdomains ?
 				strcspn(imapd_userid, "@") : 0);
+}
+
+static void authentication_success(void)
+{
+    struct mboxevent *mboxevent;
+
+    /* authstate already created by mysasl_proxy_policy() */
+    authentication_setup();
 
     /* send a Login event notification */
     if ((mboxevent = mboxevent_new(EVENT_LOGIN))) {
@@ -2841,10 +2947,195 @@ static void cmd_id(char *tag)
     imapd_id.did_id = 1;
 }
 
+/* resident set size in kilobytes, or 0 if we can't tell */
+static unsigned long idle_rss(void)
+{
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (!f) return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(f);
+
+    return resident * (getpagesize() / 1024);
+}
+
+/*
+ * Shrink the session down to what it needs to sit in IDLE: unmap the
+ * mailbox and drop what can be rebuilt later, trim the protstream
+ * buffers and hand free heap back to the system.  Everything comes
+ * back on demand once there's something to do.
+ */
+static void idle_trim(int report)
+{
+    unsigned long before = report ? idle_rss() : 0;
+
+    index_trim(imapd_index);
+    metacache_close();
+    prot_trim(imapd_in);
+    prot_trim(imapd_out);
+#ifdef HAVE_MALLOC_TRIM
+    malloc_trim(0);
+#endif
+
+    if (report) {
+	syslog(LOG_DEBUG, "IDLE: trimmed session for %s from %luk to %luk",
+	       imapd_userid ? imapd_userid : "<none>", before, idle_rss());
+    }
+}
+
+/*
+ * Hand an IDLE which has had nothing to report for a while over to
+ * idled, so this process is free to serve other clients.  idled passes
+ * the connection to an imapd -R when there's something to do, along
+ * with the state recorded here for it to carry on the session from.
+ * Returns 1 if the connection has gone, 0 if it's still ours.
+ */
+static int idle_park_session(const char *tag)
+{
+    struct dlist *kl;
+    struct buf state = BUF_INITIALIZER;
+    struct timeval checked;
+    int r;
+
+    /* only plain connections to local mailboxes, with nothing
+     * in our buffers which would be lost along the way */
+    if (!idle_can_park() || backend_current || !imapd_index ||
+	imapd_starttls_done || imapd_compress_done || imapd_in->conn ||
+	imapd_userisadmin || imapd_userisproxyadmin || !proxy_userid ||
+	imapd_in->cnt)
+	return 0;
+
+    /* have a last look: if idled hears of a change after this,
+     * it hands the connection straight back */
+    gettimeofday(&checked, NULL);
+    index_check(imapd_index, 1, 0);
+    prot_flush(imapd_out);
+    if (prot_error(imapd_out)) return 0;
+
+    kl = dlist_newkvlist(NULL, "PARK");
+    dlist_setatom(kl, "SESSIONID", session_id());
+    dlist_setatom(kl, "CLIENTHOST", imapd_clienthost);
+    if (saslprops.iplocalport && saslprops.ipremoteport) {
+	dlist_setatom(kl, "LOCALIP", saslprops.iplocalport);
+	dlist_setatom(kl, "REMOTEIP", saslprops.ipremoteport);
+    }
+    dlist_setatom(kl, "USERID", proxy_userid);
+    if (imapd_magicplus)
+	dlist_setatom(kl, "MAGICPLUS", imapd_magicplus);
+    dlist_setatom(kl, "MBOXNAME", index_mboxname(imapd_index));
+    dlist_setatom(kl, "TAG", tag);
+    dlist_setnum32(kl, "CAPA", imapd_client_capa);
+    dlist_setnum64(kl, "CHECKED",
+		   (bit64) checked.tv_sec * 1000000 + checked.tv_usec);
+    index_park(imapd_index, kl);
+    dlist_printbuf(kl, 1, &state);
+    dlist_free(&kl);
+
+    r = idle_park(index_mboxname(imapd_index), imapd_in->fd, &state);
+    buf_free(&state);
+    if (r) return 0;
+
+    syslog(LOG_INFO, "IDLE: parked session for %s on %s with idled",
+	   imapd_userid, index_mboxname(imapd_index));
+
+    imapd_parked = 1;
+
+    return 1;
+}
+
+/*
+ * Carry on a session parked by idle_park_session() in another imapd,
+ * now that idled has given us its connection.  Returns the tag of the
+ * IDLE to carry on with, or NULL if the session can't be.
+ */
+static char *resume_session(const struct buf *state)
+{
+    static struct buf clienthost = BUF_INITIALIZER;
+    struct dlist *kl = NULL;
+    struct index_init init;
+    const char *sessionid = NULL, *userid = NULL, *magicplus = NULL;
+    const char *mboxname = NULL, *tag = NULL;
+    const char *host = NULL, *localip = NULL, *remoteip = NULL;
+    uint32_t capa = 0, examine = 0;
+    char *idletag = NULL;
+    int r;
+
+    r = dlist_parsemap(&kl, 1, state->s, state->len);
+    if (r || !dlist_getatom(kl, "USERID", &userid) ||
+	!dlist_getatom(kl, "MBOXNAME", &mboxname) ||
+	!dlist_getatom(kl, "TAG", &tag) ||
+	!dlist_getnum32(kl, "CAPA", &capa) ||
+	!dlist_getnum32(kl, "EXAMINE", &examine)) {
+	syslog(LOG_ERR, "IDLE: invalid session state from idled");
+	prot_printf(imapd_out, "* BYE %s\r\n",
+		    error_message(IMAP_SERVER_UNAVAILABLE));
+	goto done;
+    }
+    dlist_getatom(kl, "SESSIONID", &sessionid);
+    dlist_getatom(kl, "MAGICPLUS", &magicplus);
+
+    /* who the client was to the session which parked it, in case
+     * the connection alone doesn't tell us as much */
+    if (dlist_getatom(kl, "CLIENTHOST", &host)) {
+	buf_setcstr(&clienthost, host);
+	imapd_clienthost = buf_cstring(&clienthost);
+    }
+    if (dlist_getatom(kl, "LOCALIP", &localip) &&
+	dlist_getatom(kl, "REMOTEIP", &remoteip)) {
+	free(saslprops.iplocalport);
+	saslprops.iplocalport = xstrdup(localip);
+	sasl_setprop(imapd_saslconn, SASL_IPLOCALPORT, localip);
+	free(saslprops.ipremoteport);
+	saslprops.ipremoteport = xstrdup(remoteip);
+	sasl_setprop(imapd_saslconn, SASL_IPREMOTEPORT, remoteip);
+    }
+
+    imapd_userid = xstrdup(userid);
+    imapd_authstate = auth_newstate(userid);
+    if (magicplus) imapd_magicplus = xstrdup(magicplus);
+    imapd_client_capa = capa;
+    authentication_setup();
+
+    memset(&init, 0, sizeof(struct index_init));
+    init.qresync = imapd_client_capa & CAPA_QRESYNC;
+    init.userid = imapd_userid;
+    init.authstate = imapd_authstate;
+    init.out = imapd_out;
+    init.examine_mode = examine;
+    init.parked = kl;
+
+    r = index_open(mboxname, &init, &imapd_index);
+    if (!r && !index_hasrights(imapd_index, ACL_READ)) {
+	index_close(&imapd_index);
+	r = IMAP_PERMISSION_DENIED;
+    }
+    if (r) {
+	syslog(LOG_NOTICE, "IDLE: can't resume session %s for %s on %s: %s",
+	       sessionid ? sessionid : "<unknown>", imapd_userid, mboxname,
+	       error_message(r));
+	prot_printf(imapd_out, "* BYE %s\r\n", error_message(r));
+	goto done;
+    }
+
+    syslog(LOG_NOTICE, "login: %s %s resumed session %s IDLE on %s",
+	   imapd_clienthost, imapd_userid,
+	   sessionid ? sessionid : "<unknown>", mboxname);
+
+    idletag = xstrdup(tag);
+
+ done:
+    dlist_free(&kl);
+    return idletag;
+}
+
 /*
  * Perform an IDLE command
+ *
+ * 'resumed' is nonzero when carrying on an IDLE parked with idled,
+ * with the flags saying why it came back.
  */
-static void cmd_idle(char *tag)
+static void cmd_idle(const char *tag, int resumed)
 {
     int c = EOF;
     int flags;
@@ -2852,10 +3143,14 @@ static void cmd_idle(char *tag)
     static int idle_period = -1;
 
     if (!backend_current) {  /* Local mailbox */
+	time_t began = time(NULL);
+	int park_after = config_getint(IMAPOPT_IMAPIDLEPARK);
 
 	/* Tell client we are idling and waiting for end of command */
-	prot_printf(imapd_out, "+ idling\r\n");
-	prot_flush(imapd_out);
+	if (!resumed) {
+	    prot_printf(imapd_out, "+ idling\r\n");
+	    prot_flush(imapd_out);
+	}
 
 	/* Start doing mailbox updates */
 	index_check(imapd_index, 1, 0);
@@ -2864,8 +3159,9 @@ static void cmd_idle(char *tag)
 	 * connection abort we tell idled about it */
 	idling = 1;
 
-	index_release(imapd_index);
-	while ((flags = idle_wait(imapd_in->fd))) {
+	idle_trim(1);
+	flags = resumed;
+	while (flags || (flags = idle_wait(imapd_in->fd))) {
 	    if (flags & IDLE_INPUT) {
 		/* Get continuation data */
 		c = getword(imapd_in, &arg);
@@ -2889,8 +3185,16 @@ static void cmd_idle(char *tag)
 		}
 	    }
 
-	    index_release(imapd_index);
 	    prot_flush(imapd_out);
+	    idle_trim(0);
+	    flags = 0;
+
+	    /* quiet for long enough to hand over to idled? */
+	    if (park_after > 0 && time(NULL) - began >= park_after &&
+		idle_park_session(tag)) {
+		idling = 0;
+		return;
+	    }
 	}
 
 	/* Stop updates and do any necessary cleanup */
@@ -7631,9 +7935,21 @@ static int print_statusline(const char *extname, unsigned statusitems,
 static int imapd_statusdata(const char *mailboxname, unsigned statusitems,
 			    struct statusdata *sd)
 {
+    struct list_status *batched;
+
     /* use the index status if we can so we get the 'alive' Recent count */
-    if (!strcmpsafe(mailboxname, index_mboxname(imapd_index)))
+    if (!strcmpsafe(mailboxname, index_mboxname(imapd_index))) {
+	/* LIST gets here with the index released, so open it again */
+	imapd_check(NULL, 0);
 	return index_status(imapd_index, sd);
+    }
+
+    /* already looked up along with the rest of a LIST */
+    if (list_statusbatch.flushing &&
+	(batched = hash_lookup(mailboxname, &list_statusbatch.status))) {
+	if (!batched->r) *sd = batched->sdata;
+	return batched->r;
+    }
 
     /* fall back to generic lookup */
     return status_lookup(mailboxname, imapd_userid, statusitems, sd);
@@ -11209,32 +11525,35 @@ static void specialuse_flags(mbentry_t *mbentry, const char *sep,
      * the substr.  Ok to just print nothing */
 }
 
+/* convert "INBOX" to "user.<userid>" */
+static void list_internal_name(const char *name, char *internal_name,
+			       size_t size)
+{
+    if (!strncasecmp(name, "inbox", 5)
+	&& (!name[5] || name[5] == '.') ) {
+	(*imapd_namespace.mboxname_tointernal)(&imapd_namespace, "INBOX",
+					       imapd_userid, internal_name);
+	strlcat(internal_name, name+5, size);
+    }
+    else
+	strlcpy(internal_name, name, size);
+}
+
+static void list_response_print(const char *name, int attributes,
+				mbentry_t *mbentry,
+				struct listargs *listargs);
+
 /* Print LIST or LSUB untagged response */
 static void list_response(const char *name, int attributes,
 			  struct listargs *listargs)
 {
-    const struct mbox_name_attribute *attr;
     char internal_name[MAX_MAILBOX_PATH+1];
     int r;
-    char mboxname[MAX_MAILBOX_PATH+1];
-    const char *sep;
-    const char *cmd;
     mbentry_t *mbentry = NULL;
-    struct statusdata sdata;
 
     if (!name) return;
 
-    memset(&sdata, 0, sizeof(struct statusdata));
-
-    /* first convert "INBOX" to "user.<userid>" */
-    if (!strncasecmp(name, "inbox", 5)
-	&& (!name[5] || name[5] == '.') ) {
-	(*imapd_namespace.mboxname_tointernal)(&imapd_namespace, "INBOX",
-					       imapd_userid, internal_name);
-	strlcat(internal_name, name+5, sizeof(internal_name));
-    }
-    else
-	strlcpy(internal_name, name, sizeof(internal_name));
+    list_internal_name(name, internal_name, sizeof(internal_name));
 
     /* get info and set flags */
     r = mboxlist_lookup(internal_name, &mbentry, NULL);
@@ -11386,9 +11705,45 @@ static void list_response(const char *name, int attributes,
 	buf_free(&attrib);
     }
 
+    if (list_statusbatch.collecting) {
+	/* it's going out, once we know the status of everything */
+	struct list_pending *pending = xmalloc(sizeof(struct list_pending));
+	pending->name = xstrdup(name);
+	pending->attributes = attributes;
+	pending->mbentry = mbentry;
+	mbentry = NULL;
+	ptrarray_append(&list_statusbatch.pending, pending);
+	goto done;
+    }
+
+    list_response_print(name, attributes, mbentry, listargs);
+
+done:
+    mboxlist_entry_free(&mbentry);
+}
+
+/* Print a LIST or LSUB response which list_response() has decided on,
+ * with its STATUS if asked for */
+static void list_response_print(const char *name, int attributes,
+				mbentry_t *mbentry,
+				struct listargs *listargs)
+{
+    const struct mbox_name_attribute *attr;
+    char internal_name[MAX_MAILBOX_PATH+1];
+    int r;
+    char mboxname[MAX_MAILBOX_PATH+1];
+    const char *sep;
+    const char *cmd;
+    struct statusdata sdata;
+
+    memset(&sdata, 0, sizeof(struct statusdata));
+
+    list_internal_name(name, internal_name, sizeof(internal_name));
+
     /* can we read the status data ? */
     if ((listargs->ret & LIST_RET_STATUS) &&
-	!(attributes & MBOX_ATTRIBUTE_NOSELECT)) {
+	!(attributes &
+	  (MBOX_ATTRIBUTE_NOSELECT | MBOX_ATTRIBUTE_NONEXISTENT))) {
 	r = imapd_statusdata(internal_name, listargs->statusitems, &sdata);
 	if (r) {
 	    /* RFC 5819: the STATUS response MUST NOT be returned and the
@@ -11448,13 +11803,11 @@ static void list_response(const char *name, int attributes,
     prot_printf(imapd_out, "\r\n");
 
     if ((listargs->ret & LIST_RET_STATUS) &&
-	!(attributes & MBOX_ATTRIBUTE_NOSELECT)) {
+	!(attributes &
+	  (MBOX_ATTRIBUTE_NOSELECT | MBOX_ATTRIBUTE_NONEXISTENT))) {
 	/* output the status line now, per rfc 5819 */
 	print_statusline(mboxname, listargs->statusitems, &sdata);
     }
-
-done:
-    mboxlist_entry_free(&mbentry);
 }
 
 static int set_subscribed(char *name, int matchlen,
@@ -11708,6 +12061,66 @@ static void list_data_recursivematch(struct listargs *listargs,
     free_hash_table(&rock.table, free);
 }
 
+static void list_statusbatch_cb(const char *mboxname, int r,
+				struct statusdata *sdata,
+				void *rock __attribute__((unused)))
+{
+    struct list_status *status = xzmalloc(sizeof(struct list_status));
+
+    /* remember failures too, so they aren't tried again */
+    status->r = r;
+    if (!r) status->sdata = *sdata;
+    hash_insert(mboxname, status, &list_statusbatch.status);
+}
+
+/* look up the status of the held back mailboxes, then print them */
+static void list_statusbatch_flush(struct listargs *listargs)
+{
+    strarray_t names = STRARRAY_INITIALIZER;
+    strarray_t partitions = STRARRAY_INITIALIZER;
+    char internal_name[MAX_MAILBOX_PATH+1];
+    struct list_pending *pending;
+    int i;
+
+    list_statusbatch.collecting = 0;
+
+    construct_hash_table(&list_statusbatch.status,
+			 list_statusbatch.pending.count + 1, 0);
+
+    for (i = 0; i < list_statusbatch.pending.count; i++) {
+	pending = ptrarray_nth(&list_statusbatch.pending, i);
+	/* these get no STATUS at all */
+	if (pending->attributes &
+	    (MBOX_ATTRIBUTE_NOSELECT | MBOX_ATTRIBUTE_NONEXISTENT))
+	    continue;
+	list_internal_name(pending->name, internal_name, sizeof(internal_name));
+	/* the selected mailbox has its own live counts */
+	if (!strcmpsafe(internal_name, index_mboxname(imapd_index)))
+	    continue;
+	strarray_append(&names, internal_name);
+	strarray_appendm(&partitions, xstrdupnull(pending->mbentry->partition));
+    }
+
+    status_lookup_multi(&names, &partitions, imapd_userid,
+			listargs->statusitems, list_statusbatch_cb, NULL);
+    list_statusbatch.flushing = 1;
+
+    for (i = 0; i < list_statusbatch.pending.count; i++) {
+	pending = ptrarray_nth(&list_statusbatch.pending, i);
+	list_response_print(pending->name, pending->attributes,
+			    pending->mbentry, listargs);
+	mboxlist_entry_free(&pending->mbentry);
+	free(pending->name);
+	free(pending);
+    }
+
+    list_statusbatch.flushing = 0;
+    ptrarray_fini(&list_statusbatch.pending);
+    free_hash_table(&list_statusbatch.status, free);
+    strarray_fini(&names);
+    strarray_fini(&partitions);
+}
+
 /* Retrieves the data and prints the untagged responses for a LIST command. */
 static void list_data(struct listargs *listargs)
 {
@@ -11734,6 +12147,9 @@ static void list_data(struct listargs *listargs)
 	findall = imapd_namespace.mboxlist_findall;
     }
 
+    if ((listargs->ret & LIST_RET_STATUS) && !listargs->scan)
+	list_statusbatch.collecting = 1;
+
     if (listargs->sel & LIST_SEL_RECURSIVEMATCH) {
 	list_data_recursivematch(listargs, findsub);
     } else {
@@ -11763,6 +12179,9 @@ static void list_data(struct listargs *listargs)
 		free_hash_table(&listargs->server_table, NULL);
 	}
     }
+
+    if (list_statusbatch.collecting)
+	list_statusbatch_flush(listargs);
 }
 
 /*
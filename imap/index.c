@@ -57,6 +57,8 @@
 #include "append.h"
 #include "assert.h"
 #include "charset.h"
+#include "crc32.h"
+#include "dlist.h"
 #include "exitcodes.h"
 #include "hash.h"
 #include "imap/imap_err.h"
@@ -70,6 +72,7 @@
 #include "parseaddr.h"
 #include "search_engines.h"
 #include "seen.h"
+#include "sortcache.h"
 #include "statuscache.h"
 #include "strhash.h"
 #include "util.h"
@@ -97,7 +100,8 @@ struct index_modified_flags {
 
 static void index_checkflags(struct index_state *state, int dirty);
 
-static int index_writeseen(struct index_state *state);
+static int index_writeseen(struct index_state *state,
+			   struct statusdata *sdata);
 static void index_fetchmsg(struct index_state *state,
 		    const char *msg_base, unsigned long msg_size,
 		    unsigned offset, unsigned size,
@@ -126,9 +130,9 @@ static void index_fetchcacheheader(struct index_state *state, struct index_recor
 				   unsigned octet_count);
 static void index_listflags(struct index_state *state);
 static void index_fetchflags(struct index_state *state, uint32_t msgno);
-static int index_search_evaluate(struct index_state *state,
-				 const struct searchargs *searchargs,
-				 uint32_t msgno, struct mapfile *msgfile);
+static int index_search_columns(struct index_state *state,
+				const struct searchargs *searchargs,
+				unsigned char *match, int text_decided);
 static int index_searchmsg(char *substr, comp_pat *pat,
 			   struct mapfile *msgfile,
 			   int skipheader, const char *cachestr);
@@ -158,8 +162,10 @@ static char *index_extract_subject(const char *subj, size_t len, int *is_refwd);
 static char *_index_extract_subject(char *s, int *is_refwd);
 static void index_get_ids(MsgData *msgdata,
 			  char *envtokens[], const char *headers, unsigned size);
+static char *index_empty_msgid(uint32_t msgno);
 static MsgData *index_msgdata_load(struct index_state *state, unsigned *msgno_list, int n,
 				   const struct sortcrit *sortcrit);
+static void index_sortcache_commit(struct index_state *state);
 static struct seqset *_index_vanished(struct index_state *state,
 				      struct vanished_params *params);
 
@@ -168,6 +174,8 @@ static void index_sort_setnext(MsgData *node, MsgData *next);
 static int index_sort_compare(MsgData *md1, MsgData *md2,
 			      const struct sortcrit *call_data);
 static void index_msgdata_free(MsgData *md);
+static const struct sortcrit *index_sort_crit;
+static int index_sort_qcompare(const void *a, const void *b);
 
 static void *index_thread_getnext(Thread *thread);
 static void index_thread_setnext(Thread *thread, Thread *next);
@@ -193,13 +201,135 @@ static const struct thread_algorithm thread_algs[] = {
     { NULL, NULL }
 };
 
+static void index_columns_resize(struct index_state *state)
+{
+    struct index_columns *cols = &state->cols;
+    unsigned n = state->mapsize;
+
+    /* nothing to keep room for until they're first loaded */
+    if (!cols->size) return;
+
+    cols->internaldate = xrealloc(cols->internaldate, n * sizeof(time_t));
+    cols->sentdate = xrealloc(cols->sentdate, n * sizeof(time_t));
+    cols->size = xrealloc(cols->size, n * sizeof(uint32_t));
+    cols->loaded = xrealloc(cols->loaded, n);
+}
+
+static void index_columns_free(struct index_columns *cols)
+{
+    free(cols->internaldate);
+    free(cols->sentdate);
+    free(cols->size);
+    free(cols->loaded);
+    memset(cols, 0, sizeof(struct index_columns));
+}
+
+/* make sure the columns cover every message in the map */
+static void index_columns_load(struct index_state *state)
+{
+    struct index_columns *cols = &state->cols;
+    struct index_record record;
+    uint32_t msgno;
+
+    if (!cols->size) {
+	cols->size = xmalloc(state->mapsize * sizeof(uint32_t));
+	index_columns_resize(state);
+    }
+
+    for (msgno = cols->count + 1; msgno <= state->exists; msgno++) {
+	struct index_map *im = &state->map[msgno-1];
+
+	/* an unreadable record is left for index_search_evaluate() to
+	 * fail, rather than matching as a zero-sized message from 1970 */
+	if (!im->recno ||
+	    mailbox_read_index_record(state->mailbox, im->recno, &record)) {
+	    memset(&record, 0, sizeof(struct index_record));
+	    cols->loaded[msgno-1] = 0;
+	}
+	else
+	    cols->loaded[msgno-1] = 1;
+
+	cols->internaldate[msgno-1] = record.internaldate;
+	cols->sentdate[msgno-1] = record.sentdate;
+	cols->size[msgno-1] = record.size;
+    }
+
+    cols->count = state->exists;
+}
+
+/* user flags are stored only as wide as the highest word in use */
+static void index_user_flags_resize(struct index_state *state,
+				    unsigned words)
+{
+    bit32 *old = state->user_flags;
+    unsigned oldwords = state->user_flag_words;
+    unsigned msgno;
+
+    if (words < oldwords) words = oldwords;
+    if (!words) return;
+
+    state->user_flags = xzmalloc(state->mapsize * words * sizeof(bit32));
+    if (old) {
+	for (msgno = 1; msgno <= state->exists; msgno++)
+	    memcpy(state->user_flags + (msgno-1) * words,
+		   old + (msgno-1) * oldwords, oldwords * sizeof(bit32));
+	free(old);
+    }
+    state->user_flag_words = words;
+}
+
+static void index_get_user_flags(struct index_state *state, uint32_t msgno,
+				 bit32 *user_flags)
+{
+    unsigned words = state->user_flag_words;
+
+    memset(user_flags, 0, (MAX_USER_FLAGS/32) * sizeof(bit32));
+    if (words)
+	memcpy(user_flags, state->user_flags + (msgno-1) * words,
+	       words * sizeof(bit32));
+}
+
+static void index_set_user_flags(struct index_state *state, uint32_t msgno,
+				 const bit32 *user_flags)
+{
+    unsigned words = MAX_USER_FLAGS/32;
+
+    while (words && !user_flags[words-1])
+	words--;
+    if (words > state->user_flag_words)
+	index_user_flags_resize(state, words);
+
+    words = state->user_flag_words;
+    if (words)
+	memcpy(state->user_flags + (msgno-1) * words, user_flags,
+	       words * sizeof(bit32));
+}
+
+/* move a message's state down the map, closing up after expunges */
+static void index_map_move(struct index_state *state, uint32_t msgno,
+			   uint32_t oldmsgno)
+{
+    unsigned words = state->user_flag_words;
+
+    state->map[msgno-1] = state->map[oldmsgno-1];
+    if (words)
+	memcpy(state->user_flags + (msgno-1) * words,
+	       state->user_flags + (oldmsgno-1) * words,
+	       words * sizeof(bit32));
+    if (oldmsgno <= state->cols.count) {
+	state->cols.internaldate[msgno-1] = state->cols.internaldate[oldmsgno-1];
+	state->cols.sentdate[msgno-1] = state->cols.sentdate[oldmsgno-1];
+	state->cols.size[msgno-1] = state->cols.size[oldmsgno-1];
+	state->cols.loaded[msgno-1] = state->cols.loaded[oldmsgno-1];
+    }
+}
+
 static int index_reload_record(struct index_state *state,
 			       uint32_t msgno,
 			       struct index_record *recordp)
 {
     struct index_map *im = &state->map[msgno-1];
     int r = 0;
-    int i;
 
     if (!im->recno) {
 	/* doh, gotta just fill in what we know */
@@ -230,8 +360,7 @@ static int index_reload_record(struct index_state *state,
     /* restore mutable fields */
     recordp->modseq = im->modseq;
     recordp->system_flags = im->system_flags;
-    for (i = 0; i < MAX_USER_FLAGS/32; i++)
-	recordp->user_flags[i] = im->user_flags[i];
+    index_get_user_flags(state, msgno, recordp->user_flags);
 
     return 0;
 }
@@ -241,7 +370,6 @@ static int index_rewrite_record(struct index_state *state,
 				struct index_record *recordp)
 {
     struct index_map *im = &state->map[msgno-1];
-    int i;
     int r;
 
     assert(recordp->uid == im->uid);
@@ -252,8 +380,7 @@ static int index_rewrite_record(struct index_state *state,
     /* update tracking of mutable fields */
     im->modseq = recordp->modseq;
     im->system_flags = recordp->system_flags;
-    for (i = 0; i < MAX_USER_FLAGS/32; i++)
-	im->user_flags[i] = recordp->user_flags[i];
+    index_set_user_flags(state, msgno, recordp->user_flags);
 
     return 0;
 }
@@ -268,6 +395,69 @@ EXPORTED void index_release(struct index_state *state)
     }
 }
 
+/*
+ * Give back what the session can do without while it waits for
+ * something to happen: the mailbox itself, the search columns and
+ * SORT cache (both rebuilt when next needed) and any slack in the
+ * map.  Everything else is per-message state that has to be kept.
+ */
+EXPORTED void index_trim(struct index_state *state)
+{
+    unsigned mapsize;
+
+    if (!state) return;
+
+    index_release(state);
+    index_columns_free(&state->cols);
+    sortcache_close(&state->sortcache);
+
+    mapsize = (state->exists | 0xff) + 1;
+    if (mapsize < state->mapsize) {
+	state->mapsize = mapsize;
+	state->map = xrealloc(state->map,
+			      state->mapsize * sizeof(struct index_map));
+	if (state->user_flag_words)
+	    state->user_flags = xrealloc(state->user_flags,
+					 state->mapsize *
+					 state->user_flag_words * sizeof(bit32));
+    }
+}
+
+/*
+ * Record what the client has been told about the mailbox, for another
+ * process to carry on from with index_open().  Only the messages it
+ * knows about and the modseq it was last told are needed, everything
+ * else can be read back from the mailbox itself.
+ */
+EXPORTED void index_park(struct index_state *state, struct dlist *kl)
+{
+    struct seqset *uids = seqset_init(0, SEQ_SPARSE);
+    struct seqset *recent = seqset_init(0, SEQ_SPARSE);
+    struct index_map *im;
+    uint32_t msgno;
+    char *str;
+
+    for (msgno = 1; msgno <= state->exists; msgno++) {
+	im = &state->map[msgno-1];
+	seqset_add(uids, im->uid, 1);
+	if (im->isrecent)
+	    seqset_add(recent, im->uid, 1);
+    }
+
+    dlist_setnum32(kl, "EXAMINE", state->examining);
+    dlist_setnum32(kl, "UIDVALIDITY", state->uidvalidity);
+    dlist_setnum64(kl, "MODSEQ", state->highestmodseq);
+    str = seqset_cstring(uids);
+    dlist_setatom(kl, "UIDS", str ? str : "");
+    free(str);
+    str = seqset_cstring(recent);
+    dlist_setatom(kl, "RECENT", str ? str : "");
+    free(str);
+
+    seqset_free(uids);
+    seqset_free(recent);
+}
+
 /*
  * A mailbox is about to be closed.
  */
@@ -281,6 +471,9 @@ EXPORTED void index_close(struct index_state **stateptr)
     index_release(state);
 
     free(state->map);
+    free(state->user_flags);
+    index_columns_free(&state->cols);
+    sortcache_close(&state->sortcache);
     free(state->mboxname);
     free(state->userid);
     for (i = 0; i < MAX_USER_FLAGS; i++)
@@ -290,6 +483,57 @@ EXPORTED void index_close(struct index_state **stateptr)
     *stateptr = NULL;
 }
 
+/*
+ * Set up the map for a session parked by index_park(), with just the
+ * messages it knows about as last told.  The refresh which follows
+ * fills in the rest, and anything that's changed since is reported
+ * at the next check as though we'd been watching all along.
+ */
+static int index_unpark(struct index_state *state, struct dlist *kl)
+{
+    const char *uids = NULL, *recent = NULL;
+    uint32_t uidvalidity = 0;
+    modseq_t modseq = 0;
+    struct seqset *seq, *recentseq;
+    struct index_map *im;
+    uint32_t uid, msgno = 0;
+
+    if (!dlist_getnum32(kl, "UIDVALIDITY", &uidvalidity) ||
+	!dlist_getnum64(kl, "MODSEQ", &modseq) ||
+	!dlist_getatom(kl, "UIDS", &uids) ||
+	!dlist_getatom(kl, "RECENT", &recent))
+	return IMAP_PROTOCOL_ERROR;
+
+    /* deleted and created again, nothing they know applies any more */
+    if (uidvalidity != state->mailbox->i.uidvalidity)
+	return IMAP_MAILBOX_NONEXISTENT;
+
+    seq = seqset_parse(uids, NULL, 0);
+    recentseq = seqset_parse(recent, NULL, 0);
+
+    while ((uid = seqset_getnext(seq))) {
+	if (msgno >= state->mapsize) {
+	    state->mapsize = ((msgno * 2) | 0xff) + 1;
+	    state->map = xrealloc(state->map,
+				  state->mapsize * sizeof(struct index_map));
+	}
+	im = &state->map[msgno++];
+	memset(im, 0, sizeof(struct index_map));
+	im->uid = uid;
+	im->modseq = im->told_modseq = modseq;
+	im->isrecent = seqset_ismember(recentseq, uid) ? 1 : 0;
+    }
+
+    seqset_free(seq);
+    seqset_free(recentseq);
+
+    state->exists = msgno;
+    state->last_uid = msgno ? state->map[msgno-1].uid : 0;
+    state->highestmodseq = modseq;
+
+    return 0;
+}
+
 /*
  * A new mailbox has been selected, map it into memory and do the
  * initial CHECK.
@@ -323,6 +567,15 @@ EXPORTED int index_open(const char *name, struct index_init *init,
 
 	state->internalseen = mailbox_internal_seen(state->mailbox,
 						    state->userid);
+
+	if (init->parked) {
+	    r = index_unpark(state, init->parked);
+	    if (r) {
+		mailbox_close(&state->mailbox);
+		free(state->map);
+		goto fail;
+	    }
+	}
     }
     else {
 	r = mailbox_open_iwl(name, &state->mailbox);
@@ -473,7 +726,8 @@ static char *index_buildseen(struct index_state *state, const char *oldseenuids)
     return out;
 }
 
-static int index_writeseen(struct index_state *state)
+static int index_writeseen(struct index_state *state,
+			   struct statusdata *sdata)
 {
     int r;
     struct seen *seendb = NULL;
@@ -529,6 +783,20 @@ static int index_writeseen(struct index_state *state)
 	sd.lastread = time(NULL);
 	sd.lastchange = mailbox->i.last_appenddate;
 	r = seen_write(seendb, mailbox->uniqueid, &sd);
+
+	/* if our view is complete, we know this user's counts now,
+	 * so save them a rescan on their next STATUS */
+	if (!r && state->last_uid == mailbox->i.last_uid &&
+	    state->num_records == mailbox->i.num_records &&
+	    !mailbox->statusdelta.removed) {
+	    statuscache_fill(sdata, state->userid, mailbox,
+			     STATUS_MESSAGES | STATUS_UIDNEXT |
+			     STATUS_UIDVALIDITY | STATUS_HIGHESTMODSEQ |
+			     STATUS_RECENT | STATUS_UNSEEN,
+			     0, state->numunseen);
+	    sdata->recentuid = sd.lastuid;
+	    sdata->seencrc = crc32_cstring(sd.seenuids);
+	}
     }
 
     seen_close(&seendb);
@@ -585,16 +853,15 @@ void index_refresh(struct index_state *state)
     struct mailbox *mailbox = state->mailbox;
     struct index_record record;
     uint32_t recno;
-    uint32_t msgno = 1;
-    uint32_t firstnotseen = 0;
-    uint32_t numrecent = 0;
-    uint32_t numunseen = 0;
+    uint32_t msgno;
+    uint32_t firstnotseen, numrecent, numunseen, numexists;
     uint32_t recentuid;
     struct index_map *im;
-    modseq_t delayed_modseq = 0;
+    modseq_t delayed_modseq;
     uint32_t need_records;
     struct seqset *seenlist;
-    int i;
+    uint32_t knownrecords = 0;
+    modseq_t modseq;
 
     /* need to start by having enough space for the entire index state
      * before telling of any expunges (which happens after this refresh
@@ -616,65 +883,94 @@ void index_refresh(struct index_state *state)
 	state->mapsize = (need_records | 0xff) + 1; /* round up 1-256 */
 	state->map = xrealloc(state->map,
 			      state->mapsize * sizeof(struct index_map));
+	if (state->user_flag_words)
+	    state->user_flags = xrealloc(state->user_flags,
+					 state->mapsize *
+					 state->user_flag_words * sizeof(bit32));
+	index_columns_resize(state);
     }
 
+    /* if nothing has been repacked away since we last looked, the
+     * records we knew about which haven't changed since are already
+     * right in the map, and don't need reading and checking again */
+    if (state->map_modseq && state->generation == mailbox->i.generation_no &&
+	state->uidvalidity == mailbox->i.uidvalidity)
+	knownrecords = state->num_records;
+
     seenlist = _readseen(state, &recentuid);
 
+restart:
+    msgno = 1;
+    firstnotseen = numrecent = numunseen = numexists = 0;
+    delayed_modseq = 0;
+
     /* walk through all records */
     for (recno = 1; recno <= mailbox->i.num_records; recno++) {
-	if (mailbox_read_index_record(mailbox, recno, &record))
-	    continue; /* bogus read... should probably be fatal */
-
-	/* skip over map records where the mailbox doesn't have any
-	 * data at all for the record any more (this can only happen
-	 * after a repack), otherwise there will still be a readable
-	 * record, which is handled below */
 	im = &state->map[msgno-1];
-	while (msgno <= state->exists && im->uid < record.uid) {
-	    /* NOTE: this same logic is repeated below for messages
-	     * past the end of recno (repack removing the trailing
-	     * records).  Make sure to keep them in sync */
-	    if (!(im->system_flags & FLAG_EXPUNGED)) {
-		/* we don't even know the modseq of when it was wiped,
-		 * but we can be sure it's since the last given highestmodseq,
-		 * so simulate the lowest possible value.  This is fine for
-		 * our told_modseq logic, and doesn't have to be exact because
-		 * QRESYNC/CONDSTORE clients will see deletedmodseq and fall
-		 * back to the inefficient codepath anyway */
-		im->modseq = state->highestmodseq + 1;
-	    }
-	    if (!delayed_modseq || im->modseq < delayed_modseq)
-		delayed_modseq = im->modseq - 1;
-	    im->recno = 0;
-	    /* simulate expunged flag so we get an EXPUNGE response and
-	     * tell about unlinked so we don't get IO errors trying to
-	     * find the file */
-	    im->system_flags |= FLAG_EXPUNGED | FLAG_UNLINKED;
-	    im = &state->map[msgno++];
-	}
-
-	/* expunged record not in map, can skip immediately.  It's
-	 * never been told to this connection, so it doesn't need to
-	 * get its own msgno */
-	if ((msgno > state->exists || record.uid < im->uid)
-	    && (record.system_flags & FLAG_EXPUNGED))
-	    continue;
 
-	/* make sure our UID map is consistent */
-	if (msgno <= state->exists) {
-	    assert(im->uid == record.uid);
+	/* an expunged record can still be silently marked UNLINKED
+	 * (by cyr_expire), so those always get read again */
+	if (recno <= knownrecords &&
+	    (modseq = mailbox_read_index_modseq(mailbox, recno)) &&
+	    modseq <= state->map_modseq &&
+	    (im->system_flags & (FLAG_EXPUNGED|FLAG_UNLINKED)) != FLAG_EXPUNGED) {
+	    /* expunged before it was ever in the map */
+	    if (msgno > state->exists || im->recno != recno)
+		continue;
 	}
 	else {
-	    im->uid = record.uid;
-	}
+	    if (mailbox_read_index_record(mailbox, recno, &record))
+		continue; /* bogus read... should probably be fatal */
+
+	    /* skip over map records where the mailbox doesn't have any
+	     * data at all for the record any more (this can only happen
+	     * after a repack), otherwise there will still be a readable
+	     * record, which is handled below */
+	    while (msgno <= state->exists && im->uid < record.uid) {
+		/* NOTE: this same logic is repeated below for messages
+		 * past the end of recno (repack removing the trailing
+		 * records).  Make sure to keep them in sync */
+		if (!(im->system_flags & FLAG_EXPUNGED)) {
+		    /* we don't even know the modseq of when it was wiped,
+		     * but we can be sure it's since the last given highestmodseq,
+		     * so simulate the lowest possible value.  This is fine for
+		     * our told_modseq logic, and doesn't have to be exact because
+		     * QRESYNC/CONDSTORE clients will see deletedmodseq and fall
+		     * back to the inefficient codepath anyway */
+		    im->modseq = state->highestmodseq + 1;
+		}
+		if (!delayed_modseq || im->modseq < delayed_modseq)
+		    delayed_modseq = im->modseq - 1;
+		im->recno = 0;
+		/* simulate expunged flag so we get an EXPUNGE response and
+		 * tell about unlinked so we don't get IO errors trying to
+		 * find the file */
+		im->system_flags |= FLAG_EXPUNGED | FLAG_UNLINKED;
+		im = &state->map[msgno++];
+	    }
 
-	/* copy all mutable fields */
-	im->recno = recno;
-	im->modseq = record.modseq;
-	im->system_flags = record.system_flags;
-	for (i = 0; i < MAX_USER_FLAGS/32; i++)
-	    im->user_flags[i] = record.user_flags[i];
+	    /* expunged record not in map, can skip immediately.  It's
+	     * never been told to this connection, so it doesn't need to
+	     * get its own msgno */
+	    if ((msgno > state->exists || record.uid < im->uid)
+		&& (record.system_flags & FLAG_EXPUNGED))
+		continue;
+
+	    /* make sure our UID map is consistent */
+	    if (msgno <= state->exists) {
+		assert(im->uid == record.uid);
+	    }
+	    else {
+		im->uid = record.uid;
+	    }
 
+	    /* copy all mutable fields */
+	    im->recno = recno;
+	    im->modseq = record.modseq;
+	    im->system_flags = record.system_flags;
+	    index_set_user_flags(state, msgno, record.user_flags);
+
+	}
 	/* for expunged records, just track the modseq */
 	if (im->system_flags & FLAG_EXPUNGED) {
 	    /* http://www.rfc-editor.org/errata_search.php?rfc=5162
@@ -685,6 +981,8 @@ void index_refresh(struct index_state *state)
 		delayed_modseq = im->modseq - 1;
 	}
 	else {
+	    numexists++;
+
 	    /* re-calculate seen flags */
 	    if (state->internalseen)
 		im->isseen = (im->system_flags & FLAG_SEEN) ? 1 : 0;
@@ -727,6 +1025,15 @@ void index_refresh(struct index_state *state)
 	}
     }
 
+    /* a silent expunge (e.g. a replica applying its master's EXPUNGE)
+     * doesn't bump the modseq, so the records we skipped above may
+     * not be right after all.  If the count doesn't add up, go back
+     * and read everything */
+    if (knownrecords && numexists != mailbox->i.exists) {
+	knownrecords = 0;
+	goto restart;
+    }
+
     /* may be trailing records which need to be considered for
      * delayed_modseq purposes, and to get the count right for
      * later expunge processing */
@@ -751,6 +1058,7 @@ void index_refresh(struct index_state *state)
     state->exists = msgno - 1; /* we actually got this many */
     state->delayed_modseq = delayed_modseq;
     state->highestmodseq = mailbox->i.highestmodseq;
+    state->map_modseq = mailbox->i.highestmodseq;
     state->generation = mailbox->i.generation_no;
     state->uidvalidity = mailbox->i.uidvalidity;
     state->last_uid = mailbox->i.last_uid;
@@ -1432,7 +1740,8 @@ EXPORTED int index_scan(struct index_state *state, const char *contents)
 
     msgno_list = (unsigned *) xmalloc(state->exists * sizeof(unsigned));
 
-    listcount = search_prefilter_messages(msgno_list, state, &searchargs);
+    listcount = search_prefilter_messages(msgno_list, state, &searchargs,
+					  NULL);
 
     for (listindex = 0; !n && listindex < listcount; listindex++) {
 	struct mapfile msgfile = MAPFILE_INITIALIZER;
@@ -1471,6 +1780,9 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
     int listindex, min;
     int listcount;
     struct index_map *im;
+    unsigned char *match;
+    int decided;
+    int exact;
 
     if (state->exists <= 0) return 0;
 
@@ -1481,7 +1793,24 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
        scan through the list and store matching message IDs back into the
        list. This is OK because we only overwrite message IDs that we've
        already looked at. */
-    listcount = search_prefilter_messages(*msgno_list, state, searchargs);
+    listcount = search_prefilter_messages(*msgno_list, state, searchargs,
+					  &exact);
+
+    /* Knock out everything which fails the non-text criteria with a
+       scan over the columns, so the per-message evaluation only sees
+       real candidates.  If that was all there was to the search (or
+       the search engine answered the rest exactly), the survivors are
+       the answer and we needn't evaluate at all. */
+    match = xmalloc(state->exists);
+    decided = index_search_columns(state, searchargs, match, exact);
+    for (listindex = 0, n = 0; listindex < listcount; listindex++) {
+	msgno = (*msgno_list)[listindex];
+	if (match[msgno-1])
+	    (*msgno_list)[n++] = msgno;
+    }
+    free(match);
+    listcount = n;
+    n = 0;
 
     if (searchargs->returnopts == SEARCH_RETURN_MAX) {
 	/* If we only want MAX, then skip forward search,
@@ -1499,11 +1828,7 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
 	msgno = (*msgno_list)[listindex];
 	im = &state->map[msgno-1];
 
-	/* expunged messages never match */
-	if (im->system_flags & FLAG_EXPUNGED)
-	    continue;
-
-	if (index_search_evaluate(state, searchargs, msgno, NULL)) {
+	if (decided || index_search_evaluate(state, searchargs, msgno, NULL)) {
 	    (*msgno_list)[n++] = msgno;
 	    if (highestmodseq && im->modseq > *highestmodseq) {
 		*highestmodseq = im->modseq;
@@ -1532,11 +1857,7 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
 	msgno = (*msgno_list)[listindex-1];
 	im = &state->map[msgno-1];
 
-	/* expunged messages never match */
-	if (im->system_flags & FLAG_EXPUNGED)
-	    continue;
-
-	if (index_search_evaluate(state, searchargs, msgno, NULL)) {
+	if (decided || index_search_evaluate(state, searchargs, msgno, NULL)) {
 	    (*msgno_list)[n++] = msgno;
 	    if (highestmodseq && im->modseq > *highestmodseq) {
 		*highestmodseq = im->modseq;
@@ -1639,14 +1960,19 @@ EXPORTED int index_status(struct index_state *state, struct statusdata *sdata)
 
 static void index_unlock(struct index_state *state)
 {
+    struct statusdata sdata;
+
+    memset(&sdata, 0, sizeof(struct statusdata));
+
     /* XXX - errors */
 
-    index_writeseen(state);
+    index_writeseen(state, &sdata);
 
     /* grab the latest modseq */
     state->highestmodseq = state->mailbox->i.highestmodseq;
 
-    mailbox_unlock_index(state->mailbox, NULL);
+    mailbox_unlock_index(state->mailbox,
+			 sdata.statusitems ? &sdata : NULL);
 }
 
 /*
@@ -1733,7 +2059,7 @@ EXPORTED int index_sort(struct index_state *state,
 	       struct searchargs *searchargs, int usinguid)
 {
     unsigned *msgno_list;
-    MsgData *msgdata = NULL, *freeme = NULL;
+    MsgData *msgdata = NULL, **sorted;
     int nmsg;
     modseq_t highestmodseq = 0;
     int i, modseq = 0;
@@ -1760,30 +2086,34 @@ EXPORTED int index_sort(struct index_state *state,
 
     if (nmsg) {
 	/* Create/load the msgdata array */
-	freeme = msgdata = index_msgdata_load(state, msgno_list, nmsg, sortcrit);
+	msgdata = index_msgdata_load(state, msgno_list, nmsg, sortcrit);
 	free(msgno_list);
 
-	/* Sort the messages based on the given criteria */
-	msgdata = lsort(msgdata,
-			(void * (*)(void*)) index_sort_getnext,
-			(void (*)(void*,void*)) index_sort_setnext,
-			(int (*)(void*,void*,void*)) index_sort_compare,
-			(void *)sortcrit);
+	/* Sort the messages based on the given criteria.  Sorting an
+	 * array of pointers keeps the comparisons on contiguous memory,
+	 * which matters once the keys come straight from the sort cache */
+	sorted = (MsgData **) xmalloc(nmsg * sizeof(MsgData *));
+	for (i = 0; i < nmsg; i++)
+	    sorted[i] = &msgdata[i];
+	index_sort_crit = sortcrit;
+	qsort(sorted, nmsg, sizeof(MsgData *), index_sort_qcompare);
+	index_sort_crit = NULL;
 
 	/* Output the sorted messages */ 
-	while (msgdata) {
-	    unsigned no = usinguid ? state->map[msgdata->msgno-1].uid
-				   : msgdata->msgno;
+	for (i = 0; i < nmsg; i++) {
+	    unsigned no = usinguid ? state->map[sorted[i]->msgno-1].uid
+				   : sorted[i]->msgno;
 	    prot_printf(state->out, " %u", no);
 
 	    /* free contents of the current node */
-	    index_msgdata_free(msgdata);
-
-	    msgdata = msgdata->next;
+	    index_msgdata_free(sorted[i]);
 	}
 
 	/* free the msgdata array */
-	free(freeme);
+	free(sorted);
+	free(msgdata);
+
+	index_sortcache_commit(state);
     }
 
     if (highestmodseq)
@@ -1822,6 +2152,8 @@ EXPORTED int index_thread(struct index_state *state, int algorithm,
 
 	free(msgno_list);
 
+	index_sortcache_commit(state);
+
 	if (highestmodseq)
 	    prot_printf(state->out, " (MODSEQ " MODSEQ_FMT ")", highestmodseq);
     }
@@ -2723,6 +3055,7 @@ static void index_tellexpunge(struct index_state *state)
     struct seqset *vanishedlist;
     struct index_map *im;
     unsigned exists = state->exists;
+    unsigned loaded = 0;
 
     vanishedlist = seqset_init(0, SEQ_SPARSE);
 
@@ -2745,11 +3078,15 @@ static void index_tellexpunge(struct index_state *state)
 
 	/* copy back if necessary (after first expunge) */
 	if (msgno < oldmsgno)
-	    state->map[msgno-1] = *im;
+	    index_map_move(state, msgno, oldmsgno);
+	if (oldmsgno <= state->cols.count)
+	    loaded = msgno;
 
 	msgno++;
     }
 
+    state->cols.count = loaded;
+
     /* report all vanished if we're doing it this way */
     if (vanishedlist->len) {
 	char *vanished = seqset_cstring(vanishedlist);
@@ -2870,8 +3207,11 @@ static void index_fetchflags(struct index_state *state,
     int sepchar = '(';
     unsigned flag;
     bit32 flagmask = 0;
+    bit32 user_flags[MAX_USER_FLAGS/32];
     struct index_map *im = &state->map[msgno-1];
 
+    index_get_user_flags(state, msgno, user_flags);
+
     prot_printf(state->out, "* %u FETCH (FLAGS ", msgno);
 
     if (im->isrecent) {
@@ -2900,7 +3240,7 @@ static void index_fetchflags(struct index_state *state,
     }
     for (flag = 0; flag < VECTOR_SIZE(state->flagname); flag++) {
 	if ((flag & 31) == 0) {
-	    flagmask = im->user_flags[flag/32];
+	    flagmask = user_flags[flag/32];
 	}
 	if (state->flagname[flag] && (flagmask & (1<<(flag & 31)))) {
 	    prot_printf(state->out, "%c%s", sepchar, state->flagname[flag]);
@@ -2939,6 +3279,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     int fetchitems = fetchargs->fetchitems;
     const char *msg_base = NULL;
     size_t msg_size = 0;
+    int msg_fd = -1;
     struct octetinfo *oi = NULL;
     int sepchar = '(';
     int started = 0;
@@ -2976,6 +3317,13 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 	    prot_printf(state->out, "\r\n");
 	    return 0;
 	}
+
+	/* on a plaintext link, large literals can go straight from the file */
+	if (msg_size >= PROT_SENDFILE_MIN && prot_cansendfile(state->out)) {
+	    msg_fd = open(mailbox_message_fname(mailbox, record.uid), O_RDONLY);
+	    if (msg_fd != -1)
+		prot_setsendfile(state->out, msg_fd, msg_base, msg_size);
+	}
     }
 
     /* display flags if asked _OR_ if they've changed */
@@ -3187,6 +3535,10 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 	/* finsh the response if we have one */
 	prot_printf(state->out, ")\r\n");
     }
+    if (msg_fd != -1) {
+	prot_setsendfile(state->out, PROT_NO_FD, NULL, 0);
+	close(msg_fd);
+    }
     if (msg_base) 
 	mailbox_unmap_message(mailbox, record.uid, &msg_base, &msg_size);
 
@@ -3675,15 +4027,153 @@ out:
     return r;
 }
 
+/*
+ * Evaluate the top-level non-text criteria of 'searchargs' for every
+ * message at once, using the columns rather than the index records.
+ * Sets match[msgno-1] to 0 for each message which can't possibly match
+ * and to 1 for the rest.  Each criterion is a separate branch-free pass
+ * over one array, which the compiler can vectorise.
+ *
+ * Returns 1 if the columns were enough to answer the whole search, or
+ * 0 if the survivors still need index_search_evaluate().  If
+ * 'text_decided', the text criteria and sublists have already been
+ * answered exactly by the search engine.
+ */
+static int index_search_columns(struct index_state *state,
+				const struct searchargs *searchargs,
+				unsigned char *match, int text_decided)
+{
+    const struct index_columns *cols = &state->cols;
+    const struct index_map *map = state->map;
+    unsigned n = state->exists;
+    unsigned words = state->user_flag_words;
+    unsigned i, j;
+    struct seqset *seq;
+    int undecided = 0;
+
+    for (i = 0; i < n; i++)
+	match[i] = !(map[i].system_flags & FLAG_EXPUNGED);
+
+    /* sizes and dates aren't kept until a search first needs them */
+    if (searchargs->smaller || searchargs->larger ||
+	searchargs->after || searchargs->before ||
+	searchargs->sentafter || searchargs->sentbefore) {
+	const unsigned char *loaded;
+
+	index_columns_load(state);
+	loaded = cols->loaded;
+
+	/* messages whose record couldn't be read pass every column test
+	 * here, and are left undecided below */
+	if (searchargs->smaller) {
+	    uint32_t smaller = searchargs->smaller;
+	    for (i = 0; i < n; i++)
+		match[i] &= !loaded[i] | (cols->size[i] < smaller);
+	}
+	if (searchargs->larger) {
+	    uint32_t larger = searchargs->larger;
+	    for (i = 0; i < n; i++)
+		match[i] &= !loaded[i] | (cols->size[i] > larger);
+	}
+
+	if (searchargs->after) {
+	    time_t after = searchargs->after;
+	    for (i = 0; i < n; i++)
+		match[i] &= !loaded[i] | (cols->internaldate[i] >= after);
+	}
+	if (searchargs->before) {
+	    time_t before = searchargs->before;
+	    for (i = 0; i < n; i++)
+		match[i] &= !loaded[i] | (cols->internaldate[i] < before);
+	}
+	if (searchargs->sentafter) {
+	    time_t sentafter = searchargs->sentafter;
+	    for (i = 0; i < n; i++)
+		match[i] &= !loaded[i] | (cols->sentdate[i] >= sentafter);
+	}
+	if (searchargs->sentbefore) {
+	    time_t sentbefore = searchargs->sentbefore;
+	    for (i = 0; i < n; i++)
+		match[i] &= !loaded[i] | (cols->sentdate[i] < sentbefore);
+	}
+
+	for (i = 0; i < n; i++)
+	    if (match[i] && !loaded[i]) undecided = 1;
+    }
+
+    if (searchargs->modseq) {
+	modseq_t modseq = searchargs->modseq;
+	for (i = 0; i < n; i++)
+	    match[i] &= (map[i].modseq >= modseq);
+    }
+
+    if (searchargs->system_flags_set || searchargs->system_flags_unset) {
+	bit32 set = searchargs->system_flags_set;
+	bit32 unset = searchargs->system_flags_unset;
+	for (i = 0; i < n; i++)
+	    match[i] &= !(~map[i].system_flags & set) &&
+			!(map[i].system_flags & unset);
+    }
+
+    /* words past user_flag_words have no flags set on any message */
+    for (j = 0; j < (MAX_USER_FLAGS/32); j++) {
+	bit32 set = searchargs->user_flags_set[j];
+	bit32 unset = searchargs->user_flags_unset[j];
+	if (!set && !unset) continue;
+	if (j >= words) {
+	    if (set) memset(match, 0, n);
+	    continue;
+	}
+	for (i = 0; i < n; i++)
+	    match[i] &= !(~state->user_flags[i*words+j] & set) &&
+			!(state->user_flags[i*words+j] & unset);
+    }
+
+    if (searchargs->flags) {
+	int flags = searchargs->flags;
+	for (i = 0; i < n; i++) {
+	    const struct index_map *im = &map[i];
+	    if (((flags & SEARCH_RECENT_SET) && !im->isrecent) ||
+		((flags & SEARCH_RECENT_UNSET) && im->isrecent) ||
+		((flags & SEARCH_SEEN_SET) && !im->isseen) ||
+		((flags & SEARCH_SEEN_UNSET) && im->isseen))
+		match[i] = 0;
+	}
+    }
+
+    for (seq = searchargs->sequence; seq; seq = seq->nextseq) {
+	for (i = 0; i < n; i++)
+	    if (match[i] && !seqset_ismember(seq, i+1)) match[i] = 0;
+    }
+    for (seq = searchargs->uidsequence; seq; seq = seq->nextseq) {
+	for (i = 0; i < n; i++)
+	    if (match[i] && !seqset_ismember(seq, map[i].uid)) match[i] = 0;
+    }
+
+    /* anything else needs the record, cache or message file */
+    if (undecided)
+	return 0;
+    if (searchargs->messageid || searchargs->annotations ||
+	searchargs->cache_atleast)
+	return 0;
+    if (!text_decided &&
+	(searchargs->from || searchargs->to || searchargs->cc ||
+	 searchargs->bcc || searchargs->subject || searchargs->body ||
+	 searchargs->text || searchargs->header_name || searchargs->sublist))
+	return 0;
+
+    return 1;
+}
+
 /*
  * Evaluate a searchargs structure on a msgno
  *
  * Note: msgfile argument must be 0 if msg is not mapped in.
  */
-static int index_search_evaluate(struct index_state *state,
-				 const struct searchargs *searchargs,
-				 uint32_t msgno,
-				 struct mapfile *msgfile)
+EXPORTED int index_search_evaluate(struct index_state *state,
+				   const struct searchargs *searchargs,
+				   uint32_t msgno,
+				   struct mapfile *msgfile)
 {
     unsigned i;
     struct strlist *l, *h;
@@ -4025,12 +4515,22 @@ static void index_getsearchtextmsg(struct index_state *state,
     unsigned long start;
     int len, charset, encoding;
     int partcount = 0;
+    int started = 0;
     char *p, *q;
     struct mailbox *mailbox = state->mailbox;
   
     if (mailbox_map_message(mailbox, uid, &msgfile.base, &msgfile.size))
 	return;
 
+    /* Each part of the body is searched separately, so keep the text
+       of consecutive parts from running together into one word */
+#define SEPARATE_PARTS() do {						\
+	if (started)							\
+	    receiver(uid, SEARCHINDEX_PART_BODY,			\
+		     SEARCHINDEX_CMD_APPENDPART, " ", 1, rock);		\
+	started = 1;							\
+    } while (0)
+
     /* Won't find anything in a truncated file */
     if (msgfile.size > 0) {
 	while (partsleft--) {
@@ -4055,6 +4555,7 @@ static void index_getsearchtextmsg(struct index_state *state,
 			    receiver(uid, SEARCHINDEX_PART_BODY,
 				     SEARCHINDEX_CMD_BEGINPART, NULL, 0, rock);
 			} else {
+			    SEPARATE_PARTS();
 			    receiver(uid, SEARCHINDEX_PART_BODY,
 				 SEARCHINDEX_CMD_APPENDPART, q, strlen(q), rock);
 			}
@@ -4070,6 +4571,7 @@ static void index_getsearchtextmsg(struct index_state *state,
 		    encoding = CACHE_ITEM_BIT32(cachestr+4*4) & 0xff;
 
 		    if (start < msgfile.size && len > 0) {
+		      SEPARATE_PARTS();
 		      charset_extractfile(receiver, rock, uid,
 					  msgfile.base + start,
 					  len, charset, encoding, charset_flags);
@@ -4083,6 +4585,8 @@ static void index_getsearchtextmsg(struct index_state *state,
 		 SEARCHINDEX_CMD_ENDPART, NULL, 0, rock);
     }
 
+#undef SEPARATE_PARTS
+
     mailbox_unmap_message(mailbox, uid, &msgfile.base, &msgfile.size);
 }
 
@@ -4203,6 +4707,209 @@ static int index_copysetup(struct index_state *state, uint32_t msgno,
     return 0;
 }
 
+/*
+ * Returns the sort key cache of the mailbox, opening it on first use,
+ * or NULL if it's turned off or can't be used.
+ */
+static struct sortcache *index_sortcache(struct index_state *state)
+{
+    if (!config_getswitch(IMAPOPT_SORTCACHE))
+	return NULL;
+
+    if (!state->sortcache) {
+	if (sortcache_open(state->mailbox, &state->sortcache))
+	    return NULL;
+    }
+    else if (sortcache_refresh(state->sortcache))
+	return NULL;
+
+    return state->sortcache;
+}
+
+/*
+ * Can every key in 'sortcrit' be had from the sort cache and the
+ * index columns?
+ */
+static int index_sortcache_covers(const struct sortcrit *sortcrit)
+{
+    int j;
+
+    for (j = 0; sortcrit[j].key; j++) {
+	switch (sortcrit[j].key) {
+	case SORT_ARRIVAL:
+	case SORT_CC:
+	case SORT_DATE:
+	case SORT_FROM:
+	case SORT_MODSEQ:
+	case SORT_SIZE:
+	case SORT_SUBJECT:
+	case SORT_TO:
+	case SORT_DISPLAYFROM:
+	case SORT_DISPLAYTO:
+	case SORT_UID:
+	case LOAD_IDS:
+	    break;
+	default:
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+/*
+ * Fills in 'cur' for index_msgdata_load() from the sort cache.  If the
+ * message isn't in the cache yet, all of its cacheable keys are worked
+ * out from cyrus.cache and queued for the next sortcache_commit().
+ */
+static void index_msgdata_fromcache(struct index_state *state,
+				    struct sortcache *sc, MsgData *cur,
+				    const struct sortcrit *sortcrit)
+{
+    struct index_map *im = &state->map[cur->msgno-1];
+    struct sortcache_entry entry;
+    struct index_record record;
+    char *xsubj = NULL, *from = NULL, *to = NULL, *cc = NULL;
+    char *displayfrom = NULL, *displayto = NULL;
+    char *tmpenv;
+    char *envtokens[NUMENVTOKENS];
+    MsgData ids;
+    struct buf refs = BUF_INITIALIZER;
+    const char *ref;
+    unsigned i;
+    int j;
+
+    memset(&ids, 0, sizeof(MsgData));
+    cur->uid = im->uid;
+    cur->modseq = im->modseq;
+
+    if (!sortcache_lookup(sc, cur->uid, &entry)) {
+	/* point straight into the mapped file */
+	cur->keys_mapped = 1;
+    }
+    else {
+	if (index_reload_record(state, cur->msgno, &record))
+	    return;
+	if (mailbox_cacherecord(state->mailbox, &record))
+	    return; /* can't do this with a broken cache */
+
+	/* index_extract_subject() counts re/fwd prefixes into is_refwd */
+	memset(&entry, 0, sizeof(struct sortcache_entry));
+	entry.uid = record.uid;
+	entry.gmtime = record.gmtime;
+	entry.xsubj = xsubj =
+	    index_extract_subject(cacheitem_base(&record, CACHE_SUBJECT),
+				  cacheitem_size(&record, CACHE_SUBJECT),
+				  &entry.is_refwd);
+	entry.xsubj_hash = strhash(xsubj);
+	entry.from = from =
+	    get_localpart_addr(cacheitem_base(&record, CACHE_FROM));
+	entry.to = to = get_localpart_addr(cacheitem_base(&record, CACHE_TO));
+	entry.cc = cc = get_localpart_addr(cacheitem_base(&record, CACHE_CC));
+	entry.displayfrom = displayfrom =
+	    get_displayname(cacheitem_base(&record, CACHE_FROM));
+	entry.displayto = displayto =
+	    get_displayname(cacheitem_base(&record, CACHE_TO));
+
+	if (cacheitem_size(&record, CACHE_ENVELOPE) > 2) {
+	    /* make a working copy of envelope -- strip outer ()'s */
+	    tmpenv = xstrndup(cacheitem_base(&record, CACHE_ENVELOPE) + 1,
+			      cacheitem_size(&record, CACHE_ENVELOPE) - 2);
+	    parse_cached_envelope(tmpenv, envtokens, VECTOR_SIZE(envtokens));
+	    index_get_ids(&ids, envtokens,
+			  cacheitem_base(&record, CACHE_HEADERS),
+			  cacheitem_size(&record, CACHE_HEADERS));
+	    free(tmpenv);
+	}
+	entry.msgid = ids.msgid;
+	entry.nrefs = ids.ref.count;
+	for (i = 0; i < entry.nrefs; i++)
+	    buf_appendmap(&refs, ids.ref.data[i], strlen(ids.ref.data[i]) + 1);
+	entry.refs = refs.s;
+
+	sortcache_add(sc, &entry);
+    }
+
+#define KEY(x) (cur->keys_mapped ? (char *) entry.x : xstrdupnull(entry.x))
+    for (j = 0; sortcrit[j].key; j++) {
+	switch (sortcrit[j].key) {
+	case SORT_CC:
+	    cur->cc = KEY(cc);
+	    break;
+	case SORT_DATE:
+	    cur->date = entry.gmtime;
+	    /* fall through */
+	case SORT_ARRIVAL:
+	    cur->internaldate = state->cols.internaldate[cur->msgno-1];
+	    break;
+	case SORT_FROM:
+	    cur->from = KEY(from);
+	    break;
+	case SORT_SIZE:
+	    cur->size = state->cols.size[cur->msgno-1];
+	    break;
+	case SORT_SUBJECT:
+	    cur->xsubj = KEY(xsubj);
+	    cur->xsubj_hash = entry.xsubj_hash;
+	    cur->is_refwd = entry.is_refwd;
+	    break;
+	case SORT_TO:
+	    cur->to = KEY(to);
+	    break;
+	case SORT_DISPLAYFROM:
+	    cur->displayfrom = KEY(displayfrom);
+	    break;
+	case SORT_DISPLAYTO:
+	    cur->displayto = KEY(displayto);
+	    break;
+	case LOAD_IDS:
+	    /* the threaders rewrite and own these */
+	    cur->msgid = (entry.msgid && *entry.msgid) ?
+		xstrdup(entry.msgid) : index_empty_msgid(cur->msgno);
+	    for (i = 0, ref = entry.refs; i < entry.nrefs; i++) {
+		strarray_append(&cur->ref, ref);
+		ref += strlen(ref) + 1;
+	    }
+	    break;
+	}
+    }
+#undef KEY
+
+    if (!cur->keys_mapped) {
+	free(xsubj);
+	free(from);
+	free(to);
+	free(cc);
+	free(displayfrom);
+	free(displayto);
+	free(ids.msgid);
+	strarray_fini(&ids.ref);
+	buf_free(&refs);
+    }
+}
+
+/*
+ * Writes out whatever keys index_msgdata_load() queued in the sort
+ * cache, and lets it drop entries for expunged messages.
+ */
+static void index_sortcache_commit(struct index_state *state)
+{
+    uint32_t *live;
+    unsigned msgno, nlive = 0;
+
+    if (!state->sortcache) return;
+
+    live = xmalloc(state->exists * sizeof(uint32_t));
+    for (msgno = 1; msgno <= state->exists; msgno++) {
+	if (!(state->map[msgno-1].system_flags & FLAG_EXPUNGED))
+	    live[nlive++] = state->map[msgno-1].uid;
+    }
+
+    sortcache_commit(state->sortcache, live, nlive);
+
+    free(live);
+}
+
 /*
  * Creates a list of msgdata.
  *
@@ -4221,9 +4928,16 @@ static MsgData *index_msgdata_load(struct index_state *state,
     int label;
     struct mailbox *mailbox = state->mailbox;
     struct index_record record;
+    struct sortcache *sc = NULL;
 
     if (!n) return NULL;
 
+    if (index_sortcache_covers(sortcrit)) {
+	sc = index_sortcache(state);
+	/* arrival dates and sizes come from the columns */
+	if (sc) index_columns_load(state);
+    }
+
     /* create an array of MsgData to use as nodes of linked list */
     md = (MsgData *) xzmalloc(n * sizeof(MsgData));
 
@@ -4234,6 +4948,11 @@ static MsgData *index_msgdata_load(struct index_state *state,
 	/* set msgno */
 	cur->msgno = msgno_list[i];
 
+	if (sc) {
+	    index_msgdata_fromcache(state, sc, cur, sortcrit);
+	    continue;
+	}
+
 	if (index_reload_record(state, cur->msgno, &record))
 	    continue;
 
@@ -4324,6 +5043,8 @@ static MsgData *index_msgdata_load(struct index_state *state,
 	    case LOAD_IDS:
 		index_get_ids(cur, envtokens, cacheitem_base(&record, CACHE_HEADERS),
 					      cacheitem_size(&record, CACHE_HEADERS));
+		if (!cur->msgid)
+		    cur->msgid = index_empty_msgid(cur->msgno);
 		break;
 	    case SORT_DISPLAYFROM:
 		cur->displayfrom = get_displayname(
@@ -4571,6 +5292,16 @@ static char *_index_extract_subject(char *s, int *is_refwd)
     return base;
 }
 
+/* Make up a message-id for a message which doesn't have one */
+
+static char *index_empty_msgid(uint32_t msgno)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "<Empty-ID: %u>", msgno);
+    return xstrdup(buf);
+}
+
 /* Get message-id, and references/in-reply-to */
 
 void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers,
@@ -4582,14 +5313,8 @@ void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers,
 
     buf_reset(&buf);
 
-    /* get msgid */
+    /* get msgid, the caller makes one up if there isn't one */
     msgdata->msgid = find_msgid(envtokens[ENV_MSGID], NULL);
-     /* if we don't have one, create one */
-    if (!msgdata->msgid) {
-	buf_printf(&buf, "<Empty-ID: %u>", msgdata->msgno);
-	msgdata->msgid = xstrdup(buf.s);
-	buf_reset(&buf);
-    }
 
     /* Copy headers to the buffer */
     buf_appendmap(&buf, headers, size);
@@ -4705,6 +5430,16 @@ static int index_sort_compare(MsgData *md1, MsgData *md2,
     return (reverse ? -ret : ret);
 }
 
+/*
+ * qsort() wrapper for index_sort_compare(); qsort has no way to pass
+ * the sort criteria through, so index_sort() parks them here.
+ */
+static int index_sort_qcompare(const void *a, const void *b)
+{
+    return index_sort_compare(*((MsgData **) a), *((MsgData **) b),
+			      index_sort_crit);
+}
+
 /*
  * Free a msgdata node.
  */
@@ -4713,12 +5448,14 @@ static void index_msgdata_free(MsgData *md)
 #define FREE(x)	if (x) free(x)
     if (!md)
 	return;
-    FREE(md->cc);
-    FREE(md->from);
-    FREE(md->to);
-    FREE(md->displayfrom);
-    FREE(md->displayto);
-    FREE(md->xsubj);
+    if (!md->keys_mapped) {
+	FREE(md->cc);
+	FREE(md->from);
+	FREE(md->to);
+	FREE(md->displayfrom);
+	FREE(md->displayto);
+	FREE(md->xsubj);
+    }
     FREE(md->msgid);
     strarray_fini(&md->ref);
     strarray_fini(&md->annot);
@@ -82,19 +82,34 @@ struct index_init {
     int select;
     struct vanished_params vanished;
     struct seqset *vanishedlist;
+    struct dlist *parked;	/* from index_park(), to carry on a session */
 };
 
+/* Per-message session state, indexed by msgno-1.  User flags are
+ * kept to one side in index_state, only as wide as the flags in use. */
 struct index_map {
     modseq_t modseq;
     modseq_t told_modseq;
     uint32_t uid;
     uint32_t recno;
     uint32_t system_flags;
-    uint32_t user_flags[MAX_USER_FLAGS/32];
     unsigned int isseen:1;
     unsigned int isrecent:1;
 };
 
+/* Columnar copy of the immutable per-message fields used by the non-text
+ * SEARCH criteria and SORT, indexed by msgno-1 in parallel with the
+ * index_map.  These are scanned as flat arrays so SINCE/LARGER and
+ * friends don't have to reload every index record, but are only loaded
+ * the first time they're needed, and then only for new messages. */
+struct index_columns {
+    unsigned count;		/* msgnos loaded */
+    time_t *internaldate;
+    time_t *sentdate;
+    uint32_t *size;
+    unsigned char *loaded;	/* 0 where the record couldn't be read */
+};
+
 struct index_state {
     struct mailbox *mailbox;
     unsigned num_records;
@@ -105,8 +120,13 @@ struct index_state {
     uint32_t uidvalidity; /* to notice delete/recreate */
     modseq_t highestmodseq;
     modseq_t delayed_modseq;
+    modseq_t map_modseq; /* highestmodseq when the map was last read */
     struct index_map *map;
     unsigned mapsize;
+    bit32 *user_flags; /* user_flag_words per msgno */
+    unsigned user_flag_words;
+    struct index_columns cols;
+    struct sortcache *sortcache; /* SORT/THREAD keys, if enabled */
     int internalseen;
     int skipped_expunge;
     int seen_dirty;
@@ -154,6 +174,7 @@ typedef struct msgdata {
     char *xsubj;		/* extracted subject text */
     unsigned xsubj_hash;	/* hash of extracted subject text */
     int is_refwd;		/* is message a reply or forward? */
+    int keys_mapped;		/* string keys point into the sortcache */
     strarray_t annot;		/* array of annotation attribute values
 				   (stored in order of sortcrit) */
     struct msgdata *next;
@@ -231,6 +252,8 @@ extern int index_open(const char *name, struct index_init *init,
 extern void index_select(struct index_state *state, struct index_init *init);
 extern int index_status(struct index_state *state, struct statusdata *sdata);
 extern void index_release(struct index_state *state);
+extern void index_trim(struct index_state *state);
+extern void index_park(struct index_state *state, struct dlist *kl);
 extern void index_close(struct index_state **stateptr);
 extern uint32_t index_finduid(struct index_state *state, uint32_t uid);
 extern uint32_t index_getuid(struct index_state *state, uint32_t msgno);
@@ -266,6 +289,10 @@ extern void index_getsearchtext_single(struct index_state *state, uint32_t msgno
 extern int index_getuidsequence(struct index_state *state,
 				struct searchargs *searchargs,
 				unsigned **uid_list);
+extern int index_search_evaluate(struct index_state *state,
+				 const struct searchargs *searchargs,
+				 uint32_t msgno,
+				 struct mapfile *msgfile);
 
 extern const char *index_mboxname(const struct index_state *state);
 extern int index_hasrights(const struct index_state *state, int rights);
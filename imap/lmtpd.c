@@ -231,7 +231,7 @@ int service_init(int argc __attribute__((unused)),
 	}
 
 	/* so we can do mboxlist operations */
-	mboxlist_init(0);
+	mboxlist_init(MBOXLIST_SNAPSHOT);
 	mboxlist_open(NULL);
 
 	/* so we can do quota operations */
@@ -99,6 +99,7 @@
 #include "map.h"
 #include "mboxevent.h"
 #include "mboxlist.h"
+#include "metacache.h"
 #include "proc.h"
 #include "retry.h"
 #include "seen.h"
@@ -129,6 +130,7 @@ static int mailbox_index_repack(struct mailbox *mailbox, int version);
 static int mailbox_lock_index_internal(struct mailbox *mailbox,
 				       int locktype);
 static void cleanup_stale_expunged(struct mailbox *mailbox);
+static void mailbox_crcflags_reset(struct mailbox *mailbox);
 
 static struct mailboxlist *create_listitem(const char *name)
 {
@@ -949,6 +951,10 @@ static int mailbox_open_advanced(const char *name,
     mailbox->acl = xstrdup(mbentry->acl);
     mailbox->mbtype = mbentry->mbtype;
 
+    /* the header has it too, but this lets us find the header in
+     * the metadata cache without reading it */
+    mailbox->uniqueid = xstrdupnull(mbentry->uniqueid);
+
     mboxlist_entry_free(&mbentry);
 
     if (index_locktype == LOCK_SHARED)
@@ -1120,6 +1126,7 @@ EXPORTED void mailbox_close(struct mailbox **mailboxptr)
     for (flag = 0; flag < MAX_USER_FLAGS; flag++) {
 	free(mailbox->flagname[flag]);
     }
+    mailbox_crcflags_reset(mailbox);
 
     if (listitem->l) mboxname_release(&listitem->l);
 
@@ -1223,6 +1230,7 @@ HIDDEN int mailbox_read_header(struct mailbox *mailbox, char **aclptr)
 	goto done;
     }
     name = p;
+    mailbox_crcflags_reset(mailbox);
     /* read the names of flags */
     for (flag = 0; name <= eol && flag < MAX_USER_FLAGS; flag++) {
 	free(mailbox->flagname[flag]);
@@ -1255,6 +1263,45 @@ done:
     return r;
 }
 
+/*
+ * Fill in the cyrus.header fields from the metadata cache, if it has
+ * the header file with inode 'ino'.  The caller must still check the
+ * CRC against the index header, and read the real thing if it's wrong.
+ */
+static int mailbox_read_header_cached(struct mailbox *mailbox, ino_t ino)
+{
+    struct metacache_entry entry;
+    int flag;
+    int r;
+
+    r = metacache_lookup(mailbox->name, mailbox->uniqueid, &entry);
+    if (r) return r;
+
+    if (entry.header_ino != ino || !entry.header_crc) {
+	metacache_entry_fini(&entry);
+	return IMAP_NOTFOUND;
+    }
+
+    xclose(mailbox->header_fd);
+
+    free(mailbox->quotaroot);
+    mailbox->quotaroot = entry.quotaroot;
+    entry.quotaroot = NULL;
+
+    mailbox_crcflags_reset(mailbox);
+    for (flag = 0; flag < MAX_USER_FLAGS; flag++) {
+	free(mailbox->flagname[flag]);
+	mailbox->flagname[flag] = entry.flagname[flag];
+	entry.flagname[flag] = NULL;
+    }
+
+    mailbox->header_file_ino = ino;
+    mailbox->header_file_crc = entry.header_crc;
+
+    metacache_entry_fini(&entry);
+    return 0;
+}
+
 /* set a new ACL - only dirty if changed */
 EXPORTED int mailbox_set_acl(struct mailbox *mailbox, const char *acl,
 		    int dirty_modseq)
@@ -1329,6 +1376,7 @@ EXPORTED int mailbox_user_flag(struct mailbox *mailbox, const char *flag,
 	userflag = emptyflag;
 	mailbox->flagname[userflag] = xstrdup(flag);
 	mailbox->header_dirty = 1;
+	mailbox_crcflags_reset(mailbox);
     }
 
     if (flagnum) *flagnum = userflag;
@@ -1354,6 +1402,7 @@ EXPORTED int mailbox_remove_user_flag(struct mailbox *mailbox, int flagnum)
     free(mailbox->flagname[flagnum]);
     mailbox->flagname[flagnum] = NULL;
     mailbox->header_dirty = 1;
+    mailbox_crcflags_reset(mailbox);
     return 0;
 }
 
@@ -1636,6 +1685,27 @@ EXPORTED int mailbox_read_index_record(struct mailbox *mailbox,
     return r;
 }
 
+/*
+ * Read just the modseq of an index record, without parsing or checking
+ * the rest - enough to notice which records have changed.  Returns 0
+ * if it's not available.
+ */
+EXPORTED modseq_t mailbox_read_index_modseq(struct mailbox *mailbox,
+					    uint32_t recno)
+{
+    unsigned offset;
+
+    if (mailbox->i.minor_version < 10)
+	return 0;
+
+    offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
+
+    if (offset + mailbox->i.record_size > mailbox->index_size)
+	return 0;
+
+    return ntohll(*((bit64 *)(mailbox->index_base + offset + OFFSET_MODSEQ)));
+}
+
 /*
  * bsearch() function to compare two index record buffers by UID
  */
@@ -1677,7 +1747,8 @@ static int mailbox_lock_index_internal(struct mailbox *mailbox, int locktype)
 {
     struct stat sbuf;
     int r = 0;
-    const char *header_fname = mailbox_meta_fname(mailbox, META_HEADER);
+    int header_cached = 0;
+    const char *header_fname;
     const char *index_fname = mailbox_meta_fname(mailbox, META_INDEX);
 
     assert(mailbox->index_fd != -1);
@@ -1718,6 +1789,8 @@ static int mailbox_lock_index_internal(struct mailbox *mailbox, int locktype)
     mailbox->index_locktype = locktype;
     gettimeofday(&mailbox->starttime, 0);
 
+    /* mailbox_meta_fname returns a static buffer, so not until now */
+    header_fname = mailbox_meta_fname(mailbox, META_HEADER);
     r = stat(header_fname, &sbuf);
     if (r == -1) {
 	syslog(LOG_ERR, "IOERROR: stating header %s for %s: %m",
@@ -1728,7 +1801,10 @@ static int mailbox_lock_index_internal(struct mailbox *mailbox, int locktype)
 
     /* has the header file changed? */
     if (sbuf.st_ino != mailbox->header_file_ino) {
-	r = mailbox_read_header(mailbox, NULL);
+	if (!mailbox_read_header_cached(mailbox, sbuf.st_ino))
+	    header_cached = 1;
+	else
+	    r = mailbox_read_header(mailbox, NULL);
 	if (r) {
 	    syslog(LOG_ERR, "IOERROR: reading header for %s: %m",
 		   mailbox->name);
@@ -1748,6 +1824,18 @@ static int mailbox_lock_index_internal(struct mailbox *mailbox, int locktype)
 	return r;
     }
 
+    /* if the cache was wrong, read the real thing */
+    if (header_cached &&
+	mailbox->header_file_crc != mailbox->i.header_file_crc) {
+	r = mailbox_read_header(mailbox, NULL);
+	if (r) {
+	    syslog(LOG_ERR, "IOERROR: reading header for %s: %m",
+		   mailbox->name);
+	    mailbox_unlock_index(mailbox, NULL);
+	    return r;
+	}
+    }
+
     /* check the CRC */
     if (mailbox->header_file_crc && mailbox->i.header_file_crc &&
 	mailbox->header_file_crc != mailbox->i.header_file_crc) {
@@ -1758,6 +1846,14 @@ static int mailbox_lock_index_internal(struct mailbox *mailbox, int locktype)
 	return IMAP_MAILBOX_CHECKSUM;
     }
 
+    /* start tracking changes for the statuscache */
+    memset(&mailbox->statusdelta, 0, sizeof(struct mailbox_statusdelta));
+    mailbox->statusdelta.modseq = mailbox->i.highestmodseq;
+    mailbox->statusdelta.recentuid = mailbox->i.recentuid;
+    mailbox->statusdelta.exists = mailbox->i.exists;
+
+    metacache_store(mailbox);
+
     return 0;
 }
 
@@ -1800,13 +1896,13 @@ EXPORTED void mailbox_unlock_index(struct mailbox *mailbox, struct statusdata *s
     if (mailbox->has_changed) {
 	if (updatenotifier) updatenotifier(mailbox->name);
 	sync_log_mailbox(mailbox->name);
-	statuscache_invalidate(mailbox->name, sdata);
+	statuscache_update(mailbox, sdata);
 
 	mailbox->has_changed = 0;
     }
     else if (sdata) {
 	/* updated data, always write */
-	statuscache_invalidate(mailbox->name, sdata);
+	statuscache_update(mailbox, sdata);
     }
 
     if (mailbox->index_locktype) {
@@ -2052,6 +2148,9 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
 
     mailbox_index_header_to_buf(&mailbox->i, buf);
 
+    /* nobody may see the old header once the new one is written */
+    metacache_invalidate(mailbox);
+
     lseek(mailbox->index_fd, 0, SEEK_SET);
     n = retry_write(mailbox->index_fd, buf, mailbox->i.start_offset);
     if (n < 0 || fsync(mailbox->index_fd)) {
@@ -2071,6 +2170,8 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
     mailbox->modseq_dirty = 0;
     mailbox->header_dirty = 0;
 
+    metacache_store(mailbox);
+
     /* label changes for later logging */
     mailbox->has_changed = 1;
 
@@ -2194,7 +2295,7 @@ static void header_update_counts(struct index_header *i,
 typedef struct mailbox_crcalgo mailbox_crcalgo_t;
 struct mailbox_crcalgo {
     unsigned version;
-    uint32_t (*record)(const struct mailbox *, const struct index_record *);
+    uint32_t (*record)(struct mailbox *, const struct index_record *);
     uint32_t (*annot)(unsigned int uid, const char *entry,
 		   const char *userid, const struct buf *value);
 };
@@ -2206,12 +2307,106 @@ struct annot_calc_rock
     quota_t used;
 };
 
-static uint32_t crc32_record(const struct mailbox *mailbox,
+#define NUM_SYSTEM_FLAGS 5
+
+static const struct {
+    bit32 flag;
+    const char *name;
+} system_flags[NUM_SYSTEM_FLAGS] = {
+    /* already sorted lexically */
+    { FLAG_ANSWERED,	"\\answered" },
+    { FLAG_DELETED,	"\\deleted" },
+    { FLAG_DRAFT,	"\\draft" },
+    { FLAG_FLAGGED,	"\\flagged" },
+    { FLAG_SEEN,	"\\seen" }
+};
+
+struct crcflag {
+    const char *name;		/* lower case */
+    size_t len;
+    uint32_t crc;		/* crc32 of the name */
+    int num;			/* user flag, or -1 - system_flags index */
+};
+
+/* Every flag name of the mailbox as the sync CRCs hash it, sorted as
+ * md5_record() wants them.  A mailbox_sync_crc() or reconstruct goes
+ * through every record with the same names, so this is worked out
+ * once and kept until the user flags change. */
+struct mailbox_crcflags {
+    struct crcflag flags[NUM_SYSTEM_FLAGS + MAX_USER_FLAGS];
+    int nflags;
+    char *names[MAX_USER_FLAGS];
+};
+
+static int crcflag_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct crcflag *)a)->name,
+		  ((const struct crcflag *)b)->name);
+}
+
+static const struct mailbox_crcflags *mailbox_crcflags(struct mailbox *mailbox)
+{
+    struct mailbox_crcflags *cf = mailbox->crcflags;
+    struct crcflag *f;
+    int i;
+
+    if (cf) return cf;
+
+    cf = xzmalloc(sizeof(struct mailbox_crcflags));
+
+    for (i = 0; i < NUM_SYSTEM_FLAGS; i++) {
+	f = &cf->flags[cf->nflags++];
+	f->name = system_flags[i].name;
+	f->num = -1 - i;
+    }
+    for (i = 0; i < MAX_USER_FLAGS; i++) {
+	if (!mailbox->flagname[i])
+	    continue;
+	/* need to compare without case being significant */
+	cf->names[i] = lcase(xstrdup(mailbox->flagname[i]));
+	f = &cf->flags[cf->nflags++];
+	f->name = cf->names[i];
+	f->num = i;
+    }
+    for (i = 0; i < cf->nflags; i++) {
+	f = &cf->flags[i];
+	f->len = strlen(f->name);
+	f->crc = crc32_map(f->name, f->len);
+    }
+    qsort(cf->flags, cf->nflags, sizeof(struct crcflag), crcflag_cmp);
+
+    mailbox->crcflags = cf;
+    return cf;
+}
+
+/* forget the flag names, after the user flags have changed */
+static void mailbox_crcflags_reset(struct mailbox *mailbox)
+{
+    int i;
+
+    if (!mailbox->crcflags) return;
+
+    for (i = 0; i < MAX_USER_FLAGS; i++)
+	free(mailbox->crcflags->names[i]);
+    free(mailbox->crcflags);
+    mailbox->crcflags = NULL;
+}
+
+static int crcflag_isset(const struct crcflag *f,
+			 const struct index_record *record)
+{
+    if (f->num < 0)
+	return record->system_flags & system_flags[-1 - f->num].flag;
+    return record->user_flags[f->num/32] & (1<<(f->num&31));
+}
+
+static uint32_t crc32_record(struct mailbox *mailbox,
 			  const struct index_record *record)
 {
+    const struct mailbox_crcflags *cf = mailbox_crcflags(mailbox);
     char buf[4096];
     uint32_t flagcrc = 0;
-    int flag;
+    int i;
 
     /* expunged flags have no sync CRC */
     if (record->system_flags & FLAG_EXPUNGED)
@@ -2220,26 +2415,9 @@ static uint32_t crc32_record(const struct mailbox *mailbox,
     /* calculate an XORed CRC32 over all the flags on the message, so no
      * matter what order they are store in the header, the final value 
      * is the same */
-    if (record->system_flags & FLAG_DELETED)
-	flagcrc ^= crc32_cstring("\\deleted");
-    if (record->system_flags & FLAG_ANSWERED)
-	flagcrc ^= crc32_cstring("\\answered");
-    if (record->system_flags & FLAG_FLAGGED)
-	flagcrc ^= crc32_cstring("\\flagged");
-    if (record->system_flags & FLAG_DRAFT)
-	flagcrc ^= crc32_cstring("\\draft");
-    if (record->system_flags & FLAG_SEEN)
-	flagcrc ^= crc32_cstring("\\seen");
-
-    for (flag = 0; flag < MAX_USER_FLAGS; flag++) {
-	if (!mailbox->flagname[flag])
-	    continue;
-	if (!(record->user_flags[flag/32] & (1<<(flag&31))))
-	    continue;
-	/* need to compare without case being significant */
-	strlcpy(buf, mailbox->flagname[flag], 4096);
-	lcase(buf);
-	flagcrc ^= crc32_cstring(buf);
+    for (i = 0; i < cf->nflags; i++) {
+	if (crcflag_isset(&cf->flags[i], record))
+	    flagcrc ^= cf->flags[i].crc;
     }
 
     snprintf(buf, sizeof(buf), "%u " MODSEQ_FMT " %lu (%u) %lu %s",
@@ -2251,25 +2429,17 @@ static uint32_t crc32_record(const struct mailbox *mailbox,
     return crc32_cstring(buf);
 }
 
-static int cmpcase(const void *a, const void *b)
-{
-    return strcasecmp(*(const char **)a, *(const char **)b);
-}
-
-static uint32_t md5_record(const struct mailbox *mailbox,
+static uint32_t md5_record(struct mailbox *mailbox,
 			const struct index_record *record)
 {
+    const struct mailbox_crcflags *cf = mailbox_crcflags(mailbox);
     MD5_CTX ctx;
     union {
 	uint32_t b32;
 	unsigned char md5[16];
     } result;
-    unsigned int i;
-    unsigned int nflags = 0;
-    int n;
-    const char *flags[MAX_USER_FLAGS + /*system flags*/5];
+    int i, n, nflags = 0;
     char buf[256];
-    static struct buf flagbuf = BUF_INITIALIZER;
 
     /* expunged flags have no sync CRC */
     if (record->system_flags & FLAG_EXPUNGED)
@@ -2277,35 +2447,6 @@ static uint32_t md5_record(const struct mailbox *mailbox,
 
     MD5Init(&ctx);
 
-    /* system flags - already sorted lexically */
-    if (record->system_flags & FLAG_ANSWERED)
-	flags[nflags++] = "\\answered";
-    if (record->system_flags & FLAG_DELETED)
-	flags[nflags++] = "\\deleted";
-    if (record->system_flags & FLAG_DRAFT)
-	flags[nflags++] = "\\draft";
-    if (record->system_flags & FLAG_FLAGGED)
-	flags[nflags++] = "\\flagged";
-    if (record->system_flags & FLAG_SEEN)
-	flags[nflags++] = "\\seen";
-
-    /* user flags */
-    for (i = 0; i < MAX_USER_FLAGS; i++) {
-	if (!mailbox->flagname[i])
-	    continue;
-	if (!(record->user_flags[i/32] & (1<<(i&31))))
-	    continue;
-	flags[nflags++] = mailbox->flagname[i];
-    }
-
-    /*
-     * There is a potential optimisation here: we only need to sort if
-     * there were any user flags because the system flags are added
-     * pre-sorted.  However, we expect never to achieve that in
-     * production, so we don't code it.
-     */
-    qsort(flags, nflags, sizeof(char *), cmpcase);
-
     n = snprintf(buf, sizeof(buf), "%u", record->uid);
     MD5Update(&ctx, buf, n);
 
@@ -2321,15 +2462,13 @@ static uint32_t md5_record(const struct mailbox *mailbox,
 
     MD5Update(&ctx, " (", 2);
 
-    for (i = 0 ; i < nflags ; i++) {
-	if (i)
+    /* all the flags, lower cased, in case-insensitive order */
+    for (i = 0 ; i < cf->nflags ; i++) {
+	if (!crcflag_isset(&cf->flags[i], record))
+	    continue;
+	if (nflags++)
 	    MD5Update(&ctx, " ", 1);
-
-	buf_reset(&flagbuf);
-	buf_appendcstr(&flagbuf, flags[i]);
-	buf_cstring(&flagbuf);
-	lcase(flagbuf.s);
-	MD5Update(&ctx, flagbuf.s, flagbuf.len);
+	MD5Update(&ctx, cf->flags[i].name, cf->flags[i].len);
     }
 
     MD5Update(&ctx, ") ", 2);
@@ -2576,6 +2715,36 @@ static void mailbox_index_update_counts(struct mailbox *mailbox,
 }
 
 
+/*
+ * Track how the visible messages change while the index is locked,
+ * so statuscache entries can be brought up to date on unlock rather
+ * than thrown away.
+ */
+static void mailbox_status_update_counts(struct mailbox *mailbox,
+					 struct index_record *old,
+					 struct index_record *new)
+{
+    struct mailbox_statusdelta *delta = &mailbox->statusdelta;
+
+    if (old && !(old->system_flags & FLAG_EXPUNGED)) {
+	if (!(old->system_flags & FLAG_SEEN))
+	    delta->unseen--;
+	if (old->uid > delta->recentuid)
+	    delta->recent--;
+	if (!new || (new->system_flags & FLAG_EXPUNGED))
+	    delta->removed++;
+    }
+
+    if (new && !(new->system_flags & FLAG_EXPUNGED)) {
+	if (!(new->system_flags & FLAG_SEEN))
+	    delta->unseen++;
+	if (new->uid > delta->recentuid)
+	    delta->recent++;
+	if (!old)
+	    delta->appended++;
+    }
+}
+
 EXPORTED int mailbox_index_recalc(struct mailbox *mailbox)
 {
     annotate_state_t *astate = NULL;
@@ -2589,6 +2758,10 @@ EXPORTED int mailbox_index_recalc(struct mailbox *mailbox)
     mailbox_quota_dirty(mailbox);
     mailbox_index_dirty(mailbox);
 
+    /* the counts may not have been right, so neither are any
+     * statuscache entries based on them */
+    mailbox->statusdelta.lost = 1;
+
     mailbox->i.answered = 0;
     mailbox->i.flagged = 0;
     mailbox->i.deleted = 0;
@@ -2845,6 +3018,8 @@ static int mailbox_update_indexes(struct mailbox *mailbox,
 
     /* NOTE - we do these last */
 
+    mailbox_status_update_counts(mailbox, old, new);
+
     if (old)
 	mailbox_index_update_counts(mailbox, old, 0);
     if (new)
@@ -3673,7 +3848,7 @@ EXPORTED int mailbox_internal_seen(struct mailbox *mailbox, const char *userid)
  * Return the number of message without \Seen flag in a mailbox.
  * Suppose that authenticated user is the owner or sharedseen is enabled
  */
-unsigned mailbox_count_unseen(struct mailbox *mailbox)
+EXPORTED unsigned mailbox_count_unseen(struct mailbox *mailbox)
 {
     struct index_record record;
     uint32_t recno;
@@ -4107,6 +4282,8 @@ static struct meta_file meta_files[] = {
     { META_CACHE,  0, 1 },
     { META_SQUAT,  1, 0 },
     { META_ANNOTATIONS,  1, 0 },
+    { META_SORTCACHE,  1, 0 },
+    { META_INVINDEX,  1, 0 },
     { 0, 0, 0 }
 };
 
@@ -4678,6 +4855,26 @@ static int records_match(const char *mboxname,
     return match;
 }
 
+/* Parsing a message file means reading it all to hash it, one file at
+ * a time.  Start the reads of the next few files in the background, so
+ * the disk has them ready by the time we get to them. */
+#define RECONSTRUCT_READAHEAD 16
+
+static void reconstruct_readahead(struct mailbox *mailbox,
+				  const struct found_uids *files,
+				  unsigned *warmed)
+{
+    if (*warmed < files->pos)
+	*warmed = files->pos;
+
+    while (*warmed < files->nused &&
+	   *warmed < files->pos + RECONSTRUCT_READAHEAD) {
+	warmup_file(mailbox_message_fname(mailbox, files->uids[*warmed]),
+		    0, 0);
+	(*warmed)++;
+    }
+}
+
 static int mailbox_reconstruct_compare_update(struct mailbox *mailbox,
 					      struct index_record *record,
 					      bit32 *valid_user_flags,
@@ -5129,6 +5326,7 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     int have_file;
     uint32_t recno;
     uint32_t last_seen_uid = 0;
+    unsigned files_warmed = 0, discovered_warmed = 0;
     bit32 valid_user_flags[MAX_USER_FLAGS/32];
 
     if (make_changes && !(flags & RECONSTRUCT_QUIET)) {
@@ -5161,6 +5359,7 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
 	    mailbox->header_dirty = 1;
 	    free(mailbox->flagname[flag]);
 	    mailbox->flagname[flag] = NULL;
+	    mailbox_crcflags_reset(mailbox);
 	    continue;
 	}
 	valid_user_flags[flag/32] |= 1<<(flag&31);
@@ -5227,6 +5426,9 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
 	    annots.pos++;
 	}
 
+	if (flags & RECONSTRUCT_ALWAYS_PARSE)
+	    reconstruct_readahead(mailbox, &files, &files_warmed);
+
 	/* lower UID file exists */
 	while (files.pos < files.nused && files.uids[files.pos] < record.uid) {
 	    add_found(&discovered, files.uids[files.pos]);
@@ -5257,6 +5459,7 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
      * from lost .index file) - so don't bother moving those */
     while (files.pos < files.nused) {
 	unsigned uid = files.uids[files.pos];
+	reconstruct_readahead(mailbox, &files, &files_warmed);
 	r = mailbox_reconstruct_append(mailbox, files.uids[files.pos], flags);
 	if (r) goto close;
 	files.pos++;
@@ -5283,6 +5486,7 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     
     /* handle new list - note, we don't copy annotations for these */
     while (discovered.pos < discovered.nused) {
+	reconstruct_readahead(mailbox, &discovered, &discovered_warmed);
 	r = mailbox_reconstruct_append(mailbox, discovered.uids[discovered.pos], flags);
 	if (r) goto close;
 	discovered.pos++;
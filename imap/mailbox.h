@@ -81,6 +81,8 @@
 #define FNAME_EXPUNGE "/cyrus.expunge"
 #define FNAME_ANNOTATIONS "/cyrus.annotations"
 #define FNAME_DAV "/cyrus.dav"
+#define FNAME_SORTCACHE "/cyrus.sortcache"
+#define FNAME_INVINDEX "/cyrus.invindex"
 
 enum meta_filename {
   META_HEADER = 1,
@@ -89,7 +91,9 @@ enum meta_filename {
   META_SQUAT,
   META_EXPUNGE,
   META_ANNOTATIONS,
-  META_DAV
+  META_DAV,
+  META_SORTCACHE,
+  META_INVINDEX
 };
 
 #define MAILBOX_FNAME_LEN 256
@@ -123,6 +127,23 @@ struct statusdata {
     unsigned uidvalidity;
     unsigned unseen;
     modseq_t highestmodseq;
+
+    /* the \Seen state recent and unseen were counted against */
+    int internalseen;
+    unsigned recentuid;
+    uint32_t seencrc;
+};
+
+/* changes to the visible messages since the index was locked */
+struct mailbox_statusdelta {
+    modseq_t modseq;		/* highestmodseq when locked */
+    uint32_t recentuid;		/* recentuid when locked */
+    uint32_t exists;		/* exists when locked */
+    uint32_t appended;
+    uint32_t removed;
+    int unseen;			/* messages without \Seen */
+    int recent;			/* messages above recentuid */
+    int lost;			/* changed in ways we didn't track */
 };
 
 struct index_record {
@@ -222,6 +243,7 @@ struct mailbox {
     char *uniqueid;
     char *quotaroot;
     char *flagname[MAX_USER_FLAGS];
+    struct mailbox_crcflags *crcflags; /* flag names for sync CRCs */
 
     struct timeval starttime;
 
@@ -234,6 +256,7 @@ struct mailbox {
     int cache_dirty;
     int quota_dirty;
     int has_changed;
+    struct mailbox_statusdelta statusdelta; /* for the statuscache */
     time_t last_updated; /* for appends*/
     quota_t quota_previously_used[QUOTA_NUMRESOURCES]; /* for quota change */
 };
@@ -473,6 +496,8 @@ extern void mailbox_modseq_dirty(struct mailbox *mailbox);
 extern int mailbox_read_index_record(struct mailbox *mailbox,
 				     uint32_t recno,
 				     struct index_record *record);
+extern modseq_t mailbox_read_index_modseq(struct mailbox *mailbox,
+					  uint32_t recno);
 extern int mailbox_rewrite_index_record(struct mailbox *mailbox,
 				        struct index_record *record);
 extern int mailbox_append_index_record(struct mailbox *mailbox,
@@ -63,6 +63,7 @@
 #include "assert.h"
 #include "global.h"
 #include "cyrusdb.h"
+#include "dbsnapshot.h"
 #include "util.h"
 #include "mailbox.h"
 #include "mboxevent.h"
@@ -89,6 +90,14 @@ cyrus_acl_canonproc_t mboxlist_ensureOwnerRights;
 EXPORTED struct db *mbdb;
 
 static int mboxlist_dbopen = 0;
+static int mboxlist_initflags = 0;
+
+/* a frontend only ever sees mailboxes.db change under the mupdate
+ * slave, which also writes a read-only snapshot of it.  Lookups
+ * outside a transaction try that first and only go to the database
+ * itself for names the snapshot doesn't have */
+static char *mbsnap_fname = NULL;
+static struct dbsnapshot *mbsnap = NULL;
 
 static int mboxlist_opensubs(const char *userid, struct db **ret);
 static void mboxlist_closesubs(struct db *sub);
@@ -226,6 +235,11 @@ static int mboxlist_read(const char *name, const char **dataptr, size_t *datalen
     if (!namelen)
 	return IMAP_MAILBOX_NONEXISTENT;
 
+    if (mbsnap && !tid && !wrlock) {
+	r = dbsnapshot_fetch(mbsnap, name, namelen, dataptr, datalenptr);
+	if (!r) return 0;
+    }
+
     if (wrlock) {
 	r = cyrusdb_fetchlock(mbdb, name, namelen, dataptr, datalenptr, tid);
     } else {
@@ -3074,6 +3088,8 @@ EXPORTED void mboxlist_init(int myflags)
     if (myflags & MBOXLIST_SYNC) {
 	cyrusdb_sync(DB);
     }
+
+    mboxlist_initflags = myflags;
 }
 
 EXPORTED void mboxlist_open(const char *fname)
@@ -3094,6 +3110,9 @@ EXPORTED void mboxlist_open(const char *fname)
     if (config_getswitch(IMAPOPT_IMPROVED_MBOXLIST_SORT)) {
 	flags |= CYRUSDB_MBOXSORT;
     }
+    if (config_getswitch(IMAPOPT_MBOXLIST_DB_BLOOM)) {
+	flags |= CYRUSDB_BLOOM;
+    }
 
     ret = cyrusdb_open(DB, fname, flags, &mbdb);
     if (ret != 0) {
@@ -3104,6 +3123,20 @@ EXPORTED void mboxlist_open(const char *fname)
 	fatal("can't read mailboxes file", EC_TEMPFAIL);
     }    
 
+    mbsnap_fname = strconcat(fname, ".snapshot", (char *)NULL);
+
+    if ((mboxlist_initflags & MBOXLIST_SNAPSHOT) &&
+	config_getswitch(IMAPOPT_MBOXLIST_SNAPSHOT) &&
+	config_mupdate_server &&
+	config_mupdate_config == IMAP_ENUM_MUPDATE_CONFIG_STANDARD) {
+	ret = dbsnapshot_open(mbsnap_fname, &mbsnap);
+	if (ret) {
+	    /* not fatal, we can always use the real thing */
+	    syslog(LOG_ERR, "DBERROR: opening %s: %s", mbsnap_fname,
+		   cyrusdb_strerror(ret));
+	}
+    }
+
     free(tofree);
 
     mboxlist_dbopen = 1;
@@ -3114,6 +3147,10 @@ EXPORTED void mboxlist_close(void)
     int r;
 
     if (mboxlist_dbopen) {
+	dbsnapshot_close(&mbsnap);
+	free(mbsnap_fname);
+	mbsnap_fname = NULL;
+
 	r = cyrusdb_close(mbdb);
 	if (r) {
 	    syslog(LOG_ERR, "DBERROR: error closing mailboxes: %s",
@@ -3123,6 +3160,31 @@ EXPORTED void mboxlist_close(void)
     }
 }
 
+/*
+ * Replace the read-only snapshot of the mailboxes.db which frontends
+ * look mailboxes up in.  Only the mupdate slave calls this, while
+ * holding off its own updates.
+ */
+EXPORTED int mboxlist_snapshot(void)
+{
+    int flags = 0;
+    int r;
+
+    if (!mboxlist_dbopen) return IMAP_IOERROR;
+
+    if (config_getswitch(IMAPOPT_IMPROVED_MBOXLIST_SORT))
+	flags |= CYRUSDB_MBOXSORT;
+
+    r = dbsnapshot_write(mbdb, mbsnap_fname, flags);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: writing %s: %s", mbsnap_fname,
+	       cyrusdb_strerror(r));
+	return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
 EXPORTED void mboxlist_done(void)
 {
     /* DB->done() handled by cyrus_done() */
@@ -244,8 +244,12 @@ void mboxlist_close(void);
 
 /* initialize database structures */
 #define MBOXLIST_SYNC 0x02
+#define MBOXLIST_SNAPSHOT 0x04	/* read through mailboxes.db.snapshot */
 void mboxlist_init(int flags);
 
+/* rewrite mailboxes.db.snapshot from the open mailboxes db */
+int mboxlist_snapshot(void);
+
 /* done with database stuff */
 void mboxlist_done(void);
 
@@ -1460,6 +1460,16 @@ EXPORTED char *mboxname_metapath(const char *partition, const char *mboxname,
 	metaflag = IMAP_ENUM_METAPARTITION_FILES_DAV;
 	filename = FNAME_DAV;
 	break;
+    case META_SORTCACHE:
+	snprintf(confkey, 256, "metadir-index-%s", partition);
+	metaflag = IMAP_ENUM_METAPARTITION_FILES_INDEX;
+	filename = FNAME_SORTCACHE;
+	break;
+    case META_INVINDEX:
+	snprintf(confkey, 256, "metadir-squat-%s", partition);
+	metaflag = IMAP_ENUM_METAPARTITION_FILES_SQUAT;
+	filename = FNAME_INVINDEX;
+	break;
     case 0:
 	break;
     default:
@@ -0,0 +1,481 @@
+/* metacache.c -- cross-process cache of mailbox metadata
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Every process which opens a mailbox reads and parses cyrus.header,
+ * and STATUS opens and locks the whole mailbox just to read a few
+ * numbers from the index header.  With hundreds of processes using
+ * the same shared folders, that's a lot of repeated work for data
+ * which rarely changes.
+ *
+ * So the last state anyone saw of each mailbox is kept in a file
+ * which every process maps shared: a header page, then a table of
+ * fixed size slots, each holding one mailbox, chosen by a hash of
+ * its uniqueid.  Collisions just replace the older mailbox.
+ *
+ * Readers take no locks.  Each slot has a sequence number which is
+ * odd while the slot is being written, so a reader copies the slot
+ * out and only believes the copy if the sequence number was even
+ * and unchanged throughout.  Writers take an fcntl lock on the slot,
+ * without waiting - if someone else is writing it, they're replacing
+ * it with another mailbox anyway, and it's only a cache.
+ *
+ * A slot is only ever filled from a mailbox whose index is locked,
+ * and a writer invalidates its mailbox's slot before changing the
+ * index, so a valid slot is never older than the files.  Users of
+ * the cache still check that the files haven't been replaced under
+ * it: the header inode (and its CRC in the index header) for
+ * cyrus.header, the inode of cyrus.index for the index header.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "assert.h"
+#include "crc32.h"
+#include "global.h"
+#include "imap/imap_err.h"
+#include "metacache.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#define MC_MAGIC "\241\002\213\015metacache\0\0\0"
+#define MC_MAGIC_SIZE 16
+#define MC_VERSION 1
+#define MC_SLOTSIZE 4096
+
+/* the first slot's worth of the file.  The cache never leaves this
+ * machine, so it's all in native byte order and layout, and a build
+ * with a different struct index_header starts the file again */
+struct mc_header {
+    char magic[MC_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t slotsize;
+    uint32_t nslots;
+    uint32_t indexsize;
+};
+
+struct mc_slot {
+    uint32_t seq;		/* odd while being written */
+    uint32_t valid;
+    uint64_t index_ino;
+    uint64_t header_ino;
+    uint32_t header_crc;
+    uint16_t namelen;
+    uint16_t uniqueidlen;
+    uint16_t quotarootlen;	/* 0xffff if there isn't one */
+    uint16_t nflags;
+    uint32_t datalen;
+    struct index_header i;
+    /* name, uniqueid, quotaroot and then 'nflags' flag names, each
+     * NUL terminated, with an empty string for an unused flag */
+    char data[1];
+};
+
+#define MC_DATASIZE (MC_SLOTSIZE - offsetof(struct mc_slot, data))
+#define MC_NOQUOTAROOT 0xffff
+
+static int mc_fd = -1;
+static char *mc_base = NULL;
+static size_t mc_len = 0;
+static uint32_t mc_nslots = 0;
+static int mc_broken = 0;
+
+#define SLOT(n) ((struct mc_slot *)(mc_base + MC_SLOTSIZE * ((n) + 1)))
+
+static int mc_lock(off_t offset, off_t len, int type, int wait)
+{
+    struct flock fl;
+    int r;
+
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = offset;
+    fl.l_len = len;
+
+    do {
+	r = fcntl(mc_fd, wait ? F_SETLKW : F_SETLK, &fl);
+    } while (r == -1 && errno == EINTR && wait);
+
+    return r;
+}
+
+static int mc_open(void)
+{
+    struct mc_header *hdr;
+    struct stat sbuf;
+    const char *fname;
+    char *tofree = NULL;
+    uint32_t nslots;
+    size_t len;
+
+    if (mc_base) return 0;
+    if (mc_broken) return -1;
+    if (!config_getswitch(IMAPOPT_METACACHE)) return -1;
+
+    /* don't try again if it fails */
+    mc_broken = 1;
+
+    fname = config_getstring(IMAPOPT_METACACHE_PATH);
+    if (!fname) {
+	tofree = strconcat(config_dir, FNAME_METACACHE, (char *)NULL);
+	fname = tofree;
+    }
+
+    mc_fd = open(fname, O_RDWR | O_CREAT, 0600);
+    if (mc_fd == -1) {
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+	goto fail;
+    }
+
+    /* everyone else only ever locks single slots */
+    if (mc_lock(0, 0, F_WRLCK, 1) || fstat(mc_fd, &sbuf)) {
+	syslog(LOG_ERR, "IOERROR: locking %s: %m", fname);
+	goto fail;
+    }
+
+    nslots = config_getint(IMAPOPT_METACACHE_SLOTS);
+    if (nslots < 1) nslots = 1;
+
+    /* use the size the file was made with, if it's one of ours */
+    if (sbuf.st_size >= MC_SLOTSIZE) {
+	struct mc_header old;
+
+	if (pread(mc_fd, &old, sizeof(old), 0) == sizeof(old) &&
+	    !memcmp(old.magic, MC_MAGIC, MC_MAGIC_SIZE) &&
+	    old.version == MC_VERSION &&
+	    old.slotsize == MC_SLOTSIZE &&
+	    old.indexsize == sizeof(struct index_header) &&
+	    (off_t)MC_SLOTSIZE * (old.nslots + 1) <= sbuf.st_size) {
+	    nslots = old.nslots;
+	    goto map;
+	}
+    }
+
+    /* start again.  Never shrink the file, someone else may have it
+     * mapped; just empty it */
+    len = (size_t)MC_SLOTSIZE * (nslots + 1);
+    if ((off_t)len > sbuf.st_size && ftruncate(mc_fd, len)) {
+	syslog(LOG_ERR, "IOERROR: extending %s: %m", fname);
+	goto fail;
+    }
+
+ map:
+    len = (size_t)MC_SLOTSIZE * (nslots + 1);
+    mc_base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, mc_fd, 0);
+    if (mc_base == MAP_FAILED) {
+	syslog(LOG_ERR, "IOERROR: mapping %s: %m", fname);
+	mc_base = NULL;
+	goto fail;
+    }
+    mc_len = len;
+    mc_nslots = nslots;
+
+    hdr = (struct mc_header *)mc_base;
+    if (memcmp(hdr->magic, MC_MAGIC, MC_MAGIC_SIZE)) {
+	/* zeroed slots are empty, and a sequence number going
+	 * backwards still fails any read in progress */
+	memset(mc_base + MC_SLOTSIZE, 0, len - MC_SLOTSIZE);
+	hdr->version = MC_VERSION;
+	hdr->slotsize = MC_SLOTSIZE;
+	hdr->nslots = nslots;
+	hdr->indexsize = sizeof(struct index_header);
+	__sync_synchronize();
+	memcpy(hdr->magic, MC_MAGIC, MC_MAGIC_SIZE);
+    }
+
+    mc_lock(0, 0, F_UNLCK, 0);
+    mc_broken = 0;
+    free(tofree);
+    return 0;
+
+ fail:
+    if (mc_fd != -1) close(mc_fd);
+    mc_fd = -1;
+    free(tofree);
+    return -1;
+}
+
+EXPORTED void metacache_close(void)
+{
+    if (mc_base) munmap(mc_base, mc_len);
+    mc_base = NULL;
+    mc_len = 0;
+    mc_nslots = 0;
+    if (mc_fd != -1) close(mc_fd);
+    mc_fd = -1;
+    mc_broken = 0;
+}
+
+static uint32_t mc_slotnum(const char *uniqueid)
+{
+    return crc32_cstring(uniqueid) % mc_nslots;
+}
+
+/* copy slot 'n' into 'copy', if nobody's in the middle of writing it */
+static int mc_read(uint32_t n, struct mc_slot *copy)
+{
+    volatile struct mc_slot *slot = SLOT(n);
+    uint32_t seq;
+    int tries;
+
+    for (tries = 0; tries < 3; tries++) {
+	seq = slot->seq;
+	if (seq & 1) return -1;
+	__sync_synchronize();
+	memcpy(copy, (const void *)slot, MC_SLOTSIZE);
+	__sync_synchronize();
+	if (slot->seq == seq) return 0;
+    }
+
+    return -1;
+}
+
+static int mc_begin(uint32_t n)
+{
+    struct mc_slot *slot = SLOT(n);
+
+    if (mc_lock((off_t)MC_SLOTSIZE * (n + 1), MC_SLOTSIZE, F_WRLCK, 0))
+	return -1;
+
+    /* still odd if a writer died half way */
+    if (!(slot->seq & 1)) slot->seq++;
+    __sync_synchronize();
+
+    return 0;
+}
+
+static void mc_end(uint32_t n)
+{
+    struct mc_slot *slot = SLOT(n);
+
+    __sync_synchronize();
+    slot->seq++;
+
+    mc_lock((off_t)MC_SLOTSIZE * (n + 1), MC_SLOTSIZE, F_UNLCK, 0);
+}
+
+/* does the slot hold this mailbox? */
+static int mc_match(const struct mc_slot *slot,
+		    const char *name, const char *uniqueid)
+{
+    size_t namelen = strlen(name);
+    size_t uniqueidlen = strlen(uniqueid);
+
+    if (!slot->valid) return 0;
+    if (slot->namelen != namelen || slot->uniqueidlen != uniqueidlen)
+	return 0;
+    if (slot->datalen > MC_DATASIZE ||
+	(size_t)namelen + uniqueidlen + 2 > slot->datalen)
+	return 0;
+    if (memcmp(slot->data, name, namelen + 1)) return 0;
+    if (memcmp(slot->data + namelen + 1, uniqueid, uniqueidlen + 1))
+	return 0;
+
+    return 1;
+}
+
+/* lay out 'mailbox' as a slot.  Returns -1 if it doesn't fit */
+static int mc_fill(struct mailbox *mailbox, struct mc_slot *slot)
+{
+    size_t len = 0, n;
+    int flag, nflags = 0;
+
+    memset(slot, 0, MC_SLOTSIZE);
+
+    for (flag = 0; flag < MAX_USER_FLAGS; flag++)
+	if (mailbox->flagname[flag]) nflags = flag + 1;
+
+#define ADD(s) do { \
+	n = (s) ? strlen(s) : 0; \
+	if (len + n + 1 > MC_DATASIZE) return -1; \
+	if (n) memcpy(slot->data + len, (s), n); \
+	len += n + 1; \
+    } while (0)
+
+    ADD(mailbox->name);
+    ADD(mailbox->uniqueid);
+    ADD(mailbox->quotaroot);
+    for (flag = 0; flag < nflags; flag++)
+	ADD(mailbox->flagname[flag]);
+
+#undef ADD
+
+    slot->valid = 1;
+    slot->index_ino = mailbox->index_ino;
+    slot->header_ino = mailbox->header_file_ino;
+    slot->header_crc = mailbox->header_file_crc;
+    slot->namelen = strlen(mailbox->name);
+    slot->uniqueidlen = strlen(mailbox->uniqueid);
+    slot->quotarootlen = mailbox->quotaroot ? strlen(mailbox->quotaroot)
+					    : MC_NOQUOTAROOT;
+    slot->nflags = nflags;
+    slot->datalen = len;
+    slot->i = mailbox->i;
+    slot->i.dirty = 0;
+
+    return 0;
+}
+
+EXPORTED int metacache_lookup(const char *name, const char *uniqueid,
+			      struct metacache_entry *entry)
+{
+    char buf[MC_SLOTSIZE];
+    struct mc_slot *slot = (struct mc_slot *)buf;
+    const char *p, *end;
+    int flag;
+
+    memset(entry, 0, sizeof(struct metacache_entry));
+
+    if (!uniqueid || mc_open()) return IMAP_NOTFOUND;
+
+    if (mc_read(mc_slotnum(uniqueid), slot)) return IMAP_NOTFOUND;
+    if (!mc_match(slot, name, uniqueid)) return IMAP_NOTFOUND;
+
+    entry->i = slot->i;
+    entry->index_ino = slot->index_ino;
+    entry->header_ino = slot->header_ino;
+    entry->header_crc = slot->header_crc;
+
+    /* the copy is stable, but may still be nonsense if a writer
+     * died half way through - so don't trust the lengths */
+    p = slot->data + slot->namelen + 1 + slot->uniqueidlen + 1;
+    end = slot->data + slot->datalen;
+    if (end[-1]) goto bad;
+
+    if (slot->quotarootlen != MC_NOQUOTAROOT) {
+	if (p + slot->quotarootlen >= end) goto bad;
+	entry->quotaroot = xstrndup(p, slot->quotarootlen);
+    }
+    p += strlen(p) + 1;
+
+    for (flag = 0; flag < slot->nflags && flag < MAX_USER_FLAGS; flag++) {
+	if (p >= end) goto bad;
+	if (*p) entry->flagname[flag] = xstrdup(p);
+	p += strlen(p) + 1;
+    }
+
+    return 0;
+
+ bad:
+    metacache_entry_fini(entry);
+    return IMAP_NOTFOUND;
+}
+
+EXPORTED void metacache_entry_fini(struct metacache_entry *entry)
+{
+    int flag;
+
+    free(entry->quotaroot);
+    entry->quotaroot = NULL;
+    for (flag = 0; flag < MAX_USER_FLAGS; flag++) {
+	free(entry->flagname[flag]);
+	entry->flagname[flag] = NULL;
+    }
+}
+
+EXPORTED void metacache_store(struct mailbox *mailbox)
+{
+    char newbuf[MC_SLOTSIZE], oldbuf[MC_SLOTSIZE];
+    struct mc_slot *new = (struct mc_slot *)newbuf;
+    struct mc_slot *old = (struct mc_slot *)oldbuf;
+    uint32_t n;
+
+    if (!mailbox->uniqueid || !mailbox->header_file_ino) return;
+    if (mc_open()) return;
+
+    assert(mailbox->index_locktype);
+
+    n = mc_slotnum(mailbox->uniqueid);
+
+    if (mc_fill(mailbox, new)) {
+	/* too big to cache, but mustn't leave an old copy behind */
+	metacache_invalidate(mailbox);
+	return;
+    }
+
+    /* most of the time, it's already there */
+    if (!mc_read(n, old)) {
+	new->seq = old->seq;
+	if (!memcmp(new, old, MC_SLOTSIZE)) return;
+    }
+
+    /* everything but the sequence number */
+    if (mc_begin(n)) return;
+    memcpy((char *)SLOT(n) + offsetof(struct mc_slot, valid),
+	   newbuf + offsetof(struct mc_slot, valid),
+	   MC_SLOTSIZE - offsetof(struct mc_slot, valid));
+    mc_end(n);
+}
+
+EXPORTED void metacache_invalidate(struct mailbox *mailbox)
+{
+    char buf[MC_SLOTSIZE];
+    struct mc_slot *slot = (struct mc_slot *)buf;
+    uint32_t n;
+
+    if (!mailbox->uniqueid) return;
+    if (mc_open()) return;
+
+    n = mc_slotnum(mailbox->uniqueid);
+
+    /* a torn read means a writer is busy with it */
+    if (!mc_read(n, slot) && !mc_match(slot, mailbox->name, mailbox->uniqueid))
+	return;
+
+    /* and if we can't lock it, whoever has it is replacing it */
+    if (mc_begin(n)) return;
+    SLOT(n)->valid = 0;
+    mc_end(n);
+}
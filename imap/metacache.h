@@ -0,0 +1,80 @@
+/* metacache.h -- cross-process cache of mailbox metadata
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef METACACHE_H
+#define METACACHE_H
+
+#include "mailbox.h"
+
+/* name of the metadata cache file in the configdirectory */
+#define FNAME_METACACHE "/metacache"
+
+/* what a mailbox looked like the last time anyone had it locked */
+struct metacache_entry {
+    struct index_header i;
+    ino_t index_ino;
+
+    /* cyrus.header */
+    ino_t header_ino;
+    bit32 header_crc;
+    char *quotaroot;
+    char *flagname[MAX_USER_FLAGS];
+};
+
+/* look up mailbox 'name' with 'uniqueid'.  Returns IMAP_NOTFOUND
+ * unless the cache is enabled and holds this mailbox.  The caller
+ * must check that the files it describes are still current */
+extern int metacache_lookup(const char *name, const char *uniqueid,
+			    struct metacache_entry *entry);
+extern void metacache_entry_fini(struct metacache_entry *entry);
+
+/* remember the state of a mailbox, which must be index locked and
+ * unchanged since it was read or committed */
+extern void metacache_store(struct mailbox *mailbox);
+
+/* forget the mailbox, before changing its files */
+extern void metacache_invalidate(struct mailbox *mailbox);
+
+/* unmap the cache file */
+extern void metacache_close(void);
+
+#endif /* METACACHE_H */
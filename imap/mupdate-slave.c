@@ -56,6 +56,7 @@
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
+#include <time.h>
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
@@ -170,6 +171,8 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
     struct mpool *pool;
     int r;
     enum mupdate_cmd_response response;
+    int snapinterval = config_getint(IMAPOPT_MBOXLIST_SNAPSHOT_INTERVAL);
+    time_t now, ping_at = 0, snap_at = 0;
     
     if (!handle || !handle->saslcompleted) return;
 
@@ -192,6 +195,9 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
     if (r) return;
 
     mupdate_signal_db_synced();
+
+    /* frontends can use the snapshot as soon as they're let in */
+    mupdate_snapshot();
     
     /* Okay, we're all set to go */
     mupdate_ready();
@@ -207,7 +213,13 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
     while (1) {
 	struct timeval tv;
 
-	tv.tv_sec = pingtimeout;
+	/* wake up early to write out a pending snapshot, but keep
+	 * the NOOP to the master to its own schedule */
+	now = time(NULL);
+	if (!ping_at) ping_at = now + pingtimeout;
+	tv.tv_sec = ping_at > now ? ping_at - now : 0;
+	if (snap_at && snap_at < ping_at)
+	    tv.tv_sec = snap_at > now ? snap_at - now : 0;
 	tv.tv_usec = 0;
 
 	prot_flush(handle->conn->out);
@@ -229,7 +241,18 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
 		    syslog(LOG_ERR, "mupdate_scarf: %d", r);
 		    break;
 		}
-	    } 
+
+		/* the local database may have changed */
+		if (!snap_at && config_getswitch(IMAPOPT_MBOXLIST_SNAPSHOT))
+		    snap_at = time(NULL) + snapinterval;
+
+		/* with the master busy we may never time out, so
+		 * don't let that hold the snapshot back either */
+		if (snap_at && time(NULL) >= snap_at) {
+		    mupdate_snapshot();
+		    snap_at = 0;
+		}
+	    }
 	    
 	    /* If we were waiting on a noop, we no longer are.
 	     * If we have been kicked, tell them we're done now */
@@ -240,6 +263,12 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
 		}
 		waiting_for_noop = 0;
 
+		/* whoever kicked us expects to see the changes */
+		if (num_kick_fds && snap_at) {
+		    mupdate_snapshot();
+		    snap_at = 0;
+		}
+
 		for (; num_kick_fds; num_kick_fds--) {
 		    if (write(kick_fds[num_kick_fds-1], "ok", 2) < 0) {
 			syslog(LOG_WARNING,
@@ -265,6 +294,14 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
 		waiting_for_noop = 1;
 	    }
 	} else /* (gotdata == 0) */ {
+	    if (snap_at && time(NULL) >= snap_at) {
+		mupdate_snapshot();
+		snap_at = 0;
+
+		/* not time to ping yet */
+		if (time(NULL) < ping_at) continue;
+	    }
+
 	    /* Timeout, send a NOOP */
 	    if (!waiting_for_noop) {
 		prot_printf(handle->conn->out, "N%u NOOP\r\n", handle->tagn++);
@@ -279,6 +316,8 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
 		break;
 	    }
 	}
+
+	ping_at = 0;
     } /* Loop */
 
     /* Don't leak the descriptors! */
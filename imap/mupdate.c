@@ -2527,6 +2527,16 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
     return ret;
 }
 
+/* rewrite the mailboxes.db snapshot, if we keep one */
+void mupdate_snapshot(void)
+{
+    if (!config_getswitch(IMAPOPT_MBOXLIST_SNAPSHOT)) return;
+
+    pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
+    mboxlist_snapshot();
+    pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+}
+
 void mupdate_signal_db_synced(void) 
 {
     pthread_mutex_lock(&synced_mutex);
@@ -113,6 +113,9 @@ int mupdate_synchronize_remote(mupdate_handle *handle,
 /* Given an mbent_queue, will synchronize the local database to it */
 int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool);
 
+/* Rewrite the snapshot of the local database that frontends read */
+void mupdate_snapshot(void);
+
 /* Signal that we are ready to accept connections */
 void mupdate_ready(void);
 void mupdate_unready(void);
@@ -457,7 +457,7 @@ int service_init(int argc __attribute__((unused)),
     }
 
     /* open the mboxlist, we'll need it for real work */
-    mboxlist_init(0);
+    mboxlist_init(MBOXLIST_SNAPSHOT);
     mboxlist_open(NULL);
 
     /* open the quota db, we'll need it for expunge */
@@ -441,7 +441,7 @@ int service_init(int argc __attribute__((unused)),
     global_sasl_init(1, 1, mysasl_cb);
 
     /* open the mboxlist, we'll need it for real work */
-    mboxlist_init(0);
+    mboxlist_init(MBOXLIST_SNAPSHOT);
     mboxlist_open(NULL);
 
     /* open the quota db, we'll need it for expunge */
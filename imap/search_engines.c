@@ -42,286 +42,302 @@
 
 #include <config.h>
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <stdlib.h>
 #include <syslog.h>
 #include <string.h>
-#ifdef HAVE_UNISTD_H
-#include <unistd.h>
-#endif
 
-#include "index.h"
+#include "bitvector.h"
 #include "global.h"
+#include "imapd.h"
+#include "index.h"
 #include "xmalloc.h"
 
-#include "squat.h"
-
-typedef struct {
-    unsigned char	*vector;
-    struct index_state	*state;
-    const char		*part_types;
-    int			found_validity;
-} SquatSearchResult;
-
-static int vector_len(struct index_state *state)
-{
-    return (state->exists >> 3) + 1;
-}
-
-/* The document name is of the form
+#include "search_engines.h"
 
-   pnnn.vvv
+static const struct search_engine *engines[] = {
+    &squat_search_engine,
+    &invindex_search_engine,
+    NULL
+};
 
-   Where p is a part_type character (denoting which segment of the message
-   is represented by the document), nnn is the UID of the message, and vvv
-   is the UID validity value.
-
-   This function parses the document name and returns the message
-   UID only if the name has the right part type and it corresponds
-   to a real message UID.
-*/
-static int parse_doc_name(SquatSearchResult *r, const char *doc_name)
+EXPORTED const struct search_engine *search_engine_lookup(const char *name)
 {
-    int ch = doc_name[0];
-    const char *t = r->part_types;
-    int doc_UID, index;
+    int i;
 
-    if (ch == 'v' && strncmp(doc_name, "validity.", 9) == 0) {
-	if ((unsigned) atoi(doc_name + 9) == r->state->mailbox->i.uidvalidity) {
-	    r->found_validity = 1;
-	}
-	return -1;
+    for (i = 0; engines[i]; i++) {
+	if (!strcasecmp(engines[i]->name, name))
+	    return engines[i];
     }
+    return NULL;
+}
 
-    /* make sure that the document part type is one of the ones we're
-     accepting */
-    while (*t != 0 && *t != ch) {
-	t++;
-    }
-    if (*t == 0) {
-	return -1;
+EXPORTED const struct search_engine *search_engine(void)
+{
+    switch (config_getenum(IMAPOPT_SEARCH_ENGINE)) {
+    case IMAP_ENUM_SEARCH_ENGINE_INVINDEX:
+	return &invindex_search_engine;
+    case IMAP_ENUM_SEARCH_ENGINE_SQUAT:
+    default:
+	return &squat_search_engine;
     }
+}
 
-    doc_UID = atoi(++doc_name);
-    while ((*doc_name >= '0' && *doc_name <= '9') || *doc_name == '-') {
-	++doc_name;
-    }
-    if (*doc_name != 0) {
-	return -1;
-    }
+/* ====================================================================== */
+
+/* The state of one prefiltering query.  All the sets are bitvectors
+ * indexed by message number. */
+struct search_query {
+    struct index_state *state;
+    const struct search_engine *engine;
+    search_searcher_t *searcher;
+    bitvector_t unindexed;	/* messages the index doesn't cover */
+    int complete;		/* ...of which there are none */
+};
+
+struct uid_rock {
+    struct index_state *state;
+    bitvector_t *bv;
+};
+
+/* Add a UID reported by the engine to a set of message numbers.  UIDs
+ * which have since been expunged are ignored. */
+static int add_uid(uint32_t uid, void *rock)
+{
+    struct uid_rock *ur = (struct uid_rock *)rock;
+    uint32_t msgno = index_finduid(ur->state, uid);
 
-    index = index_finduid(r->state, doc_UID);
+    if (msgno && index_getuid(ur->state, msgno) == uid)
+	bv_set(ur->bv, msgno);
 
-    return index;
+    return 0;
 }
 
-static int drop_indexed_docs(void* closure, const SquatListDoc *doc)
+static void query_setall(struct search_query *q, bitvector_t *bv)
 {
-    SquatSearchResult* r = (SquatSearchResult*)closure;
-    int doc_uid = parse_doc_name(r, doc->doc_name);
-
-    if (doc_uid >= 0) {
-	unsigned char* vect = r->vector;
-	vect[doc_uid >> 3] &= ~(1 << (doc_uid & 0x7));
-    }
-    return SQUAT_CALLBACK_CONTINUE;
+    bv_setsize(bv, q->state->exists + 1);
+    bv_setall(bv);
 }
 
-static int fill_with_hits(void* closure, char const* doc)
+/* Compute in 'out' the messages which might contain any of the strings
+ * in 'strs' in any of 'parts'.  Returns 1 if the result is exact, 0 if
+ * not, or -1 on error. */
+static int query_strlist(struct search_query *q, struct strlist *strs,
+			 int parts, int exact_ok, bitvector_t *out)
 {
-    SquatSearchResult* r = (SquatSearchResult*)closure;
-    int doc_uid = parse_doc_name(r, doc);
-
-    if (doc_uid >= 0) {
-	unsigned char* vect = r->vector;
-	vect[doc_uid >> 3] |= 1 << (doc_uid & 0x7);
+    bitvector_t hits = BV_INITIALIZER;
+    struct uid_rock ur;
+    int exact = exact_ok && q->complete;
+    int r = 0;
+
+    ur.state = q->state;
+    ur.bv = &hits;
+
+    for (; strs; strs = strs->next) {
+	int str_exact = 0;
+
+	bv_setsize(&hits, q->state->exists + 1);
+	bv_clearall(&hits);
+	r = q->engine->find(q->searcher, strs->s, parts,
+			    add_uid, &ur, &str_exact);
+	if (r) {
+	    syslog(LOG_DEBUG, "%s search failed on string %s",
+		   q->engine->name, strs->s);
+	    break;
+	}
+	bv_oreq(&hits, &q->unindexed);
+	bv_andeq(out, &hits);
+	exact = exact && str_exact;
     }
-    return SQUAT_CALLBACK_CONTINUE;
+
+    bv_free(&hits);
+    return r ? -1 : exact;
 }
 
-static int search_strlist(SquatSearchIndex* index, struct index_state *state,
-			  unsigned char* output, unsigned char* tmp,
-			  struct strlist* strs, char const* part_types)
+/* Compute in 'out' the messages which might match 'args', considering
+ * only the text criteria and sublists.  Returns 1 if the result is
+ * exact, 0 if not, or -1 on error.  The other criteria are the
+ * caller's job at the top level, and make a sublist inexact. */
+static int query_node(struct search_query *q, const struct searchargs *args,
+		      int top, bitvector_t *out)
 {
-    SquatSearchResult r;
-    int i;
-    int len = vector_len(state);
-
-    r.part_types = part_types;
-    r.vector = tmp;
-    r.state = state;
-    while (strs != NULL) {
-	char const* s = strs->s;
-
-	memset(tmp, 0, len);
-	if (squat_search_execute(index, s, strlen(s), fill_with_hits, &r)
-	    != SQUAT_OK) {
-	    if (squat_get_last_error() == SQUAT_ERR_SEARCH_STRING_TOO_SHORT)
-		return 1; /* The rest of the search is still viable */
-	    syslog(LOG_DEBUG, "SQUAT string list search failed on string %s "
-			      "with part types %s", s, part_types);
-	    return 0;
-	}
-	for (i = 0; i < len; i++) {
-	    output[i] &= tmp[i];
-	}
+    struct searchsub *sub;
+    unsigned i;
+    int exact = 1;
+    int r;
+
+    query_setall(q, out);
 
-	strs = strs->next;
+#define STRLIST(field, parts, exact_ok) \
+    if (args->field) { \
+	r = query_strlist(q, args->field, parts, exact_ok, out); \
+	if (r < 0) return r; \
+	exact = exact && r; \
     }
-    return 1;
-}
 
-static unsigned char* search_squat_do_query(SquatSearchIndex* index,
-					    struct index_state *state,
-					    const struct searchargs* args)
-{
-    int vlen = vector_len(state);
-    unsigned char* vect = xmalloc(vlen);
-    unsigned char* t_vect = xmalloc(vlen);
-    struct searchsub* sub;
-    int found_something = 1;
-
-    memset(vect, 255, vlen);
-
-    if (!(search_strlist(index, state, vect, t_vect, args->to, "t")
-	&& search_strlist(index, state, vect, t_vect, args->from, "f")
-	&& search_strlist(index, state, vect, t_vect, args->cc, "c")
-	&& search_strlist(index, state, vect, t_vect, args->bcc, "b")
-	&& search_strlist(index, state, vect, t_vect, args->subject, "s")
-	&& search_strlist(index, state, vect, t_vect, args->header_name, "h")
-	&& search_strlist(index, state, vect, t_vect, args->header, "h")
-	&& search_strlist(index, state, vect, t_vect, args->body, "m")
-	&& search_strlist(index, state, vect, t_vect, args->text, "mh"))) {
-	found_something = 0;
-	goto cleanup;
+    STRLIST(from, SEARCH_PART(SEARCHINDEX_PART_FROM), 1);
+    STRLIST(to, SEARCH_PART(SEARCHINDEX_PART_TO), 1);
+    STRLIST(cc, SEARCH_PART(SEARCHINDEX_PART_CC), 1);
+    STRLIST(bcc, SEARCH_PART(SEARCHINDEX_PART_BCC), 1);
+    /* a missing subject is cached (and indexed) as "NIL" */
+    STRLIST(subject, SEARCH_PART(SEARCHINDEX_PART_SUBJECT), 0);
+    /* header names and values are both somewhere in the headers */
+    STRLIST(header_name, SEARCH_PART(SEARCHINDEX_PART_HEADERS), 0);
+    STRLIST(header, SEARCH_PART(SEARCHINDEX_PART_HEADERS), 0);
+    STRLIST(body, SEARCH_PART(SEARCHINDEX_PART_BODY), 1);
+    STRLIST(text, SEARCH_PART(SEARCHINDEX_PART_HEADERS) |
+		  SEARCH_PART(SEARCHINDEX_PART_BODY), 1);
+
+#undef STRLIST
+
+    /* not indexed at all */
+    if (args->messageid || args->annotations || args->cache_atleast)
+	exact = 0;
+
+    if (!top &&
+	(args->flags || args->smaller || args->larger ||
+	 args->before || args->after || args->sentbefore || args->sentafter ||
+	 args->system_flags_set || args->system_flags_unset ||
+	 args->sequence || args->uidsequence || args->modseq))
+	exact = 0;
+    for (i = 0; !top && i < (MAX_USER_FLAGS/32); i++) {
+	if (args->user_flags_set[i] || args->user_flags_unset[i])
+	    exact = 0;
     }
 
-    sub = args->sublist;
-    while (sub != NULL) {
-	if (args->sublist->sub2 == NULL) {
-	    /* do nothing; because our search is conservative (may include false
-	       positives) we can't compute the NOT (since the result might include
-	       false negatives, which we do not allow) */
-	    /* Note that it's OK to do nothing. We'll just be returning more
-	       false positives. */
-	} else {
-	    unsigned char* sub1_vect =
-		    search_squat_do_query(index, state, args->sublist->sub1);
-	    unsigned char* sub2_vect;
-	    int i;
-
-	    if (sub1_vect == NULL) {
-		found_something = 0;
-		goto cleanup;
-	    }
+    for (sub = args->sublist; sub; sub = sub->next) {
+	bitvector_t v1 = BV_INITIALIZER;
+	bitvector_t v2 = BV_INITIALIZER;
+	int r1, r2;
 
-	    sub2_vect = search_squat_do_query(index, state, args->sublist->sub2);
+	r1 = query_node(q, sub->sub1, 0, &v1);
+	if (r1 < 0) {
+	    bv_free(&v1);
+	    return r1;
+	}
 
-	    if (sub2_vect == NULL) {
-		found_something = 0;
-		free(sub1_vect);
-		goto cleanup;
+	if (sub->sub2) {
+	    /* OR */
+	    r2 = query_node(q, sub->sub2, 0, &v2);
+	    if (r2 < 0) {
+		bv_free(&v1);
+		bv_free(&v2);
+		return r2;
 	    }
-
-	    for (i = 0; i < vlen; i++) {
-		vect[i] &= sub1_vect[i] | sub2_vect[i];
+	    bv_oreq(&v1, &v2);
+	    bv_andeq(out, &v1);
+	    exact = exact && r1 && r2;
+	}
+	else if (r1) {
+	    /* NOT of an exact set is exact */
+	    for (i = 1; i <= q->state->exists; i++) {
+		if (bv_isset(&v1, i)) bv_clear(out, i);
 	    }
-
-	    free(sub1_vect);
-	    free(sub2_vect);
+	}
+	else {
+	    /* but we can't compute the NOT of a conservative set (it
+	       might leave out real matches), so do nothing.  That just
+	       means more false positives. */
+	    exact = 0;
 	}
 
-	sub = sub->next;
+	bv_free(&v1);
+	bv_free(&v2);
     }
 
-cleanup:
-    free(t_vect);
-    if (!found_something) {
-	free(vect);
-	return NULL;
-    }
+    return exact;
+}
+
+static int mark_indexed(uint32_t uid, void *rock)
+{
+    struct uid_rock *ur = (struct uid_rock *)rock;
+    uint32_t msgno = index_finduid(ur->state, uid);
+
+    if (msgno && index_getuid(ur->state, msgno) == uid)
+	bv_clear(ur->bv, msgno);
 
-    return vect;
+    return 0;
 }
 
-static int search_squat(unsigned* msg_list, struct index_state *state,
-			const struct searchargs *searchargs)
+static int search_engine_query(const struct search_engine *engine,
+			       unsigned *msg_list, struct index_state *state,
+			       const struct searchargs *searchargs,
+			       int *exactp)
 {
-    char *fname;
-    int fd;
-    SquatSearchIndex* index;
-    unsigned char* msg_vector;
-    int result;
-
-    fname = mailbox_meta_fname(state->mailbox, META_SQUAT);
-    if ((fd = open(fname, O_RDONLY)) < 0) {
-	syslog(LOG_DEBUG, "SQUAT failed to open index file");
-	return -1;   /* probably not found. Just bail */
-    }
-    if ((index = squat_search_open(fd)) == NULL) {
-	syslog(LOG_DEBUG, "SQUAT failed to open index");
-	close(fd);
+    struct search_query q;
+    struct uid_rock ur;
+    bitvector_t result = BV_INITIALIZER;
+    unsigned i;
+    int r, count = 0;
+
+    memset(&q, 0, sizeof(q));
+    q.state = state;
+    q.engine = engine;
+    q.searcher = engine->open(state->mailbox);
+    if (!q.searcher) {
+	syslog(LOG_DEBUG, "%s failed to open index", engine->name);
 	return -1;
     }
-    if ((msg_vector = search_squat_do_query(index, state, searchargs))
-	    == NULL) {
-	result = -1;
-    } else {
-	unsigned i;
-	unsigned vlen = vector_len(state);
-	unsigned char* unindexed_vector = xmalloc(vlen);
-	SquatSearchResult r;
-
-	memset(unindexed_vector, 255, vlen);
-	r.vector = unindexed_vector;
-	r.state = state;
-	r.part_types = "tfcbsmh";
-	r.found_validity = 0;
-	if (squat_search_list_docs(index, drop_indexed_docs, &r) != SQUAT_OK) {
-	    syslog(LOG_DEBUG, "SQUAT failed to get list of indexed documents");
-	    result = -1;
-	} else if (!r.found_validity) {
-	    syslog(LOG_DEBUG, "SQUAT didn't find validity record");
-	    result = -1;
-	} else {
-	    /* Add in any unindexed messages. They must be searched manually. */
-	    for (i = 0; i < vlen; i++) {
-		msg_vector[i] |= unindexed_vector[i];
-	    }
 
-	    result = 0;
-	    for (i = 1; i <= state->exists; i++) {
-	        if ((msg_vector[i >> 3] & (1 << (i & 7))) != 0) {
-		    msg_list[result] = i;
-		    result++;
-		}
-	    }
+    /* Messages the index doesn't know about can't be ruled out */
+    query_setall(&q, &q.unindexed);
+    bv_clear(&q.unindexed, 0);
+    ur.state = state;
+    ur.bv = &q.unindexed;
+    r = engine->foreach_uid(q.searcher, mark_indexed, &ur);
+    if (r) {
+	syslog(LOG_DEBUG, "%s failed to get list of indexed messages",
+	       engine->name);
+	count = -1;
+	goto done;
+    }
+    q.complete = 1;
+    for (i = 1; i <= state->exists; i++) {
+	if (bv_isset(&q.unindexed, i)) {
+	    q.complete = 0;
+	    break;
 	}
-	free(msg_vector);
-	free(unindexed_vector);
     }
-    squat_search_close(index);
-    close(fd);
-    return result;
+
+    r = query_node(&q, searchargs, 1, &result);
+    if (r < 0) {
+	count = -1;
+	goto done;
+    }
+    if (exactp) *exactp = r;
+
+    for (i = 1; i <= state->exists; i++) {
+	if (bv_isset(&result, i))
+	    msg_list[count++] = i;
+    }
+
+ done:
+    engine->close(q.searcher);
+    bv_free(&q.unindexed);
+    bv_free(&result);
+    return count;
 }
 
 HIDDEN int search_prefilter_messages(unsigned *msgno_list,
 				     struct index_state *state,
-				     const struct searchargs *searchargs)
+				     const struct searchargs *searchargs,
+				     int *exactp)
 {
+    const struct search_engine *engine = search_engine();
     unsigned i;
     int count;
 
+    if (exactp) *exactp = 0;
+
     if (SQUAT_ENGINE) {
-	count = search_squat(msgno_list, state, searchargs);
+	count = search_engine_query(engine, msgno_list, state, searchargs,
+				    exactp);
 	if (count >= 0) {
-	    syslog(LOG_DEBUG, "SQUAT returned %d messages", count);
+	    syslog(LOG_DEBUG, "%s returned %d messages", engine->name, count);
 	    return count;
 	} else {
 	    /* otherwise, we failed for some reason, so do the default */
-	    syslog(LOG_DEBUG, "SQUAT failed");
+	    syslog(LOG_DEBUG, "%s failed", engine->name);
+	    if (exactp) *exactp = 0;
 	}
     }
   
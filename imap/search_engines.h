@@ -44,13 +44,111 @@
 #define INCLUDED_SEARCH_ENGINES_H
 
 #include "index.h"
+#include "charset.h"
+
+/*
+ * A search engine maintains a per-mailbox index of the text that
+ * index_getsearchtext_single() extracts from each message, and
+ * answers queries for a single search string with a set of UIDs.
+ * search_prefilter_messages() walks the criteria tree of a SEARCH
+ * over those UID sets, so the engine never needs to understand
+ * searchargs itself.
+ *
+ * Updating an index (squatter):
+ *
+ *   b = engine->begin_update(mailbox, flags, progress, rock);
+ *   engine->foreach_indexed(b, ...);   UIDs already in the index
+ *   engine->delete_uid(b, uid);	   for each of those now expunged
+ *   index_getsearchtext_single(state, msgno, engine->receiver, b);
+ *					   for each message not yet indexed
+ *   engine->end_update(b, commit, &size);
+ *
+ * Searching:
+ *
+ *   s = engine->open(mailbox);
+ *   engine->foreach_uid(s, ...);	   UIDs covered by the index
+ *   engine->find(s, str, parts, ...);  UIDs which may contain str
+ *   engine->close(s);
+ */
+
+typedef struct search_builder search_builder_t;
+typedef struct search_searcher search_searcher_t;
+
+/* Callback for UID sets.  Return nonzero to stop the iteration, which
+ * then returns that value. */
+typedef int search_uid_cb_t(uint32_t uid, void *rock);
+
+/* Callback describing each step of the slow parts of an update, for
+ * squatter -vv.  Engines with nothing worth reporting never call it. */
+typedef void search_progress_cb_t(const char *desc, void *rock);
+
+/* Bit for each SEARCHINDEX_PART_* in a mask of parts to search */
+#define SEARCH_PART(p)		(1<<(p))
+#define SEARCH_PART_ALL		0xfe
+
+/* flags for begin_update */
+#define SEARCH_UPDATE_INCREMENTAL (1<<0)
+
+struct search_engine {
+    const char *name;
+    int metafile;		/* META_* file holding the index */
+
+    /* Start writing an index for 'mailbox'.  With
+     * SEARCH_UPDATE_INCREMENTAL the existing index is kept and added
+     * to; returns NULL if there is no usable existing index (or, with
+     * no flags, if the new index can't be created).  If 'progress'
+     * isn't NULL it is told how the update is getting on. */
+    search_builder_t *(*begin_update)(struct mailbox *mailbox, int flags,
+				      search_progress_cb_t *progress,
+				      void *rock);
+    /* Calls 'proc' for each UID in the existing index, ascending. */
+    int (*foreach_indexed)(search_builder_t *b, search_uid_cb_t *proc,
+			   void *rock);
+    /* Drop a message from the index */
+    int (*delete_uid)(search_builder_t *b, uint32_t uid);
+    /* Takes the text of one message at a time, with 'rock' being the
+     * builder.  Each message is passed to the receiver exactly once. */
+    index_search_text_receiver_t *receiver;
+    /* Finish the update.  If 'commit' the new index replaces the old
+     * one and its size is stored in *sizep; otherwise it is discarded.
+     * Either way the builder is freed. */
+    int (*end_update)(search_builder_t *b, int commit,
+		      unsigned long *sizep);
+
+    /* Open the index of 'mailbox' for searching.  Returns NULL if
+     * there is none, or it is unusable (e.g. the UIDVALIDITY changed). */
+    search_searcher_t *(*open)(struct mailbox *mailbox);
+    /* Calls 'proc' for each UID covered by the index.  Messages which
+     * aren't covered must be searched some other way. */
+    int (*foreach_uid)(search_searcher_t *s, search_uid_cb_t *proc,
+		       void *rock);
+    /* Calls 'proc' for each indexed UID with 's' (in the canonical
+     * search form) in any of the 'parts'.  Sets *exactp if no other
+     * indexed UID contains 's' in those parts, or clears it if the
+     * result may include false positives.  Never misses a match. */
+    int (*find)(search_searcher_t *s, const char *str, int parts,
+		search_uid_cb_t *proc, void *rock, int *exactp);
+    void (*close)(search_searcher_t *s);
+};
+
+/* The engine selected by the search_engine option */
+extern const struct search_engine *search_engine(void);
+extern const struct search_engine *search_engine_lookup(const char *name);
+
+extern const struct search_engine squat_search_engine;
+extern const struct search_engine invindex_search_engine;
 
 /* Fill the msg_list with a list of message IDs which could match the
  * searchargs.
- * Return the number of message IDs inserted.
+ * Return the number of message IDs inserted.  If 'exactp' is not
+ * NULL, it is set when the engine answered every text criterion
+ * (including those in sublists) exactly for every listed message, so
+ * they only need checking against the remaining top-level non-text
+ * criteria.
  */
 extern int search_prefilter_messages(unsigned* msg_list,
 				     struct index_state *state,
-				     const struct searchargs *searchargs);
+				     const struct searchargs *searchargs,
+				     int *exactp);
 
 #endif
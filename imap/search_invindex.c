@@ -0,0 +1,852 @@
+/* search_invindex.c -- word-level inverted index search engine
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * The invindex engine keeps, in "cyrus.invindex", a dictionary of
+ * every word in the indexed text of a mailbox with the messages (and
+ * the parts of those messages) it appears in.  A word is a maximal
+ * run of bytes other than ASCII punctuation, whitespace and controls,
+ * so a search string which is itself a single word can only occur
+ * inside a word, and the messages containing it are exactly those
+ * listed against the dictionary words containing it.  Longer strings
+ * are narrowed down word by word and left for the caller to check.
+ *
+ * Format (all fixed size integers in network byte order):
+ *
+ *   header:  16 bytes magic
+ *             4 bytes version
+ *             4 bytes uidvalidity
+ *             4 bytes number of indexed UIDs
+ *             4 bytes number of words
+ *
+ *   the indexed UIDs, 4 bytes each, ascending
+ *   the offset of each word's entry, 4 bytes each
+ *
+ *   entry:   the word, NUL terminated
+ *            varint number of postings
+ *            each posting: varint distance to its UID in the list
+ *                          above from the previous posting's, then
+ *                          one byte of SEARCH_PART() bits
+ *
+ * Entries are sorted by word.  The file is never updated in place:
+ * an update writes the whole file out again under cyrus.invindex.NEW
+ * and renames it into place.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <syslog.h>
+
+#include "bitvector.h"
+#include "global.h"
+#include "hash.h"
+#include "imap/imap_err.h"
+#include "mailbox.h"
+#include "map.h"
+#include "retry.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#include "search_engines.h"
+
+#define INVINDEX_MAGIC "\241\002invindex file"
+#define INVINDEX_MAGIC_SIZE 16
+#define INVINDEX_VERSION 1
+
+#define HDR_VERSION 16
+#define HDR_UIDVALIDITY 20
+#define HDR_NUIDS 24
+#define HDR_NWORDS 28
+#define HEADER_SIZE 32
+
+/* size of the chunks the file is written out in */
+#define INVINDEX_WRITESIZE (64*1024)
+
+#define GET32(p) ntohl(*((bit32 *)(p)))
+
+static int is_word_char(unsigned char c)
+{
+    return c >= 0x80 || Uisalnum(c);
+}
+
+static const char *get_varint(const char *p, const char *end,
+			      uint32_t *valp)
+{
+    uint32_t val = 0;
+    int shift;
+
+    for (shift = 0; p < end && shift < 35; shift += 7) {
+	unsigned char c = *p++;
+
+	val |= (uint32_t)(c & 0x7f) << shift;
+	if (!(c & 0x80)) {
+	    *valp = val;
+	    return p;
+	}
+    }
+    return NULL;
+}
+
+static void put_varint(struct buf *buf, uint32_t val)
+{
+    while (val >= 0x80) {
+	buf_putc(buf, (val & 0x7f) | 0x80);
+	val >>= 7;
+    }
+    buf_putc(buf, val);
+}
+
+/* ====================================================================== */
+
+/* An open index file */
+struct invindex {
+    char *fname;
+    int fd;
+    const char *base;
+    size_t len;
+    uint32_t nuids;
+    uint32_t nwords;
+    const char *uids;
+    const char *offsets;
+};
+
+static void invindex_close(struct invindex *ix)
+{
+    map_free(&ix->base, &ix->len);
+    if (ix->fd >= 0) close(ix->fd);
+    free(ix->fname);
+    free(ix);
+}
+
+static struct invindex *invindex_open(struct mailbox *mailbox)
+{
+    struct invindex *ix = xzmalloc(sizeof(struct invindex));
+    struct stat sbuf;
+    uint32_t i, prev = 0;
+
+    ix->fname = xstrdup(mailbox_meta_fname(mailbox, META_INVINDEX));
+    ix->fd = open(ix->fname, O_RDONLY, 0);
+    if (ix->fd < 0) {
+	if (errno != ENOENT)
+	    syslog(LOG_ERR, "IOERROR: opening %s: %m", ix->fname);
+	goto fail;
+    }
+    if (fstat(ix->fd, &sbuf) < 0) {
+	syslog(LOG_ERR, "IOERROR: fstating %s: %m", ix->fname);
+	goto fail;
+    }
+    if (sbuf.st_size < HEADER_SIZE)
+	goto bad;
+
+    map_refresh(ix->fd, 1, &ix->base, &ix->len, sbuf.st_size,
+		"invindex", mailbox->name);
+
+    if (memcmp(ix->base, INVINDEX_MAGIC, INVINDEX_MAGIC_SIZE) ||
+	GET32(ix->base + HDR_VERSION) != INVINDEX_VERSION)
+	goto bad;
+    /* the UIDs have been renumbered since the index was made */
+    if (GET32(ix->base + HDR_UIDVALIDITY) != mailbox->i.uidvalidity)
+	goto fail;
+
+    ix->nuids = GET32(ix->base + HDR_NUIDS);
+    ix->nwords = GET32(ix->base + HDR_NWORDS);
+    if (ix->nuids > (ix->len - HEADER_SIZE) / 4 ||
+	ix->nwords > (ix->len - HEADER_SIZE) / 4 - ix->nuids)
+	goto bad;
+    ix->uids = ix->base + HEADER_SIZE;
+    ix->offsets = ix->uids + 4 * ix->nuids;
+
+    for (i = 0; i < ix->nuids; i++) {
+	uint32_t uid = GET32(ix->uids + 4 * i);
+	if (uid <= prev) goto bad;
+	prev = uid;
+    }
+    for (i = 0; i < ix->nwords; i++) {
+	uint32_t offset = GET32(ix->offsets + 4 * i);
+	if (offset < (size_t)(ix->offsets + 4 * ix->nwords - ix->base) ||
+	    offset >= ix->len ||
+	    !memchr(ix->base + offset, '\0', ix->len - offset))
+	    goto bad;
+    }
+
+    return ix;
+
+ bad:
+    syslog(LOG_ERR, "invindex: %s is damaged, ignoring it", ix->fname);
+ fail:
+    invindex_close(ix);
+    return NULL;
+}
+
+static const char *invindex_word(const struct invindex *ix, uint32_t i)
+{
+    return ix->base + GET32(ix->offsets + 4 * i);
+}
+
+static uint32_t invindex_uid(const struct invindex *ix, uint32_t i)
+{
+    return GET32(ix->uids + 4 * i);
+}
+
+/* Calls 'proc' with the position in the UID list and the parts of
+ * each posting of word 'i'.  Returns -1 if the entry is damaged. */
+static int invindex_postings(const struct invindex *ix, uint32_t i,
+			     void (*proc)(uint32_t, int, void *),
+			     void *rock)
+{
+    const char *word = invindex_word(ix, i);
+    const char *p = word + strlen(word) + 1;
+    const char *end = ix->base + ix->len;
+    uint32_t count, delta, pos = 0;
+
+    if (!(p = get_varint(p, end, &count)))
+	return -1;
+
+    while (count--) {
+	if (!(p = get_varint(p, end, &delta)) || p == end)
+	    return -1;
+	pos += delta;
+	if (pos >= ix->nuids)
+	    return -1;
+	proc(pos, (unsigned char)*p++, rock);
+    }
+
+    return 0;
+}
+
+/* The first word not sorting before 'str' */
+static uint32_t invindex_lower_bound(const struct invindex *ix,
+				     const char *str)
+{
+    uint32_t first = 0, last = ix->nwords;
+
+    while (first < last) {
+	uint32_t middle = (first + last) / 2;
+
+	if (strcmp(invindex_word(ix, middle), str) < 0)
+	    first = middle + 1;
+	else
+	    last = middle;
+    }
+    return first;
+}
+
+/* ====================================================================== */
+
+struct invindex_searcher {
+    struct invindex *ix;
+};
+
+static search_searcher_t *invindex_search_open(struct mailbox *mailbox)
+{
+    struct invindex_searcher *s;
+    struct invindex *ix = invindex_open(mailbox);
+
+    if (!ix) return NULL;
+
+    s = xzmalloc(sizeof(struct invindex_searcher));
+    s->ix = ix;
+    return (search_searcher_t *)s;
+}
+
+static int invindex_foreach_uid(search_searcher_t *searcher,
+				search_uid_cb_t *proc, void *rock)
+{
+    struct invindex_searcher *s = (struct invindex_searcher *)searcher;
+    uint32_t i;
+    int r = 0;
+
+    for (i = 0; !r && i < s->ix->nuids; i++)
+	r = proc(invindex_uid(s->ix, i), rock);
+
+    return r;
+}
+
+/* How a query word has to match a dictionary word */
+enum match_type {
+    MATCH_WITHIN,		/* the only word: anywhere */
+    MATCH_SUFFIX,		/* the first word: at the end */
+    MATCH_EXACT,		/* a middle word: all of it */
+    MATCH_PREFIX		/* the last word: at the start */
+};
+
+struct hits_rock {
+    bitvector_t *hits;
+    int parts;
+};
+
+static void add_hit(uint32_t pos, int parts, void *rock)
+{
+    struct hits_rock *hr = (struct hits_rock *)rock;
+
+    if (parts & hr->parts)
+	bv_set(hr->hits, pos);
+}
+
+/* Mark in 'hits' the positions of the UIDs with a dictionary word
+ * matching 'word' in one of 'parts' */
+static int find_word(const struct invindex *ix, const char *word,
+		     enum match_type type, int parts, bitvector_t *hits)
+{
+    struct hits_rock hr;
+    size_t len = strlen(word);
+    uint32_t i;
+
+    hr.hits = hits;
+    hr.parts = parts;
+
+    bv_setsize(hits, ix->nuids);
+    bv_clearall(hits);
+
+    if (type == MATCH_EXACT || type == MATCH_PREFIX) {
+	/* these all sort together */
+	for (i = invindex_lower_bound(ix, word); i < ix->nwords; i++) {
+	    const char *w = invindex_word(ix, i);
+
+	    if (strncmp(w, word, len)) break;
+	    if (type == MATCH_EXACT && w[len]) break;
+	    if (invindex_postings(ix, i, add_hit, &hr)) goto bad;
+	}
+	return 0;
+    }
+
+    for (i = 0; i < ix->nwords; i++) {
+	const char *w = invindex_word(ix, i);
+	size_t wlen = strlen(w);
+
+	if (wlen < len) continue;
+	if (type == MATCH_SUFFIX ? memcmp(w + wlen - len, word, len) :
+	    !memmem(w, wlen, word, len))
+	    continue;
+	if (invindex_postings(ix, i, add_hit, &hr)) goto bad;
+    }
+    return 0;
+
+ bad:
+    syslog(LOG_ERR, "IOERROR: invindex: %s: bad entry for word %u",
+	   ix->fname, i);
+    return IMAP_IOERROR;
+}
+
+static int invindex_find(search_searcher_t *searcher, const char *str,
+			 int parts, search_uid_cb_t *proc, void *rock,
+			 int *exactp)
+{
+    struct invindex_searcher *s = (struct invindex_searcher *)searcher;
+    const struct invindex *ix = s->ix;
+    bitvector_t result = BV_INITIALIZER;
+    bitvector_t hits = BV_INITIALIZER;
+    strarray_t words = STRARRAY_INITIALIZER;
+    const char *p, *start;
+    int i, r = 0;
+    uint32_t pos;
+
+    for (p = str; *p; ) {
+	for (; *p && !is_word_char(*p); p++);
+	for (start = p; *p && is_word_char(*p); p++);
+	if (p > start)
+	    strarray_appendm(&words, xstrndup(start, p - start));
+    }
+
+    /* just punctuation: nothing to go on */
+    if (!words.count) {
+	*exactp = 0;
+	r = invindex_foreach_uid(searcher, proc, rock);
+	goto done;
+    }
+
+    /* a single word is found exactly unless it's only part of 'str' */
+    *exactp = words.count == 1 && !strcmp(words.data[0], str);
+
+    for (i = 0; i < words.count; i++) {
+	enum match_type type;
+
+	if (words.count == 1)
+	    type = MATCH_WITHIN;
+	else if (i == 0)
+	    type = is_word_char(str[0]) ? MATCH_SUFFIX : MATCH_EXACT;
+	else if (i == words.count - 1)
+	    type = is_word_char(str[strlen(str)-1]) ? MATCH_PREFIX : MATCH_EXACT;
+	else
+	    type = MATCH_EXACT;
+
+	r = find_word(ix, words.data[i], type, parts, i ? &hits : &result);
+	if (r) goto done;
+	if (i) bv_andeq(&result, &hits);
+    }
+
+    for (pos = 0; !r && pos < ix->nuids; pos++) {
+	if (bv_isset(&result, pos))
+	    r = proc(invindex_uid(ix, pos), rock);
+    }
+
+ done:
+    bv_free(&result);
+    bv_free(&hits);
+    strarray_fini(&words);
+    return r;
+}
+
+static void invindex_search_close(search_searcher_t *searcher)
+{
+    struct invindex_searcher *s = (struct invindex_searcher *)searcher;
+
+    invindex_close(s->ix);
+    free(s);
+}
+
+/* ====================================================================== */
+
+/* The postings of one word, as the update builds them up */
+struct postings {
+    uint32_t *uids;
+    unsigned char *parts;
+    unsigned count;
+    unsigned alloc;
+};
+
+struct invindex_builder {
+    struct mailbox *mailbox;
+    struct invindex *old;	/* for incremental updates */
+    unsigned char *deleted;	/* ...by position in its UID list */
+    hash_table words;		/* new postings, by word */
+    uint32_t *uids;		/* UIDs sent to the receiver */
+    unsigned nuids;
+    unsigned alloc;
+    uint32_t uid;		/* current message */
+    int part;			/* ...and part */
+    struct buf word;		/* word being assembled */
+};
+
+#define INVINDEX_HASH_SIZE 4096
+
+static search_builder_t *invindex_begin_update(struct mailbox *mailbox,
+					       int flags,
+					       search_progress_cb_t *progress
+						   __attribute__((unused)),
+					       void *rock
+						   __attribute__((unused)))
+{
+    struct invindex_builder *b;
+    struct invindex *old = NULL;
+
+    if ((flags & SEARCH_UPDATE_INCREMENTAL) &&
+	!(old = invindex_open(mailbox)))
+	return NULL;
+
+    b = xzmalloc(sizeof(struct invindex_builder));
+    b->mailbox = mailbox;
+    b->old = old;
+    if (old)
+	b->deleted = xzmalloc(old->nuids + 1);
+    construct_hash_table(&b->words, INVINDEX_HASH_SIZE, 0);
+
+    return (search_builder_t *)b;
+}
+
+static int invindex_foreach_indexed(search_builder_t *builder,
+				    search_uid_cb_t *proc, void *rock)
+{
+    struct invindex_builder *b = (struct invindex_builder *)builder;
+    uint32_t i;
+    int r = 0;
+
+    for (i = 0; !r && b->old && i < b->old->nuids; i++)
+	r = proc(invindex_uid(b->old, i), rock);
+
+    return r;
+}
+
+static int invindex_delete_uid(search_builder_t *builder, uint32_t uid)
+{
+    struct invindex_builder *b = (struct invindex_builder *)builder;
+    uint32_t first = 0, last = b->old ? b->old->nuids : 0;
+
+    /* Binary chop on sorted array */
+    while (first < last) {
+	uint32_t middle = (first + last) / 2;
+	uint32_t muid = invindex_uid(b->old, middle);
+
+	if (muid == uid) {
+	    b->deleted[middle] = 1;
+	    break;
+	}
+	if (muid < uid)
+	    first = middle + 1;
+	else
+	    last = middle;
+    }
+    return 0;
+}
+
+static void postings_add(struct postings *pl, uint32_t uid, int parts)
+{
+    /* a word is usually seen many times in the same message */
+    if (pl->count && pl->uids[pl->count-1] == uid) {
+	pl->parts[pl->count-1] |= parts;
+	return;
+    }
+
+    if (pl->count == pl->alloc) {
+	pl->alloc = pl->alloc ? 2 * pl->alloc : 4;
+	pl->uids = xrealloc(pl->uids, pl->alloc * sizeof(uint32_t));
+	pl->parts = xrealloc(pl->parts, pl->alloc);
+    }
+    pl->uids[pl->count] = uid;
+    pl->parts[pl->count] = parts;
+    pl->count++;
+}
+
+static void add_posting(struct invindex_builder *b, const char *word,
+			uint32_t uid, int parts)
+{
+    struct postings *pl = hash_lookup(word, &b->words);
+
+    if (!pl) {
+	pl = xzmalloc(sizeof(struct postings));
+	hash_insert(word, pl, &b->words);
+    }
+    postings_add(pl, uid, parts);
+}
+
+static void flush_word(struct invindex_builder *b)
+{
+    if (!b->word.len) return;
+
+    add_posting(b, buf_cstring(&b->word), b->uid, SEARCH_PART(b->part));
+    buf_reset(&b->word);
+}
+
+/* Cyrus passes the text to index in here, after it has canonicalized
+   the text.  Words may be split across calls for the same part. */
+static void invindex_receiver(int uid, int part, int cmd,
+			      char const *text, int text_len, void *rock)
+{
+    struct invindex_builder *b = (struct invindex_builder *)rock;
+    int i;
+
+    if ((cmd & SEARCHINDEX_CMD_BEGINPART) != 0) {
+	if (!b->nuids || b->uids[b->nuids-1] != (uint32_t)uid) {
+	    if (b->nuids == b->alloc) {
+		b->alloc = b->alloc ? 2 * b->alloc : 64;
+		b->uids = xrealloc(b->uids, b->alloc * sizeof(uint32_t));
+	    }
+	    b->uids[b->nuids++] = uid;
+	}
+	b->uid = uid;
+	b->part = part;
+	buf_reset(&b->word);
+    }
+
+    if ((cmd & SEARCHINDEX_CMD_APPENDPART) != 0) {
+	for (i = 0; i < text_len; i++) {
+	    if (is_word_char(text[i]))
+		buf_putc(&b->word, text[i]);
+	    else
+		flush_word(b);
+	}
+    }
+
+    if ((cmd & SEARCHINDEX_CMD_ENDPART) != 0)
+	flush_word(b);
+}
+
+struct copy_rock {
+    struct invindex_builder *b;
+    const char *word;
+};
+
+static void copy_posting(uint32_t pos, int parts, void *rock)
+{
+    struct copy_rock *cr = (struct copy_rock *)rock;
+
+    if (!cr->b->deleted[pos])
+	add_posting(cr->b, cr->word, invindex_uid(cr->b->old, pos), parts);
+}
+
+/* Bring the surviving postings of the old index into b->words */
+static int copy_old(struct invindex_builder *b)
+{
+    struct copy_rock cr;
+    uint32_t i;
+
+    cr.b = b;
+    for (i = 0; i < b->old->nwords; i++) {
+	cr.word = invindex_word(b->old, i);
+	if (invindex_postings(b->old, i, copy_posting, &cr)) {
+	    syslog(LOG_ERR, "IOERROR: invindex: %s: bad entry for word %u",
+		   b->old->fname, i);
+	    return IMAP_IOERROR;
+	}
+    }
+
+    for (i = 0; i < b->old->nuids; i++) {
+	if (b->deleted[i]) continue;
+	if (b->nuids == b->alloc) {
+	    b->alloc = b->alloc ? 2 * b->alloc : 64;
+	    b->uids = xrealloc(b->uids, b->alloc * sizeof(uint32_t));
+	}
+	b->uids[b->nuids++] = invindex_uid(b->old, i);
+    }
+
+    return 0;
+}
+
+static int uid_compare(const void *a, const void *b)
+{
+    uint32_t ua = *(const uint32_t *)a;
+    uint32_t ub = *(const uint32_t *)b;
+
+    return ua < ub ? -1 : ua > ub;
+}
+
+static int word_compare(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static void collect_word(const char *word, void *data __attribute__((unused)),
+			 void *rock)
+{
+    strarray_append((strarray_t *)rock, word);
+}
+
+/* Position of 'uid' in the sorted, duplicate free 'uids' */
+static uint32_t uid_position(const uint32_t *uids, uint32_t nuids,
+			     uint32_t uid)
+{
+    uint32_t first = 0, last = nuids;
+
+    while (first < last) {
+	uint32_t middle = (first + last) / 2;
+
+	if (uids[middle] < uid)
+	    first = middle + 1;
+	else
+	    last = middle;
+    }
+    return first;
+}
+
+/* Sort and merge the postings of one word, then serialise them */
+static void put_postings(struct buf *out, struct postings *pl,
+			 const uint32_t *uids, uint32_t nuids)
+{
+    uint32_t *pos = xmalloc(pl->count * sizeof(uint32_t));
+    unsigned char *parts = xzmalloc(nuids ? nuids : 1);
+    unsigned i, n = 0;
+    uint32_t prev = 0;
+
+    /* there are several postings for a message which was indexed again */
+    for (i = 0; i < pl->count; i++) {
+	uint32_t p = uid_position(uids, nuids, pl->uids[i]);
+
+	if (!parts[p]) pos[n++] = p;
+	parts[p] |= pl->parts[i];
+    }
+    qsort(pos, n, sizeof(uint32_t), uid_compare);
+
+    put_varint(out, n);
+    for (i = 0; i < n; i++) {
+	put_varint(out, pos[i] - prev);
+	buf_putc(out, parts[pos[i]]);
+	prev = pos[i];
+    }
+
+    free(pos);
+    free(parts);
+}
+
+static int invindex_write(struct invindex_builder *b, const char *newfname,
+			  unsigned long *sizep)
+{
+    struct buf out = BUF_INITIALIZER;
+    strarray_t words = STRARRAY_INITIALIZER;
+    char hdr[HEADER_SIZE];
+    uint32_t offset;
+    unsigned i, n = 0;
+    int fd, r = 0;
+
+    /* the UIDs of the old index and the new messages together */
+    qsort(b->uids, b->nuids, sizeof(uint32_t), uid_compare);
+    for (i = 0; i < b->nuids; i++) {
+	if (!n || b->uids[n-1] != b->uids[i])
+	    b->uids[n++] = b->uids[i];
+    }
+    b->nuids = n;
+
+    hash_enumerate(&b->words, collect_word, &words);
+    qsort(words.data, words.count, sizeof(char *), word_compare);
+
+    fd = open(newfname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+	strarray_fini(&words);
+	return IMAP_IOERROR;
+    }
+
+    memset(hdr, 0, HEADER_SIZE);
+    memcpy(hdr, INVINDEX_MAGIC, INVINDEX_MAGIC_SIZE);
+    *((bit32 *)(hdr + HDR_VERSION)) = htonl(INVINDEX_VERSION);
+    *((bit32 *)(hdr + HDR_UIDVALIDITY)) = htonl(b->mailbox->i.uidvalidity);
+    *((bit32 *)(hdr + HDR_NUIDS)) = htonl(b->nuids);
+    *((bit32 *)(hdr + HDR_NWORDS)) = htonl(words.count);
+    buf_appendmap(&out, hdr, HEADER_SIZE);
+
+    for (i = 0; i < b->nuids; i++) {
+	bit32 uid = htonl(b->uids[i]);
+	buf_appendmap(&out, (char *)&uid, 4);
+    }
+
+    /* the offsets can only be worked out by serialising the entries,
+     * so do that twice rather than hold the whole file in memory */
+    offset = out.len + 4 * words.count;
+    for (i = 0; i < (unsigned)words.count; i++) {
+	struct buf entry = BUF_INITIALIZER;
+	bit32 off = htonl(offset);
+
+	buf_appendmap(&out, (char *)&off, 4);
+	buf_appendcstr(&entry, words.data[i]);
+	buf_putc(&entry, '\0');
+	put_postings(&entry, hash_lookup(words.data[i], &b->words),
+		     b->uids, b->nuids);
+	offset += entry.len;
+	buf_free(&entry);
+    }
+
+    for (i = 0; i < (unsigned)words.count; i++) {
+	if (out.len >= INVINDEX_WRITESIZE) {
+	    if (retry_write(fd, out.s, out.len) != (ssize_t) out.len) {
+		r = IMAP_IOERROR;
+		goto done;
+	    }
+	    buf_reset(&out);
+	}
+	buf_appendcstr(&out, words.data[i]);
+	buf_putc(&out, '\0');
+	put_postings(&out, hash_lookup(words.data[i], &b->words),
+		     b->uids, b->nuids);
+    }
+
+    if (out.len && retry_write(fd, out.s, out.len) != (ssize_t) out.len)
+	r = IMAP_IOERROR;
+
+ done:
+    if (r) syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
+    else if (sizep) *sizep = offset;
+    if (close(fd) < 0 && !r) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
+	r = IMAP_IOERROR;
+    }
+
+    buf_free(&out);
+    strarray_fini(&words);
+    return r;
+}
+
+static void postings_free(void *data)
+{
+    struct postings *pl = (struct postings *)data;
+
+    free(pl->uids);
+    free(pl->parts);
+    free(pl);
+}
+
+static int invindex_end_update(search_builder_t *builder, int commit,
+			       unsigned long *sizep)
+{
+    struct invindex_builder *b = (struct invindex_builder *)builder;
+    char *newfname = NULL;
+    int r = 0;
+
+    if (commit) {
+	newfname = xstrdup(mailbox_meta_newfname(b->mailbox, META_INVINDEX));
+
+	if (b->old)
+	    r = copy_old(b);
+	if (!r)
+	    r = invindex_write(b, newfname, sizep);
+	if (!r && mailbox_meta_rename(b->mailbox, META_INVINDEX) < 0) {
+	    syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+	    r = IMAP_IOERROR;
+	}
+	if (r)
+	    unlink(newfname);
+    }
+
+    if (b->old)
+	invindex_close(b->old);
+    free(b->deleted);
+    free_hash_table(&b->words, postings_free);
+    free(b->uids);
+    buf_free(&b->word);
+    free(newfname);
+    free(b);
+
+    return r;
+}
+
+EXPORTED const struct search_engine invindex_search_engine = {
+    "invindex",
+    META_INVINDEX,
+    invindex_begin_update,
+    invindex_foreach_indexed,
+    invindex_delete_uid,
+    invindex_receiver,
+    invindex_end_update,
+    invindex_search_open,
+    invindex_foreach_uid,
+    invindex_find,
+    invindex_search_close
+};
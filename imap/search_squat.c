@@ -0,0 +1,633 @@
+/* search_squat.c -- SQUAT search engine
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+  The SQUAT engine keeps one substring index per mailbox, in
+  "cyrus.squat".
+
+  Source documents are named 'xUID' where UID is the numeric UID of a
+  message and x is a character denoting a part of the message: 'f' ==
+  FROM, 't' == TO, 'b' == BCC, 'c' == CC, 's' == SUBJECT, 'h' == other
+  headers, 'm' == the body. So, a messge with UID 331 could give rise
+  to several source documents named "f331", "t331", "b331", "c331",
+  "s331", "h331"  and "m331".
+
+  There is also a special source document named "validity.N" where N
+  is the validitity nonce for the mailbox. We use this to detect when
+  the UIDs have been renumbered since we created the index (in which
+  case the index is useless and is ignored).
+
+  SQUAT indexes can't be changed in place. An update writes a new
+  index in "cyrus.squat.NEW", copying across the documents of the
+  messages still wanted from the old index, and then atomically
+  renames it to "cyrus.squat". This guarantees that we don't interfere
+  with anyone who has the old index open.
+
+  SQUAT only matches runs of SQUAT_WORD_SIZE bytes, so its results are
+  never exact.
+*/
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "exitcodes.h"
+#include "global.h"
+#include "imap/imap_err.h"
+#include "mailbox.h"
+#include "xmalloc.h"
+
+#include "search_engines.h"
+#include "squat.h"
+
+/* The part types, indexed by SEARCHINDEX_PART_* */
+static const char part_types[] = "\0ftcbshm";
+
+struct uid_list {
+    uint32_t *uids;
+    unsigned char *deleted;
+    unsigned count;
+    unsigned alloc;
+};
+
+static void uid_list_add(struct uid_list *l, uint32_t uid)
+{
+    if (l->count == l->alloc) {
+	l->alloc = l->alloc ? 2 * l->alloc : 64;
+	l->uids = xrealloc(l->uids, l->alloc * sizeof(uint32_t));
+    }
+    l->uids[l->count++] = uid;
+}
+
+static int uid_compare(const void *a, const void *b)
+{
+    uint32_t ua = *(const uint32_t *)a;
+    uint32_t ub = *(const uint32_t *)b;
+
+    return ua < ub ? -1 : ua > ub;
+}
+
+/* Sort the list and drop duplicates (each message has several
+   documents) */
+static void uid_list_finish(struct uid_list *l)
+{
+    unsigned i, n = 0;
+
+    qsort(l->uids, l->count, sizeof(uint32_t), uid_compare);
+    for (i = 0; i < l->count; i++) {
+	if (!n || l->uids[n-1] != l->uids[i])
+	    l->uids[n++] = l->uids[i];
+    }
+    l->count = n;
+    l->deleted = xzmalloc(n + 1);
+}
+
+static int uid_list_find(const struct uid_list *l, uint32_t uid)
+{
+    unsigned first = 0;
+    unsigned last = l->count;
+
+    /* Binary chop on sorted array */
+    while (first < last) {
+	unsigned middle = (first + last) / 2;
+
+	if (l->uids[middle] == uid)
+	    return middle;
+	if (l->uids[middle] < uid)
+	    first = middle + 1;
+	else
+	    last = middle;
+    }
+    return -1;
+}
+
+static void uid_list_free(struct uid_list *l)
+{
+    free(l->uids);
+    free(l->deleted);
+    memset(l, 0, sizeof(*l));
+}
+
+/* The document name is of the form
+
+   pnnn
+
+   Where p is a part_type character (denoting which segment of the message
+   is represented by the document) and nnn is the UID of the message.
+
+   This function parses the document name and returns the part type
+   (as a SEARCHINDEX_PART_*), filling in the UID, or returns 0 if the
+   name is not a message document. */
+static int parse_doc_name(const char *doc_name, uint32_t *uidp)
+{
+    const char *t;
+    char *end;
+
+    if (!doc_name[0] || !(t = strchr(part_types + 1, doc_name[0])))
+	return 0;
+
+    *uidp = strtoul(doc_name + 1, &end, 10);
+    if (end == doc_name + 1 || *end != 0)
+	return 0;
+
+    return t - part_types;
+}
+
+/* Collect the UIDs with documents in the index, checking the validity
+   document on the way */
+struct list_rock {
+    struct uid_list *uids;
+    uint32_t uidvalidity;
+    int found_validity;
+    int invalid;
+};
+
+static int list_doc(void *closure, const SquatListDoc *doc)
+{
+    struct list_rock *lr = (struct list_rock *)closure;
+    uint32_t uid;
+
+    if (!strncmp(doc->doc_name, "validity.", 9)) {
+	if (strtoul(doc->doc_name + 9, NULL, 10) == lr->uidvalidity)
+	    lr->found_validity = 1;
+	return SQUAT_CALLBACK_CONTINUE;
+    }
+
+    if (parse_doc_name(doc->doc_name, &uid) && uid > 0)
+	uid_list_add(lr->uids, uid);
+    else {
+	syslog(LOG_ERR, "Invalid document name: %s", doc->doc_name);
+	lr->invalid = 1;
+    }
+
+    return SQUAT_CALLBACK_CONTINUE;
+}
+
+static int open_index(struct mailbox *mailbox, int *fdp,
+		      SquatSearchIndex **indexp, struct uid_list *uids)
+{
+    struct list_rock lr;
+    const char *fname = mailbox_meta_fname(mailbox, META_SQUAT);
+
+    if ((*fdp = open(fname, O_RDONLY)) < 0) {
+	syslog(LOG_DEBUG, "SQUAT failed to open index file");
+	return IMAP_IOERROR;   /* probably not found. Just bail */
+    }
+    if ((*indexp = squat_search_open(*fdp)) == NULL) {
+	syslog(LOG_DEBUG, "SQUAT failed to open index");
+	goto fail;
+    }
+
+    memset(&lr, 0, sizeof(lr));
+    lr.uids = uids;
+    lr.uidvalidity = mailbox->i.uidvalidity;
+    if (squat_search_list_docs(*indexp, list_doc, &lr) != SQUAT_OK) {
+	syslog(LOG_DEBUG, "SQUAT failed to get list of indexed documents");
+	goto fail;
+    }
+    if (lr.invalid) {
+	syslog(LOG_ERR, "Corrupt squat index for %s", mailbox->name);
+	goto fail;
+    }
+    if (!lr.found_validity) {
+	syslog(LOG_DEBUG, "SQUAT didn't find validity record");
+	goto fail;
+    }
+    uid_list_finish(uids);
+
+    return 0;
+
+ fail:
+    if (*indexp) squat_search_close(*indexp);
+    *indexp = NULL;
+    close(*fdp);
+    *fdp = -1;
+    uid_list_free(uids);
+    return IMAP_IOERROR;
+}
+
+/* ====================================================================== */
+
+struct squat_searcher {
+    int fd;
+    SquatSearchIndex *index;
+    struct uid_list uids;
+};
+
+static search_searcher_t *squat_open(struct mailbox *mailbox)
+{
+    struct squat_searcher *s = xzmalloc(sizeof(struct squat_searcher));
+
+    if (open_index(mailbox, &s->fd, &s->index, &s->uids)) {
+	free(s);
+	return NULL;
+    }
+
+    return (search_searcher_t *)s;
+}
+
+static int squat_foreach_uid(search_searcher_t *searcher,
+			     search_uid_cb_t *proc, void *rock)
+{
+    struct squat_searcher *s = (struct squat_searcher *)searcher;
+    unsigned i;
+    int r = 0;
+
+    for (i = 0; !r && i < s->uids.count; i++)
+	r = proc(s->uids.uids[i], rock);
+
+    return r;
+}
+
+struct find_rock {
+    int parts;
+    search_uid_cb_t *proc;
+    void *rock;
+    int r;
+};
+
+static int fill_with_hits(void *closure, char const *doc)
+{
+    struct find_rock *fr = (struct find_rock *)closure;
+    uint32_t uid;
+    int part = parse_doc_name(doc, &uid);
+
+    if (part && (fr->parts & SEARCH_PART(part)))
+	fr->r = fr->proc(uid, fr->rock);
+
+    /* stop the walk if the caller wants to */
+    return fr->r ? SQUAT_CALLBACK_ABORT : SQUAT_CALLBACK_CONTINUE;
+}
+
+static int squat_find(search_searcher_t *searcher, const char *str,
+		      int parts, search_uid_cb_t *proc, void *rock,
+		      int *exactp)
+{
+    struct squat_searcher *s = (struct squat_searcher *)searcher;
+    struct find_rock fr;
+
+    *exactp = 0;
+
+    fr.parts = parts;
+    fr.proc = proc;
+    fr.rock = rock;
+    fr.r = 0;
+    if (squat_search_execute(s->index, str, strlen(str),
+			     fill_with_hits, &fr) != SQUAT_OK) {
+	/* The rest of the search is still viable, we just can't rule
+	   anything out */
+	if (squat_get_last_error() == SQUAT_ERR_SEARCH_STRING_TOO_SHORT)
+	    return squat_foreach_uid(searcher, proc, rock);
+	return IMAP_IOERROR;
+    }
+
+    return fr.r;
+}
+
+static void squat_close(search_searcher_t *searcher)
+{
+    struct squat_searcher *s = (struct squat_searcher *)searcher;
+
+    squat_search_close(s->index);
+    close(s->fd);
+    uid_list_free(&s->uids);
+    free(s);
+}
+
+/* ====================================================================== */
+
+static int squat_end_update(search_builder_t *builder, int commit,
+			    unsigned long *sizep);
+
+struct squat_builder {
+    struct mailbox *mailbox;
+    char *newfname;
+    int fd;			/* the new index */
+    SquatIndex *index;
+    int old_fd;			/* the old index, for incremental updates */
+    SquatSearchIndex *old_index;
+    struct uid_list old_uids;
+    int copied;			/* have the old documents been copied? */
+    int r;			/* the first error */
+    search_progress_cb_t *progress;
+    void *progress_rock;
+};
+
+/* Let SQUAT tell us what's going on in the expensive
+   squat_index_finish function. */
+static void stats_callback(void *closure, SquatStatsEvent *params)
+{
+    struct squat_builder *b = (struct squat_builder *)closure;
+    char desc[100];
+
+    switch (params->generic.type) {
+    case SQUAT_STATS_COMPLETED_INITIAL_CHAR:
+	if (params->completed_initial_char.num_words > 0) {
+	    snprintf(desc, sizeof(desc),
+		     "Processing index character %d, %d total words, "
+		     "temp file size is %d",
+		     params->completed_initial_char.completed_char,
+		     params->completed_initial_char.num_words,
+		     params->completed_initial_char.temp_file_size);
+	    b->progress(desc, b->progress_rock);
+	}
+	break;
+
+    default:
+	;			/* do nothing */
+    }
+}
+
+static search_builder_t *squat_begin_update(struct mailbox *mailbox,
+					    int flags,
+					    search_progress_cb_t *progress,
+					    void *rock)
+{
+    struct squat_builder *b = xzmalloc(sizeof(struct squat_builder));
+    SquatOptions options;
+    char uid_validity_buf[30];
+
+    b->mailbox = mailbox;
+    b->fd = -1;
+    b->old_fd = -1;
+    b->progress = progress;
+    b->progress_rock = rock;
+
+    if ((flags & SEARCH_UPDATE_INCREMENTAL) &&
+	open_index(mailbox, &b->old_fd, &b->old_index, &b->old_uids)) {
+	free(b);
+	return NULL;
+    }
+    b->copied = !b->old_index;
+
+    b->newfname = xstrdup(mailbox_meta_newfname(mailbox, META_SQUAT));
+    if ((b->fd = open(b->newfname, O_CREAT | O_TRUNC | O_WRONLY, 0666)) < 0) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", b->newfname);
+	goto fail;
+    }
+
+    options.option_mask = SQUAT_OPTION_TMP_PATH;
+    options.tmp_path = mailbox_datapath(mailbox);
+    if (progress) {
+	options.option_mask |= SQUAT_OPTION_STATISTICS;
+	options.stats_callback = stats_callback;
+	options.stats_callback_closure = b;
+    }
+    b->index = squat_index_init(b->fd, &options);
+    if (b->index == NULL) {
+	syslog(LOG_ERR, "IOERROR: initializing SQUAT index %s", b->newfname);
+	goto fail;
+    }
+
+    if (!b->old_index) {
+	/* write an empty document at the beginning to record the validity
+	   nonce */
+	snprintf(uid_validity_buf, sizeof(uid_validity_buf),
+		 "validity.%u", mailbox->i.uidvalidity);
+	if (squat_index_open_document(b->index, uid_validity_buf) != SQUAT_OK
+	    || squat_index_close_document(b->index) != SQUAT_OK) {
+	    syslog(LOG_ERR, "IOERROR: writing SQUAT index %s", b->newfname);
+	    goto fail;
+	}
+    }
+
+    return (search_builder_t *)b;
+
+ fail:
+    b->r = IMAP_IOERROR;
+    squat_end_update((search_builder_t *)b, 0, NULL);
+    return NULL;
+}
+
+static int squat_foreach_indexed(search_builder_t *builder,
+				 search_uid_cb_t *proc, void *rock)
+{
+    struct squat_builder *b = (struct squat_builder *)builder;
+    unsigned i;
+    int r = 0;
+
+    for (i = 0; !r && i < b->old_uids.count; i++)
+	r = proc(b->old_uids.uids[i], rock);
+
+    return r;
+}
+
+static int squat_delete_uid(search_builder_t *builder, uint32_t uid)
+{
+    struct squat_builder *b = (struct squat_builder *)builder;
+    int i = uid_list_find(&b->old_uids, uid);
+
+    /* too late, they've been copied already */
+    assert(!b->copied);
+
+    if (i >= 0)
+	b->old_uids.deleted[i] = 1;
+
+    return 0;
+}
+
+/* Decide which documents of the old index are copied into the new one */
+static int doc_check(void *closure, const SquatListDoc *doc)
+{
+    struct squat_builder *b = (struct squat_builder *)closure;
+    uint32_t uid;
+    int i;
+
+    /* validity will be replaced with new value in same slot */
+    if (!strncmp(doc->doc_name, "validity.", 9))
+	return 1;
+
+    if (!parse_doc_name(doc->doc_name, &uid))
+	return 0;
+
+    i = uid_list_find(&b->old_uids, uid);
+    return i >= 0 && !b->old_uids.deleted[i];
+}
+
+/* The existing documents have to go in before any new ones. They end
+   up with the same doc_IDs as in the old index, which makes trie
+   copying much simpler. */
+static void copy_existing(struct squat_builder *b)
+{
+    if (b->copied) return;
+    b->copied = 1;
+
+    if (squat_index_add_existing(b->index, b->old_index,
+				 doc_check, b) != SQUAT_OK) {
+	syslog(LOG_ERR, "IOERROR: copying SQUAT index for %s",
+	       b->mailbox->name);
+	b->r = IMAP_IOERROR;
+    }
+}
+
+/* Cyrus passes the text to index in here, after it has canonicalized
+   the text. We figure out what source document the text belongs to,
+   and update the index. */
+static void squat_receiver(int uid, int part, int cmd,
+			   char const *text, int text_len, void *rock)
+{
+    struct squat_builder *b = (struct squat_builder *)rock;
+
+    copy_existing(b);
+    if (b->r) return;
+
+    if ((cmd & SEARCHINDEX_CMD_BEGINPART) != 0) {
+	char buf[100];
+
+	/* Figure out what the name of the source document is going to be. */
+	if (part <= 0 || part >= (int)sizeof(part_types) - 1)
+	    fatal("Unknown search_text part", EC_SOFTWARE);
+
+	snprintf(buf, sizeof(buf), "%c%d", part_types[part], uid);
+
+	/* don't index document parts that are going to be empty (or too
+	   short to search) */
+	if ((cmd & SEARCHINDEX_CMD_ENDPART) != 0
+	    && ((cmd & SEARCHINDEX_CMD_APPENDPART) == 0
+		|| text_len < SQUAT_WORD_SIZE)) {
+	    return;
+	}
+
+	if (squat_index_open_document(b->index, buf) != SQUAT_OK)
+	    goto fail;
+    }
+
+    if ((cmd & SEARCHINDEX_CMD_APPENDPART) != 0) {
+	if (squat_index_append_document(b->index, text, text_len) != SQUAT_OK)
+	    goto fail;
+    }
+
+    if ((cmd & SEARCHINDEX_CMD_ENDPART) != 0) {
+	if (squat_index_close_document(b->index) != SQUAT_OK)
+	    goto fail;
+    }
+
+    return;
+
+ fail:
+    syslog(LOG_ERR, "IOERROR: writing SQUAT index %s: error %d",
+	   b->newfname, squat_get_last_error());
+    b->r = IMAP_IOERROR;
+}
+
+static int squat_end_update(search_builder_t *builder, int commit,
+			    unsigned long *sizep)
+{
+    struct squat_builder *b = (struct squat_builder *)builder;
+    struct stat sbuf;
+    int r = b->r;
+
+    if (commit && !r) {
+	copy_existing(b);
+	r = b->r;
+    }
+
+    if (b->index) {
+	if (commit && !r) {
+	    if (squat_index_finish(b->index) != SQUAT_OK) {
+		syslog(LOG_ERR, "IOERROR: finishing SQUAT index %s: error %d",
+		       b->newfname, squat_get_last_error());
+		r = IMAP_IOERROR;
+	    }
+	}
+	else
+	    squat_index_destroy(b->index);
+    }
+
+    if (commit && !r) {
+	/* Check how big the resulting file is */
+	if (fstat(b->fd, &sbuf) < 0) {
+	    syslog(LOG_ERR, "IOERROR: stating %s: %m", b->newfname);
+	    r = IMAP_IOERROR;
+	}
+	else if (sizep)
+	    *sizep = sbuf.st_size;
+    }
+
+    if (b->fd >= 0 && close(b->fd) < 0 && commit && !r) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", b->newfname);
+	r = IMAP_IOERROR;
+    }
+
+    /* OK, we successfully created the index under the temporary file name.
+       Let's rename it to make it the real index. */
+    if (commit && !r && mailbox_meta_rename(b->mailbox, META_SQUAT) < 0) {
+	syslog(LOG_ERR, "IOERROR: renaming %s: %m", b->newfname);
+	r = IMAP_IOERROR;
+    }
+    if ((!commit || r) && b->fd >= 0)
+	unlink(b->newfname);
+
+    if (b->old_index)
+	squat_search_close(b->old_index);
+    if (b->old_fd >= 0)
+	close(b->old_fd);
+    uid_list_free(&b->old_uids);
+    free(b->newfname);
+    free(b);
+
+    return r;
+}
+
+EXPORTED const struct search_engine squat_search_engine = {
+    "squat",
+    META_SQUAT,
+    squat_begin_update,
+    squat_foreach_indexed,
+    squat_delete_uid,
+    squat_receiver,
+    squat_end_update,
+    squat_open,
+    squat_foreach_uid,
+    squat_find,
+    squat_close
+};
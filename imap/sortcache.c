@@ -0,0 +1,616 @@
+/* sortcache.c -- per-mailbox cache of SORT and THREAD keys
+ *
+ * Copyright (c) 1994-2014 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The sort cache lives next to cyrus.index and holds the keys that
+ * index_msgdata_load() would otherwise have to parse out of
+ * cyrus.cache for every SORT and THREAD command.
+ *
+ * Format (all integers in network byte order):
+ *
+ *   header:  16 bytes magic
+ *             4 bytes version
+ *             4 bytes uidvalidity
+ *             4 bytes offset of the end of the committed entries
+ *             4 bytes number of committed entries
+ *
+ *   entry:    4 bytes uid
+ *             4 bytes length of the whole entry, a multiple of 4
+ *             4 bytes sent date (gmtime)
+ *             4 bytes hash of the extracted subject
+ *             4 bytes flags
+ *             4 bytes number of references
+ *             the extracted subject, from, to, cc, display-from,
+ *             display-to and message-id keys, then each of the
+ *             message's references (or its in-reply-to), all NUL
+ *             terminated, then NUL padding
+ *
+ * Entries are kept in ascending UID order.  New entries are appended
+ * and the header updated afterwards, so a reader never sees a partial
+ * entry; anything else (out of order UIDs, compaction, a damaged file)
+ * writes a complete new file and renames it into place.  Nothing is
+ * ever fsync()ed: the file can always be rebuilt from cyrus.cache.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <syslog.h>
+
+#include "cyr_lock.h"
+#include "imap/imap_err.h"
+#include "map.h"
+#include "retry.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#include "sortcache.h"
+
+#define SORTCACHE_MAGIC "\241\002sortcache file"
+#define SORTCACHE_MAGIC_SIZE 16
+#define SORTCACHE_VERSION 2
+
+#define HDR_VERSION 16
+#define HDR_UIDVALIDITY 20
+#define HDR_END 24
+#define HDR_COUNT 28
+#define HEADER_SIZE 32
+
+#define ENTRY_UID 0
+#define ENTRY_LEN 4
+#define ENTRY_GMTIME 8
+#define ENTRY_XSUBJ_HASH 12
+#define ENTRY_FLAGS 16
+#define ENTRY_NREFS 20
+#define ENTRY_STRINGS 24
+#define ENTRY_NSTRINGS 7
+
+#define ENTRY_IS_REFWD (1<<0)
+
+/* rewrite the file once it holds more than twice as many entries
+ * as the mailbox has messages, plus this many */
+#define SORTCACHE_SLACK 1024
+
+/* size of the chunks a rewrite is written out in */
+#define SORTCACHE_WRITESIZE (64*1024)
+
+#define GET32(p) ntohl(*((bit32 *)(p)))
+
+struct sortcache {
+    char *fname;
+    char *newfname;
+    char *mboxname;
+    uint32_t uidvalidity;
+    int fd;
+    int readonly;
+    ino_t ino;
+
+    const char *base;		/* mapped file */
+    size_t len;			/* size of the mapping */
+    size_t size;		/* size of the file */
+
+    int valid;			/* header matches this mailbox */
+    int broken;			/* a bad entry stopped the parse */
+    size_t end;			/* end of the entries parsed so far */
+    uint32_t count;
+    uint32_t alloc;
+    uint32_t *uids;
+    uint32_t *offsets;
+
+    struct buf pending;		/* serialised entries not yet written */
+    uint32_t npending;
+};
+
+/* an entry in the file or in the pending buffer */
+struct sortcache_rec {
+    uint32_t uid;
+    const char *base;
+    uint32_t len;
+};
+
+static void sortcache_reset(struct sortcache *sc)
+{
+    sc->valid = 0;
+    sc->broken = 0;
+    sc->end = HEADER_SIZE;
+    sc->count = 0;
+}
+
+static void sortcache_grow(struct sortcache *sc, uint32_t want)
+{
+    if (want <= sc->alloc) return;
+
+    sc->alloc = want < 2 * sc->alloc ? 2 * sc->alloc : want;
+    if (sc->alloc < 64) sc->alloc = 64;
+    sc->uids = xrealloc(sc->uids, sc->alloc * sizeof(uint32_t));
+    sc->offsets = xrealloc(sc->offsets, sc->alloc * sizeof(uint32_t));
+}
+
+/* index any committed entries past sc->end */
+static void sortcache_parse(struct sortcache *sc)
+{
+    const char *p, *q, *nul, *limit;
+    uint32_t uid, reclen, end, nstrings, i;
+
+    if (sc->size < HEADER_SIZE ||
+	memcmp(sc->base, SORTCACHE_MAGIC, SORTCACHE_MAGIC_SIZE) ||
+	GET32(sc->base + HDR_VERSION) != SORTCACHE_VERSION ||
+	GET32(sc->base + HDR_UIDVALIDITY) != sc->uidvalidity) {
+	sortcache_reset(sc);
+	return;
+    }
+
+    end = GET32(sc->base + HDR_END);
+    if (end < HEADER_SIZE || end > sc->size) {
+	sortcache_reset(sc);
+	return;
+    }
+
+    /* the file only ever grows in place */
+    if (end < sc->end) sortcache_reset(sc);
+
+    sc->valid = 1;
+    if (sc->broken) return;
+
+    sortcache_grow(sc, GET32(sc->base + HDR_COUNT));
+
+    while (sc->end < end) {
+	p = sc->base + sc->end;
+	if (end - sc->end < ENTRY_STRINGS) goto bad;
+
+	uid = GET32(p + ENTRY_UID);
+	reclen = GET32(p + ENTRY_LEN);
+	if (reclen < ENTRY_STRINGS || (reclen & 3) ||
+	    reclen > end - sc->end) goto bad;
+	if (sc->count && uid <= sc->uids[sc->count-1]) goto bad;
+
+	limit = p + reclen;
+	nstrings = ENTRY_NSTRINGS + GET32(p + ENTRY_NREFS);
+	if (nstrings > reclen) goto bad;
+	for (i = 0, q = p + ENTRY_STRINGS; i < nstrings; i++, q = nul + 1) {
+	    nul = memchr(q, '\0', limit - q);
+	    if (!nul) goto bad;
+	}
+
+	sortcache_grow(sc, sc->count + 1);
+	sc->uids[sc->count] = uid;
+	sc->offsets[sc->count] = sc->end;
+	sc->count++;
+	sc->end += reclen;
+    }
+
+    return;
+
+ bad:
+    syslog(LOG_NOTICE, "sortcache: %s: bad entry at offset %lu, will rebuild",
+	   sc->fname, (unsigned long) sc->end);
+    sc->broken = 1;
+}
+
+/* (re)map the file behind sc->fd and pick up new entries */
+static int sortcache_map(struct sortcache *sc)
+{
+    struct stat sbuf;
+
+    if (fstat(sc->fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstating sortcache %s: %m", sc->fname);
+	return IMAP_IOERROR;
+    }
+
+    if (sbuf.st_ino != sc->ino) {
+	/* a different file: nothing we know about it holds */
+	map_free(&sc->base, &sc->len);
+	sortcache_reset(sc);
+	sc->ino = sbuf.st_ino;
+    }
+
+    sc->size = sbuf.st_size;
+    if (sc->size)
+	map_refresh(sc->fd, 0, &sc->base, &sc->len, sc->size,
+		    "sortcache", sc->mboxname);
+
+    sortcache_parse(sc);
+
+    return 0;
+}
+
+EXPORTED int sortcache_open(struct mailbox *mailbox, struct sortcache **scp)
+{
+    struct sortcache *sc;
+    int r;
+
+    sc = xzmalloc(sizeof(struct sortcache));
+    sc->fname = xstrdup(mailbox_meta_fname(mailbox, META_SORTCACHE));
+    sc->newfname = xstrdup(mailbox_meta_newfname(mailbox, META_SORTCACHE));
+    sc->mboxname = xstrdup(mailbox->name);
+    sc->uidvalidity = mailbox->i.uidvalidity;
+    sortcache_reset(sc);
+
+    sc->fd = open(sc->fname, O_RDWR | O_CREAT, 0666);
+    if (sc->fd == -1 && (errno == EACCES || errno == EROFS)) {
+	/* we can still use what someone else has written */
+	sc->fd = open(sc->fname, O_RDONLY, 0);
+	sc->readonly = 1;
+    }
+    if (sc->fd == -1) {
+	syslog(LOG_ERR, "IOERROR: opening sortcache %s: %m", sc->fname);
+	sortcache_close(&sc);
+	return IMAP_IOERROR;
+    }
+
+    r = sortcache_map(sc);
+    if (r) {
+	sortcache_close(&sc);
+	return r;
+    }
+
+    *scp = sc;
+    return 0;
+}
+
+EXPORTED int sortcache_refresh(struct sortcache *sc)
+{
+    struct stat sbuf;
+    int fd;
+
+    /* has it been rewritten behind our back? */
+    if (stat(sc->fname, &sbuf) == 0 && sbuf.st_ino != sc->ino) {
+	fd = open(sc->fname, sc->readonly ? O_RDONLY : O_RDWR, 0);
+	if (fd != -1) {
+	    dup2(fd, sc->fd);
+	    close(fd);
+	}
+    }
+
+    return sortcache_map(sc);
+}
+
+EXPORTED int sortcache_lookup(struct sortcache *sc, uint32_t uid,
+			      struct sortcache_entry *entry)
+{
+    uint32_t lo = 0, hi = sc->count, mid;
+    const char *p, *s;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (sc->uids[mid] < uid) lo = mid + 1;
+	else hi = mid;
+    }
+    if (lo == sc->count || sc->uids[lo] != uid)
+	return IMAP_NOTFOUND;
+
+    p = sc->base + sc->offsets[lo];
+    entry->uid = uid;
+    entry->gmtime = GET32(p + ENTRY_GMTIME);
+    entry->xsubj_hash = GET32(p + ENTRY_XSUBJ_HASH);
+    entry->is_refwd = (GET32(p + ENTRY_FLAGS) & ENTRY_IS_REFWD) ? 1 : 0;
+
+    s = p + ENTRY_STRINGS;
+    entry->xsubj = s;
+    s += strlen(s) + 1;
+    entry->from = s;
+    s += strlen(s) + 1;
+    entry->to = s;
+    s += strlen(s) + 1;
+    entry->cc = s;
+    s += strlen(s) + 1;
+    entry->displayfrom = s;
+    s += strlen(s) + 1;
+    entry->displayto = s;
+    s += strlen(s) + 1;
+    entry->msgid = s;
+    s += strlen(s) + 1;
+    entry->nrefs = GET32(p + ENTRY_NREFS);
+    entry->refs = s;
+
+    return 0;
+}
+
+static void sortcache_putstr(struct buf *buf, const char *s)
+{
+    if (!s) s = "";
+    buf_appendmap(buf, s, strlen(s) + 1);
+}
+
+EXPORTED void sortcache_add(struct sortcache *sc,
+			    const struct sortcache_entry *entry)
+{
+    size_t start = sc->pending.len;
+    bit32 hdr[ENTRY_STRINGS / 4];
+    const char *ref;
+    unsigned i;
+
+    hdr[ENTRY_UID / 4] = htonl(entry->uid);
+    hdr[ENTRY_LEN / 4] = 0;
+    hdr[ENTRY_GMTIME / 4] = htonl((bit32) entry->gmtime);
+    hdr[ENTRY_XSUBJ_HASH / 4] = htonl(entry->xsubj_hash);
+    hdr[ENTRY_FLAGS / 4] = htonl(entry->is_refwd ? ENTRY_IS_REFWD : 0);
+    hdr[ENTRY_NREFS / 4] = htonl(entry->nrefs);
+    buf_appendmap(&sc->pending, (const char *) hdr, ENTRY_STRINGS);
+
+    sortcache_putstr(&sc->pending, entry->xsubj);
+    sortcache_putstr(&sc->pending, entry->from);
+    sortcache_putstr(&sc->pending, entry->to);
+    sortcache_putstr(&sc->pending, entry->cc);
+    sortcache_putstr(&sc->pending, entry->displayfrom);
+    sortcache_putstr(&sc->pending, entry->displayto);
+    sortcache_putstr(&sc->pending, entry->msgid);
+    for (i = 0, ref = entry->refs; i < entry->nrefs; i++) {
+	sortcache_putstr(&sc->pending, ref);
+	ref += strlen(ref) + 1;
+    }
+    while (sc->pending.len & 3)
+	buf_putc(&sc->pending, '\0');
+
+    *((bit32 *)(sc->pending.s + start + ENTRY_LEN)) =
+	htonl(sc->pending.len - start);
+    sc->npending++;
+}
+
+static int sortcache_bloated(struct sortcache *sc, unsigned nlive)
+{
+    return (nlive && sc->count > 2 * nlive + SORTCACHE_SLACK);
+}
+
+static int sortcache_islive(uint32_t uid, const uint32_t *live, unsigned nlive)
+{
+    unsigned lo = 0, hi = nlive, mid;
+
+    /* anything newer than the caller's view of the mailbox is kept */
+    if (!live || !nlive || uid > live[nlive-1]) return 1;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (live[mid] < uid) lo = mid + 1;
+	else hi = mid;
+    }
+
+    return (lo < nlive && live[lo] == uid);
+}
+
+static int rec_compare(const void *a, const void *b)
+{
+    const struct sortcache_rec *r1 = (const struct sortcache_rec *) a;
+    const struct sortcache_rec *r2 = (const struct sortcache_rec *) b;
+
+    return (r1->uid < r2->uid) ? -1 : (r1->uid > r2->uid) ? 1 : 0;
+}
+
+static void sortcache_header(char *hdr, uint32_t uidvalidity,
+			     uint32_t end, uint32_t count)
+{
+    memset(hdr, 0, HEADER_SIZE);
+    memcpy(hdr, SORTCACHE_MAGIC, SORTCACHE_MAGIC_SIZE);
+    *((bit32 *)(hdr + HDR_VERSION)) = htonl(SORTCACHE_VERSION);
+    *((bit32 *)(hdr + HDR_UIDVALIDITY)) = htonl(uidvalidity);
+    *((bit32 *)(hdr + HDR_END)) = htonl(end);
+    *((bit32 *)(hdr + HDR_COUNT)) = htonl(count);
+}
+
+/* add the new entries to the end of the file, then commit them by
+ * updating the header */
+static int sortcache_append(struct sortcache *sc,
+			    struct sortcache_rec *pend, unsigned npend)
+{
+    struct buf out = BUF_INITIALIZER;
+    char hdr[HEADER_SIZE];
+    unsigned i;
+    int r = 0;
+
+    for (i = 0; i < npend; i++)
+	buf_appendmap(&out, pend[i].base, pend[i].len);
+
+    sortcache_header(hdr, sc->uidvalidity, sc->end + out.len,
+		     sc->count + npend);
+
+    if (lseek(sc->fd, sc->end, SEEK_SET) == -1 ||
+	retry_write(sc->fd, out.s, out.len) != (ssize_t) out.len ||
+	lseek(sc->fd, HDR_END, SEEK_SET) == -1 ||
+	retry_write(sc->fd, hdr + HDR_END, HEADER_SIZE - HDR_END) !=
+	    HEADER_SIZE - HDR_END) {
+	syslog(LOG_ERR, "IOERROR: writing sortcache %s: %m", sc->fname);
+	r = IMAP_IOERROR;
+    }
+
+    buf_free(&out);
+    return r;
+}
+
+/* write a new file holding the live entries we have plus the new ones */
+static int sortcache_rewrite(struct sortcache *sc,
+			     struct sortcache_rec *pend, unsigned npend,
+			     const uint32_t *live, unsigned nlive)
+{
+    struct buf out = BUF_INITIALIZER;
+    char hdr[HEADER_SIZE];
+    struct sortcache_rec rec;
+    uint32_t end = HEADER_SIZE, count = 0;
+    unsigned i = 0, j = 0;
+    int fd, r = 0;
+
+    fd = open(sc->newfname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", sc->newfname);
+	return IMAP_IOERROR;
+    }
+
+    /* header goes in once we know where the entries end */
+    sortcache_header(hdr, sc->uidvalidity, 0, 0);
+    buf_appendmap(&out, hdr, HEADER_SIZE);
+
+    while (i < sc->count || j < npend) {
+	if (j == npend || (i < sc->count && sc->uids[i] < pend[j].uid)) {
+	    rec.uid = sc->uids[i];
+	    rec.base = sc->base + sc->offsets[i];
+	    rec.len = GET32(rec.base + ENTRY_LEN);
+	    i++;
+	    if (!sortcache_islive(rec.uid, live, nlive)) continue;
+	}
+	else {
+	    rec = pend[j++];
+	    /* already had it */
+	    if (i < sc->count && sc->uids[i] == rec.uid) continue;
+	}
+
+	buf_appendmap(&out, rec.base, rec.len);
+	end += rec.len;
+	count++;
+
+	if (out.len >= SORTCACHE_WRITESIZE) {
+	    if (retry_write(fd, out.s, out.len) != (ssize_t) out.len) {
+		r = IMAP_IOERROR;
+		goto done;
+	    }
+	    buf_reset(&out);
+	}
+    }
+
+    if (out.len && retry_write(fd, out.s, out.len) != (ssize_t) out.len) {
+	r = IMAP_IOERROR;
+	goto done;
+    }
+
+    sortcache_header(hdr, sc->uidvalidity, end, count);
+    if (lseek(fd, 0, SEEK_SET) == -1 ||
+	retry_write(fd, hdr, HEADER_SIZE) != HEADER_SIZE) {
+	r = IMAP_IOERROR;
+	goto done;
+    }
+
+ done:
+    if (r) syslog(LOG_ERR, "IOERROR: writing %s: %m", sc->newfname);
+    close(fd);
+
+    if (!r && rename(sc->newfname, sc->fname) == -1) {
+	syslog(LOG_ERR, "IOERROR: renaming %s: %m", sc->newfname);
+	r = IMAP_IOERROR;
+    }
+    if (r) unlink(sc->newfname);
+
+    buf_free(&out);
+    return r;
+}
+
+EXPORTED int sortcache_commit(struct sortcache *sc,
+			      const uint32_t *live, unsigned nlive)
+{
+    struct sortcache_rec *pend = NULL;
+    struct sortcache_entry entry;
+    const char *failaction;
+    const char *p;
+    unsigned npend = 0;
+    int r = 0;
+
+    if (!sc->npending && !sortcache_bloated(sc, nlive))
+	return 0;
+
+    if (sc->readonly) goto done;
+
+    if (lock_reopen(sc->fd, sc->fname, NULL, &failaction) < 0) {
+	syslog(LOG_ERR, "IOERROR: %s sortcache %s: %m",
+	       failaction, sc->fname);
+	r = IMAP_IOERROR;
+	goto done;
+    }
+
+    /* someone else may have got in first */
+    r = sortcache_map(sc);
+    if (r) goto unlock;
+
+    if (sc->npending) {
+	pend = xmalloc(sc->npending * sizeof(struct sortcache_rec));
+	for (p = sc->pending.s; p < sc->pending.s + sc->pending.len;
+	     p += GET32(p + ENTRY_LEN)) {
+	    pend[npend].uid = GET32(p + ENTRY_UID);
+	    pend[npend].base = p;
+	    pend[npend].len = GET32(p + ENTRY_LEN);
+	    if (sortcache_lookup(sc, pend[npend].uid, &entry))
+		npend++;
+	}
+	qsort(pend, npend, sizeof(struct sortcache_rec), rec_compare);
+    }
+
+    if (!sc->valid || sc->broken || sortcache_bloated(sc, nlive) ||
+	(npend && sc->count && pend[0].uid <= sc->uids[sc->count-1]))
+	r = sortcache_rewrite(sc, pend, npend, live, nlive);
+    else if (npend)
+	r = sortcache_append(sc, pend, npend);
+
+ unlock:
+    lock_unlock(sc->fd, sc->fname);
+
+ done:
+    free(pend);
+    buf_reset(&sc->pending);
+    sc->npending = 0;
+
+    return r;
+}
+
+EXPORTED void sortcache_close(struct sortcache **scp)
+{
+    struct sortcache *sc = *scp;
+
+    if (!sc) return;
+
+    map_free(&sc->base, &sc->len);
+    if (sc->fd != -1) close(sc->fd);
+    buf_free(&sc->pending);
+    free(sc->uids);
+    free(sc->offsets);
+    free(sc->fname);
+    free(sc->newfname);
+    free(sc->mboxname);
+    free(sc);
+
+    *scp = NULL;
+}
@@ -0,0 +1,97 @@
+/* sortcache.h -- per-mailbox cache of SORT and THREAD keys
+ *
+ * Copyright (c) 1994-2014 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef INCLUDED_SORTCACHE_H
+#define INCLUDED_SORTCACHE_H
+
+#include <sys/types.h>
+
+#include "mailbox.h"
+
+/* The sort and thread keys of one message.  The strings are in the
+ * same form index_msgdata_load() produces them, with "" standing in
+ * for NULL (including a missing Message-ID).
+ * Entries returned by sortcache_lookup() point into the mapped file
+ * and are only valid until the next sortcache_refresh(),
+ * sortcache_commit() or sortcache_close(). */
+struct sortcache_entry {
+    uint32_t uid;
+    time_t gmtime;
+    unsigned xsubj_hash;
+    int is_refwd;
+    const char *xsubj;
+    const char *from;
+    const char *to;
+    const char *cc;
+    const char *displayfrom;
+    const char *displayto;
+    const char *msgid;
+    unsigned nrefs;
+    const char *refs;		/* 'nrefs' NUL-terminated message-ids,
+				   back to back */
+};
+
+struct sortcache;
+
+/* open (creating if need be) the sort key cache of 'mailbox' */
+extern int sortcache_open(struct mailbox *mailbox, struct sortcache **scp);
+
+/* pick up entries written by other processes since we last looked */
+extern int sortcache_refresh(struct sortcache *sc);
+
+/* returns 0 and fills in 'entry' if there are keys for 'uid' */
+extern int sortcache_lookup(struct sortcache *sc, uint32_t uid,
+			    struct sortcache_entry *entry);
+
+/* queue keys for a message which wasn't in the cache */
+extern void sortcache_add(struct sortcache *sc,
+			  const struct sortcache_entry *entry);
+
+/* write out the queued keys.  'live' is the sorted list of UIDs still
+ * in the mailbox; if the file is mostly dead entries it is rewritten
+ * with only those (and anything newer) */
+extern int sortcache_commit(struct sortcache *sc,
+			    const uint32_t *live, unsigned nlive);
+
+extern void sortcache_close(struct sortcache **scp);
+
+#endif /* INCLUDED_SORTCACHE_H */
@@ -64,6 +64,7 @@ struct _SquatSearchIndex {
   char const* doc_ID_list;            /* where does the doc-ID-list
 					 array start in memory */
   char const* data_end;               /* the end of the mmaped file */
+  int         version;                /* the index format version */
   unsigned char valid_char_bits[32];  /* which characters are valid in
 					 queries according to whoever
 					 created the index */
@@ -124,8 +125,13 @@ EXPORTED SquatSearchIndex* squat_search_open(int fd) {
   doc_ID_list_offset = squat_decode_64(header->doc_ID_list_offset);
 
   /* Do some sanity checking in case the header was corrupted. We wouldn't
-     want to dereference any bad pointers... */
-  if (memcmp(header->header_text, squat_index_file_header, 8) != 0
+     want to dereference any bad pointers... The header text only differs
+     between versions in the version digit. */
+  index->version = header->header_text[6] - '0';
+  if (memcmp(header->header_text, squat_index_file_header, 6) != 0
+      || header->header_text[7] != '\n'
+      || index->version < SQUAT_FORMAT_VERSION_MIN
+      || index->version > SQUAT_FORMAT_VERSION
       || doc_list_offset < 0 || doc_list_offset >= data_len
       || word_list_offset < 0 || word_list_offset >= data_len
       || doc_ID_list_offset < 0 || doc_ID_list_offset >= data_len
@@ -248,14 +254,7 @@ static char const* lookup_word_docs(SquatSearchIndex* index,
       /* leaf case. We need to scan through the document lists for each
          leaf to skip. */
       while (skip-- > 0) {
-        char const* t = s;
-        int v = (int)squat_decode_I(&t);
-          
-        if ((v & 1) != 0) {
-          s = t;  /* singleton; no more data to eat for this word */
-        } else {
-          s = t + (v >> 1); /* run-list; size is in v>>1 */
-        }
+        s = squat_skip_doc_list(s, index->version);
       }
     }
     /* s now points at the trie branch for the data */
@@ -264,48 +263,28 @@ static char const* lookup_word_docs(SquatSearchIndex* index,
   return s;
 }
 
-/* Get the pointer to the list of documents containing 'data' into
-   '*run_start', and return the number of documents in the list. */
-static int count_docs_containing_word(SquatSearchIndex* index,
-  char const* data, char const** run_start) {
+/* Open a cursor on the list of documents containing the word 'data',
+   and return the number of documents in the list. If there are none,
+   the cursor is left closed. Returns -1 if the index is corrupt. */
+static int open_docs_containing_word(SquatSearchIndex* index,
+  char const* data, SquatDocList* list) {
   int invalid_file = 0;
   char const* raw_doc_list = lookup_word_docs(index, data, &invalid_file);
-  int i;
 
   if (raw_doc_list == NULL) {
     return invalid_file ? -1 : 0;
   }
 
-  *run_start = raw_doc_list;
-
-  i = (int)squat_decode_I(&raw_doc_list);
-  if ((i & 1) != 0) {
-    return 1; /* singleton */
-  } else {
-    int size = i >> 1;
-    char const* s = raw_doc_list;
-    int count = 0;
-    
-    if (raw_doc_list + size >= index->data_end) {
-      return -1;
-    }
-
-    while (s - raw_doc_list < size) {
-      i = (int)squat_decode_I(&s);
-      if ((i & 1) == 1) {
-        count++;
-      } else {
-        count += i >> 1;
-        s = squat_decode_skip_I(s, 1);
-      }
-    }
-
-    if (raw_doc_list + size != s) {
-      return -1;
-    }
+  if (squat_doc_list_open(list, raw_doc_list, index->data_end,
+                          index->version) != SQUAT_OK) {
+    return -1;
+  }
 
-    return count;
+  if (list->count == 0) {
+    squat_doc_list_close(list);
   }
+
+  return list->count;
 }
 
 /* We store a set of documents in this little structure. The set
@@ -319,108 +298,31 @@ typedef struct {
   int index;       /* The index of the 'current' document within the array. */
 } SquatDocSet;
 
-/* Extract the list of documents containing the word 'data' into a
-   SquatDocSet. The list is extracted from the index file data
-   'doc_list' which refers to 'doc_count' documents.
-*/
-static int
-set_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
-			    SquatDocSet* set,
-			    char const* data __attribute__((unused)),
-			    int doc_count, char const* doc_list)
-{
+/* Extract the list of documents in 'list' into a SquatDocSet. */
+static void set_to_docs_containing_word(SquatDocSet* set,
+                                        SquatDocList* list) {
   int i;
 
-  set->array_len = doc_count;
+  set->array_len = list->count;
   set->array_data = (int*)xmalloc(sizeof(int)*set->array_len);
-  
-  i = (int)squat_decode_I(&doc_list);
-  if ((i & 1) != 0) {
-    set->array_data[0] = i >> 1;
-  } else {
-    int size = i >> 1;
-    char const* s = doc_list;
-    int last_doc = 0;
-    int j = 0;
-    
-    while (s - doc_list < size) {
-      i = (int)squat_decode_I(&s);
-      if ((i & 1) == 1) {
-        last_doc = set->array_data[j++] = last_doc + (i >> 1);
-      } else {
-        int count = i >> 1;
-        int delta = squat_decode_I(&s);
-
-        last_doc += delta;
-        set->array_data[j++] = last_doc;
-        while (--count > 0) {
-          last_doc++;
-          set->array_data[j++] = last_doc;
-        }
-      }
-    }
-  }
-
-  return SQUAT_OK;
-}
-
-/* Advance the "current document" in the set to the first document
-   with ID > 'doc'. Remove any documents found along the way that were
-   not 'doc'.
-*/
-static void filter_doc(SquatDocSet* set, int doc) {
-  int i = set->index;
-
-  while (i < set->array_len && set->array_data[i] < doc) {
-    /* this document is not in the currently filtered set */
-    set->array_data[i] = -1;
-    i++;
-  }
 
-  /* skip over the matched document, if we matched */
-  if (i < set->array_len && set->array_data[i] == doc) {
-    i++;
+  for (i = 0; i < set->array_len; i++) {
+    set->array_data[i] = squat_doc_list_next(list);
   }
-
-  set->index = i;
 }
 
-/* Remove from a SquatDocSet any documents not in the list of
-   documents containing the word 'data'. The list is extracted from
-   the index file data 'doc_list'.
-*/
-static void
-filter_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
-			       SquatDocSet* set,
-			       char const* data __attribute__((unused)),
-			       char const* doc_list)
-{
-  int i = (int)squat_decode_I(&doc_list);
-
-  set->index = 0;
+/* Remove from a SquatDocSet any documents not in 'list'. Only the
+   parts of 'list' which might hold documents still in the set are
+   decoded. */
+static void filter_to_docs_containing_word(SquatDocSet* set,
+                                           SquatDocList* list) {
+  int i;
 
-  if ((i & 1) != 0) {
-    filter_doc(set, i >> 1); 
-  } else {
-    int size = i >> 1;
-    char const* s = doc_list;
-    int last_doc = 0;
-    
-    while (s - doc_list < size) {
-      i = (int)squat_decode_I(&s);
-      if ((i & 1) == 1) {
-        filter_doc(set, last_doc += i >> 1);
-      } else {
-        int count = i >> 1;
-        int delta = squat_decode_I(&s);
-
-        last_doc += delta;
-        filter_doc(set, last_doc);
-        while (--count > 0) {
-          last_doc++;
-          filter_doc(set, last_doc);
-        }
-      }
+  for (i = 0; i < set->array_len; i++) {
+    if (set->array_data[i] >= 0
+        && !squat_doc_list_contains(list, set->array_data[i])) {
+      /* this document is not in the currently filtered set */
+      set->array_data[i] = -1;
     }
   }
 }
@@ -463,6 +365,11 @@ static void destroy_docset(SquatDocSet* set) {
    through that list for each other subword, throwing out any
    documents that don't contain that subword.
 
+   Long document lists are stored in blocks with a skip table (see
+   squat_internal.h), so checking a document against a list only
+   unpacks the one block that could contain it, and blocks holding
+   none of the surviving documents are never unpacked at all.
+
    The only trick is that some subwords may occur in lots of documents
    while others only occur in a few (or no) documents. In that case we
    would rather construct the list with the smallest possible number
@@ -477,7 +384,8 @@ HIDDEN int squat_search_execute(SquatSearchIndex* index, char const* data,
   int min_doc_count;      /* The number of documents that include that
 			     subword */
   SquatDocSet set;
-  char const** run_starts;
+  SquatDocList* lists;
+  int nlists = 0;         /* The number of cursors opened in 'lists' */
 
   /* First, do sanity checking on the string. We wouldn't want invalid
      client searches to mysteriously return 'no documents'. */
@@ -496,38 +404,31 @@ HIDDEN int squat_search_execute(SquatSearchIndex* index, char const* data,
   }
 
   /* We search for every subword of the search string. We save a
-     pointer to the document list for each subword in this array
+     cursor on the document list for each subword in this array
      ... so we don't have to traverse the trie data structures more
      than once per subword.
   */
-  run_starts = (char const**)xmalloc(sizeof(char const*)*
-                                    (data_len - SQUAT_WORD_SIZE + 1));
+  lists = (SquatDocList*)xmalloc(sizeof(SquatDocList)*
+                                 (data_len - SQUAT_WORD_SIZE + 1));
   squat_set_last_error(SQUAT_ERR_OK);
 
   /* Now, for each subword, find its list of documents and how many
      documents are in the list. Remember the word which had minimum
      number of documents.
   */
-  min_doc_count = count_docs_containing_word(index, data, run_starts);
-  if (min_doc_count < 0) {
-    squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
-    goto cleanup_run_starts;
-  } else if (min_doc_count == 0) {
-      /* The first word of the substring isn't in any documents, so we
-	 can just stop now. */
-    goto cleanup_run_starts_ok;
-  }
+  min_doc_count = 0;
   min_doc_count_word = 0;
-  for (i = 1; i <= data_len - SQUAT_WORD_SIZE; i++) {
-    int doc_count = count_docs_containing_word(index, data + i,
-                                               run_starts + i);
+  for (i = 0; i <= data_len - SQUAT_WORD_SIZE; i++) {
+    int doc_count = open_docs_containing_word(index, data + i, lists + i);
     if (doc_count < 0) {
       squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
-      goto cleanup_run_starts;
+      goto cleanup_lists;
     } else if (doc_count == 0) {
       /* This word isn't in any documents, we can stop now. */
-      goto cleanup_run_starts_ok;
-    } else if (doc_count < min_doc_count) {
+      goto cleanup_lists_ok;
+    }
+    nlists++;
+    if (i == 0 || doc_count < min_doc_count) {
       min_doc_count = doc_count;
       min_doc_count_word = i;
     }
@@ -539,15 +440,12 @@ HIDDEN int squat_search_execute(SquatSearchIndex* index, char const* data,
      of documents, and we'd allocate a huge array and have to iterate
      through it all lots of times.
   */
-  if (set_to_docs_containing_word(index, &set, data + min_doc_count_word,
-        min_doc_count, run_starts[min_doc_count_word]) == SQUAT_ERR) {
-    goto cleanup_run_starts;
-  }
+  set_to_docs_containing_word(&set, lists + min_doc_count_word);
   /* Scan through the other document lists and throw out any documents
      that aren't in all those lists. */
   for (i = 0; i <= data_len - SQUAT_WORD_SIZE; i++) {
     if (i != min_doc_count_word) {
-      filter_to_docs_containing_word(index, &set, data + i, run_starts[i]);
+      filter_to_docs_containing_word(&set, lists + i);
     }
   }
 
@@ -563,7 +461,7 @@ HIDDEN int squat_search_execute(SquatSearchIndex* index, char const* data,
     /* Lookup the document info so we can get the document name to report. */
     next_doc = get_next_doc(&set);
     next_doc_info = index->doc_ID_list + next_doc*4;
-    if (next_doc < 0 && next_doc_info >= index->data_end) {
+    if (next_doc < 0 || next_doc_info >= index->data_end) {
       squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
       goto cleanup_docset;
     }
@@ -583,15 +481,21 @@ HIDDEN int squat_search_execute(SquatSearchIndex* index, char const* data,
 
   destroy_docset(&set);
 
-cleanup_run_starts_ok:
-  free(run_starts);
+cleanup_lists_ok:
+  while (nlists > 0) {
+    squat_doc_list_close(&lists[--nlists]);
+  }
+  free(lists);
   return SQUAT_OK;
 
 cleanup_docset:
   destroy_docset(&set);
 
-cleanup_run_starts:
-  free(run_starts);
+cleanup_lists:
+  while (nlists > 0) {
+    squat_doc_list_close(&lists[--nlists]);
+  }
+  free(lists);
   return SQUAT_ERR;
 }
 
@@ -632,42 +536,26 @@ EXPORTED int squat_search_close(SquatSearchIndex* index) {
  *
  */
 
-static int squat_scan_leaf(char const* doc_list, char *name,
+static int squat_scan_leaf(char const* doc_list, char const* data_end,
+                           int version, char *name,
                            SquatScanCallback handler, void* closure)
 {
-  int i;
+  SquatDocList list;
+  int doc;
 
-  i = (int)squat_decode_I(&doc_list);
-  if ((i & 1) != 0) {
-    handler(closure, name, i >> 1);
-  } else {
-    int size = i >> 1;
-    char const* s = doc_list;
-    int last_doc = 0;
-    
-    while (s - doc_list < size) {
-      i = (int)squat_decode_I(&s);
-      if ((i & 1) == 1) {
-        last_doc = last_doc + (i >> 1);
-        handler(closure, name, last_doc);
-      } else {
-        int count = i >> 1;
-        int delta = squat_decode_I(&s);
-              
-        last_doc += delta;
-        handler(closure, name, last_doc);
-        while (--count > 0) {
-          last_doc++;
-          handler(closure, name, last_doc);
-        }
-      }
-    }
+  if (squat_doc_list_open(&list, doc_list, data_end, version) != SQUAT_OK) {
+    return(SQUAT_ERR);
   }
+  while ((doc = squat_doc_list_next(&list)) >= 0) {
+    handler(closure, name, doc);
+  }
+  squat_doc_list_close(&list);
+
   return(SQUAT_OK);
 }
 
 static int squat_scan_recurse(char const* s, char const* data_end,
-                              char *name, int level,
+                              int version, char *name, int level,
                               SquatScanCallback handler, void* closure)
 {
   int r = SQUAT_OK;
@@ -696,9 +584,10 @@ static int squat_scan_recurse(char const* s, char const* data_end,
       if (next_offset < 0 || s >= data_end) {
         return(SQUAT_ERR);
       }
-      r = squat_scan_recurse(s, data_end, name, level+1, handler, closure);
+      r = squat_scan_recurse(s, data_end, version, name, level+1,
+                             handler, closure);
     } else {
-      r = squat_scan_leaf(s, name, handler, closure);
+      r = squat_scan_leaf(s, data_end, version, name, handler, closure);
     }
     return(r);
   }
@@ -744,21 +633,15 @@ static int squat_scan_recurse(char const* s, char const* data_end,
       if (next_offset < 0 || s >= data_end) {
         return(SQUAT_ERR);
       }
-      r = squat_scan_recurse(s, data_end, name, level+1, handler, closure);
+      r = squat_scan_recurse(s, data_end, version, name, level+1,
+                             handler, closure);
     } else {
       /* leaf case. We need to scan through the document lists for each
          leaf to skip. */
       while (skip-- > 0) {
-        char const* t = s;
-        int v = (int)squat_decode_I(&t);
-          
-        if ((v & 1) != 0) {
-          s = t;  /* singleton; no more data to eat for this word */
-        } else {
-          s = t + (v >> 1); /* run-list; size is in v>>1 */
-        }
+        s = squat_skip_doc_list(s, version);
       }
-      r = squat_scan_leaf(s, name, handler, closure);
+      r = squat_scan_leaf(s, data_end, version, name, handler, closure);
     }
   }
   return(r);
@@ -868,7 +751,8 @@ EXPORTED int squat_scan(SquatSearchIndex* index, char first_char,
   memset(buf, 0, sizeof(buf));
   buf[0] = first_char;
 
-  return(squat_scan_recurse(s, index->data_end, buf, 1, handler, closure));
+  return(squat_scan_recurse(s, index->data_end, index->version, buf, 1,
+                            handler, closure));
 }
 
 /* ====================================================================== */
@@ -945,6 +829,6 @@ EXPORTED int squat_count_docs(SquatSearchIndex* index, char first_char, int *cou
   memset(buf, 0, sizeof(buf));
   buf[0] = first_char;
 
-  return(squat_scan_recurse(s, index->data_end, buf, 1,
+  return(squat_scan_recurse(s, index->data_end, index->version, buf, 1,
                             squat_count_docs_callback, counter));
 }
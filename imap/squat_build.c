@@ -259,6 +259,12 @@ struct _SquatIndex {
 					 above buffer, measured in
 					 multiples of
 					 sizeof(SquatInt32) (i.e., 4) */
+  int* word_docs;                     /* Scratch array holding the
+					 document IDs of the word
+					 whose document list is being
+					 written out */
+  int word_docs_size;                 /* The allocated size of the
+					 above array */
   int current_doc_ID;                 /* The current document
 					 ID. Document IDs are numbered
 					 starting at zero and
@@ -484,6 +490,8 @@ SquatIndex *squat_index_init(int fd, const SquatOptions *options)
     index->doc_ID_list_size = 1000;
     index->doc_ID_list =
 	(char *)xmalloc(index->doc_ID_list_size * sizeof(SquatInt32));
+    index->word_docs = NULL;
+    index->word_docs_size = 0;
 
     /* Use a 128K write buffer for the main index file */
     if (init_write_buffer(&index->out, 128 * 1024, fd) != SQUAT_OK) {
@@ -1217,100 +1225,32 @@ static int dump_doc_list_docs(SquatIndex *index,
 	if (doc_list[i] != NULL) {
 	    WordDocEntry *first_doc;
 	    WordDocEntry *doc;
-	    int run_size = 0;	/* Bytes required to store the doclist for this word */
-	    int last_doc_ID;
-	    int run_seq_delta = 0;
-	    int run_seq_count;
 	    int doc_count = 0;	/* number of documents containing this word */
 	    char *buf;
 
+	    /* Gather the document IDs; the list is circular, starting
+	       with the successor of the entry in the table */
 	    doc = first_doc = doc_list[i]->next;
-
-	    last_doc_ID = 0;
-	    run_seq_count = 0;
-	    /* First compute the run_size bytes required to store the doclist */
 	    do {
-		if (doc->doc_ID == last_doc_ID + 1 && run_seq_count > 0) {
-		    run_seq_count++;
-		} else {
-		    if (run_seq_count > 0) {
-			if (run_seq_count > 1) {
-			    run_size +=
-				squat_count_encode_I(run_seq_count << 1)
-				+ squat_count_encode_I(run_seq_delta);
-			} else {
-			    run_size +=
-				squat_count_encode_I((run_seq_delta << 1) |
-						     1);
-			}
-		    }
-		    run_seq_count = 1;
-		    run_seq_delta = doc->doc_ID - last_doc_ID;
+		if (doc_count >= index->word_docs_size) {
+		    index->word_docs_size =
+			index->word_docs_size ? 2 * index->word_docs_size
+					      : 1024;
+		    index->word_docs =
+			(int *)xrealloc(index->word_docs,
+					index->word_docs_size * sizeof(int));
 		}
-		last_doc_ID = doc->doc_ID;
+		index->word_docs[doc_count++] = doc->doc_ID;
 		doc = doc->next;
-		doc_count++;
 	    } while (doc != first_doc);
-	    if (run_seq_count > 0) {
-		if (run_seq_count > 1) {
-		    run_size += squat_count_encode_I(run_seq_count << 1)
-			+ squat_count_encode_I(run_seq_delta);
-		} else {
-		    run_size +=
-			squat_count_encode_I((run_seq_delta << 1) | 1);
-		}
-	    }
 
-	    /* reserve more than enough space in the buffer */
-	    if ((buf = prepare_buffered_write(&index->out, 10 + run_size)) == NULL) {
+	    buf = prepare_buffered_write(&index->out,
+			squat_count_encode_doc_list(index->word_docs,
+						    doc_count));
+	    if (buf == NULL) {
 		return SQUAT_ERR;
 	    }
-
-	    /* If there's only one document, use singleton document format */
-	    if (doc_count == 1) {
-		buf = squat_encode_I(buf, (doc->doc_ID << 1) | 1);
-	    } else {
-		/* Store the entire document list, with its size first. */
-		buf = squat_encode_I(buf, run_size << 1);
-
-		last_doc_ID = 0;
-		run_seq_count = 0;
-		/* This logic should mirror the logic above that counts the bytes. */
-		do {
-		    if (doc->doc_ID == last_doc_ID + 1
-			&& run_seq_count > 0) {
-			run_seq_count++;
-		    } else {
-			if (run_seq_count > 0) {
-			    if (run_seq_count > 1) {
-				buf =
-				    squat_encode_I(buf,
-						   run_seq_count << 1);
-				buf = squat_encode_I(buf, run_seq_delta);
-			    } else {
-				buf =
-				    squat_encode_I(buf,
-						   (run_seq_delta << 1) |
-						   1);
-			    }
-			}
-			run_seq_count = 1;
-			run_seq_delta = doc->doc_ID - last_doc_ID;
-		    }
-		    last_doc_ID = doc->doc_ID;
-		    doc = doc->next;
-		} while (doc != first_doc);
-		if (run_seq_count > 0) {
-		    if (run_seq_count > 1) {
-			buf = squat_encode_I(buf, run_seq_count << 1);
-			buf = squat_encode_I(buf, run_seq_delta);
-		    } else {
-			buf =
-			    squat_encode_I(buf, (run_seq_delta << 1) | 1);
-		    }
-		}
-	    }
-
+	    buf = squat_encode_doc_list(buf, index->word_docs, doc_count);
 	    complete_buffered_write(&index->out, buf);
 	}
     }
@@ -1684,6 +1624,7 @@ cleanup:
     }
     free(index->tmp_path);
     free(index->doc_ID_list);
+    free(index->word_docs);
     doc_ID_map_free(&index->doc_ID_map);
     free(index);
 
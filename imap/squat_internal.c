@@ -42,12 +42,15 @@
  */
 
 #include "config.h"
+#include <limits.h>
+#include <string.h>
 #include "assert.h"
 #include "squat_internal.h"
+#include "xmalloc.h"
 
 static int last_err = SQUAT_ERR_OK;
 
-EXPORTED char const squat_index_file_header[8] = "SQUAT 1\n";
+EXPORTED char const squat_index_file_header[8] = "SQUAT 2\n";
 
 EXPORTED void squat_set_last_error(int err)
 {
@@ -112,7 +115,7 @@ EXPORTED SquatInt64 squat_decode_I(char const** s)
     return r;
 }
 
-HIDDEN char const *squat_decode_skip_I(char const* s, int num_to_skip)
+EXPORTED char const *squat_decode_skip_I(char const* s, int num_to_skip)
 {
     while (num_to_skip > 0) {
 	while ((*s & 0x80) != 0) {
@@ -201,3 +204,418 @@ EXPORTED char *squat_encode_I(char* s, SquatInt64 v64)
     return s + 2;
 }
 
+
+/* ====================================================================== */
+
+/* Document lists. See the format description in squat_internal.h. */
+
+/* Number of documents in block 'b' of a blocked list of 'count'. */
+static int block_doc_count(int count, int b)
+{
+    int n = count - b * SQUAT_DOC_BLOCK_SIZE;
+
+    return n < SQUAT_DOC_BLOCK_SIZE ? n : SQUAT_DOC_BLOCK_SIZE;
+}
+
+/* Number of bytes taken by the packed gaps of an 'n' document block. */
+static int block_data_size(int n, int width)
+{
+    return ((n - 1) * width + 7) / 8;
+}
+
+/* The number of bits needed to store every gap in the 'n' documents
+   starting at 'docs'. */
+static int block_width(int const* docs, int n)
+{
+    unsigned int bits = 0;
+    int i, width = 0;
+
+    for (i = 1; i < n; i++) {
+	bits |= (unsigned int)(docs[i] - docs[i - 1] - 1);
+    }
+    while (bits != 0) {
+	width++;
+	bits >>= 1;
+    }
+
+    return width;
+}
+
+static char *pack_gaps(char *s, int const* docs, int n, int width)
+{
+    unsigned long long acc = 0;
+    int nbits = 0;
+    int i;
+
+    for (i = 1; i < n; i++) {
+	acc |= (unsigned long long)(unsigned int)(docs[i] - docs[i - 1] - 1)
+	    << nbits;
+	nbits += width;
+	while (nbits >= 8) {
+	    *s++ = (char)(acc & 0xFF);
+	    acc >>= 8;
+	    nbits -= 8;
+	}
+    }
+    if (nbits > 0) {
+	*s++ = (char)acc;
+    }
+
+    return s;
+}
+
+/* Encode the <index-run-list> for 'docs', returning its size in
+   bytes. If 's' is NULL, just compute the size. */
+static int encode_runs(char *s, int const* docs, int count)
+{
+    int bytes = 0;
+    int last_doc = 0;
+    int i = 0;
+
+    while (i < count) {
+	int delta = docs[i] - last_doc;
+	int run = 1;
+
+	while (i + run < count && docs[i + run] == docs[i] + run) {
+	    run++;
+	}
+	if (run > 1) {
+	    bytes += squat_count_encode_I(run << 1)
+		+ squat_count_encode_I(delta);
+	    if (s) {
+		s = squat_encode_I(s, run << 1);
+		s = squat_encode_I(s, delta);
+	    }
+	} else {
+	    bytes += squat_count_encode_I((delta << 1) | 1);
+	    if (s) {
+		s = squat_encode_I(s, (delta << 1) | 1);
+	    }
+	}
+	last_doc = docs[i + run - 1];
+	i += run;
+    }
+
+    return bytes;
+}
+
+/* Encode the <index-block-list> for 'docs', returning its size in
+   bytes. If 's' is NULL, just compute the size. */
+static int encode_blocks(char *s, int const* docs, int count)
+{
+    int bytes = squat_count_encode_I(count);
+    int prev_last = -1;
+    int b;
+
+    if (s) {
+	s = squat_encode_I(s, count);
+    }
+
+    for (b = 0; b * SQUAT_DOC_BLOCK_SIZE < count; b++) {
+	int const* block = docs + b * SQUAT_DOC_BLOCK_SIZE;
+	int n = block_doc_count(count, b);
+	int gap = block[0] - prev_last - 1;
+	int span = block[n - 1] - block[0];
+
+	bytes += squat_count_encode_I(gap) + squat_count_encode_I(span) + 1;
+	if (s) {
+	    s = squat_encode_I(s, gap);
+	    s = squat_encode_I(s, span);
+	    *s++ = (char)block_width(block, n);
+	}
+	prev_last = block[n - 1];
+    }
+
+    for (b = 0; b * SQUAT_DOC_BLOCK_SIZE < count; b++) {
+	int const* block = docs + b * SQUAT_DOC_BLOCK_SIZE;
+	int n = block_doc_count(count, b);
+	int width = block_width(block, n);
+
+	bytes += block_data_size(n, width);
+	if (s) {
+	    s = pack_gaps(s, block, n, width);
+	}
+    }
+
+    return bytes;
+}
+
+EXPORTED int squat_count_encode_doc_list(int const* docs, int count)
+{
+    int size;
+
+    assert(count > 0);
+
+    if (count == 1) {
+	return squat_count_encode_I((docs[0] << 1) | 1);
+    } else if (count <= SQUAT_DOC_BLOCK_SIZE) {
+	size = encode_runs(NULL, docs, count);
+    } else {
+	size = encode_blocks(NULL, docs, count);
+    }
+
+    return squat_count_encode_I((SquatInt64)size << 2) + size;
+}
+
+EXPORTED char *squat_encode_doc_list(char *s, int const* docs, int count)
+{
+    int size;
+
+    assert(count > 0);
+
+    if (count == 1) {
+	return squat_encode_I(s, (docs[0] << 1) | 1);
+    } else if (count <= SQUAT_DOC_BLOCK_SIZE) {
+	size = encode_runs(NULL, docs, count);
+	s = squat_encode_I(s, (SquatInt64)size << 2);
+	encode_runs(s, docs, count);
+    } else {
+	size = encode_blocks(NULL, docs, count);
+	s = squat_encode_I(s, ((SquatInt64)size << 2) | 2);
+	encode_blocks(s, docs, count);
+    }
+
+    return s + size;
+}
+
+EXPORTED char const *squat_skip_doc_list(char const* s, int version)
+{
+    SquatInt64 v = squat_decode_I(&s);
+
+    if ((v & 1) != 0) {
+	return s;  /* singleton; no more data to eat for this word */
+    }
+
+    return s + (version < 2 ? v >> 1 : v >> 2);
+}
+
+/* Decode a whole <index-run-list> of 'size' bytes at 's' */
+static int open_runs(SquatDocList* list, char const* s, SquatInt64 size,
+		     char const* end)
+{
+    char const* limit = s + size;
+    char const* t = s;
+    SquatInt64 count = 0;
+    int last_doc = 0;
+    int j = 0;
+
+    if (size < 0 || size >= end - s) {
+	return SQUAT_ERR;
+    }
+
+    while (t < limit) {
+	SquatInt64 i = squat_decode_I(&t);
+
+	if ((i & 1) == 1) {
+	    count++;
+	} else {
+	    count += i >> 1;
+	    t = squat_decode_skip_I(t, 1);
+	}
+	if (count > INT_MAX) {
+	    return SQUAT_ERR;
+	}
+    }
+    if (t != limit) {
+	return SQUAT_ERR;
+    }
+
+    list->count = list->ndocs = (int)count;
+    list->docs = (int*)xmalloc(sizeof(int) * (count ? count : 1));
+
+    while (s < limit) {
+	int i = (int)squat_decode_I(&s);
+
+	if ((i & 1) == 1) {
+	    last_doc = list->docs[j++] = last_doc + (i >> 1);
+	} else {
+	    int run = i >> 1;
+
+	    last_doc += (int)squat_decode_I(&s);
+	    list->docs[j++] = last_doc;
+	    while (--run > 0) {
+		list->docs[j++] = ++last_doc;
+	    }
+	}
+    }
+
+    return SQUAT_OK;
+}
+
+/* Decode the skip table of the <index-block-list> of 'size' bytes at
+   's', checking that the blocks fill the list exactly. */
+static int open_blocks(SquatDocList* list, char const* s, SquatInt64 size,
+		       char const* end)
+{
+    char const* limit = s + size;
+    SquatInt64 count, prev_last = -1;
+    int b;
+
+    if (size <= 0 || size >= end - s) {
+	return SQUAT_ERR;
+    }
+
+    count = squat_decode_I(&s);
+    /* every skip table entry takes at least three bytes */
+    if (count <= 0 || count > INT_MAX
+	|| (count + SQUAT_DOC_BLOCK_SIZE - 1) / SQUAT_DOC_BLOCK_SIZE > size) {
+	return SQUAT_ERR;
+    }
+
+    list->count = (int)count;
+    list->nblocks = (list->count + SQUAT_DOC_BLOCK_SIZE - 1)
+	/ SQUAT_DOC_BLOCK_SIZE;
+    list->blocks = (SquatDocBlock*)xmalloc(sizeof(SquatDocBlock)
+					   * list->nblocks);
+
+    for (b = 0; b < list->nblocks; b++) {
+	SquatInt64 gap = squat_decode_I(&s);
+	SquatInt64 span = squat_decode_I(&s);
+	int width = (unsigned char)*s++;
+	int n = block_doc_count(list->count, b);
+
+	if (s > limit || gap < 0 || gap > INT_MAX || span < n - 1
+	    || span > INT_MAX || width > 31
+	    || prev_last + 1 + gap + span > INT_MAX) {
+	    return SQUAT_ERR;
+	}
+	list->blocks[b].first_doc = (int)(prev_last + 1 + gap);
+	list->blocks[b].last_doc = (int)(prev_last + 1 + gap + span);
+	list->blocks[b].width = width;
+	prev_last = list->blocks[b].last_doc;
+    }
+
+    for (b = 0; b < list->nblocks; b++) {
+	int bytes = block_data_size(block_doc_count(list->count, b),
+				    list->blocks[b].width);
+
+	if (limit - s < bytes) {
+	    return SQUAT_ERR;
+	}
+	list->blocks[b].data = s;
+	s += bytes;
+    }
+    if (s != limit) {
+	return SQUAT_ERR;
+    }
+
+    list->docs = (int*)xmalloc(sizeof(int) * SQUAT_DOC_BLOCK_SIZE);
+
+    return SQUAT_OK;
+}
+
+EXPORTED int squat_doc_list_open(SquatDocList* list, char const* s,
+				 char const* end, int version)
+{
+    SquatInt64 v = squat_decode_I(&s);
+    int r;
+
+    memset(list, 0, sizeof(*list));
+    list->cur_block = -1;
+
+    if (v < 0) {
+	r = SQUAT_ERR;
+    } else if ((v & 1) != 0) {
+	if ((v >> 1) > INT_MAX) {
+	    r = SQUAT_ERR;
+	} else {
+	    list->count = list->ndocs = 1;
+	    list->docs = (int*)xmalloc(sizeof(int));
+	    list->docs[0] = (int)(v >> 1);
+	    r = SQUAT_OK;
+	}
+    } else if (version < 2) {
+	r = open_runs(list, s, v >> 1, end);
+    } else if ((v & 3) == 0) {
+	r = open_runs(list, s, v >> 2, end);
+    } else {
+	r = open_blocks(list, s, v >> 2, end);
+    }
+
+    if (r != SQUAT_OK) {
+	squat_doc_list_close(list);
+	squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
+    }
+
+    return r;
+}
+
+/* Unpack block 'b' of a blocked list into list->docs. */
+static void load_block(SquatDocList* list, int b)
+{
+    SquatDocBlock const* block = &list->blocks[b];
+    unsigned char const* s = (unsigned char const*)block->data;
+    unsigned long long acc = 0;
+    unsigned int mask = (1U << block->width) - 1;
+    unsigned int doc = block->first_doc;
+    int n = block_doc_count(list->count, b);
+    int nbits = 0;
+    int i;
+
+    list->docs[0] = (int)doc;
+    for (i = 1; i < n; i++) {
+	while (nbits < block->width) {
+	    acc |= (unsigned long long)*s++ << nbits;
+	    nbits += 8;
+	}
+	doc += (unsigned int)(acc & mask) + 1;
+	acc >>= block->width;
+	nbits -= block->width;
+	list->docs[i] = (int)doc;
+    }
+
+    list->ndocs = n;
+    list->pos = 0;
+    list->cur_block = b;
+}
+
+EXPORTED int squat_doc_list_next(SquatDocList* list)
+{
+    while (list->pos >= list->ndocs) {
+	if (list->cur_block + 1 >= list->nblocks) {
+	    return -1;
+	}
+	load_block(list, list->cur_block + 1);
+    }
+
+    return list->docs[list->pos++];
+}
+
+EXPORTED int squat_doc_list_contains(SquatDocList* list, int doc)
+{
+    if (list->nblocks > 0) {
+	int lo = list->cur_block < 0 ? 0 : list->cur_block;
+	int hi = list->nblocks;
+
+	/* find the first block that ends at or after 'doc' */
+	while (lo < hi) {
+	    int mid = lo + (hi - lo) / 2;
+
+	    if (list->blocks[mid].last_doc < doc) {
+		lo = mid + 1;
+	    } else {
+		hi = mid;
+	    }
+	}
+	if (lo == list->nblocks || list->blocks[lo].first_doc > doc) {
+	    return 0;
+	}
+	if (lo != list->cur_block) {
+	    load_block(list, lo);
+	}
+    }
+
+    while (list->pos < list->ndocs && list->docs[list->pos] < doc) {
+	list->pos++;
+    }
+
+    return list->pos < list->ndocs && list->docs[list->pos] == doc;
+}
+
+EXPORTED void squat_doc_list_close(SquatDocList* list)
+{
+    free(list->blocks);
+    free(list->docs);
+    list->blocks = NULL;
+    list->docs = NULL;
+}
@@ -104,7 +104,7 @@
 /* The format of a SQUAT index file. This record is stored at the
    beginning of the file. */
 typedef struct {
-  char header_text[8];       /* "SQUAT 1\n" */
+  char header_text[8];       /* "SQUAT 2\n" ("SQUAT 1\n" is still read) */
   char doc_list_offset[8];   /* offset to a doc-list structure (see below) */
   char doc_ID_list_offset[8];/* offset to a doc-ID-list structure (see below) */
   char word_list_offset[8];  /* offset to a word-list structure (see below) */
@@ -155,6 +155,32 @@ typedef struct {
    The adjusted-run-length is the length of the run of consecutive indices
    shifted left one bit with the bottom bit set to 0.
 
+   That is the whole story for version 1 ("SQUAT 1\n") files. Version 2
+   files use the low two bits of the leading value to select between
+   three encodings, so that long lists can be counted and intersected
+   without decoding all of them:
+
+   <index-run> = I"adjusted-single-index"
+               | I"adjusted-run-size" <index-run-list>*
+               | I"adjusted-block-size" <index-block-list>
+   <index-block-list> = I"count" <block-skip>* <block-data>*
+   <block-skip> = I"first-index-gap" I"last-minus-first" 8"width"
+   <block-data> = the (n-1) gaps between consecutive indices of the block,
+                  each minus one, packed 'width' bits apiece starting at
+                  the least significant bit of the first byte
+
+   The adjusted-single-index is as before. The adjusted-run-size is the
+   run size shifted left two bits with the bottom bits set to 00, and is
+   used for lists of up to SQUAT_DOC_BLOCK_SIZE documents. Longer lists
+   use the adjusted-block-size, which is the size in bytes of the
+   <index-block-list> shifted left two bits with the bottom bits set to
+   10. The documents are split into blocks of SQUAT_DOC_BLOCK_SIZE (the
+   last block may be shorter), and the skip table records the first and
+   last index of every block. The first-index-gap is the distance from
+   the last index of the previous block (or -1, for the first block),
+   minus one. Each <block-data> occupies ((n-1)*width+7)/8 bytes, so the
+   skip table alone is enough to locate any block.
+
    The last SQUAT_SAFETY_ZONE bytes of the index file must be 0.
    This helps protect us against corrupt index files.
 */
@@ -193,4 +219,57 @@ char* squat_encode_I(char* s, SquatInt64 v);
 /* We return the number of bytes required to encode the given value. */
 int squat_count_encode_I(SquatInt64 v64);
 
+/* The index format version we write, and the oldest one we can read. */
+#define SQUAT_FORMAT_VERSION 2
+#define SQUAT_FORMAT_VERSION_MIN 1
+
+/* Number of documents in each block of a blocked document list. */
+#define SQUAT_DOC_BLOCK_SIZE 128
+
+/* Encode the 'count' (> 0) strictly increasing document IDs in 'docs'
+   as a current-format document list. squat_count_encode_doc_list
+   returns the exact number of bytes squat_encode_doc_list will
+   write; squat_encode_doc_list returns a pointer past the list. */
+int squat_count_encode_doc_list(int const* docs, int count);
+char* squat_encode_doc_list(char* s, int const* docs, int count);
+
+/* Return a pointer past the document list at 's' in an index of the
+   given format version, without decoding it. */
+char const* squat_skip_doc_list(char const* s, int version);
+
+typedef struct {
+  int first_doc;             /* first document ID in the block */
+  int last_doc;              /* last document ID in the block */
+  int width;                 /* bits per packed gap */
+  char const* data;          /* the packed gaps */
+} SquatDocBlock;
+
+/* A cursor over one document list in an index. Short lists are
+   decoded in full when the cursor is opened; blocked lists only have
+   their skip table decoded, and each block is unpacked the first
+   time the cursor needs it. */
+typedef struct {
+  int count;                 /* number of documents in the list */
+  int nblocks;               /* 0 unless this is a blocked list */
+  SquatDocBlock* blocks;
+  int cur_block;             /* block held in 'docs', or -1 */
+  int* docs;                 /* decoded document IDs */
+  int ndocs;
+  int pos;                   /* cursor position within 'docs' */
+} SquatDocList;
+
+/* Open a cursor on the document list at 's', which must end before
+   'end'. Returns SQUAT_ERR (with SQUAT_ERR_INVALID_INDEX_FILE) if the
+   list is malformed. */
+int squat_doc_list_open(SquatDocList* list, char const* s,
+                        char const* end, int version);
+/* Return the next document ID in the list, or -1 when there are no
+   more. */
+int squat_doc_list_next(SquatDocList* list);
+/* Return 1 if 'doc' is in the list, 0 if not. Successive calls must
+   pass increasing document IDs; blocks which cannot contain them are
+   skipped over without being unpacked. */
+int squat_doc_list_contains(SquatDocList* list, int doc);
+void squat_doc_list_close(SquatDocList* list);
+
 #endif
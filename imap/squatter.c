@@ -1,4 +1,4 @@
-/* squatter.c -- SQUAT-based message indexing tool
+/* squatter.c -- message indexing tool
  *
  * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
  *
@@ -41,30 +41,17 @@
  */
 
 /*
-  This is the tool that creates SQUAT indexes for Cyrus mailboxes.
-
-  SQUAT index files are organised as follows:
-
-  There is (at most) one index file for each Cyrus mailbox, named
-  "cyrus.squat", stored in the mailbox directory.
-
-  Source documents are named 'xUID' where UID is the numeric UID of a
-  message and x is a character denoting a part of the message: 'f' ==
-  FROM, 't' == TO, 'b' == BCC, 'c' == CC, 's' == SUBJECT, 'h' == other
-  headers, 'm' == the body. So, a messge with UID 331 could give rise
-  to several source documents named "f331", "t331", "b331", "c331",
-  "s331", "h331"  and "m331".
-
-  There is also a special source document named "validity.N" where N
-  is the validitity nonce for the mailbox. We use this to detect when
-  the UIDs have been renumbered since we created the index (in which
-  case the index is useless and is ignored).
-
-  This tool creates new indexes for one or more mailboxes. (We do not
-  support incremental updates to an index yet.) The index is created
-  in "cyrus.squat.tmp" and then, if creation was successful, it is
-  atomically renamed to "cyrus.squat". This guarantees that we don't
-  interfere with anyone who has the old index open.
+  This is the tool that creates search indexes for Cyrus mailboxes,
+  using the engine chosen by the "search_engine" option (see
+  search_engines.h).  Each engine keeps (at most) one index file per
+  mailbox, stored with its other metadata files: "cyrus.squat" for
+  SQUAT, "cyrus.invindex" for the inverted index.
+
+  With -i, the messages already in an existing index are left alone
+  and only new ones are added, otherwise the index is created from
+  scratch.  Either way the new index is written under a temporary
+  name and then atomically renamed into place, so we don't interfere
+  with anyone who has the old index open.
 */
 
 #include <config.h>
@@ -74,8 +61,12 @@
 #endif
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/select.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <syslog.h>
 #include <string.h>
@@ -93,8 +84,10 @@
 #include "seen.h"
 #include "mboxname.h"
 #include "map.h"
-#include "squat.h"
+#include "retry.h"
+#include "bitvector.h"
 #include "index.h"
+#include "search_engines.h"
 #include "util.h"
 
 extern char *optarg;
@@ -120,6 +113,8 @@ static int mailbox_count = 0;
 static int skip_unmodified = 0;
 static int incremental_mode = 0;
 static SquatStats total_stats;
+static SquatStats last_stats;	/* stats of the last mailbox indexed */
+static int worker_mode = 0;	/* are we a -j worker? */
 
 static void start_stats(SquatStats *stats)
 {
@@ -145,7 +140,8 @@ static void print_stats(FILE *out, SquatStats *stats)
 static int usage(const char *name)
 {
     fprintf(stderr,
-	    "usage: %s [-C <alt_config>] [-r] [-s] [-a] [-v] [mailbox...]\n",
+	    "usage: %s [-C <alt_config>] [-r] [-s] [-i] [-a] [-v]\n"
+	    "       [-j <workers>] [-J <workers per partition>] [mailbox...]\n",
 	    name);
  
     exit(EC_USAGE);
@@ -157,371 +153,128 @@ static void fatal_syserror(const char *s)
     exit(99);
 }
 
-static void fatal_squat_error(const char *s)
-{
-    int err = squat_get_last_error();
-
-    switch (err) {
-    case SQUAT_ERR_SYSERR:
-	perror(s);
-	break;
-    default:
-	/* There are other error codes, but they only apply for searching,
-	   not index construction */
-	fprintf(stderr, "SQUAT: Unknown error %d (%s)\n", err, s);
-    }
-
-    exit(98);
-}
-
 /* ====================================================================== */
 
-/* uid_info is used to track which messages exist in old squat index, by
- * parsing document names (e.g: m456. is part of message UID 456).
- */
-
-struct uid_item {
-    unsigned long uid;
-    int flagged;
-};
-
-struct uid_info {
-    struct uid_item *list;
-    unsigned long len;
-    unsigned long uidvalidity;
-    int valid;
-};
-
-static void uid_info_init(struct uid_info *uid_info, unsigned long exists)
-{
-    uid_info->list = xmalloc((exists + 1) * sizeof(struct uid_item));
-    uid_info->len = exists;
-    uid_info->uidvalidity = 0L;
-    uid_info->valid = 1;
-}
-
-static void uid_info_free(struct uid_info *uid_info)
-{
-    if (uid_info->list != NULL)
-	free(uid_info->list);
-
-    uid_info->list = NULL;
-}
-
-static void uid_item_init(struct uid_item *uid_item, unsigned long uid)
-{
-    uid_item->uid = uid;
-    uid_item->flagged = 0;
-}
-
-static struct uid_item *find_uid_item(struct uid_info *uid_info,
-				      unsigned long uid)
-{
-    struct uid_item *list = uid_info->list;
-    unsigned long first = 0;
-    unsigned long last = uid_info->len;
-
-    /* Binary chop on sorted array */
-    while (first < last) {
-	unsigned long middle = (first + last) / 2;
-
-	if (list[middle].uid == uid)
-	    return (&list[middle]);
-	if (list[middle].uid < uid)
-	    first = middle + 1;
-	else
-	    last = middle;
-    }
-    return (NULL);
-}
-
-/* Populate uid_info map using document names from SquatSearchIndex backend */
-static int doc_check(void *closure, const SquatListDoc *doc)
-{
-    struct uid_info *uid_info = (struct uid_info *)closure;
-    struct uid_item *uid_item;
-    unsigned long uid;
-
-    /* validity will be replaced with new value in same slot */
-    if (!strncmp(doc->doc_name, "validity.", 9)) {
-	uid_info->uidvalidity = strtoul(doc->doc_name + 9, NULL, 10);
-	return (1);
-    }
-
-    if (!strchr("tfcbsmh", doc->doc_name[0])) {
-	syslog(LOG_ERR, "Invalid document name: %s", doc->doc_name);
-	uid_info->valid = 0;
-	return (1);
-    }
-
-    uid = strtoul(doc->doc_name + 1, NULL, 10);
-    if ((uid > 0) && (uid_item = find_uid_item(uid_info, uid))) {
-	uid_item->flagged = 1;
-	return (1);
-    }
-
-    /* Remove this UID from the index */
-    return (0);
-}
-
-/* ====================================================================== */
-
-
 typedef struct {
     SquatStats *mailbox_stats;
-    SquatIndex *index;
-    struct mailbox *mailbox;
+    const struct search_engine *engine;
+    search_builder_t *builder;
 } SquatReceiverData;
 
-/* Cyrus passes the text to index in here, after it has canonicalized
-   the text. We figure out what source document the text belongs to,
-   and update the index. */
+/* Count what goes past on its way to the engine */
 static void search_text_receiver(int uid, int part, int cmd,
 				 char const *text, int text_len,
 				 void *rock)
 {
     SquatReceiverData *d = (SquatReceiverData *) rock;
 
-    if ((cmd & SEARCHINDEX_CMD_BEGINPART) != 0) {
-	char buf[100];
-	char part_char = 0;
-
-	/* Figure out what the name of the source document is going to be. */
-	switch (part) {
-	case SEARCHINDEX_PART_FROM: part_char = 'f'; break;
-	case SEARCHINDEX_PART_TO: part_char = 't'; break;
-	case SEARCHINDEX_PART_CC: part_char = 'c'; break;
-	case SEARCHINDEX_PART_BCC: part_char = 'b'; break;
-	case SEARCHINDEX_PART_SUBJECT: part_char = 's'; break;
-	case SEARCHINDEX_PART_HEADERS: part_char = 'h'; break;
-	case SEARCHINDEX_PART_BODY:
-	    part_char = 'm';
-	    d->mailbox_stats->indexed_messages++;
-	    total_stats.indexed_messages++;
-	    break;
-	default:
-	    fatal("Unknown search_text part", EC_SOFTWARE);
-	}
-
-	snprintf(buf, sizeof(buf), "%c%d", part_char, uid);
-
-	/* don't index document parts that are going to be empty (or too
-	   short to search) */
-	if ((cmd & SEARCHINDEX_CMD_ENDPART) != 0
-	    && ((cmd & SEARCHINDEX_CMD_APPENDPART) == 0
-		|| text_len < SQUAT_WORD_SIZE)) {
-	    if (verbose > 2) {
-		printf("Skipping tiny document part '%s' (size %d)\n", buf,
-		       (cmd & SEARCHINDEX_CMD_APPENDPART) ==
-		       0 ? 0 : text_len);
-	    }
-	    return;
-	}
-
-	if (verbose > 2) {
-	    printf("Opening document part '%s'\n", buf);
-	}
-
-	if (squat_index_open_document(d->index, buf) != SQUAT_OK) {
-	    fatal_squat_error("Writing index");
-	}
+    if ((cmd & SEARCHINDEX_CMD_BEGINPART) != 0
+	&& part == SEARCHINDEX_PART_BODY) {
+	d->mailbox_stats->indexed_messages++;
+	total_stats.indexed_messages++;
     }
 
     if ((cmd & SEARCHINDEX_CMD_APPENDPART) != 0) {
 	if (verbose > 3) {
 	    printf("Writing %d bytes into message %d\n", text_len, uid);
 	}
-
-	if (squat_index_append_document(d->index, text, text_len) != SQUAT_OK) {
-	    fatal_squat_error("Writing index data");
-	}
 	d->mailbox_stats->indexed_bytes += text_len;
 	total_stats.indexed_bytes += text_len;
     }
 
-    if ((cmd & SEARCHINDEX_CMD_ENDPART) != 0) {
-	if (squat_index_close_document(d->index) != SQUAT_OK) {
-	    fatal_squat_error("Writing index update");
-	}
-    }
+    d->engine->receiver(uid, part, cmd, text, text_len, d->builder);
 }
 
-/* Let SQUAT tell us what's going on in the expensive
-   squat_index_finish function. */
-static void stats_callback(void *closure __attribute__ ((unused)),
-			   SquatStatsEvent *params)
+/* Pass on what the engine says it's doing in the expensive part of
+   the update */
+static void progress_callback(const char *desc,
+			      void *rock __attribute__((unused)))
 {
-    switch (params->generic.type) {
-    case SQUAT_STATS_COMPLETED_INITIAL_CHAR:
-	if (verbose > 1) {
-	    if (params->completed_initial_char.num_words > 0) {
-		printf("Processing index character %d, %d total words, "
-		       "temp file size is %d\n",
-		       params->completed_initial_char.completed_char,
-		       params->completed_initial_char.num_words,
-		       params->completed_initial_char.temp_file_size);
-	    }
-	}
-	break;
+    printf("%s\n", desc);
+}
 
-    default:
-	;			/* do nothing */
-    }
+/* Note the UIDs already in the index, and drop those which have
+   since been expunged. */
+struct indexed_rock {
+    struct index_state *state;
+    const struct search_engine *engine;
+    search_builder_t *builder;
+    bitvector_t *indexed;	/* by msgno */
+};
+
+static int indexed_uid(uint32_t uid, void *rock)
+{
+    struct indexed_rock *ir = (struct indexed_rock *) rock;
+    uint32_t msgno = index_finduid(ir->state, uid);
+
+    if (msgno && index_getuid(ir->state, msgno) == uid)
+	bv_set(ir->indexed, msgno);
+    else
+	ir->engine->delete_uid(ir->builder, uid);
+
+    return 0;
 }
 
-/* Squat a single open mailbox */
-static int squat_single(struct index_state *state, int incremental)
+/* Index a single open mailbox with the configured search engine */
+static int index_single(struct index_state *state, int incremental)
 {
     struct mailbox *mailbox = state->mailbox;
-    char *fname;
-    char *newfname;
+    const struct search_engine *engine = search_engine();
     SquatStats stats;
-    SquatOptions options;
     SquatReceiverData data;
-    SquatSearchIndex *old_index = NULL;
-    char uid_validity_buf[30];
-    struct uid_info uid_info;
-    struct uid_item *uid_item;
-    struct stat index_file_info;
+    struct indexed_rock ir;
+    bitvector_t indexed = BV_INITIALIZER;
     uint32_t msgno;
-    int new_index_fd = -1;
-    int old_index_fd = -1;
-    int r = 0;			/* Using IMAP_* not SQUAT_* return codes here */
-
-    uid_info_init(&uid_info, state->exists);
-
-    newfname = mailbox_meta_newfname(mailbox, META_SQUAT);
-    if ((new_index_fd = open(newfname, O_CREAT | O_TRUNC | O_WRONLY, 0666)) < 0)
-	fatal_syserror("Unable to create temporary index file");
-
-    options.option_mask = SQUAT_OPTION_TMP_PATH | SQUAT_OPTION_STATISTICS;
-    options.tmp_path = mailbox_datapath(mailbox);
-    options.stats_callback = stats_callback;
-    options.stats_callback_closure = NULL;
-    data.index = squat_index_init(new_index_fd, &options);
-    if (data.index == NULL)
-	fatal_squat_error("Initializing index");
-
-    uid_item = uid_info.list;
-    for (msgno = 1; msgno <= state->exists; msgno++) {
-	uid_item_init(&uid_item[msgno - 1], index_getuid(state, msgno));
-    }
-    /* Add zero UID as an end of list marker: uid_info_init() assigned space */
-    uid_item_init(&uid_item[state->exists], 0);
-
-    /* Open existing index if it exists */
-    fname = mailbox_meta_fname(mailbox, META_SQUAT);
-    old_index_fd = -1;
-    old_index = NULL;
-    if (incremental &&
-	((old_index_fd = open(fname, O_RDONLY)) >= 0) &&
-	(old_index = squat_search_open(old_index_fd)) == NULL) {
-	close(old_index_fd);
-	old_index_fd = -1;
-    }
-
-    /* Fall back to full update if open() or squat_search_open() failed */
-    if (!old_index)
-	incremental = 0;
-
-    if (incremental) {
-	/* Copy existing document names verbatim. They end up with the same
-	 * doc_IDs as in the old index, which makes trie copying much simpler.
-	 */
-	uid_info.valid = 1;
-	uid_info.uidvalidity = 0L;
-	squat_index_add_existing(data.index, old_index, doc_check,
-				 &uid_info);
-
-	if (!uid_info.valid) {
-	    syslog(LOG_ERR,
-		   "Corrupt squat index for %s, retrying without incremental",
-		   mailbox->name);
-	    r = IMAP_IOERROR;
-	    goto bail;
-	}
+    int r;
 
-	if (uid_info.uidvalidity != mailbox->i.uidvalidity) {
-	    /* Squat file refers to old mailbox: force full rebuild */
-	    r = IMAP_IOERROR;
-	    goto bail;
-	}
-    } else {
-	/* write an empty document at the beginning to record the validity
-	   nonce */
-	snprintf(uid_validity_buf, sizeof(uid_validity_buf),
-		 "validity.%u", mailbox->i.uidvalidity);
-	if (squat_index_open_document(data.index, uid_validity_buf) != SQUAT_OK
-	    || squat_index_close_document(data.index) != SQUAT_OK) {
-	    fatal_squat_error("Writing index");
-	}
+    data.builder = engine->begin_update(mailbox, incremental ?
+					SEARCH_UPDATE_INCREMENTAL : 0,
+					verbose > 1 && !worker_mode ?
+					progress_callback : NULL,
+					NULL);
+    if (!data.builder) {
+	/* no usable index to add to */
+	return IMAP_IOERROR;
     }
-
-    data.mailbox = mailbox;
+    data.engine = engine;
     data.mailbox_stats = &stats;
     start_stats(&stats);
 
-    uid_item = uid_info.list;
-    for (msgno = 1; msgno <= state->exists; msgno++) {
-	uint32_t uid = index_getuid(state, msgno);
-	/* Scan uid_item list for matching UID (ascending order, 0 termination) */
-	while (uid_item->uid && (uid_item->uid < uid))
-	    uid_item++;
+    bv_setsize(&indexed, state->exists + 1);
+    ir.state = state;
+    ir.engine = engine;
+    ir.builder = data.builder;
+    ir.indexed = &indexed;
+    engine->foreach_indexed(data.builder, indexed_uid, &ir);
 
-	if ((uid_item->uid == uid) && uid_item->flagged)
+    for (msgno = 1; msgno <= state->exists; msgno++) {
+	if (bv_isset(&indexed, msgno))
 	    continue;
 
 	/* This UID didn't appear in the old index file */
 	index_getsearchtext_single(state, msgno, search_text_receiver,
 				   &data);
-	uid_item->flagged = 1;
     }
+    bv_free(&indexed);
 
-    if (squat_index_finish(data.index) != SQUAT_OK) {
+    r = engine->end_update(data.builder, 1, &stats.index_size);
+    if (r) {
 	if (incremental) {
 	    syslog(LOG_ERR,
-		   "Corrupt squat index %s, retrying without incremental update",
-		   mailbox->name);
-	    r = IMAP_IOERROR;
-	    goto bail;
+		   "Failed to update %s index for %s, retrying without "
+		   "incremental update", engine->name, mailbox->name);
 	}
-	/* Just give up if not incremental */
-	fatal_squat_error("Closing index");
-    }
-
-    /* Check how big the resulting file is */
-    if (fstat(new_index_fd, &index_file_info) < 0) {
-	fatal_syserror("Unable to stat temporary index file");
-    }
-    stats.index_size = index_file_info.st_size;
-    total_stats.index_size += index_file_info.st_size;
-
-    if (close(new_index_fd) < 0) {
-	fatal_syserror("Unable to complete writing temporary index file");
-    }
-    new_index_fd = -1;
-
-    /* OK, we successfully created the index under the temporary file name.
-       Let's rename it to make it the real index. */
-    if (mailbox_meta_rename(mailbox, META_SQUAT) < 0) {
-	fatal_syserror("Unable to rename temporary index file");
+	return r;
     }
+    total_stats.index_size += stats.index_size;
 
     stop_stats(&stats);
-    if (verbose > 0) {
+    last_stats = stats;
+    if (verbose > 0 && !worker_mode) {
 	print_stats(stdout, &stats);
     }
 
-bail:
-    if (old_index)
-	squat_search_close(old_index);
-    if (old_index_fd >= 0)
-	close(old_index_fd);
-    if (new_index_fd >= 0)
-	close(new_index_fd);
-    uid_info_free(&uid_info);
-
-    return (r);
+    return 0;
 }
 
 /* This is called once for each mailbox we're told to index. */
@@ -610,7 +363,7 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
         return 1;
     }
 
-    fname = mailbox_meta_fname(state->mailbox, META_SQUAT);
+    fname = mailbox_meta_fname(state->mailbox, search_engine()->metafile);
 
     /* process only changed mailboxes if skip option delected. */
     if (skip_unmodified && !stat(fname, &sbuf)) {
@@ -625,13 +378,18 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
     }
 
     syslog(LOG_INFO, "indexing mailbox %s... ", extname);
-    if (verbose > 0) {
+    if (verbose > 0 && !worker_mode) {
       printf("Indexing mailbox %s... ", extname);
     }
 
-    if (!incremental_mode || (squat_single(state, 1) != 0)) {
-      /* Fall back to complete squat */
-      squat_single(state, 0);
+    if (!incremental_mode || (index_single(state, 1) != 0)) {
+	/* Fall back to a complete rebuild */
+	r = index_single(state, 0);
+	if (r) {
+	    fprintf(stderr, "Unable to index mailbox %s: %s\n",
+		    extname, error_message(r));
+	    exit(99);
+	}
     }
 
     index_close(&state);
@@ -650,13 +408,305 @@ static int addmbox(char *name,
     return 0;
 }
 
+/* ====================================================================== */
+
+/* With -j, the mailboxes are handed out one at a time to a pool of
+ * worker processes, each of which runs index_me() and sends back what
+ * it did.  Mailboxes are queued per partition, and at most
+ * 'part_limit' workers are busy on any one partition at a time, so
+ * that every worker doesn't end up waiting on the same spool disk. */
+
+struct squat_result {
+    int r;			/* index_me() return code */
+    int indexed;		/* was the mailbox indexed? */
+    SquatStats stats;
+};
+
+struct squat_partition {
+    char *name;
+    strarray_t mboxes;		/* mailboxes to index */
+    int next;			/* next one to hand out */
+    int running;		/* workers busy on this partition */
+};
+
+struct squat_worker {
+    pid_t pid;
+    int alive;
+    int to_fd;			/* mailbox names to the worker */
+    int from_fd;		/* results from the worker */
+    struct squat_partition *part;	/* partition it's busy on, if any */
+    const char *mboxname;
+};
+
+static void worker_run(int in_fd, int out_fd, int use_annot)
+{
+    struct squat_result res;
+    char name[MAX_MAILBOX_BUFFER];
+    uint32_t len;
+    int count;
+
+    worker_mode = 1;
+
+    mboxlist_open(NULL);
+    annotatemore_open();
+
+    for (;;) {
+	if (retry_read(in_fd, &len, sizeof(len)) != sizeof(len) ||
+	    !len || len >= sizeof(name) ||
+	    retry_read(in_fd, name, len) != (ssize_t) len)
+	    break;
+	name[len] = '\0';
+
+	memset(&last_stats, 0, sizeof(last_stats));
+	count = mailbox_count;
+	res.r = index_me(name, 0, 0, &use_annot);
+	res.indexed = mailbox_count - count;
+	res.stats = last_stats;
+
+	if (retry_write(out_fd, &res, sizeof(res)) != sizeof(res))
+	    break;
+    }
+
+    seen_done();
+    mboxlist_close();
+    mboxlist_done();
+    annotatemore_close();
+    annotate_done();
+
+    cyrus_done();
+
+    exit(0);
+}
+
+/* round-robin over the partitions with work left and a free slot */
+static struct squat_partition *next_partition(struct squat_partition *parts,
+					      int nparts, int part_limit,
+					      int *rr)
+{
+    struct squat_partition *part;
+    int i;
+
+    for (i = 0; i < nparts; i++) {
+	part = &parts[(*rr + i) % nparts];
+	if (part->next < part->mboxes.count && part->running < part_limit) {
+	    *rr = (*rr + i + 1) % nparts;
+	    return part;
+	}
+    }
+
+    return NULL;
+}
+
+static void worker_died(struct squat_worker *w)
+{
+    syslog(LOG_ERR, "squatter worker %d died%s%s", (int) w->pid,
+	   w->mboxname ? " indexing " : "",
+	   w->mboxname ? w->mboxname : "");
+    close(w->to_fd);
+    close(w->from_fd);
+    w->alive = 0;
+}
+
+static void squat_parallel(strarray_t *mboxes, int nworkers, int part_limit,
+			   int use_annot)
+{
+    struct squat_partition *parts = NULL, *part;
+    struct squat_worker *workers, *w;
+    struct squat_result res;
+    mbentry_t *mbentry = NULL;
+    char extname[MAX_MAILBOX_BUFFER];
+    const char *partname;
+    int nparts = 0, nalive = 0, nbusy = 0, remaining = 0, rr = 0;
+    int i, j, maxfd, status;
+    fd_set rfds;
+    uint32_t len;
+
+    /* sort the mailboxes into a queue per partition.  Leave lookup
+     * errors to index_me() so they get reported as usual */
+    for (i = 0; i < mboxes->count; i++) {
+	partname = "";
+	if (!mboxlist_lookup(mboxes->data[i], &mbentry, NULL)) {
+	    if (mbentry->mbtype & MBTYPE_REMOTE) {
+		mboxlist_entry_free(&mbentry);
+		continue;
+	    }
+	    if (mbentry->partition) partname = mbentry->partition;
+	}
+
+	for (j = 0; j < nparts; j++) {
+	    if (!strcmp(parts[j].name, partname)) break;
+	}
+	if (j == nparts) {
+	    parts = xrealloc(parts, ++nparts * sizeof(struct squat_partition));
+	    memset(&parts[j], 0, sizeof(struct squat_partition));
+	    parts[j].name = xstrdup(partname);
+	}
+	strarray_append(&parts[j].mboxes, mboxes->data[i]);
+	remaining++;
+
+	mboxlist_entry_free(&mbentry);
+    }
+
+    if (!remaining) return;
+
+    /* by default, share the workers out evenly between the partitions */
+    if (part_limit <= 0)
+	part_limit = (nworkers + nparts - 1) / nparts;
+
+    syslog(LOG_NOTICE, "indexing %d mailboxes on %d partitions "
+	   "with %d workers, at most %d per partition",
+	   remaining, nparts, nworkers, part_limit);
+
+    /* the workers open their own database handles */
+    mboxlist_close();
+    annotatemore_close();
+
+    /* a dead worker shouldn't take us with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    workers = xzmalloc(nworkers * sizeof(struct squat_worker));
+    for (i = 0; i < nworkers; i++) {
+	int to[2], from[2];
+
+	if (pipe(to) < 0 || pipe(from) < 0)
+	    fatal_syserror("Unable to create worker pipes");
+
+	w = &workers[i];
+	w->pid = fork();
+	if (w->pid < 0)
+	    fatal_syserror("Unable to fork worker");
+
+	if (!w->pid) {
+	    /* don't hold the other workers' pipes open */
+	    for (j = 0; j < i; j++) {
+		close(workers[j].to_fd);
+		close(workers[j].from_fd);
+	    }
+	    close(to[1]);
+	    close(from[0]);
+	    worker_run(to[0], from[1], use_annot);
+	}
+
+	close(to[0]);
+	close(from[1]);
+	w->to_fd = to[1];
+	w->from_fd = from[0];
+	w->alive = 1;
+	nalive++;
+    }
+
+    while (nalive && (remaining || nbusy)) {
+	/* hand out mailboxes to idle workers */
+	for (i = 0; i < nworkers && remaining; i++) {
+	    w = &workers[i];
+	    if (!w->alive || w->part) continue;
+
+	    part = next_partition(parts, nparts, part_limit, &rr);
+	    if (!part) break;
+
+	    w->mboxname = part->mboxes.data[part->next];
+	    len = strlen(w->mboxname);
+	    if (retry_write(w->to_fd, &len, sizeof(len)) != sizeof(len) ||
+		retry_write(w->to_fd, w->mboxname, len) != (ssize_t) len) {
+		/* leave the mailbox for someone else */
+		w->mboxname = NULL;
+		worker_died(w);
+		nalive--;
+		continue;
+	    }
+
+	    part->next++;
+	    part->running++;
+	    w->part = part;
+	    nbusy++;
+	    remaining--;
+	}
+
+	if (!nbusy) break;
+
+	/* wait for a worker to finish */
+	FD_ZERO(&rfds);
+	maxfd = -1;
+	for (i = 0; i < nworkers; i++) {
+	    w = &workers[i];
+	    if (!w->part) continue;
+	    FD_SET(w->from_fd, &rfds);
+	    if (w->from_fd > maxfd) maxfd = w->from_fd;
+	}
+
+	if (select(maxfd + 1, &rfds, NULL, NULL, NULL) < 0) {
+	    if (errno == EINTR) continue;
+	    fatal_syserror("Unable to wait for workers");
+	}
+
+	for (i = 0; i < nworkers; i++) {
+	    w = &workers[i];
+	    if (!w->part || !FD_ISSET(w->from_fd, &rfds)) continue;
+
+	    w->part->running--;
+	    w->part = NULL;
+	    nbusy--;
+
+	    if (retry_read(w->from_fd, &res, sizeof(res)) != sizeof(res)) {
+		worker_died(w);
+		nalive--;
+		continue;
+	    }
+
+	    if (res.indexed) {
+		mailbox_count += res.indexed;
+		total_stats.indexed_messages += res.stats.indexed_messages;
+		total_stats.indexed_bytes += res.stats.indexed_bytes;
+		total_stats.index_size += res.stats.index_size;
+
+		if (verbose > 0) {
+		    (*squat_namespace.mboxname_toexternal)(&squat_namespace,
+							   w->mboxname,
+							   NULL, extname);
+		    printf("Indexing mailbox %s... ", extname);
+		    print_stats(stdout, &res.stats);
+		}
+	    }
+	    w->mboxname = NULL;
+	}
+    }
+
+    if (remaining) {
+	syslog(LOG_ERR, "%d mailboxes not indexed: no workers left",
+	       remaining);
+	fprintf(stderr, "%d mailboxes not indexed: no workers left\n",
+		remaining);
+    }
+
+    /* closing the pipes tells the workers to exit */
+    for (i = 0; i < nworkers; i++) {
+	w = &workers[i];
+	if (w->alive) {
+	    close(w->to_fd);
+	    close(w->from_fd);
+	}
+    }
+    for (i = 0; i < nworkers; i++) {
+	while (waitpid(workers[i].pid, &status, 0) < 0 && errno == EINTR);
+    }
+
+    free(workers);
+    for (i = 0; i < nparts; i++) {
+	free(parts[i].name);
+	strarray_fini(&parts[i].mboxes);
+    }
+    free(parts);
+}
+
 int main(int argc, char **argv)
 {
     int opt;
     char *alt_config = NULL;
     int rflag = 0, use_annot = 0;
+    int nworkers = 1, part_limit = 0;
     int i;
     char buf[MAX_MAILBOX_PATH + 1];
+    strarray_t sa = STRARRAY_INITIALIZER;
     int r;
 
     if ((geteuid()) == 0 && (become_cyrus(/*is_master*/0) != 0)) {
@@ -665,7 +715,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:rsiav")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:rsiavj:J:")) != EOF) {
 	switch (opt) {
 	case 'C':		/* alt config file */
 	    alt_config = optarg;
@@ -691,6 +741,16 @@ int main(int argc, char **argv)
 	    use_annot = 1;
 	    break;
 
+	case 'j':		/* number of workers */
+	    nworkers = atoi(optarg);
+	    if (nworkers < 1) usage("squatter");
+	    break;
+
+	case 'J':		/* workers per partition */
+	    part_limit = atoi(optarg);
+	    if (part_limit < 1) usage("squatter");
+	    break;
+
 	default:
 	    usage("squatter");
 	}
@@ -714,8 +774,6 @@ int main(int argc, char **argv)
     start_stats(&total_stats);
 
     if (optind == argc) {
-	strarray_t sa = STRARRAY_INITIALIZER;
-
 	if (rflag) {
 	    fprintf(stderr, "please specify a mailbox to recurse from\n");
 	    exit(EC_USAGE);
@@ -724,26 +782,30 @@ int main(int argc, char **argv)
 	strlcpy(buf, "*", sizeof(buf));
 	(*squat_namespace.mboxlist_findall) (&squat_namespace, buf, 1,
 					     0, 0, addmbox, &sa);
-
-	for (i = 0 ; i < sa.count ; i++) {
-	    index_me(sa.data[i], strlen(sa.data[i]), 0, &use_annot);
-	    /* Ignore errors: most will be mailboxes moving around */
-	}
-	strarray_fini(&sa);
     }
 
     for (i = optind; i < argc; i++) {
 	/* Translate any separators in mailboxname */
 	(*squat_namespace.mboxname_tointernal) (&squat_namespace, argv[i],
 						NULL, buf);
-	index_me(buf, 0, 0, &use_annot);
+	strarray_append(&sa, buf);
 	if (rflag) {
 	    strlcat(buf, ".*", sizeof(buf));
 	    (*squat_namespace.mboxlist_findall) (&squat_namespace, buf, 1,
-						 0, 0, index_me,
-						 &use_annot);
+						 0, 0, addmbox, &sa);
+	}
+    }
+
+    if (nworkers > 1) {
+	squat_parallel(&sa, nworkers, part_limit, use_annot);
+    }
+    else {
+	for (i = 0 ; i < sa.count ; i++) {
+	    index_me(sa.data[i], strlen(sa.data[i]), 0, &use_annot);
+	    /* Ignore errors: most will be mailboxes moving around */
 	}
     }
+    strarray_fini(&sa);
 
     if (verbose > 0 && mailbox_count > 1) {
 	stop_stats(&total_stats);
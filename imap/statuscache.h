@@ -44,10 +44,11 @@
 #define STATUSCACHE_H
 
 #include "mailbox.h"
+#include "strarray.h"
 
 /* name of the statuscache database */
 #define FNAME_STATUSCACHEDB "/statuscache.db"
-#define STATUSCACHE_VERSION 4
+#define STATUSCACHE_VERSION 5
 
 /* open the statuscache db */
 extern void statuscache_open(void);
@@ -61,15 +62,27 @@ extern void statuscache_fill(struct statusdata *sdata, const char *userid,
 extern int status_lookup(const char *mboxname, const char *userid,
 			 unsigned statusitems, struct statusdata *sdata);
 
+/* callback for status_lookup_multi, sdata is NULL if r is set */
+typedef void status_proc_t(const char *mboxname, int r,
+			   struct statusdata *sdata, void *rock);
+
+/* lookup the status of many mailboxes for one user in a batch.
+ * partitions, if given, holds the partition of each mailbox */
+extern void status_lookup_multi(const strarray_t *mboxnames,
+				const strarray_t *partitions,
+				const char *userid, unsigned statusitems,
+				status_proc_t *proc, void *rock);
+
 /* lookup a single statuscache entry and return result, or error if it
    doesn't exist or doesn't have the fields we need */
 extern int statuscache_lookup(const char *mboxname, const char *userid,
 			      unsigned statusitems, struct statusdata *sdata);
 
-/* invalidate (delete) statuscache entry for the mailbox,
+/* bring the statuscache entries for the mailbox up to date with the
+   changes made while it was locked (deleting those which can't be),
    optionally writing the data for one user in the same transaction */
-extern int statuscache_invalidate(const char *mboxname,
-				  struct statusdata *sdata);
+extern int statuscache_update(struct mailbox *mailbox,
+			      struct statusdata *sdata);
 
 /* close the database */
 extern void statuscache_close(void);
@@ -55,12 +55,16 @@
 #include <syslog.h>
 
 #include "assert.h"
+#include "crc32.h"
 #include "cyrusdb.h"
+#include "hash.h"
 #include "imapd.h"
 #include "global.h"
 #include "imap/imap_err.h"
 #include "mboxlist.h"
 #include "mailbox.h"
+#include "metacache.h"
+#include "ptrarray.h"
 #include "seen.h"
 #include "util.h"
 #include "xmalloc.h"
@@ -77,6 +81,7 @@ EXPORTED void statuscache_open(void)
 {
     const char *fname = NULL;
     int ret;
+    int flags = CYRUSDB_CREATE;
     char *tofree = NULL;
 
     if (!fname)
@@ -88,7 +93,10 @@ EXPORTED void statuscache_open(void)
 	fname = tofree;
     }
 
-    ret = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &statuscachedb);
+    if (config_getswitch(IMAPOPT_STATUSCACHE_DB_BLOOM))
+	flags |= CYRUSDB_BLOOM;
+
+    ret = cyrusdb_open(DB, fname, flags, &statuscachedb);
     if (ret != 0) {
 	syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
 	       cyrusdb_strerror(ret));
@@ -131,6 +139,10 @@ HIDDEN void statuscache_fill(struct statusdata *sdata, const char *userid,
     sdata->uidvalidity = mailbox->i.uidvalidity;
     sdata->unseen = numunseen;
     sdata->highestmodseq = mailbox->i.highestmodseq;
+
+    sdata->internalseen = mailbox_internal_seen(mailbox, userid);
+    sdata->recentuid = mailbox->i.recentuid;
+    sdata->seencrc = 0;
 }
 
 EXPORTED void statuscache_done(void)
@@ -158,38 +170,126 @@ static char *statuscache_buildkey(const char *mailboxname, const char *userid,
 }
 
 /*
- * Performs a STATUS command - note: state MAY be NULL here.
+ * Answer from the shared metadata cache, without opening the mailbox,
+ * if nothing depends on the user's \Seen state.
  */
-EXPORTED int status_lookup(const char *mboxname, const char *userid,
-		  unsigned statusitems, struct statusdata *sdata)
+static int status_metacache(const char *mboxname, const char *userid,
+			    unsigned statusitems, struct statusdata *sdata)
 {
-    struct mailbox *mailbox = NULL;
-    unsigned numrecent = 0;
-    unsigned numunseen = 0;
-    unsigned c_statusitems;
+    mbentry_t *mbentry = NULL;
+    struct metacache_entry entry;
+    struct stat sbuf;
+    const char *fname;
     int r;
 
-    /* Check status cache if possible */
-    if (config_getswitch(IMAPOPT_STATUSCACHE)) {
-	/* Do actual lookup of cache item. */
-	r = statuscache_lookup(mboxname, userid, statusitems, sdata);
+    r = mboxlist_lookup(mboxname, &mbentry, NULL);
+    if (r) return r;
 
-	/* Seen/recent status uses "push" invalidation events from
-	 * seen_db.c.   This avoids needing to open cyrus.header to get
-	 * the mailbox uniqueid to open the seen db and get the
-	 * unseen_mtime and recentuid.
-	 */
+    r = metacache_lookup(mboxname, mbentry->uniqueid, &entry);
+    if (r) goto done;
+    metacache_entry_fini(&entry);
 
-	if (!r) {
-	    syslog(LOG_DEBUG, "statuscache, '%s', '%s', '0x%02x', 'yes'",
-		   mboxname, userid, statusitems);
-	    return 0;
-	}
+    r = IMAP_NOTFOUND;
 
-	syslog(LOG_DEBUG, "statuscache, '%s', '%s', '0x%02x', 'no'",
-	       mboxname, userid, statusitems);
+    if (entry.i.options & OPT_MAILBOX_DELETED)
+	goto done;
+    if (entry.i.exists && (statusitems & (STATUS_RECENT | STATUS_UNSEEN)))
+	goto done;
+
+    /* is it still the same index file? */
+    fname = mboxname_metapath(mbentry->partition, mboxname, META_INDEX, 0);
+    if (!fname || stat(fname, &sbuf) || sbuf.st_ino != entry.index_ino)
+	goto done;
+
+    sdata->userid = userid;
+    sdata->statusitems = STATUS_MESSAGES | STATUS_UIDNEXT |
+			 STATUS_UIDVALIDITY | STATUS_HIGHESTMODSEQ;
+    if (!entry.i.exists)
+	sdata->statusitems |= STATUS_RECENT | STATUS_UNSEEN;
+
+    sdata->messages = entry.i.exists;
+    sdata->recent = 0;
+    sdata->uidnext = entry.i.last_uid+1;
+    sdata->uidvalidity = entry.i.uidvalidity;
+    sdata->unseen = 0;
+    sdata->highestmodseq = entry.i.highestmodseq;
+
+    r = 0;
+
+  done:
+    mboxlist_entry_free(&mbentry);
+    return r;
+}
+
+/*
+ * Recent and unseen counts for a user with their own seen database
+ * are only good until it changes, which can happen without the
+ * mailbox itself changing.
+ */
+static int status_checkseen(struct seen **seendbp, const char *mboxname,
+			    const char *userid, struct statusdata *sdata)
+{
+    mbentry_t *mbentry = NULL;
+    struct seendata sd = SEENDATA_INITIALIZER;
+    int r;
+
+    r = mboxlist_lookup(mboxname, &mbentry, NULL);
+    if (r) return r;
+
+    if (!mbentry->uniqueid) {
+	r = IMAP_NO_NOSUCHMSG;
+	goto done;
     }
 
+    r = *seendbp ? 0 : seen_open(userid, SEEN_SILENT, seendbp);
+    if (!r) r = seen_read(*seendbp, mbentry->uniqueid, &sd);
+    if (r) goto done;
+
+    if (sd.lastuid != sdata->recentuid ||
+	crc32_cstring(sd.seenuids) != sdata->seencrc)
+	r = IMAP_NO_NOSUCHMSG;
+
+    seen_freedata(&sd);
+
+  done:
+    mboxlist_entry_free(&mbentry);
+    return r;
+}
+
+/*
+ * Is a cached entry still good?  Entries are kept up to date as the
+ * mailbox changes, and internal seen state only changes along with it.
+ */
+static int status_validate(struct seen **seendbp, const char *mboxname,
+			   const char *userid, unsigned statusitems,
+			   struct statusdata *sdata)
+{
+    if (sdata->internalseen || !sdata->messages ||
+	!(statusitems & (STATUS_RECENT | STATUS_UNSEEN)))
+	return 0;
+
+    return status_checkseen(seendbp, mboxname, userid, sdata);
+}
+
+/*
+ * Work out the status of a mailbox which isn't in the statuscache,
+ * and cache it.
+ */
+static int status_calculate(const char *mboxname, const char *userid,
+			    unsigned statusitems, struct statusdata *sdata)
+{
+    struct mailbox *mailbox = NULL;
+    unsigned numrecent = 0;
+    unsigned numunseen = 0;
+    unsigned recentuid = 0;
+    uint32_t seencrc = 0;
+    unsigned c_statusitems;
+    int r;
+
+    if (config_getswitch(IMAPOPT_METACACHE) &&
+	!status_metacache(mboxname, userid, statusitems, sdata))
+	return 0;
+
     /* Missing or invalid cache entry */
     r = mailbox_open_irl(mboxname, &mailbox);
     if (r) return r;
@@ -209,7 +309,6 @@ EXPORTED int status_lookup(const char *mboxname, const char *userid,
 	uint32_t recno;
 	struct index_record record;
 	int internalseen = mailbox_internal_seen(mailbox, userid);
-	unsigned recentuid;
 
 	if (internalseen) {
 	    recentuid = mailbox->i.recentuid;
@@ -224,6 +323,7 @@ EXPORTED int status_lookup(const char *mboxname, const char *userid,
 
 	    recentuid = sd.lastuid;
 	    seq = seqset_parse(sd.seenuids, NULL, recentuid);
+	    seencrc = crc32_cstring(sd.seenuids);
 	    seen_freedata(&sd);
 	}
 
@@ -250,6 +350,10 @@ EXPORTED int status_lookup(const char *mboxname, const char *userid,
 
     statuscache_fill(sdata, userid, mailbox, c_statusitems,
 		     numrecent, numunseen);
+    if (!sdata->internalseen) {
+	sdata->recentuid = recentuid;
+	sdata->seencrc = seencrc;
+    }
 
     /* cache the new value while unlocking */
     mailbox_unlock_index(mailbox, sdata);
@@ -259,27 +363,16 @@ EXPORTED int status_lookup(const char *mboxname, const char *userid,
     return r;
 }
 
-EXPORTED int statuscache_lookup(const char *mboxname, const char *userid,
-		       unsigned statusitems, struct statusdata *sdata)
+static int statuscache_parse(const char *data, size_t datalen,
+			     struct statusdata *sdata)
 {
-    size_t keylen, datalen;
-    int r = 0;
-    const char *data = NULL, *dend;
-    char *p, *key = statuscache_buildkey(mboxname, userid, &keylen);
+    const char *dend;
+    char *p;
     unsigned version;
 
-    /* Don't access DB if it hasn't been opened */
-    if (!statuscache_dbopen)
-	return IMAP_NO_NOSUCHMSG;
-
     memset(sdata, 0, sizeof(struct statusdata));
 
-    /* Check if there is an entry in the database */
-    do {
-	r = cyrusdb_fetch(statuscachedb, key, keylen, &data, &datalen, NULL);
-    } while (r == CYRUSDB_AGAIN);
-
-    if (r || !data || ((size_t) datalen < sizeof(unsigned))) {
+    if (!data || (datalen < sizeof(unsigned))) {
 	return IMAP_NO_NOSUCHMSG;
     }
 
@@ -298,20 +391,285 @@ EXPORTED int statuscache_lookup(const char *mboxname, const char *userid,
     if (p < dend) sdata->uidvalidity = strtoul(p, &p, 10);
     if (p < dend) sdata->unseen = strtoul(p, &p, 10);
     if (p < dend) sdata->highestmodseq = strtoull(p, &p, 10);
+    if (p < dend) sdata->internalseen = strtoul(p, &p, 10);
+    if (p < dend) sdata->recentuid = strtoul(p, &p, 10);
+    if (p < dend) sdata->seencrc = strtoul(p, &p, 10);
 
     /* Sanity check the data */
     if (!sdata->statusitems || !sdata->uidnext || !sdata->uidvalidity) {
 	return IMAP_NO_NOSUCHMSG;
     }
 
+    return 0;
+}
+
+/*
+ * Performs a STATUS command - note: state MAY be NULL here.
+ */
+EXPORTED int status_lookup(const char *mboxname, const char *userid,
+		  unsigned statusitems, struct statusdata *sdata)
+{
+    struct seen *seendb = NULL;
+    int r;
+
+    /* Check status cache if possible */
+    if (config_getswitch(IMAPOPT_STATUSCACHE)) {
+	/* Do actual lookup of cache item. */
+	r = statuscache_lookup(mboxname, userid, statusitems, sdata);
+	if (!r) r = status_validate(&seendb, mboxname, userid,
+				    statusitems, sdata);
+	seen_close(&seendb);
+
+	if (!r) {
+	    syslog(LOG_DEBUG, "statuscache, '%s', '%s', '0x%02x', 'yes'",
+		   mboxname, userid, statusitems);
+	    return 0;
+	}
+
+	syslog(LOG_DEBUG, "statuscache, '%s', '%s', '0x%02x', 'no'",
+	       mboxname, userid, statusitems);
+    }
+
+    return status_calculate(mboxname, userid, statusitems, sdata);
+}
+
+EXPORTED int statuscache_lookup(const char *mboxname, const char *userid,
+		       unsigned statusitems, struct statusdata *sdata)
+{
+    size_t keylen, datalen;
+    int r = 0;
+    const char *data = NULL;
+    char *key = statuscache_buildkey(mboxname, userid, &keylen);
+
+    /* Don't access DB if it hasn't been opened */
+    if (!statuscache_dbopen)
+	return IMAP_NO_NOSUCHMSG;
+
+    memset(sdata, 0, sizeof(struct statusdata));
+
+    /* Check if there is an entry in the database */
+    do {
+	r = cyrusdb_fetch(statuscachedb, key, keylen, &data, &datalen, NULL);
+    } while (r == CYRUSDB_AGAIN);
+
+    if (r || statuscache_parse(data, datalen, sdata)) {
+	return IMAP_NO_NOSUCHMSG;
+    }
+
     if ((sdata->statusitems & statusitems) != statusitems) {
 	/* Don't have all of the requested information */
 	return IMAP_NO_NOSUCHMSG;
     }
 
+    sdata->userid = userid;
+
     return 0;
 }
 
+/* one mailbox in a status_lookup_multi() batch */
+struct status_multi {
+    const char *mboxname;
+    int found;
+    struct statusdata sdata;
+    char *partition;
+    char *indexfname;
+};
+
+struct status_multirock {
+    const char *userid;
+    unsigned statusitems;
+    hash_table table;		/* mboxname => struct status_multi */
+};
+
+static int multi_cb(void *rockp,
+		    const char *key, size_t keylen,
+		    const char *data, size_t datalen)
+{
+    struct status_multirock *rp = (struct status_multirock *)rockp;
+    char name[MAX_MAILBOX_BUFFER];
+    struct status_multi *item;
+    size_t namelen, userlen = strlen(rp->userid);
+    const char *p;
+
+    p = memmem(key, keylen, "%%", 2);
+    if (!p) return 0;
+    namelen = p - key;
+    p += 2;
+
+    /* only interested in this user's entries */
+    if (namelen >= sizeof(name) || key + keylen - p != (ssize_t) userlen ||
+	memcmp(p, rp->userid, userlen))
+	return 0;
+
+    memcpy(name, key, namelen);
+    name[namelen] = '\0';
+
+    item = hash_lookup(name, &rp->table);
+    if (!item || item->found)
+	return 0;
+
+    if (!statuscache_parse(data, datalen, &item->sdata) &&
+	(item->sdata.statusitems & rp->statusitems) == rp->statusitems)
+	item->found = 1;
+
+    return 0;
+}
+
+/*
+ * The part of a mailbox name which its statuscache keys share with
+ * those of its neighbours - the top two levels of the hierarchy, so
+ * all of a user's mailboxes are read in one pass.
+ */
+static size_t status_groupprefix(const char *mboxname)
+{
+    const char *p = strchr(mboxname, '!');
+    int levels = 0;
+
+    for (p = p ? p + 1 : mboxname; *p; p++) {
+	if (*p == '.' && ++levels == 2)
+	    break;
+    }
+
+    return p - mboxname;
+}
+
+static int multi_compare(const void **a, const void **b)
+{
+    const struct status_multi *ma = *a;
+    const struct status_multi *mb = *b;
+    int r;
+
+    /* mailboxes on the same partition are near each other on disk */
+    r = strcmpsafe(ma->partition, mb->partition);
+    if (r) return r;
+
+    return strcmp(ma->mboxname, mb->mboxname);
+}
+
+/*
+ * Lookup the status of a batch of mailboxes for one user: the cached
+ * entries are read with one pass over each group of neighbouring keys,
+ * then the rest are calculated in partition order, reading the next
+ * index ahead of time.  proc is called once for each mailbox, in no
+ * particular order.  If the caller already knows the partitions, they
+ * save looking each miss up in mailboxes.db.
+ */
+EXPORTED void status_lookup_multi(const strarray_t *mboxnames,
+				  const strarray_t *partitions,
+				  const char *userid, unsigned statusitems,
+				  status_proc_t *proc, void *rock)
+{
+    struct status_multirock mrock;
+    struct status_multi *items;
+    ptrarray_t misses = PTRARRAY_INITIALIZER;
+    struct seen *seendb = NULL;
+    struct status_multi *item;
+    mbentry_t *mbentry = NULL;
+    const char *fname;
+    int i, j, r;
+
+    if (!mboxnames->count)
+	return;
+
+    mrock.userid = userid;
+    mrock.statusitems = statusitems;
+    construct_hash_table(&mrock.table, mboxnames->count, 0);
+
+    items = xzmalloc(mboxnames->count * sizeof(struct status_multi));
+    for (i = 0; i < mboxnames->count; i++) {
+	items[i].mboxname = mboxnames->data[i];
+	if (!hash_lookup(items[i].mboxname, &mrock.table))
+	    hash_insert(items[i].mboxname, &items[i], &mrock.table);
+    }
+
+    if (config_getswitch(IMAPOPT_STATUSCACHE) && statuscache_dbopen) {
+	for (i = 0; i < mboxnames->count; i = j) {
+	    const char *prefix = items[i].mboxname;
+	    size_t prefixlen = status_groupprefix(prefix);
+
+	    for (j = i + 1; j < mboxnames->count; j++) {
+		if (strncmp(items[j].mboxname, prefix, prefixlen) ||
+		    status_groupprefix(items[j].mboxname) != prefixlen)
+		    break;
+	    }
+
+	    if (j == i + 1) {
+		/* on its own, just fetch it */
+		if (!statuscache_lookup(items[i].mboxname, userid,
+					statusitems, &items[i].sdata))
+		    items[i].found = 1;
+		continue;
+	    }
+
+	    do {
+		r = cyrusdb_foreach(statuscachedb, prefix, prefixlen, NULL,
+				    multi_cb, &mrock, NULL);
+	    } while (r == CYRUSDB_AGAIN);
+	}
+    }
+
+    for (i = 0; i < mboxnames->count; i++) {
+	item = &items[i];
+	if (hash_lookup(item->mboxname, &mrock.table) != item)
+	    continue; /* duplicate */
+
+	if (item->found) {
+	    item->sdata.userid = userid;
+	    if (!status_validate(&seendb, item->mboxname, userid,
+				 statusitems, &item->sdata)) {
+		proc(item->mboxname, 0, &item->sdata, rock);
+		continue;
+	    }
+	    item->found = 0;
+	}
+
+	if (partitions && strarray_nth(partitions, i)) {
+	    item->partition = xstrdup(strarray_nth(partitions, i));
+	}
+	else {
+	    r = mboxlist_lookup(item->mboxname, &mbentry, NULL);
+	    if (r) {
+		proc(item->mboxname, r, NULL, rock);
+		continue;
+	    }
+	    item->partition = xstrdupnull(mbentry->partition);
+	    mboxlist_entry_free(&mbentry);
+	}
+	fname = mboxname_metapath(item->partition, item->mboxname,
+				  META_INDEX, 0);
+	item->indexfname = xstrdupnull(fname);
+
+	ptrarray_append(&misses, item);
+    }
+
+    seen_close(&seendb);
+
+    ptrarray_sort(&misses, multi_compare);
+
+    for (i = 0; i < misses.count; i++) {
+	struct status_multi *next = ptrarray_nth(&misses, i + 1);
+
+	/* the next one can be read in while we work on this one */
+	if (next && next->indexfname)
+	    warmup_file(next->indexfname, 0,
+			(statusitems & (STATUS_RECENT | STATUS_UNSEEN)) ?
+			0 : INDEX_HEADER_SIZE);
+
+	item = ptrarray_nth(&misses, i);
+	r = status_calculate(item->mboxname, userid, statusitems,
+			     &item->sdata);
+	proc(item->mboxname, r, r ? NULL : &item->sdata, rock);
+    }
+
+    for (i = 0; i < mboxnames->count; i++) {
+	free(items[i].partition);
+	free(items[i].indexfname);
+    }
+    ptrarray_fini(&misses);
+    free_hash_table(&mrock.table, NULL);
+    free(items);
+}
+
 static int statuscache_store(const char *mboxname,
 			     struct statusdata *sdata,
 			     struct txn **tidptr)
@@ -330,12 +688,13 @@ static int statuscache_store(const char *mboxname,
      * Any non-digit char would be fine, but whitespace 
      * looks less ugly in dbtool output */
     datalen = snprintf(data, sizeof(data),
-		       "%u %u %u %u %u %u %u " MODSEQ_FMT " ",
+		       "%u %u %u %u %u %u %u " MODSEQ_FMT " %d %u %u ",
 		       STATUSCACHE_VERSION,
 		       sdata->statusitems, sdata->messages,
 		       sdata->recent, sdata->uidnext,
 		       sdata->uidvalidity, sdata->unseen,
-		       sdata->highestmodseq);
+		       sdata->highestmodseq, sdata->internalseen,
+		       sdata->recentuid, sdata->seencrc);
 
     r = cyrusdb_store(statuscachedb, key, keylen, data, datalen, tidptr);
 
@@ -347,27 +706,100 @@ static int statuscache_store(const char *mboxname,
     return r;
 }
 
-struct statuscache_deleterock {
+/*
+ * Apply the changes made to the mailbox since it was locked to an
+ * entry which was correct at the time.  Returns 0 if it can't be
+ * brought up to date.
+ */
+static int statuscache_apply(struct mailbox *mailbox,
+			     struct statusdata *sdata)
+{
+    struct mailbox_statusdelta *delta = &mailbox->statusdelta;
+    int count;
+
+    if (delta->lost)
+	return 0;
+    if (mailbox->i.options & OPT_MAILBOX_DELETED)
+	return 0;
+
+    /* was it right when we started? */
+    if (sdata->highestmodseq != delta->modseq ||
+	sdata->uidvalidity != mailbox->i.uidvalidity ||
+	sdata->messages != delta->exists)
+	return 0;
+
+    /* and did we see every change? */
+    if (delta->exists + delta->appended - delta->removed != mailbox->i.exists)
+	return 0;
+
+    if (sdata->internalseen != mailbox_internal_seen(mailbox, sdata->userid))
+	return 0;
+
+    sdata->messages = mailbox->i.exists;
+    sdata->uidnext = mailbox->i.last_uid+1;
+    sdata->highestmodseq = mailbox->i.highestmodseq;
+
+    if (sdata->internalseen) {
+	/* \Seen is in the records, so we saw it change */
+	count = (int) sdata->unseen + delta->unseen;
+	if (count < 0)
+	    sdata->statusitems &= ~STATUS_UNSEEN;
+	sdata->unseen = count;
+
+	count = (int) sdata->recent + delta->recent;
+	if (mailbox->i.recentuid >= mailbox->i.last_uid)
+	    count = 0;
+	else if (mailbox->i.recentuid != delta->recentuid || count < 0)
+	    sdata->statusitems &= ~STATUS_RECENT;
+	sdata->recent = count;
+	sdata->recentuid = mailbox->i.recentuid;
+    }
+    else if (!delta->removed) {
+	/* new messages are both recent and unseen for everyone else */
+	sdata->unseen += delta->appended;
+	sdata->recent += delta->appended;
+    }
+    else {
+	/* no idea which of theirs went */
+	sdata->statusitems &= ~(STATUS_RECENT | STATUS_UNSEEN);
+    }
+
+    return 1;
+}
+
+struct statuscache_updaterock {
+    struct mailbox *mailbox;
     struct db *db;
     struct txn *tid;
 };
 
-static int delete_cb(void *rockp,
-                     const char *key, size_t keylen,
-                     const char *data __attribute__((unused)),
-                     size_t datalen __attribute__((unused))) 
+static int update_cb(void *rockp,
+		     const char *key, size_t keylen,
+		     const char *data, size_t datalen)
 {
     int r;
     char buf[4096];
-    struct statuscache_deleterock *rp = (struct statuscache_deleterock *)rockp;
+    struct statuscache_updaterock *rp = (struct statuscache_updaterock *)rockp;
+    struct mailbox *mailbox = rp->mailbox;
+    struct statusdata sdata;
+    size_t prefixlen = strlen(mailbox->name) + 2;
 
     /* error if it's too big */
-    if (keylen > 4096)
+    if (keylen >= sizeof(buf) || keylen < prefixlen)
 	return 1;
 
-    /* we need to cache a copy, because the delete might re-map
+    /* we need to cache a copy, because the write might re-map
      * the mmap space */
     memcpy(buf, key, keylen);
+    buf[keylen] = '\0';
+
+    if (!statuscache_parse(data, datalen, &sdata)) {
+	sdata.userid = buf + prefixlen;
+	if (statuscache_apply(mailbox, &sdata)) {
+	    statuscache_store(mailbox->name, &sdata, &rp->tid);
+	    return 0;
+	}
+    }
 
     /* Delete db entry */
     r = cyrusdb_delete(rp->db, buf, keylen, &rp->tid, 1);
@@ -379,13 +811,14 @@ static int delete_cb(void *rockp,
     return 0;
 }
 
-HIDDEN int statuscache_invalidate(const char *mboxname, struct statusdata *sdata)
+HIDDEN int statuscache_update(struct mailbox *mailbox,
+			      struct statusdata *sdata)
 {
     size_t keylen;
     char *key;
-    int r;
+    int r = 0;
     int doclose = 0;
-    struct statuscache_deleterock drock;
+    struct statuscache_updaterock urock;
 
     /* if it's disabled then skip */
     if (!config_getswitch(IMAPOPT_STATUSCACHE))
@@ -397,29 +830,33 @@ HIDDEN int statuscache_invalidate(const char *mboxname, struct statusdata *sdata
 	doclose = 1;
     }
 
-    drock.db = statuscachedb;
-    drock.tid = NULL;
+    urock.mailbox = mailbox;
+    urock.db = statuscachedb;
+    urock.tid = NULL;
 
-    key = statuscache_buildkey(mboxname, /*userid*/NULL, &keylen);
+    if (mailbox->has_changed) {
+	key = statuscache_buildkey(mailbox->name, /*userid*/NULL, &keylen);
 
-    r = cyrusdb_foreach(drock.db, key, keylen, NULL, delete_cb,
-		    &drock, &drock.tid);
+	r = cyrusdb_foreach(urock.db, key, keylen, NULL, update_cb,
+			    &urock, &urock.tid);
 
-    if (r != CYRUSDB_OK) {
-	syslog(LOG_ERR, "DBERROR: error invalidating: %s (%s)",
-	       mboxname, cyrusdb_strerror(r));
+	if (r != CYRUSDB_OK) {
+	    syslog(LOG_ERR, "DBERROR: error updating: %s (%s)",
+		   mailbox->name, cyrusdb_strerror(r));
+	}
     }
 
     if (!r && sdata) {
-	r = statuscache_store(mboxname, sdata, &drock.tid);
+	r = statuscache_store(mailbox->name, sdata, &urock.tid);
     }
 
     if (r == CYRUSDB_OK) {
-	cyrusdb_commit(drock.db, drock.tid);
+	if (urock.tid) cyrusdb_commit(urock.db, urock.tid);
     }
     else {
-	syslog(LOG_NOTICE, "DBERROR: failed to store statuscace data for %s", mboxname);
-	if (drock.tid) cyrusdb_abort(drock.db, drock.tid);
+	syslog(LOG_NOTICE, "DBERROR: failed to store statuscace data for %s",
+	       mailbox->name);
+	if (urock.tid) cyrusdb_abort(urock.db, urock.tid);
     }
 
     if (doclose)
@@ -427,4 +864,3 @@ HIDDEN int statuscache_invalidate(const char *mboxname, struct statusdata *sdata
 
     return 0; 
 }
-
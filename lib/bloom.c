@@ -0,0 +1,343 @@
+/* bloom.c -- on-disk bloom filters for negative lookups
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* File format:
+ *
+ * 64 byte header, all numbers in network byte order:
+ *   0: magic (16 bytes)
+ *  16: version
+ *  20: flags
+ *  24: number of bits (64 bit, always a power of two)
+ *  32: number of hashes
+ *  36: unused
+ * followed by the bits themselves.
+ *
+ * Each key is hashed once to 64 bits, and the two halves are
+ * combined to give the bit positions (the Kirsch-Mitzenmacher
+ * trick), which is as good as separate hash functions in practice.
+ *
+ * The file never changes size once it's created - a filter which
+ * has grown too full is replaced by a new file, and the old one
+ * marked as retired so that anyone else using it goes and reopens.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "assert.h"
+#include "bloom.h"
+#include "byteorder64.h"
+#include "mappedfile.h"
+#include "xmalloc.h"
+
+#define BLOOM_MAGIC ("\241\002\213\015bloom file\0\0")
+#define BLOOM_MAGIC_SIZE (16)
+#define BLOOM_VERSION 1
+
+enum {
+    OFFSET_MAGIC = 0,
+    OFFSET_VERSION = 16,
+    OFFSET_FLAGS = 20,
+    OFFSET_NBITS = 24,
+    OFFSET_NHASHES = 32,
+};
+
+#define HEADER_SIZE 64
+
+#define BLOOM_RETIRED (1<<0)
+
+/* bits per expected key, and the smallest filter worth having */
+#define BITS_PER_KEY 16
+#define MINKEYS 4096
+/* optimal would be 11 for 16 bits per key, but every hash is a
+ * potential page fault, and 7 still gives under 0.1% false positives
+ * at the sized load */
+#define NHASHES 7
+
+struct bloom {
+    struct mappedfile *mf;
+    uint64_t nbits;
+    uint32_t nhashes;
+};
+
+#define BASE(b) mappedfile_base((b)->mf)
+
+/* 64 bit FNV-1a, with the murmur3 finalizer to spread the bits -
+ * plain FNV is weak in the high bits for short keys */
+static uint64_t bloom_hash(const char *key, size_t keylen)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < keylen; i++) {
+	h ^= (unsigned char)key[i];
+	h *= 1099511628211ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+EXPORTED int bloom_create(const char *fname, size_t nkeys, struct bloom **bp)
+{
+    struct bloom *b;
+    char header[HEADER_SIZE];
+    uint64_t nbits = 64;
+    int r;
+
+    assert(!*bp);
+
+    if (nkeys < MINKEYS) nkeys = MINKEYS;
+    while (nbits < (uint64_t)nkeys * BITS_PER_KEY)
+	nbits <<= 1;
+
+    /* someone may still have the old one mapped, so it mustn't
+     * shrink underneath them */
+    if (unlink(fname) < 0 && errno != ENOENT) {
+	syslog(LOG_ERR, "IOERROR: unlink %s: %m", fname);
+	return -EIO;
+    }
+
+    b = xzmalloc(sizeof(struct bloom));
+    b->nbits = nbits;
+    b->nhashes = NHASHES;
+
+    r = mappedfile_open(&b->mf, fname, MAPPEDFILE_CREATE | MAPPEDFILE_RW);
+    if (r) goto err;
+
+    memset(header, 0, HEADER_SIZE);
+    memcpy(header + OFFSET_MAGIC, BLOOM_MAGIC, BLOOM_MAGIC_SIZE);
+    *((uint32_t *)(header + OFFSET_VERSION)) = htonl(BLOOM_VERSION);
+    *((uint64_t *)(header + OFFSET_NBITS)) = htonll(b->nbits);
+    *((uint32_t *)(header + OFFSET_NHASHES)) = htonl(b->nhashes);
+
+    if (mappedfile_pwrite(b->mf, header, HEADER_SIZE, 0) < 0) {
+	r = -EIO;
+	goto err;
+    }
+
+    /* the bits start out as a sparse run of zeros */
+    r = mappedfile_truncate(b->mf, HEADER_SIZE + b->nbits / 8);
+    if (r) {
+	r = -EIO;
+	goto err;
+    }
+
+    *bp = b;
+    return 0;
+
+err:
+    if (b->mf) {
+	mappedfile_commit(b->mf);
+	mappedfile_close(&b->mf);
+    }
+    unlink(fname);
+    free(b);
+    return r;
+}
+
+EXPORTED int bloom_open(const char *fname, struct bloom **bp)
+{
+    struct bloom *b;
+    int r;
+
+    assert(!*bp);
+
+    b = xzmalloc(sizeof(struct bloom));
+
+    r = mappedfile_open(&b->mf, fname, MAPPEDFILE_RW);
+    if (r) goto err;
+
+    if (mappedfile_size(b->mf) < HEADER_SIZE ||
+	memcmp(BASE(b) + OFFSET_MAGIC, BLOOM_MAGIC, BLOOM_MAGIC_SIZE)) {
+	syslog(LOG_ERR, "DBERROR: %s: invalid bloom filter header", fname);
+	r = -EINVAL;
+	goto err;
+    }
+
+    if (ntohl(*((uint32_t *)(BASE(b) + OFFSET_VERSION))) > BLOOM_VERSION) {
+	syslog(LOG_ERR, "DBERROR: %s: unknown bloom filter version", fname);
+	r = -EINVAL;
+	goto err;
+    }
+
+    b->nbits = ntohll(*((uint64_t *)(BASE(b) + OFFSET_NBITS)));
+    b->nhashes = ntohl(*((uint32_t *)(BASE(b) + OFFSET_NHASHES)));
+
+    if (!b->nbits || (b->nbits & (b->nbits - 1)) || !b->nhashes ||
+	mappedfile_size(b->mf) < HEADER_SIZE + b->nbits / 8) {
+	syslog(LOG_ERR, "DBERROR: %s: bloom filter truncated", fname);
+	r = -EINVAL;
+	goto err;
+    }
+
+    /* a retired filter is as good as missing */
+    if (bloom_isretired(b)) {
+	r = -ESTALE;
+	goto err;
+    }
+
+    *bp = b;
+    return 0;
+
+err:
+    mappedfile_close(&b->mf);
+    free(b);
+    return r;
+}
+
+EXPORTED int bloom_close(struct bloom **bp)
+{
+    struct bloom *b = *bp;
+    int r;
+
+    /* make this safe to call multiple times */
+    if (!b) return 0;
+
+    r = bloom_commit(b);
+    if (!r) r = mappedfile_close(&b->mf);
+
+    free(b);
+    *bp = NULL;
+
+    return r;
+}
+
+EXPORTED int bloom_add(struct bloom *b, const char *key, size_t keylen)
+{
+    uint64_t h = bloom_hash(key, keylen);
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    uint64_t mask = b->nbits - 1;
+    uint32_t i;
+
+    for (i = 0; i < b->nhashes; i++) {
+	uint64_t bit = ((uint64_t)h1 + (uint64_t)i * h2) & mask;
+	off_t offset = HEADER_SIZE + bit / 8;
+	char c = BASE(b)[offset];
+
+	/* only write if it changes anything, so that commit stays free
+	 * for the common case of a key we've seen before */
+	if (c & (1 << (bit & 7))) continue;
+
+	c |= (1 << (bit & 7));
+	if (mappedfile_pwrite(b->mf, &c, 1, offset) < 0)
+	    return -EIO;
+    }
+
+    return 0;
+}
+
+EXPORTED int bloom_test(const struct bloom *b, const char *key, size_t keylen)
+{
+    uint64_t h = bloom_hash(key, keylen);
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    uint64_t mask = b->nbits - 1;
+    uint32_t i;
+
+    /* somebody's replaced it, we can't know any more */
+    if (bloom_isretired(b)) return 1;
+
+    for (i = 0; i < b->nhashes; i++) {
+	uint64_t bit = ((uint64_t)h1 + (uint64_t)i * h2) & mask;
+	if (!(BASE(b)[HEADER_SIZE + bit / 8] & (1 << (bit & 7))))
+	    return 0;
+    }
+
+    return 1;
+}
+
+EXPORTED int bloom_commit(struct bloom *b)
+{
+    return mappedfile_commit(b->mf);
+}
+
+EXPORTED void bloom_defer(struct bloom *b)
+{
+    mappedfile_defer(b->mf);
+}
+
+EXPORTED int bloom_sync(struct bloom *b)
+{
+    return mappedfile_sync(b->mf);
+}
+
+EXPORTED int bloom_rename(struct bloom *b, const char *newname)
+{
+    return mappedfile_rename(b->mf, newname);
+}
+
+EXPORTED int bloom_retire(struct bloom *b)
+{
+    uint32_t flags;
+
+    flags = ntohl(*((uint32_t *)(BASE(b) + OFFSET_FLAGS)));
+    flags = htonl(flags | BLOOM_RETIRED);
+
+    if (mappedfile_pwrite(b->mf, (char *)&flags, 4, OFFSET_FLAGS) < 0)
+	return -EIO;
+
+    return mappedfile_commit(b->mf);
+}
+
+EXPORTED int bloom_isretired(const struct bloom *b)
+{
+    uint32_t flags = ntohl(*((volatile uint32_t *)(BASE(b) + OFFSET_FLAGS)));
+    return !!(flags & BLOOM_RETIRED);
+}
+
+EXPORTED const char *bloom_fname(const struct bloom *b)
+{
+    return mappedfile_fname(b->mf);
+}
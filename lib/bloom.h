@@ -0,0 +1,88 @@
+/* bloom.h -- on-disk bloom filters for negative lookups
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_LIB_BLOOM_H__
+#define __CYRUS_LIB_BLOOM_H__
+
+#include <sys/types.h>
+
+/* A bloom filter kept in its own file, next to the database it
+ * describes.  bloom_test() never gives a false negative, so a zero
+ * from it means the key is certainly not there.
+ *
+ * Tests don't take any lock - bits are only ever set, and they are
+ * read straight out of a shared map.  Adding is left to the owner of
+ * the database, under whatever lock it uses for writing.  A filter
+ * which has been replaced by a fresh one is marked "retired", and
+ * tests on it always answer "maybe" until the reader opens the new
+ * one. */
+
+struct bloom;
+
+/* create a new, empty filter file sized for about nkeys keys.  Any
+ * existing file is unlinked first rather than truncated, since it
+ * may still be mapped by someone else */
+extern int bloom_create(const char *fname, size_t nkeys, struct bloom **bp);
+/* open an existing filter file - fails if it's missing, broken or
+ * retired */
+extern int bloom_open(const char *fname, struct bloom **bp);
+/* commits anything outstanding first */
+extern int bloom_close(struct bloom **bp);
+
+extern int bloom_add(struct bloom *b, const char *key, size_t keylen);
+/* returns 0 if the key is definitely absent, 1 if it might be there */
+extern int bloom_test(const struct bloom *b, const char *key, size_t keylen);
+/* fsync any added bits - cheap if nothing changed */
+extern int bloom_commit(struct bloom *b);
+/* leave the added bits for a later bloom_sync, maybe in another process */
+extern void bloom_defer(struct bloom *b);
+/* fsync everything added by anyone */
+extern int bloom_sync(struct bloom *b);
+
+extern int bloom_rename(struct bloom *b, const char *newname);
+/* mark as replaced, so everyone else stops trusting it */
+extern int bloom_retire(struct bloom *b);
+extern int bloom_isretired(const struct bloom *b);
+
+extern const char *bloom_fname(const struct bloom *b);
+
+#endif /* __CYRUS_LIB_BLOOM_H__ */
@@ -49,6 +49,11 @@
 #include "chartable.h"
 #include "util.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SEARCH_X86 1
+#include <immintrin.h>
+#endif
+
 #define U_REPLACEMENT	0xfffd
 
 #define unicode_isvalid(c) \
@@ -115,15 +120,28 @@ struct search_state {
     unsigned char *substr;
     size_t patlen;
     size_t offset;
+    /* for the block matchers: search form bytes not yet scanned */
+    unsigned char *buf;
+    size_t buflen;
+    size_t bufsize;
 };
 
+/* bytes of search form text collected before running a block matcher */
+#define SEARCH_BLOCKSIZE 4096
+
+typedef int search_block_t(const unsigned char *pat, size_t patlen,
+			   const unsigned char *s, size_t len);
+
 struct convert_rock;
 
 typedef void convertproc_t(struct convert_rock *rock, int c);
+typedef void convertblockproc_t(struct convert_rock *rock,
+				const unsigned char *s, size_t len);
 typedef void freeconvert_t(struct convert_rock *rock);
 
 struct convert_rock {
     convertproc_t *f;
+    convertblockproc_t *fblock;	/* optional, takes a run of bytes at once */
     freeconvert_t *cleanup;
     struct convert_rock *next;
     void *state;
@@ -131,6 +149,10 @@ struct convert_rock {
 
 #define GROWSIZE 100
 
+/* how much input the block converters decode before pushing the
+ * result downstream */
+#define CONVERT_BLOCKSIZE 4096
+
 #define XX 127
 /*
  * Table for decoding hexadecimal in quoted-printable
@@ -204,6 +226,11 @@ static void convert_cat(struct convert_rock *rock, const char *s)
 
 static void convert_catn(struct convert_rock *rock, const char *s, size_t len)
 {
+    if (rock->fblock) {
+	rock->fblock(rock, (const unsigned char *)s, len);
+	return;
+    }
+
     while (len-- > 0) {
 	convert_putc(rock, (unsigned char)*s);
 	s++;
@@ -282,6 +309,104 @@ static void b64_2byte(struct convert_rock *rock, int c)
     }
 }
 
+/* convertblockproc_t conversion functions.  These handle the common
+ * cases in a tight loop and hand anything unusual (invalid or split
+ * escapes, whitespace, padding) to the bytewise converter above, so
+ * the two always agree on the output and on the state left behind */
+
+static void qp2byte_block(struct convert_rock *rock,
+			  const unsigned char *p, size_t len)
+{
+    struct qp_state *s = (struct qp_state *)rock->state;
+    const unsigned char *end = p + len;
+    unsigned char out[CONVERT_BLOCKSIZE];
+    size_t n = 0;
+    int c, hi, lo;
+
+    /* finish an encoded byte left over from last time */
+    while (s->bytesleft && p < end)
+	qp2byte(rock, *p++);
+
+    while (p < end) {
+	if (n == sizeof(out)) {
+	    convert_catn(rock->next, (char *)out, n);
+	    n = 0;
+	}
+
+	c = *p;
+	if (c == '=') {
+	    if (end - p >= 3) {
+		hi = HEXCHAR(p[1]);
+		lo = HEXCHAR(p[2]);
+		if (hi != XX && lo != XX) {
+		    out[n++] = (hi << 4) | lo;
+		    p += 3;
+		    continue;
+		}
+	    }
+	    /* soft line break, bad escape or one split across calls */
+	    convert_catn(rock->next, (char *)out, n);
+	    n = 0;
+	    qp2byte(rock, *p++);
+	    while (s->bytesleft && p < end)
+		qp2byte(rock, *p++);
+	    continue;
+	}
+
+	/* underscores are space in headers */
+	if (s->isheader && c == '_') c = ' ';
+
+	out[n++] = c;
+	p++;
+    }
+
+    convert_catn(rock->next, (char *)out, n);
+}
+
+static void b64_2byte_block(struct convert_rock *rock,
+			    const unsigned char *p, size_t len)
+{
+    struct b64_state *s = (struct b64_state *)rock->state;
+    const unsigned char *end = p + len;
+    unsigned char out[CONVERT_BLOCKSIZE];
+    size_t n = 0;
+    int a, b, c, d;
+
+    /* finish a quantum left over from last time */
+    while (s->bytesleft && p < end)
+	b64_2byte(rock, *p++);
+
+    while (p < end) {
+	if (n + 3 > sizeof(out)) {
+	    convert_catn(rock->next, (char *)out, n);
+	    n = 0;
+	}
+
+	if (end - p >= 4) {
+	    a = CHAR64(p[0]);
+	    b = CHAR64(p[1]);
+	    c = CHAR64(p[2]);
+	    d = CHAR64(p[3]);
+	    if (a != XX && b != XX && c != XX && d != XX) {
+		out[n++] = ((a << 2) | (b >> 4)) & 0xff;
+		out[n++] = ((b << 4) | (c >> 2)) & 0xff;
+		out[n++] = ((c << 6) | d) & 0xff;
+		p += 4;
+		continue;
+	    }
+	}
+
+	/* line break, padding or a quantum split across calls */
+	convert_catn(rock->next, (char *)out, n);
+	n = 0;
+	b64_2byte(rock, *p++);
+	while (s->bytesleft && p < end)
+	    b64_2byte(rock, *p++);
+    }
+
+    convert_catn(rock->next, (char *)out, n);
+}
+
 static void stripnl2uni(struct convert_rock *rock, int c)
 {
     if (c != '\r' && c != '\n')
@@ -511,6 +636,117 @@ static void uni2utf8(struct convert_rock *rock, int c)
     }
 }
 
+/* block substring matchers.  Each returns nonzero iff 'pat' occurs
+ * anywhere in the 'len' bytes at 's' */
+
+static int search_block_scalar(const unsigned char *pat, size_t patlen,
+			       const unsigned char *s, size_t len)
+{
+    const unsigned char *p = s;
+    const unsigned char *end = s + len;
+
+    if (len < patlen) return 0;
+    end -= patlen - 1;
+
+    while (p < end) {
+	p = memchr(p, pat[0], end - p);
+	if (!p) return 0;
+	if (!memcmp(p + 1, pat + 1, patlen - 1)) return 1;
+	p++;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_SEARCH_X86
+/* Compare the first and last bytes of the pattern against 16 or 32
+ * candidate positions at a time, and only memcmp() the positions
+ * where both agree.  The tail that doesn't fill a vector goes to
+ * the scalar matcher. */
+
+__attribute__((target("sse2")))
+static int search_block_sse2(const unsigned char *pat, size_t patlen,
+			     const unsigned char *s, size_t len)
+{
+    const __m128i first = _mm_set1_epi8((char)pat[0]);
+    const __m128i last = _mm_set1_epi8((char)pat[patlen-1]);
+    size_t inner = patlen > 2 ? patlen - 2 : 0;
+    size_t i = 0;
+
+    if (len < patlen) return 0;
+
+    for (; i + patlen - 1 + 16 <= len; i += 16) {
+	__m128i bf = _mm_loadu_si128((const __m128i *)(s + i));
+	__m128i bl = _mm_loadu_si128((const __m128i *)(s + i + patlen - 1));
+	unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(bf, first),
+							_mm_cmpeq_epi8(bl, last)));
+	while (mask) {
+	    unsigned bit = __builtin_ctz(mask);
+	    if (!memcmp(s + i + bit + 1, pat + 1, inner)) return 1;
+	    mask &= mask - 1;
+	}
+    }
+
+    return search_block_scalar(pat, patlen, s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int search_block_avx2(const unsigned char *pat, size_t patlen,
+			     const unsigned char *s, size_t len)
+{
+    const __m256i first = _mm256_set1_epi8((char)pat[0]);
+    const __m256i last = _mm256_set1_epi8((char)pat[patlen-1]);
+    size_t inner = patlen > 2 ? patlen - 2 : 0;
+    size_t i = 0;
+
+    if (len < patlen) return 0;
+
+    for (; i + patlen - 1 + 32 <= len; i += 32) {
+	__m256i bf = _mm256_loadu_si256((const __m256i *)(s + i));
+	__m256i bl = _mm256_loadu_si256((const __m256i *)(s + i + patlen - 1));
+	unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(bf, first),
+							      _mm256_cmpeq_epi8(bl, last)));
+	while (mask) {
+	    unsigned bit = __builtin_ctz(mask);
+	    if (!memcmp(s + i + bit + 1, pat + 1, inner)) return 1;
+	    mask &= mask - 1;
+	}
+    }
+
+    return search_block_sse2(pat, patlen, s + i, len - i);
+}
+#endif /* HAVE_SEARCH_X86 */
+
+static int search_impl = CHARSET_SEARCH_AUTO;
+static search_block_t *search_block = NULL;
+static const char *search_block_name = NULL;
+
+static void search_choose(void)
+{
+    search_block = search_block_scalar;
+    search_block_name = "scalar";
+
+    if (search_impl == CHARSET_SEARCH_BYTEWISE) {
+	search_block = NULL;
+	search_block_name = "bytewise";
+	return;
+    }
+    if (search_impl == CHARSET_SEARCH_SCALAR)
+	return;
+
+#ifdef HAVE_SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	search_block = search_block_avx2;
+	search_block_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+	search_block = search_block_sse2;
+	search_block_name = "sse2";
+    }
+#endif
+}
+
 static void byte2search(struct convert_rock *rock, int c)
 {
     struct search_state *s = (struct search_state *)rock->state;
@@ -558,6 +794,57 @@ static void byte2search(struct convert_rock *rock, int c)
     s->offset++;
 }
 
+/* scan the collected bytes, keeping enough of the tail to catch
+ * a match which straddles into the next block */
+static void search_flush(struct search_state *s)
+{
+    size_t keep = s->patlen - 1;
+
+    if (s->havematch || s->buflen < s->patlen)
+	return;
+
+    if (search_block(s->substr, s->patlen, s->buf, s->buflen)) {
+	s->havematch = 1;
+	return;
+    }
+
+    memmove(s->buf, s->buf + s->buflen - keep, keep);
+    s->buflen = keep;
+}
+
+static void byte2searchbuf(struct convert_rock *rock, int c)
+{
+    struct search_state *s = (struct search_state *)rock->state;
+
+    if (s->havematch)
+	return;
+
+    if (c == 0xfffd) {
+	c = 0xff; /* searchable by invalid character! */
+    }
+
+    s->buf[s->buflen++] = (unsigned char)c;
+    if (s->buflen == s->bufsize)
+	search_flush(s);
+}
+
+static void byte2searchbuf_block(struct convert_rock *rock,
+				 const unsigned char *p, size_t len)
+{
+    struct search_state *s = (struct search_state *)rock->state;
+    size_t n;
+
+    while (len && !s->havematch) {
+	n = MIN(len, s->bufsize - s->buflen);
+	memcpy(s->buf + s->buflen, p, n);
+	s->buflen += n;
+	p += n;
+	len -= n;
+	if (s->buflen == s->bufsize)
+	    search_flush(s);
+    }
+}
+
 static void byte2buffer(struct convert_rock *rock, int c)
 {
     struct buf *buf = (struct buf *)rock->state;
@@ -565,6 +852,14 @@ static void byte2buffer(struct convert_rock *rock, int c)
     buf_putc(buf, c & 0xff);
 }
 
+static void byte2buffer_block(struct convert_rock *rock,
+			      const unsigned char *p, size_t len)
+{
+    struct buf *buf = (struct buf *)rock->state;
+
+    buf_appendmap(buf, (const char *)p, len);
+}
+
 /* convert_rock manipulation routines */
 
 static void table_switch(struct convert_rock *rock, int charset_num)
@@ -615,6 +910,15 @@ static inline int search_havematch(struct convert_rock *rock)
     return s->havematch;
 }
 
+/* like search_havematch, but first scans anything still buffered.
+ * Call this once all the input has been fed in */
+static int search_result(struct convert_rock *rock)
+{
+    struct search_state *s = (struct search_state *)rock->state;
+    if (s->buf) search_flush(s);
+    return s->havematch;
+}
+
 /* conversion cleanup routines */
 
 static void basic_free(struct convert_rock *rock)
@@ -630,6 +934,7 @@ static void search_free(struct convert_rock *rock)
     if (rock && rock->state) {
 	struct search_state *s = (struct search_state *)rock->state;
 	if (s->starts) free(s->starts);
+	if (s->buf) free(s->buf);
     }
     basic_free(rock);
 }
@@ -664,6 +969,7 @@ static struct convert_rock *qp_init(int isheader, struct convert_rock *next)
     s->isheader = isheader;
     rock->state = (void *)s;
     rock->f = qp2byte;
+    rock->fblock = qp2byte_block;
     rock->next = next;
     return rock;
 }
@@ -673,6 +979,7 @@ static struct convert_rock *b64_init(struct convert_rock *next)
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     rock->state = xzmalloc(sizeof(struct b64_state));
     rock->f = b64_2byte;
+    rock->fblock = b64_2byte_block;
     rock->next = next;
     return rock;
 }
@@ -724,14 +1031,25 @@ static struct convert_rock *search_init(const char *substr, comp_pat *pat) {
     s->patlen = p->patlen;
     s->substr = (unsigned char *)substr;
 
-    /* allocate tracking space and initialise to "no match" */
-    s->starts = xmalloc(s->max_start * sizeof(size_t));
-    for (i = 0; i < s->max_start; i++) {
-	s->starts[i] = -1;
+    if (!search_block_name) search_choose();
+
+    if (search_block && s->patlen) {
+	/* collect a block at a time for the block matcher */
+	s->bufsize = SEARCH_BLOCKSIZE + s->patlen;
+	s->buf = xmalloc(s->bufsize);
+	rock->f = byte2searchbuf;
+	rock->fblock = byte2searchbuf_block;
+    }
+    else {
+	/* allocate tracking space and initialise to "no match" */
+	s->starts = xmalloc(s->max_start * sizeof(size_t));
+	for (i = 0; i < s->max_start; i++) {
+	    s->starts[i] = -1;
+	}
+	rock->f = byte2search;
     }
 
     /* set up the rock */
-    rock->f = byte2search;
     rock->cleanup = search_free;
     rock->state = (void *)s;
 
@@ -744,6 +1062,7 @@ static struct convert_rock *buffer_init(void)
     struct buf *buf = xzmalloc(sizeof(struct buf));
 
     rock->f = byte2buffer;
+    rock->fblock = byte2buffer_block;
     rock->cleanup = buffer_free;
     rock->state = (void *)buf;
 
@@ -1034,7 +1353,7 @@ EXPORTED int charset_search_mimeheader(const char *substr, comp_pat *pat,
 
     mimeheader_cat(input, s);
  
-    res = search_havematch(tosearch);
+    res = search_result(tosearch);
 
     convert_free(input);
 
@@ -1068,6 +1387,19 @@ EXPORTED void charset_freepat(comp_pat *pat)
     free((struct comp_pat_s *)pat);
 }
 
+/*
+ * Choose the substring matcher used by the search functions, one of
+ * the CHARSET_SEARCH_* values.  CHARSET_SEARCH_AUTO (the default)
+ * picks the fastest one this CPU supports.  Returns the name of the
+ * matcher in use.
+ */
+EXPORTED const char *charset_search_use(int impl)
+{
+    search_impl = impl;
+    search_choose();
+    return search_block_name;
+}
+
 /*
  * Search for the string 'substr', with compiled pattern 'pat'
  * in the string 's', with length 'len'.  Return nonzero if match
@@ -1101,7 +1433,7 @@ EXPORTED int charset_searchstring(const char *substr, comp_pat *pat,
     }
 
     /* copy the value */
-    res = search_havematch(tosearch);
+    res = search_result(tosearch);
 
     /* clean up */
     convert_free(input);
@@ -1121,7 +1453,7 @@ EXPORTED int charset_searchfile(const char *substr, comp_pat *pat,
 		       int charset, int encoding, int flags)
 {
     struct convert_rock *input, *tosearch;
-    size_t i;
+    size_t i, n;
     int res;
 
     /* Initialize character set mapping */
@@ -1160,13 +1492,15 @@ EXPORTED int charset_searchfile(const char *substr, comp_pat *pat,
 	return 0;
     }
 
-    /* implement the loop here so we can check on the search each time */
-    for (i = 0; i < len; i++) {
-	convert_putc(input, msg_base[i]);
+    /* implement the loop here so we can check on the search after
+     * each block */
+    for (i = 0; i < len; i += n) {
+	n = MIN(len - i, CONVERT_BLOCKSIZE);
+	convert_catn(input, msg_base + i, n);
 	if (search_havematch(tosearch)) break;
     }
 
-    res = search_havematch(tosearch); /* copy before we free it */
+    res = search_result(tosearch); /* copy before we free it */
 
     convert_free(input);
 
@@ -1182,7 +1516,7 @@ EXPORTED int charset_extractitem(index_search_text_receiver_t receiver,
 {
     struct convert_rock *input, *tobuffer;
     struct buf *out;
-    size_t i;
+    size_t i, n;
 
     /* Initialize character set mapping */
     if (charset < 0 || charset >= chartables_num_charsets) 
@@ -1218,8 +1552,9 @@ EXPORTED int charset_extractitem(index_search_text_receiver_t receiver,
     /* point to the buffer for easy block sending */
     out = (struct buf *)tobuffer->state;
 
-    for (i = 0; i < len; i++) {
-	convert_putc(input, msg_base[i]);
+    for (i = 0; i < len; i += n) {
+	n = MIN(len - i, CONVERT_BLOCKSIZE);
+	convert_catn(input, msg_base + i, n);
 
 	/* process a block of output every so often */
 	if (buf_len(out) > 4096) {
@@ -68,6 +68,12 @@ extern const char *charset_name(charset_index);
 extern charset_index charset_lookupname(const char *name);
 extern comp_pat *charset_compilepat(const char *s);
 extern void charset_freepat(comp_pat *pat);
+
+/* substring matchers for charset_search_use() */
+#define CHARSET_SEARCH_AUTO	0	/* best available for this CPU */
+#define CHARSET_SEARCH_SCALAR	1	/* portable block matcher */
+#define CHARSET_SEARCH_BYTEWISE	2	/* original byte at a time matcher */
+extern const char *charset_search_use(int impl);
 extern int charset_searchstring(const char *substr, comp_pat *pat,
 			        const char *s, size_t len, int flags);
 extern int charset_searchfile(const char *substr, comp_pat *pat,
@@ -6,29 +6,49 @@
 #include "util.h"
 #include "string.h"
 
+#ifdef HAVE_PCLMUL
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
+
+/*
+ * All the implementations below work on the CRC register, before the
+ * final inversion: crc32_map() starts with ~0 and inverts the result.
+ * crc32_update points at the fastest one this machine can run, picked
+ * the first time it is called, unless crc32_set_implementation() has
+ * picked one itself.
+ */
+typedef uint32_t crc32_update_t(uint32_t crc, const uint8_t *p, size_t len);
+
+static crc32_update_t crc32_update_init;
+static crc32_update_t *crc32_update = crc32_update_init;
+static const char *crc32_impl = "none";
+
 #ifdef HAVE_ZLIB
 
 #include <zlib.h>
 
-EXPORTED uint32_t crc32_map(const char *base, unsigned len)
+static uint32_t crc32_update_zlib(uint32_t crc, const uint8_t *p,
+				  size_t len)
 {
-    uint32_t crc = crc32(0L, Z_NULL, 0);
-    crc = crc32(crc, (const unsigned char *)base, len);
-    return crc;
-}
+    uLong c = ~crc & 0xffffffff;
 
-EXPORTED uint32_t crc32_iovec(struct iovec *iov, int iovcnt)
-{
-    int n;
-    uint32_t crc = crc32(0L, Z_NULL, 0);
-    for (n = 0; n < iovcnt; n++) {
-	if (iov[n].iov_len)
-	    crc = crc32(crc, (const unsigned char *)iov[n].iov_base, iov[n].iov_len);
+    /* zlib would take a NULL buffer as a request for the initial value */
+    if (!len) return crc;
+
+    /* zlib takes a uInt length */
+    while (len > 0x40000000) {
+	c = crc32(c, p, 0x40000000);
+	p += 0x40000000;
+	len -= 0x40000000;
     }
-    return crc;
+    c = crc32(c, p, len);
+
+    return ~c;
 }
 
-#else
+#endif /* HAVE_ZLIB */
 
 /*-
  *  COPYRIGHT (C) 1986 Gary S. Brown.  You may use this program, or
@@ -144,15 +164,227 @@ static uint32_t crc32_tab[] = {
  */
 
 
-EXPORTED uint32_t crc32_map(const char *base, unsigned len)
+/* crc32_tab[] extended to eight tables, so that eight bytes can be
+ * consumed at once */
+static uint32_t crc32_tab8[8][256];
+
+static void crc32_init_slice8(void)
 {
-    uint32_t crc = ~0U;
-    const uint8_t *p = (const uint8_t *)base;
-    
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+	crc32_tab8[0][i] = crc32_tab[i];
+	for (k = 1; k < 8; k++)
+	    crc32_tab8[k][i] = (crc32_tab8[k-1][i] >> 8) ^
+			       crc32_tab[crc32_tab8[k-1][i] & 0xFF];
+    }
+}
+
+static uint32_t crc32_update_slice8(uint32_t crc, const uint8_t *p,
+				    size_t len)
+{
+    while (len >= 8) {
+	uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+	uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+
+	crc = crc32_tab8[7][lo & 0xFF] ^ crc32_tab8[6][(lo >> 8) & 0xFF] ^
+	      crc32_tab8[5][(lo >> 16) & 0xFF] ^ crc32_tab8[4][lo >> 24] ^
+	      crc32_tab8[3][hi & 0xFF] ^ crc32_tab8[2][(hi >> 8) & 0xFF] ^
+	      crc32_tab8[1][(hi >> 16) & 0xFF] ^ crc32_tab8[0][hi >> 24];
+	p += 8;
+	len -= 8;
+    }
+
     while (len--)
 	crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
 
-    return crc ^ ~0U;
+    return crc;
+}
+
+/* zlib's is the faster of the two, where we have it */
+#ifdef HAVE_ZLIB
+#define crc32_update_generic crc32_update_zlib
+#define CRC32_GENERIC "zlib"
+#else
+#define crc32_update_generic crc32_update_slice8
+#define CRC32_GENERIC "slice8"
+#endif
+
+#ifdef HAVE_PCLMUL
+
+/*
+ * Fold the buffer 64 bytes at a time with carry-less multiplies, as
+ * in Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction", then reduce to 32 bits with a Barrett
+ * reduction.  The constants are powers of x modulo the (bit reflected)
+ * CRC-32 polynomial: x^(4*128+32), x^(4*128-32), x^(128+32),
+ * x^(128-32), x^64, and the polynomial and its Barrett quotient.
+ * 'len' must be a multiple of 16, and at least 64.
+ */
+#define CLMUL_LO(a, b) _mm_clmulepi64_si128((a), (b), 0x00)
+#define CLMUL_HI(a, b) _mm_clmulepi64_si128((a), (b), 0x11)
+#define LOAD128(p) _mm_loadu_si128((const __m128i *)(p))
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul(uint32_t crc, const uint8_t *p, size_t len)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596LL, 0x154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eLL, 0x1751997d0LL);
+    const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x1f7011641LL, 0x1db710641LL);
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+    __m128i x0, x1, x2, x3, y0, y1, y2, y3;
+
+    x0 = _mm_xor_si128(LOAD128(p), _mm_cvtsi32_si128(crc));
+    x1 = LOAD128(p + 16);
+    x2 = LOAD128(p + 32);
+    x3 = LOAD128(p + 48);
+    p += 64;
+    len -= 64;
+
+    while (len >= 64) {
+	y0 = CLMUL_HI(x0, k1k2);
+	y1 = CLMUL_HI(x1, k1k2);
+	y2 = CLMUL_HI(x2, k1k2);
+	y3 = CLMUL_HI(x3, k1k2);
+	x0 = CLMUL_LO(x0, k1k2);
+	x1 = CLMUL_LO(x1, k1k2);
+	x2 = CLMUL_LO(x2, k1k2);
+	x3 = CLMUL_LO(x3, k1k2);
+	x0 = _mm_xor_si128(_mm_xor_si128(x0, y0), LOAD128(p));
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, y1), LOAD128(p + 16));
+	x2 = _mm_xor_si128(_mm_xor_si128(x2, y2), LOAD128(p + 32));
+	x3 = _mm_xor_si128(_mm_xor_si128(x3, y3), LOAD128(p + 48));
+	p += 64;
+	len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    y0 = CLMUL_HI(x0, k3k4);
+    x0 = _mm_xor_si128(_mm_xor_si128(CLMUL_LO(x0, k3k4), y0), x1);
+    y0 = CLMUL_HI(x0, k3k4);
+    x0 = _mm_xor_si128(_mm_xor_si128(CLMUL_LO(x0, k3k4), y0), x2);
+    y0 = CLMUL_HI(x0, k3k4);
+    x0 = _mm_xor_si128(_mm_xor_si128(CLMUL_LO(x0, k3k4), y0), x3);
+
+    while (len >= 16) {
+	y0 = CLMUL_HI(x0, k3k4);
+	x0 = _mm_xor_si128(_mm_xor_si128(CLMUL_LO(x0, k3k4), y0), LOAD128(p));
+	p += 16;
+	len -= 16;
+    }
+
+    /* 128 bits down to 64, appending 32 zero bits */
+    y0 = _mm_clmulepi64_si128(x0, k3k4, 0x10);
+    x0 = _mm_xor_si128(_mm_srli_si128(x0, 8), y0);
+
+    /* ...and down to 32 */
+    y0 = _mm_srli_si128(x0, 4);
+    x0 = _mm_xor_si128(CLMUL_LO(_mm_and_si128(x0, mask32), k5), y0);
+
+    /* Barrett reduction */
+    y0 = x0;
+    x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x10);
+    x0 = CLMUL_LO(_mm_and_si128(x0, mask32), poly);
+    x0 = _mm_xor_si128(x0, y0);
+
+    return _mm_extract_epi32(x0, 1);
+}
+
+static uint32_t crc32_update_pclmul(uint32_t crc, const uint8_t *p,
+				    size_t len)
+{
+    size_t n = len & ~(size_t)15;
+
+    /* not worth setting up the folding for short buffers */
+    if (n < 64)
+	return crc32_update_generic(crc, p, len);
+
+    crc = crc32_fold_pclmul(crc, p, n);
+    return crc32_update_generic(crc, p + n, len - n);
+}
+
+static int crc32_have_pclmul(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+	   (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+
+#endif /* HAVE_PCLMUL */
+
+static uint32_t crc32_update_init(uint32_t crc, const uint8_t *p, size_t len)
+{
+    crc32_init_slice8();
+    crc32_update = crc32_update_generic;
+    crc32_impl = CRC32_GENERIC;
+
+#ifdef HAVE_PCLMUL
+    if (crc32_have_pclmul()) {
+	crc32_update = crc32_update_pclmul;
+	crc32_impl = "pclmul";
+    }
+#endif
+
+    return crc32_update(crc, p, len);
+}
+
+static const struct {
+    const char *name;
+    crc32_update_t *update;
+} crc32_impls[] = {
+#ifdef HAVE_PCLMUL
+    { "pclmul", crc32_update_pclmul },
+#endif
+#ifdef HAVE_ZLIB
+    { "zlib", crc32_update_zlib },
+#endif
+    { "slice8", crc32_update_slice8 },
+    { NULL, NULL }
+};
+
+/* Which implementation crc32_map() and friends use, for benchmarks */
+EXPORTED const char *crc32_implementation(void)
+{
+    if (crc32_update == crc32_update_init)
+	crc32_update(~0U, NULL, 0);
+    return crc32_impl;
+}
+
+/* Make crc32_map() and friends use the named implementation, or the
+ * fastest again if 'name' is NULL, so tests can check each of them.
+ * Returns -1 if this build or machine can't run the one named. */
+EXPORTED int crc32_set_implementation(const char *name)
+{
+    int i;
+
+    /* the slice-by-8 tables, which the others fall back on too */
+    crc32_implementation();
+
+    if (!name) {
+	crc32_update = crc32_update_init;
+	return 0;
+    }
+
+    for (i = 0; crc32_impls[i].name; i++) {
+	if (strcmp(crc32_impls[i].name, name)) continue;
+#ifdef HAVE_PCLMUL
+	if (crc32_impls[i].update == crc32_update_pclmul &&
+	    !crc32_have_pclmul())
+	    return -1;
+#endif
+	crc32_update = crc32_impls[i].update;
+	crc32_impl = crc32_impls[i].name;
+	return 0;
+    }
+
+    return -1;
+}
+
+EXPORTED uint32_t crc32_map(const char *base, unsigned len)
+{
+    return ~crc32_update(~0U, (const uint8_t *)base, len);
 }
 
 EXPORTED uint32_t crc32_iovec(struct iovec *iov, int iovcnt)
@@ -161,18 +393,14 @@ EXPORTED uint32_t crc32_iovec(struct iovec *iov, int iovcnt)
     int n;
 
     for (n = 0; n < iovcnt; n++) {
-	size_t len = iov[n].iov_len;
-	const uint8_t *p = (const uint8_t *)iov[n].iov_base;
-
-	while (len--)
-	    crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	if (iov[n].iov_len)
+	    crc = crc32_update(crc, (const uint8_t *)iov[n].iov_base,
+			       iov[n].iov_len);
     }
 
-    return crc ^ ~0U;
+    return ~crc;
 }
 
-#endif
-
 EXPORTED uint32_t crc32_buf(const struct buf *buf)
 {
     return crc32_map(buf->s, buf->len);
@@ -15,5 +15,7 @@ uint32_t crc32_map(const char *base, unsigned len);
 uint32_t crc32_buf(const struct buf *buf);
 uint32_t crc32_cstring(const char *buf);
 uint32_t crc32_iovec(struct iovec *iov, int iovcnt);
+const char *crc32_implementation(void);
+int crc32_set_implementation(const char *name);
 
 #endif
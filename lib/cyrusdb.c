@@ -93,6 +93,7 @@ static struct cyrusdb_backend *_backends[] = {
 struct db {
     struct dbengine *engine;
     struct cyrusdb_backend *backend;
+    unsigned changes;		/* writes through this handle, for cursors */
 };
 
 static struct cyrusdb_backend *cyrusdb_fromname(const char *name)
@@ -173,6 +174,15 @@ EXPORTED int cyrusdb_open(const char *backend, const char *fname,
     r = db->backend->open(fname, flags, &db->engine);
 
 done:
+    if (!r && (flags & CYRUSDB_BLOOM) && !db->backend->bloom) {
+	static int warned = 0;
+
+	/* it's only a hint, but someone asked for it */
+	if (!warned++)
+	    syslog(LOG_WARNING, "cyrusdb: backend %s keeps no bloom filter, "
+		   "ignoring the bloom option for %s",
+		   db->backend->name, fname);
+    }
 
     if (r) free(db);
     else *ret = db;
@@ -233,6 +243,7 @@ EXPORTED int cyrusdb_create(struct db *db,
 	      const char *data, size_t datalen,
 	      struct txn **tid)
 {
+    db->changes++;
     return db->backend->create(db->engine, key, keylen, data, datalen, tid);
 }
 
@@ -241,6 +252,7 @@ EXPORTED int cyrusdb_store(struct db *db,
 	     const char *data, size_t datalen,
 	     struct txn **tid)
 {
+    db->changes++;
     return db->backend->store(db->engine, key, keylen, data, datalen, tid);
 }
 
@@ -248,16 +260,19 @@ EXPORTED int cyrusdb_delete(struct db *db,
 	      const char *key, size_t keylen,
 	      struct txn **tid, int force)
 {
+    db->changes++;
     return db->backend->delete(db->engine, key, keylen, tid, force);
 }
 
 EXPORTED int cyrusdb_commit(struct db *db, struct txn *tid)
 {
+    db->changes++;
     return db->backend->commit(db->engine, tid);
 }
 
 EXPORTED int cyrusdb_abort(struct db *db, struct txn *tid)
 {
+    db->changes++;
     return db->backend->abort(db->engine, tid);
 }
 
@@ -288,6 +303,335 @@ EXPORTED int cyrusdb_compar(struct db *db,
 
 /**********************************************/
 
+/* how many records the fallback reads ahead at a time, for backends
+ * whose foreach() gives them in order.  It starts small for short
+ * ranges and doubles with each read */
+#define CURSOR_WINDOW_MIN 16
+#define CURSOR_WINDOW_MAX 1024
+
+/* returned by the callbacks to stop foreach() once they have enough */
+#define CURSOR_DONE 1
+
+struct cursor_record {
+    struct buf key;
+    struct buf data;
+};
+
+struct cyrusdb_cursor {
+    struct db *db;
+    struct dbcursor *engine;	/* if the backend has cursors */
+
+    /* otherwise, where we are */
+    struct txn **tid;
+    enum { CURSOR_GAP, CURSOR_ON, CURSOR_END } state;
+    struct buf keybuf;
+    struct buf databuf;
+
+    /* and for sorted backends, the records read ahead of us in the
+     * direction of the last step, nearest first */
+    struct cursor_record *ahead;
+    int alloc;
+    int nahead;
+    int next;		/* the next one to step onto */
+    int window;		/* how many to read next time */
+    int forward;	/* which way they were read */
+    int atedge;		/* and there's nothing beyond them */
+    unsigned changes;	/* db->changes when they were read */
+};
+
+/* is the record on the position, or behind it going this way? */
+static int cursor_behind(struct cyrusdb_cursor *c, int forward,
+			 const char *key, size_t keylen)
+{
+    struct db *db = c->db;
+    int cmp;
+
+    if (c->state == CURSOR_END)
+	return 0;
+
+    cmp = db->backend->compar(db->engine, key, keylen,
+			      c->keybuf.s, c->keybuf.len);
+
+    return forward ? (cmp < 0 || (!cmp && c->state == CURSOR_ON))
+		   : cmp >= 0;
+}
+
+struct cursor_rock {
+    struct cyrusdb_cursor *cursor;
+    int forward;
+    int found;
+    struct cursor_record rec;
+};
+
+/* the closest record in the right direction, whatever order foreach
+ * gives them to us in */
+static int cursor_cb(void *rock,
+		     const char *key, size_t keylen,
+		     const char *data, size_t datalen)
+{
+    struct cursor_rock *cr = (struct cursor_rock *)rock;
+    struct cyrusdb_cursor *c = cr->cursor;
+    struct db *db = c->db;
+    int cmp;
+
+    if (cursor_behind(c, cr->forward, key, keylen))
+	return 0;
+
+    if (cr->found) {
+	cmp = db->backend->compar(db->engine, key, keylen,
+				  cr->rec.key.s, cr->rec.key.len);
+	if (cr->forward ? cmp >= 0 : cmp <= 0)
+	    return 0;
+    }
+
+    buf_setmap(&cr->rec.key, key, keylen);
+    buf_setmap(&cr->rec.data, data, datalen);
+    cr->found = 1;
+
+    return 0;
+}
+
+/* with records in order, the next 'window' after the position, and
+ * then stop */
+static int cursor_ahead_cb(void *rock,
+			   const char *key, size_t keylen,
+			   const char *data, size_t datalen)
+{
+    struct cyrusdb_cursor *c = (struct cyrusdb_cursor *)rock;
+    struct cursor_record *cr;
+
+    if (cursor_behind(c, 1, key, keylen))
+	return 0;
+
+    cr = &c->ahead[c->nahead++];
+    buf_setmap(&cr->key, key, keylen);
+    buf_setmap(&cr->data, data, datalen);
+
+    return (c->nahead == c->window) ? CURSOR_DONE : 0;
+}
+
+/* with records in order, the last 'window' before the position, kept
+ * in a ring, stopping when we reach it */
+static int cursor_behind_cb(void *rock,
+			    const char *key, size_t keylen,
+			    const char *data, size_t datalen)
+{
+    struct cyrusdb_cursor *c = (struct cyrusdb_cursor *)rock;
+    struct cursor_record *cr;
+
+    if (cursor_behind(c, 0, key, keylen))
+	return CURSOR_DONE;
+
+    cr = &c->ahead[c->nahead++ % c->window];
+    buf_setmap(&cr->key, key, keylen);
+    buf_setmap(&cr->data, data, datalen);
+
+    return 0;
+}
+
+static void cursor_forget(struct cyrusdb_cursor *c)
+{
+    c->nahead = c->next = 0;
+    c->atedge = 0;
+}
+
+/* read the next window's worth of records in this direction */
+static int cursor_read(struct cyrusdb_cursor *c, int forward)
+{
+    int r, i, n;
+
+    if (c->alloc < c->window) {
+	c->ahead = xrealloc(c->ahead, c->window * sizeof(*c->ahead));
+	memset(c->ahead + c->alloc, 0,
+	       (c->window - c->alloc) * sizeof(*c->ahead));
+	c->alloc = c->window;
+    }
+
+    cursor_forget(c);
+    c->forward = forward;
+    c->changes = c->db->changes;
+
+    r = cyrusdb_foreach(c->db, NULL, 0, NULL,
+			forward ? cursor_ahead_cb : cursor_behind_cb,
+			c, c->tid);
+    /* not every backend passes on why the callback stopped it */
+    if (r && r != CURSOR_DONE) {
+	cursor_forget(c);
+	return r;
+    }
+
+    if (forward) {
+	c->atedge = (c->nahead < c->window);
+    }
+    else {
+	/* nearest first: the newest in the ring is the nearest */
+	struct cursor_record *ring;
+
+	n = c->nahead < c->window ? c->nahead : c->window;
+	c->atedge = (c->nahead <= c->window);
+
+	if (n) {
+	    ring = xmalloc(n * sizeof(*ring));
+	    for (i = 0; i < n; i++)
+		ring[i] = c->ahead[(c->nahead - 1 - i) % c->window];
+	    memcpy(c->ahead, ring, n * sizeof(*ring));
+	    free(ring);
+	}
+	c->nahead = n;
+    }
+
+    if (c->window < CURSOR_WINDOW_MAX)
+	c->window *= 2;
+
+    return 0;
+}
+
+static int cursor_move(struct cyrusdb_cursor *c, int forward,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    struct cursor_rock cr;
+    struct cursor_record *rec = NULL;
+    int r = 0;
+
+    memset(&cr, 0, sizeof(cr));
+    cr.cursor = c;
+    cr.forward = forward;
+
+    if (forward ? c->state == CURSOR_END
+		: c->state == CURSOR_GAP && !c->keybuf.len) {
+	/* already off this end */
+    }
+    else if (c->db->backend->sorted) {
+	/* what we read ahead is no good going the other way, or
+	 * once we've written to the database ourselves */
+	if (c->forward != forward || c->changes != c->db->changes)
+	    cursor_forget(c);
+	if (c->next == c->nahead && !c->atedge)
+	    r = cursor_read(c, forward);
+	if (!r && c->next < c->nahead)
+	    rec = &c->ahead[c->next++];
+    }
+    else {
+	r = cyrusdb_foreach(c->db, NULL, 0, NULL, cursor_cb, &cr, c->tid);
+	if (!r && cr.found)
+	    rec = &cr.rec;
+    }
+
+    if (!r && !rec) {
+	/* off the end */
+	if (forward) {
+	    c->state = CURSOR_END;
+	}
+	else {
+	    c->state = CURSOR_GAP;
+	    buf_reset(&c->keybuf);
+	}
+	cursor_forget(c);
+	r = CYRUSDB_NOTFOUND;
+    }
+
+    if (!r) {
+	buf_copy(&c->keybuf, &rec->key);
+	buf_copy(&c->databuf, &rec->data);
+	c->state = CURSOR_ON;
+
+	if (key) *key = c->keybuf.s;
+	if (keylen) *keylen = c->keybuf.len;
+	/* never NULL, as for fetch */
+	if (data) *data = c->databuf.s ? c->databuf.s : "";
+	if (datalen) *datalen = c->databuf.len;
+    }
+
+    buf_free(&cr.rec.key);
+    buf_free(&cr.rec.data);
+
+    return r;
+}
+
+EXPORTED int cyrusdb_cursor_open(struct db *db,
+		       const char *key, size_t keylen,
+		       struct cyrusdb_cursor **cursorp,
+		       struct txn **tid)
+{
+    struct cyrusdb_cursor *c = xzmalloc(sizeof(struct cyrusdb_cursor));
+    int r;
+
+    c->db = db;
+
+    if (db->backend->cursor_open) {
+	r = db->backend->cursor_open(db->engine, key, keylen,
+				     &c->engine, tid);
+	if (r) {
+	    free(c);
+	    return r;
+	}
+    }
+    else {
+	c->tid = tid;
+	cyrusdb_cursor_seek(c, key, keylen);
+    }
+
+    *cursorp = c;
+
+    return 0;
+}
+
+EXPORTED int cyrusdb_cursor_next(struct cyrusdb_cursor *c,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    if (c->engine)
+	return c->db->backend->cursor_next(c->engine, key, keylen,
+					   data, datalen);
+    return cursor_move(c, 1, key, keylen, data, datalen);
+}
+
+EXPORTED int cyrusdb_cursor_prev(struct cyrusdb_cursor *c,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    if (c->engine)
+	return c->db->backend->cursor_prev(c->engine, key, keylen,
+					   data, datalen);
+    return cursor_move(c, 0, key, keylen, data, datalen);
+}
+
+EXPORTED int cyrusdb_cursor_seek(struct cyrusdb_cursor *c,
+		       const char *key, size_t keylen)
+{
+    if (c->engine)
+	return c->db->backend->cursor_seek(c->engine, key, keylen);
+
+    buf_setmap(&c->keybuf, key, keylen);
+    c->state = CURSOR_GAP;
+    cursor_forget(c);
+    c->window = CURSOR_WINDOW_MIN;
+
+    return 0;
+}
+
+EXPORTED void cyrusdb_cursor_close(struct cyrusdb_cursor *c)
+{
+    int i;
+
+    if (!c) return;
+
+    if (c->engine)
+	c->db->backend->cursor_close(c->engine);
+
+    for (i = 0; i < c->alloc; i++) {
+	buf_free(&c->ahead[i].key);
+	buf_free(&c->ahead[i].data);
+    }
+    free(c->ahead);
+    buf_free(&c->keybuf);
+    buf_free(&c->databuf);
+    free(c);
+}
+
+/**********************************************/
+
 EXPORTED void cyrusdb_init(void)
 {
     int i, r;
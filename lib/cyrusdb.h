@@ -71,7 +71,8 @@ enum cyrusdb_dbflags {
 enum cyrusdb_openflags {
     CYRUSDB_CREATE   = 0x01,	/* Create the database if not existant */
     CYRUSDB_MBOXSORT = 0x02,	/* Use mailbox sort order ('.' sorts 1st) */
-    CYRUSDB_CONVERT  = 0x04	/* Convert to the named format if not already */
+    CYRUSDB_CONVERT  = 0x04,	/* Convert to the named format if not already */
+    CYRUSDB_BLOOM    = 0x08	/* Keep a filter for fast negative fetches */
 };
 
 typedef int foreach_p(void *rock,
@@ -86,6 +87,8 @@ typedef int cyrusdb_archiver(const strarray_t *fnames,
 			     const char *dirname);
 
 struct dbengine;
+struct dbcursor;
+struct cyrusdb_cursor;
 
 struct cyrusdb_backend {
     const char *name;
@@ -210,6 +213,55 @@ struct cyrusdb_backend {
     int (*repack)(struct dbengine *db);
     int (*compar)(struct dbengine *db, const char *s1, int l1,
 		  const char *s2, int l2);
+
+    /* nonzero if foreach() gives the records in compar() order */
+    int sorted;
+
+    /* cursors: a position in the database which moves one record at
+       a time in either direction, for walking a range without turning
+       the loop inside out into a foreach() callback.
+
+       cursor_open() starts in the gap before the first record >= 'key',
+       or at the start if 'key' is NULL or empty.  'tid' is as for
+       fetch(), and is used for every step, so a cursor inside a
+       transaction must be closed before the transaction ends.
+
+       cursor_next() returns the first record after the position and
+       cursor_prev() the last record before it, moving onto it.  Off
+       either end they return CYRUSDB_NOTFOUND and stay there, so a
+       next() after running off the start returns the first record,
+       and a prev() after running off the end the last.
+
+       cursor_seek() goes back to the gap before 'key', as for open.
+
+       The key and data are valid until the next call on the cursor or
+       the database.  As with foreach(), changes made since the last
+       step may or may not be seen, but every step is relative to the
+       key of the last one.
+
+       Backends may leave these NULL, in which case cyrusdb_cursor_*()
+       fall back to foreach().  If it is sorted, that reads a window of
+       records at a time, stopping as soon as it has them, but each
+       window is read from the start, so walking N records reads around
+       N*N/2048, as it does for berkeley; otherwise it searches the
+       whole database at every step, as it does for berkeley-hash,
+       quotalegacy and sql. */
+    int (*cursor_open)(struct dbengine *db,
+		       const char *key, size_t keylen,
+		       struct dbcursor **cursorp,
+		       struct txn **tid);
+    int (*cursor_next)(struct dbcursor *cursor,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen);
+    int (*cursor_prev)(struct dbcursor *cursor,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen);
+    int (*cursor_seek)(struct dbcursor *cursor,
+		       const char *key, size_t keylen);
+    void (*cursor_close)(struct dbcursor *cursor);
+
+    /* nonzero if open() does something with CYRUSDB_BLOOM */
+    int bloom;
 };
 
 extern int cyrusdb_copyfile(const char *srcname, const char *dstname);
@@ -276,6 +328,21 @@ extern int cyrusdb_compar(struct db *db,
 			  const char *a, int alen,
 			  const char *b, int blen);
 
+/* cursors, see struct cyrusdb_backend above */
+extern int cyrusdb_cursor_open(struct db *db,
+			       const char *key, size_t keylen,
+			       struct cyrusdb_cursor **cursorp,
+			       struct txn **tid);
+extern int cyrusdb_cursor_next(struct cyrusdb_cursor *cursor,
+			       const char **key, size_t *keylen,
+			       const char **data, size_t *datalen);
+extern int cyrusdb_cursor_prev(struct cyrusdb_cursor *cursor,
+			       const char **key, size_t *keylen,
+			       const char **data, size_t *datalen);
+extern int cyrusdb_cursor_seek(struct cyrusdb_cursor *cursor,
+			       const char *key, size_t keylen);
+extern void cyrusdb_cursor_close(struct cyrusdb_cursor *cursor);
+
 /* somewhat special case, because they don't take a DB */
 
 extern int cyrusdb_sync(const char *backend);
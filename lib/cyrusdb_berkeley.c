@@ -1044,7 +1044,9 @@ HIDDEN struct cyrusdb_backend cyrusdb_berkeley =
     NULL,
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+
+    1				/* sorted */
 };
 
 HIDDEN struct cyrusdb_backend cyrusdb_berkeley_nosync =
@@ -1074,7 +1076,9 @@ HIDDEN struct cyrusdb_backend cyrusdb_berkeley_nosync =
     NULL,
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+
+    1				/* sorted */
 };
 
 HIDDEN struct cyrusdb_backend cyrusdb_berkeley_hash =
@@ -1104,7 +1108,9 @@ HIDDEN struct cyrusdb_backend cyrusdb_berkeley_hash =
     NULL,
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+
+    0				/* sorted */
 };
 
 HIDDEN struct cyrusdb_backend cyrusdb_berkeley_hash_nosync =
@@ -1134,5 +1140,7 @@ HIDDEN struct cyrusdb_backend cyrusdb_berkeley_hash_nosync =
     NULL,
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+
+    0				/* sorted */
 };
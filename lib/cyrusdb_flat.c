@@ -599,6 +599,160 @@ static int foreach(struct dbengine *db,
 
 #undef GETENTRY
 
+/* cursors find their place again by key at every step, but with a
+ * hint of where they were, so unless the file has changed the search
+ * ends at the first line it looks at */
+enum {
+    CURSOR_GAP = 0,	/* before keybuf, which might be empty */
+    CURSOR_ON,		/* on keybuf */
+    CURSOR_END
+};
+
+struct dbcursor {
+    struct dbengine *db;
+    struct txn **mytid;
+
+    int state;
+    struct buf keybuf;
+    size_t offset;	/* where keybuf's line was last time */
+};
+
+/* the line for keybuf, or where it would go */
+static size_t cursor_find(struct dbcursor *c, unsigned long *lenp)
+{
+    struct dbengine *db = c->db;
+    struct buf encbuf = BUF_INITIALIZER;
+    size_t offset;
+
+    *lenp = 0;
+    if (!c->keybuf.len) return 0;
+
+    encode(c->keybuf.s, c->keybuf.len, &encbuf);
+    offset = bsearch_mem_mbox(encbuf.s, db->base, db->size,
+			      c->offset ? c->offset - 1 : 0, lenp);
+    buf_free(&encbuf);
+
+    return offset;
+}
+
+static int cursor_move(struct dbcursor *c, int forward,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    struct dbengine *db = c->db;
+    const char *p = NULL;
+    const char *dataend;
+    unsigned long len;
+    size_t offset;
+    int r;
+
+    r = starttxn_or_refetch(db, c->mytid);
+    if (r) return r;
+
+    if (forward) {
+	if (c->state == CURSOR_END) {
+	    offset = db->size;
+	}
+	else {
+	    offset = cursor_find(c, &len);
+	    /* already returned this one */
+	    if (c->state == CURSOR_ON) offset += len;
+	}
+
+	if (offset < db->size) p = db->base + offset;
+    }
+    else {
+	if (c->state == CURSOR_END) offset = db->size;
+	else offset = cursor_find(c, &len);
+
+	if (offset) {
+	    /* back to the start of the line before */
+	    p = db->base + offset - 1;
+	    while (p > db->base && p[-1] != '\n') p--;
+	}
+    }
+
+    if (!p) {
+	/* off the end */
+	if (forward) {
+	    c->state = CURSOR_END;
+	}
+	else {
+	    c->state = CURSOR_GAP;
+	    buf_reset(&c->keybuf);
+	}
+	c->offset = 0;
+	return CYRUSDB_NOTFOUND;
+    }
+
+    r = getentry(db, p, &c->keybuf, &dataend);
+    if (r) return r;
+
+    c->state = CURSOR_ON;
+    c->offset = p - db->base;
+
+    if (key) *key = c->keybuf.s;
+    if (keylen) *keylen = c->keybuf.len;
+    if (data) *data = DATA(db);
+    if (datalen) *datalen = DATALEN(db);
+
+    return 0;
+}
+
+static int cursor_seek(struct dbcursor *c, const char *key, size_t keylen)
+{
+    buf_setmap(&c->keybuf, key, keylen);
+    c->state = CURSOR_GAP;
+
+    return 0;
+}
+
+static int cursor_open(struct dbengine *db,
+		       const char *key, size_t keylen,
+		       struct dbcursor **cursorp,
+		       struct txn **mytid)
+{
+    struct dbcursor *c;
+    int r;
+
+    assert(db);
+
+    /* start the transaction now, as fetch would */
+    if (mytid && !*mytid) {
+	r = starttxn_or_refetch(db, mytid);
+	if (r) return r;
+    }
+
+    c = xzmalloc(sizeof(struct dbcursor));
+    c->db = db;
+    c->mytid = mytid;
+    cursor_seek(c, key, keylen);
+
+    *cursorp = c;
+
+    return 0;
+}
+
+static int cursor_next(struct dbcursor *c,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    return cursor_move(c, 1, key, keylen, data, datalen);
+}
+
+static int cursor_prev(struct dbcursor *c,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    return cursor_move(c, 0, key, keylen, data, datalen);
+}
+
+static void cursor_close(struct dbcursor *c)
+{
+    buf_free(&c->keybuf);
+    free(c);
+}
+
 static int mystore(struct dbengine *db, 
 		   const char *key, size_t keylen,
 		   const char *data, size_t datalen,
@@ -853,5 +1007,13 @@ EXPORTED struct cyrusdb_backend cyrusdb_flat =
     NULL,
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+
+    1,				/* sorted */
+
+    &cursor_open,
+    &cursor_next,
+    &cursor_prev,
+    &cursor_seek,
+    &cursor_close
 };
@@ -1234,6 +1234,196 @@ static int myforeach(struct dbengine *db,
     return r ? r : cb_r;
 }
 
+/* cursors step from the node they're on while the file is unchanged,
+   and find their place again by key when it isn't */
+enum {
+    CURSOR_GAP = 0,	/* before keybuf, which might be empty */
+    CURSOR_ON,		/* on keybuf */
+    CURSOR_END
+};
+
+struct dbcursor {
+    struct dbengine *db;
+    struct txn **tidptr;
+
+    int state;
+    struct buf keybuf;
+
+    /* the node we're on, while ino and size match */
+    unsigned offset;
+    ino_t ino;
+    unsigned long size;
+};
+
+/* returns the last node in the file, or the dummy if it's empty */
+static const char *find_last(struct dbengine *db)
+{
+    const char *ptr = db->map_base + DUMMY_OFFSET(db);
+    unsigned offset;
+    int i;
+
+    for (i = db->curlevel - 1; i >= 0; i--) {
+	while ((offset = FORWARD(ptr, i)))
+	    ptr = db->map_base + offset;
+    }
+
+    return ptr;
+}
+
+static int cursor_move(struct dbcursor *c, int forward,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    struct dbengine *db = c->db;
+    struct txn **tidptr = c->tidptr;
+    unsigned updateoffsets[SKIPLIST_MAXLEVEL+1];
+    const char *ptr = db->map_base;
+    int r = 0;
+
+    /* Hacky workaround:
+     *
+     * If no transaction was passed, but we're in a transaction,
+     * then just do the read within that transaction. 
+     */
+    if (!tidptr && db->current_txn != NULL) {
+	tidptr = &(db->current_txn);
+    }
+
+    if (tidptr) {
+	/* make sure we're write locked and up to date */
+	if ((r = lock_or_refresh(db, tidptr)) < 0) {
+	    return r;
+	}
+    } else {
+	/* grab a r lock */
+	if ((r = read_lock(db)) < 0) {
+	    return r;
+	}
+    }
+
+    if (forward) {
+	if (c->state == CURSOR_END) {
+	    /* nothing more */
+	}
+	else if (c->state == CURSOR_ON && c->ino == db->map_ino &&
+		 c->size == db->map_size) {
+	    /* nothing changed, just step along */
+	    ptr = db->map_base + FORWARD(db->map_base + c->offset, 0);
+	}
+	else {
+	    ptr = find_node(db, c->keybuf.s, c->keybuf.len, 0);
+
+	    /* already returned this one */
+	    if (c->state == CURSOR_ON && ptr != db->map_base &&
+		!db->compar(KEY(ptr), KEYLEN(ptr),
+			    c->keybuf.s, c->keybuf.len)) {
+		ptr = db->map_base + FORWARD(ptr, 0);
+	    }
+	}
+    }
+    else if (c->state != CURSOR_GAP || c->keybuf.len) {
+	if (c->state == CURSOR_END) {
+	    ptr = find_last(db);
+	}
+	else {
+	    find_node(db, c->keybuf.s, c->keybuf.len, updateoffsets);
+	    ptr = db->map_base + updateoffsets[0];
+	}
+
+	/* the dummy isn't a record */
+	if (ptr == db->map_base + DUMMY_OFFSET(db)) ptr = db->map_base;
+    }
+
+    if (ptr == db->map_base) {
+	/* off the end */
+	if (forward) {
+	    c->state = CURSOR_END;
+	}
+	else {
+	    c->state = CURSOR_GAP;
+	    buf_reset(&c->keybuf);
+	}
+	r = CYRUSDB_NOTFOUND;
+    }
+    else {
+	buf_setmap(&c->keybuf, KEY(ptr), KEYLEN(ptr));
+	c->state = CURSOR_ON;
+	c->offset = ptr - db->map_base;
+	c->ino = db->map_ino;
+	c->size = db->map_size;
+
+	if (key) *key = c->keybuf.s;
+	if (keylen) *keylen = c->keybuf.len;
+	if (data) *data = DATA(ptr);
+	if (datalen) *datalen = DATALEN(ptr);
+    }
+
+    if (!tidptr) {
+	/* release read lock */
+	int r1;
+	if ((r1 = unlock(db)) < 0) {
+	    return r1;
+	}
+    }
+
+    return r;
+}
+
+static int cursor_seek(struct dbcursor *c, const char *key, size_t keylen)
+{
+    buf_setmap(&c->keybuf, key, keylen);
+    c->state = CURSOR_GAP;
+
+    return 0;
+}
+
+static int cursor_open(struct dbengine *db,
+		       const char *key, size_t keylen,
+		       struct dbcursor **cursorp,
+		       struct txn **tidptr)
+{
+    struct dbcursor *c;
+    int r;
+
+    assert(db != NULL);
+
+    if (tidptr && !*tidptr) {
+	/* start the transaction now, as fetch would */
+	if ((r = lock_or_refresh(db, tidptr)) < 0) {
+	    return r;
+	}
+    }
+
+    c = xzmalloc(sizeof(struct dbcursor));
+    c->db = db;
+    c->tidptr = tidptr;
+    cursor_seek(c, key, keylen);
+
+    *cursorp = c;
+
+    return 0;
+}
+
+static int cursor_next(struct dbcursor *c,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    return cursor_move(c, 1, key, keylen, data, datalen);
+}
+
+static int cursor_prev(struct dbcursor *c,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    return cursor_move(c, 0, key, keylen, data, datalen);
+}
+
+static void cursor_close(struct dbcursor *c)
+{
+    buf_free(&c->keybuf);
+    free(c);
+}
+
 static unsigned int randlvl(struct dbengine *db)
 {
     unsigned int lvl = 1;
@@ -2472,5 +2662,13 @@ EXPORTED struct cyrusdb_backend cyrusdb_skiplist =
     &dump,
     &consistent,
     &mycheckpoint,
-    &mycompar
+    &mycompar,
+
+    1,				/* sorted */
+
+    &cursor_open,
+    &cursor_next,
+    &cursor_prev,
+    &cursor_seek,
+    &cursor_close
 };
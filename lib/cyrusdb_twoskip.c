@@ -43,20 +43,24 @@
 #include <config.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 
 #include "assert.h"
+#include "bloom.h"
 #include "bsearch.h"
 #include "byteorder64.h"
 #include "cyrusdb.h"
 #include "crc32.h"
+#include "cyr_lock.h"
 #include "libcyr_cfg.h"
 #include "mappedfile.h"
 #include "util.h"
@@ -128,6 +132,15 @@
  *  flags: 4 bytes
  *  crc32: 4 bytes
  *
+ * The flags are DIRTY (see TRANSACTIONS below), BLOOM, which says
+ * that a bloom filter of all the keys is kept in "<fname>.bloom",
+ * GROUP, which goes with DIRTY while a group commit is unsynced (see
+ * GROUP COMMIT below), and PREFIX, which allows records with shared
+ * key prefixes (see PREFIX COMPRESSION below).
+ * Files with the BLOOM flag are written as version 2, so that code
+ * which doesn't know to update the filter won't open them, and files
+ * with the PREFIX flag as version 3.
+ *
  * RECORDS:
  *  type 1 byte
  *  level: 1 byte
@@ -135,6 +148,7 @@
  *  vallen: 4 bytes
  *  <optionally: 64 bit keylen if keylen == UINT16_MAX>
  *  <optionally: 64 bit vallen if vallen == UINT32_MAX>
+ *  <optionally: 16 bit prefixlen and 48 bit offset if type is '*'>
  *  ptrs: 8 bytes * (level+1)
  *  crc32_head: 4 bytes
  *  crc32_tail: 4 bytes
@@ -147,17 +161,23 @@
  * '+' -> ADD/INORDER
  * '-' -> DELETE (kind of)
  * '$' -> COMMIT
+ * '*' -> ADD/INORDER with a shared key prefix
  * but note that delete records behave differently - they're
  * part of the pointer hierarchy, so that back offsets will
  * always point somewhere past the 'end' until commit.
  *
  * The DUMMY is always MAXLEVEL level, with zero keylen and vallen
- * The DELETE is always zero level, with zero keylen and vallen
+ * The DELETE is always zero level, with zero vallen.  Its key is the
+ * key it deleted (zero keylen in files written by older versions)
  * crc32_head is calculated on all bytes before it in the record
  * crc32_tail is calculated on all bytes after, INCLUDING padding
  *
  * The COMMIT is inserted at the end of each transaction, and its
  * single pointer points back to the start of the transaction.
+ *
+ * A '*' record is a '+' record whose key starts with the prefixlen
+ * bytes at the given offset, which are some earlier record's key
+ * bytes - keylen then only counts the bytes stored in this record.
  */
 
 /* OPERATION:
@@ -248,7 +268,14 @@
  * TUNING constants below) then the file is checkpointed.
  * A checkpoint is achieved by creating a new file, and
  * copying all the current records, in order, into it, then
- * renaming the new file over the old.  The "generation"
+ * renaming the new file over the old.  The copy is made from
+ * a snapshot (see SNAPSHOT READS) without holding the lock, so
+ * other users carry on meanwhile.  The lock is then taken just
+ * long enough to replay the records written since the copy
+ * started into the new file - which is why delete records
+ * carry the key they deleted - and rename it.  While copying,
+ * the new file is kept write locked, so nobody else starts a
+ * checkpoint of their own over the top of it.  The "generation"
  * counter in the header is incremented to tell other users
  * that offsets into the file are no longer valid.  This is
  * more reliable than just using the inode, because inodes
@@ -262,6 +289,77 @@
  * regular fetches that happen to hit either the current key,
  * the gap immediately after, or the next key.  All other
  * locations cause a full relocate.
+ *
+ * SNAPSHOT READS:
+ * A foreach without a transaction doesn't hold the lock while it
+ * walks the file.  It takes a read lock just long enough to read the
+ * header, and then reads the committed records (everything below
+ * current_size) from its map.  Nothing below current_size is ever
+ * rewritten except record heads, and by the level zero rule above
+ * one of the two level zero pointers keeps pointing where it did at
+ * the last commit until the NEXT commit.  So as long as the header
+ * still shows the same generation and current_size, the walk sees a
+ * consistent snapshot, ignoring any pointer at or past its end.  A
+ * checkpoint renames a new file into place and never touches the
+ * old one, so a map of the old file stays a consistent snapshot.
+ * If the header has moved on, the walk takes the read lock again
+ * and carries on from the last key in a new snapshot.
+ *
+ * BLOOM FILTER:
+ * If opened with CYRUSDB_BLOOM, a bloom filter (lib/bloom.c) of
+ * every key ever stored is kept alongside the file, and a fetch
+ * outside any transaction checks it first - a definite "no" returns
+ * CYRUSDB_NOTFOUND without taking the lock or touching the file.
+ * New keys are added as they're stored, and the filter is fsynced
+ * BEFORE the records, so it never misses a committed key.  Deleted
+ * keys stay in the filter until the next checkpoint, which builds a
+ * fresh one sized for the records it copied.  The old filter is
+ * marked retired before the new one is renamed into place, so other
+ * users go and reopen it.  Once set, the BLOOM flag stays set - if
+ * the filter goes missing, the next writer rebuilds it from the
+ * records.
+ *
+ * PREFIX COMPRESSION:
+ * Keys in a sorted database tend to share long prefixes with their
+ * neighbours.  With twoskip_prefix_compression, a new record whose
+ * key starts with the same bytes as the key of its level zero
+ * predecessor (or of the record it replaces) doesn't store them
+ * again, it points at them instead.  Records are never moved or
+ * rewritten apart from their heads, so the bytes stay put until the
+ * next checkpoint - which writes everything in order, so every
+ * record gets its predecessor to share with.  If the predecessor
+ * shares a prefix itself, only that prefix can be shared, so keys
+ * are never more than two pieces.  Keys are put back together as
+ * records are read by find_loc and advance_loc, and compared piece
+ * by piece on the way.
+ *
+ * GROUP COMMIT:
+ * With twoskip_group_commit, concurrent writers share their fsyncs.
+ * A commit appends its COMMIT record and writes a header with the
+ * new current_size WITHOUT any fsync, leaving DIRTY set (along with
+ * GROUP), and lets the next writer in.  Then, without the lock, it
+ * waits for somebody to fsync past its end.  If nobody is already
+ * doing that, it becomes the leader: notes how far it's syncing,
+ * runs one fdatasync for everything committed so far, by anyone,
+ * and clears DIRTY if nobody has committed since.  So a commit only
+ * returns once it's on disk, but one fsync covers a whole batch.
+ * The bookkeeping lives in "<fname>.group", which everyone in the
+ * batch holds a shared lock on until their commit is durable - an
+ * unlocked file with GROUP set in the header means the batch died
+ * unsynced.  Since the header may then have reached the disk before
+ * the records it describes, the level zero pointers can't be
+ * trusted, and recovery2 rebuilds from the COMMIT records instead.
+ * twoskip_group_commit_delay makes a leader wait that many
+ * microseconds for company before syncing.
+ *
+ * CURSORS:
+ * A cursor keeps its own copy of the last record it returned, and
+ * reads like a snapshot foreach - without a transaction it holds no
+ * lock between steps.  While the snapshot it read the record in is
+ * still current, "next" just follows the level zero pointer.  There
+ * are no backwards pointers, so "prev" searches from the dummy for
+ * the last record before the key, which a descent gives for free.
+ * Inside a transaction the "snapshot" is the end of the file.
  */
 
 
@@ -277,10 +375,26 @@
 #define MAXLEVEL 31
 /* should be 0.5 for binary search semantics */
 #define PROB 0.5
+/* don't bother sharing a key prefix shorter than this, the pointer
+ * to it takes 8 bytes */
+#define MINPREFIX 10
+/* microseconds between looks at a group commit someone else is syncing */
+#define GROUP_POLL 100
+/* and after this long syncing, assume they died and take over */
+#define GROUP_TAKEOVER 2000000
 
 /* format specifics */
 #undef VERSION /* defined in config.h */
-#define VERSION 1
+#define VERSION 3
+/* files without shared prefixes or a bloom filter are still written
+ * as older versions, so that older code can carry on using them */
+#define VERSION_NOPREFIX 2
+#define VERSION_NOBLOOM 1
+
+/* prefixlen and offset are packed together */
+#define PREFIX_SHIFT 48
+#define PREFIX_MAXOFFSET ((1ULL << PREFIX_SHIFT) - 1)
+#define PREFIX_MAXLEN UINT16_MAX
 
 /* type aliases */
 #define LLU long long unsigned int
@@ -291,6 +405,8 @@
 #define RECORD '+'
 #define DELETE '-'
 #define COMMIT '$'
+/* only on disk: read back as RECORD with a prefixlen */
+#define PREFIXED '*'
 
 /********** DATA STRUCTURES *************/
 
@@ -315,7 +431,10 @@ struct skiprecord {
     uint32_t crc32_head;
     uint32_t crc32_tail;
 
-    /* our key and value */
+    /* our key and value.  keylen is the whole key, but only the
+     * last keylen - prefixlen bytes are at keyoffset */
+    size_t prefixlen;
+    size_t prefixoffset;
     size_t keyoffset;
     size_t valoffset;
 };
@@ -362,6 +481,9 @@ enum {
 };
 
 #define DIRTY (1<<0)
+#define BLOOM (1<<1)
+#define GROUP (1<<2)
+#define PREFIX (1<<3)
 
 struct txn {
     /* logstart is where we start changes from on commit, where we truncate
@@ -379,6 +501,27 @@ struct db_header {
     size_t current_size;
 };
 
+/* this process's part in a group commit */
+struct groupcommit {
+    int enabled;
+    int pending;	/* committed, not yet known to be synced */
+    int fd;		/* "<fname>.group", or -1 */
+};
+
+/* the shared state in "<fname>.group", in native byte order since
+ * it never leaves the machine */
+struct groupstate {
+    uint64_t generation;	/* of the file the offsets are in */
+    uint64_t synced;		/* everything before here is on disk */
+    uint64_t syncing;		/* a sync up to here is running, or 0 */
+    uint64_t started;		/* when it started, in microseconds */
+    /* statistics */
+    uint64_t commits;
+    uint64_t synced_commits;
+    uint64_t syncs;
+    uint64_t maxbatch;
+};
+
 struct dbengine {
     /* file data */
     struct mappedfile *mf;
@@ -386,6 +529,12 @@ struct dbengine {
     struct db_header header;
     struct skiploc loc;
 
+    /* negative lookups, if the header says we have one */
+    struct bloom *bloom;
+
+    /* sharing fsyncs with other processes */
+    struct groupcommit group;
+
     /* tracking info */
     int is_open;
     size_t end;
@@ -420,7 +569,7 @@ enum {
 
 #define HEADER_SIZE 64
 #define DUMMY_OFFSET HEADER_SIZE
-#define MAXRECORDHEAD ((MAXLEVEL + 5)*8)
+#define MAXRECORDHEAD ((MAXLEVEL + 6)*8)
 
 /* mount a scratch monkey */
 static union skipwritebuf {
@@ -437,11 +586,15 @@ static int myconsistent(struct dbengine *db, struct txn *tid);
 static int recovery(struct dbengine *db);
 static int recovery1(struct dbengine *db, int *count);
 static int recovery2(struct dbengine *db, int *count);
+static int bloom_refresh(struct dbengine *db);
+static int group_islive(struct dbengine *db);
 
 /************** HELPER FUNCTIONS ****************/
 
 #define BASE(db) mappedfile_base((db)->mf)
 #define KEY(db, rec) (BASE(db) + (rec)->keyoffset)
+#define PREFIXKEY(db, rec) (BASE(db) + (rec)->prefixoffset)
+#define KEYTAILLEN(rec) ((rec)->keylen - (rec)->prefixlen)
 #define VAL(db, rec) (BASE(db) + (rec)->valoffset)
 #define SIZE(db) mappedfile_size((db)->mf)
 #define FNAME(db) mappedfile_fname((db)->mf)
@@ -529,7 +682,10 @@ static int write_header(struct dbengine *db)
 
     /* format one buffer */
     memcpy(buf, HEADER_MAGIC, HEADER_MAGIC_SIZE);
-    *((uint32_t *)(buf + OFFSET_VERSION)) = htonl(db->header.version);
+    *((uint32_t *)(buf + OFFSET_VERSION))
+	= htonl((db->header.flags & PREFIX) ? VERSION
+		: (db->header.flags & BLOOM) ? VERSION_NOPREFIX
+		: VERSION_NOBLOOM);
     *((uint64_t *)(buf + OFFSET_GENERATION)) = htonll(db->header.generation);
     *((uint64_t *)(buf + OFFSET_NUM_RECORDS)) = htonll(db->header.num_records);
     *((uint64_t *)(buf + OFFSET_REPACK_SIZE)) = htonll(db->header.repack_size);
@@ -559,7 +715,7 @@ static int check_tailcrc(struct dbengine *db, struct skiprecord *record)
     uint32_t crc;
 
     crc = crc32_map(BASE(db) + record->keyoffset,
-		    roundup(record->keylen + record->vallen, 8));
+		    roundup(KEYTAILLEN(record) + record->vallen, 8));
     if (crc != record->crc32_tail) {
 	syslog(LOG_ERR, "DBERROR: invalid tail crc %s at %llX",
 	       FNAME(db), (LLU)record->offset);
@@ -569,6 +725,74 @@ static int check_tailcrc(struct dbengine *db, struct skiprecord *record)
     return 0;
 }
 
+/* the whole key of a record, in one piece */
+static void record_getkey(struct dbengine *db,
+			  const struct skiprecord *record,
+			  struct buf *buf)
+{
+    if (!record->prefixlen) {
+	buf_setmap(buf, KEY(db, record), record->keylen);
+	return;
+    }
+
+    buf_setmap(buf, PREFIXKEY(db, record), record->prefixlen);
+    buf_appendmap(buf, KEY(db, record), KEYTAILLEN(record));
+}
+
+/* compare a record's key with 'key', a piece at a time */
+static int record_compar(struct dbengine *db,
+			 const struct skiprecord *record,
+			 const char *key, size_t keylen)
+{
+    int cmp;
+
+    if (!record->prefixlen)
+	return db->compar(KEY(db, record), record->keylen, key, keylen);
+
+    if (keylen < record->prefixlen)
+	return db->compar(PREFIXKEY(db, record), record->prefixlen,
+			  key, keylen);
+
+    cmp = db->compar(PREFIXKEY(db, record), record->prefixlen,
+		     key, record->prefixlen);
+    if (cmp) return cmp;
+
+    return db->compar(KEY(db, record), KEYTAILLEN(record),
+		      key + record->prefixlen, keylen - record->prefixlen);
+}
+
+/* point a new record's key at the start of 'prev's key, as far as
+ * they're the same */
+static void record_share(struct dbengine *db, struct skiprecord *record,
+			 const struct skiprecord *prev, const char *key)
+{
+    const char *base;
+    size_t max;
+    size_t len = 0;
+
+    if (prev->prefixlen) {
+	/* only the shared part is in one piece */
+	base = PREFIXKEY(db, prev);
+	max = prev->prefixlen;
+    }
+    else {
+	base = KEY(db, prev);
+	max = prev->keylen;
+    }
+
+    if (max > record->keylen) max = record->keylen;
+    if (max > PREFIX_MAXLEN) max = PREFIX_MAXLEN;
+
+    while (len < max && base[len] == key[len])
+	len++;
+
+    if (len < MINPREFIX || (size_t)(base - BASE(db)) > PREFIX_MAXOFFSET)
+	return;
+
+    record->prefixlen = len;
+    record->prefixoffset = base - BASE(db);
+}
+
 /* read a single skiprecord at the given offset */
 static int read_onerecord(struct dbengine *db, size_t offset,
 			  struct skiprecord *record)
@@ -613,11 +837,27 @@ static int read_onerecord(struct dbengine *db, size_t offset,
 	offset += 8;
     }
 
+    /* shared key prefix */
+    if (record->type == PREFIXED) {
+	uint64_t prefix;
+	base = BASE(db) + offset;
+	prefix = ntohll(*((uint64_t *)base));
+	record->type = RECORD;
+	record->prefixlen = prefix >> PREFIX_SHIFT;
+	record->prefixoffset = prefix & PREFIX_MAXOFFSET;
+	record->keylen += record->prefixlen;
+	offset += 8;
+
+	/* it has to be something already written */
+	if (record->prefixoffset + record->prefixlen > record->offset)
+	    return CYRUSDB_IOERROR;
+    }
+
     /* we know the length now */
     record->len = (offset - record->offset) /* header including lengths */
 		+ 8 * (1 + record->level)   /* ptrs */
 		+ 8                         /* crc32s */
-		+ roundup(record->keylen + record->vallen, 8);  /* keyval */
+		+ roundup(KEYTAILLEN(record) + record->vallen, 8);  /* keyval */
 
     if (record->offset + record->len > SIZE(db))
 	goto badsize;
@@ -637,7 +877,7 @@ static int read_onerecord(struct dbengine *db, size_t offset,
     record->crc32_tail = ntohl(*((uint32_t *)(base+4)));
 
     record->keyoffset = offset + 8;
-    record->valoffset = record->keyoffset + record->keylen;
+    record->valoffset = record->keyoffset + KEYTAILLEN(record);
 
     return 0;
 
@@ -670,14 +910,14 @@ static void prepare_record(struct skiprecord *record, char *buf, size_t *sizep)
 
     assert(record->level <= MAXLEVEL);
 
-    buf[0] = record->type;
+    buf[0] = record->prefixlen ? PREFIXED : record->type;
     buf[1] = record->level;
-    if (record->keylen < UINT16_MAX) {
-	*((uint16_t *)(buf+2)) = htons(record->keylen);
+    if (KEYTAILLEN(record) < UINT16_MAX) {
+	*((uint16_t *)(buf+2)) = htons(KEYTAILLEN(record));
     }
     else {
 	*((uint16_t *)(buf+2)) = htons(UINT16_MAX);
-	*((uint64_t *)(buf+len)) = htonll(record->keylen);
+	*((uint64_t *)(buf+len)) = htonll(KEYTAILLEN(record));
 	len += 8;
     }
 
@@ -690,6 +930,13 @@ static void prepare_record(struct skiprecord *record, char *buf, size_t *sizep)
 	len += 8;
     }
 
+    if (record->prefixlen) {
+	*((uint64_t *)(buf+len)) =
+	    htonll(((uint64_t)record->prefixlen << PREFIX_SHIFT)
+		   | record->prefixoffset);
+	len += 8;
+    }
+
     /* got pointers? */
     for (i = 0; i <= record->level; i++) {
 	*((uint64_t *)(buf+len)) = htonll(record->nextloc[i]);
@@ -740,14 +987,15 @@ static int write_record(struct dbengine *db, struct skiprecord *record,
     io[0].iov_base = scratchspace.s;
     io[0].iov_len = 0;
 
-    io[1].iov_base = (char *)key;
-    io[1].iov_len = record->keylen;
+    /* only what isn't shared */
+    io[1].iov_base = (char *)key + record->prefixlen;
+    io[1].iov_len = KEYTAILLEN(record);
 
     io[2].iov_base = (char *)val;
     io[2].iov_len = record->vallen;
 
     /* pad to 8 bytes */
-    len = record->vallen + record->keylen;
+    len = record->vallen + KEYTAILLEN(record);
     io[3].iov_base = zeros;
     io[3].iov_len = roundup(len, 8) - len;
 
@@ -766,7 +1014,7 @@ static int write_record(struct dbengine *db, struct skiprecord *record,
     /* locate the record */
     record->offset = db->end;
     record->keyoffset = db->end + io[0].iov_len;
-    record->valoffset = record->keyoffset + record->keylen;
+    record->valoffset = record->keyoffset + KEYTAILLEN(record);
     record->len = n;
 
     /* and advance the known file size */
@@ -787,6 +1035,7 @@ static int append_record(struct dbengine *db, struct skiprecord *record,
     /* dirty the header if not already dirty */
     if (!(db->header.flags & DIRTY)) {
 	db->header.flags |= DIRTY;
+	if (db->group.enabled) db->header.flags |= GROUP;
 	r = commit_header(db);
 	if (r) return r;
     }
@@ -796,18 +1045,13 @@ static int append_record(struct dbengine *db, struct skiprecord *record,
 
 /************************** LOCATION MANAGEMENT ***************************/
 
-/* find the next record at a given level, encapsulating the
- * level 0 magic */
-static size_t _getloc(struct dbengine *db, struct skiprecord *record,
-		      uint8_t level)
+/* the level 0 magic: the highest next pointer before 'end' */
+static size_t _getloc0(struct skiprecord *record, size_t end)
 {
-    if (level)
-	return record->nextloc[level + 1];
-
     /* if one is past, must be the other */
-    if (record->nextloc[0] >= db->end)
+    if (record->nextloc[0] >= end)
 	return record->nextloc[1];
-    else if (record->nextloc[1] >= db->end)
+    else if (record->nextloc[1] >= end)
 	return record->nextloc[0];
 
     /* highest remaining */
@@ -817,6 +1061,17 @@ static size_t _getloc(struct dbengine *db, struct skiprecord *record,
 	return record->nextloc[1];
 }
 
+/* find the next record at a given level, encapsulating the
+ * level 0 magic */
+static size_t _getloc(struct dbengine *db, struct skiprecord *record,
+		      uint8_t level)
+{
+    if (level)
+	return record->nextloc[level + 1];
+
+    return _getloc0(record, db->end);
+}
+
 /* set the next record at a given level, encapsulating the
  * level 0 magic */
 static void _setloc(struct dbengine *db, struct skiprecord *record,
@@ -890,8 +1145,8 @@ static int relocate(struct dbengine *db)
 	    if (newrecord.offset) {
 		assert(newrecord.level >= level);
 
-		cmp = db->compar(KEY(db, &newrecord), newrecord.keylen,
-				 loc->keybuf.s, loc->keybuf.len);
+		cmp = record_compar(db, &newrecord,
+				    loc->keybuf.s, loc->keybuf.len);
 
 		/* not there?  stay at this level */
 		if (cmp < 0) {
@@ -937,8 +1192,8 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
     /* can we special case advance? */
     if (keylen && loc->end == db->end
                && loc->generation == db->header.generation) {
-	cmp = db->compar(KEY(db, &loc->record), loc->record.keylen,
-			 loc->keybuf.s, loc->keybuf.len);
+	cmp = record_compar(db, &loc->record,
+			    loc->keybuf.s, loc->keybuf.len);
 	/* same place, and was exact.  Otherwise we're going back,
 	 * and the reverse pointers are no longer valid... */
 	if (db->loc.is_exactmatch && cmp == 0) {
@@ -961,8 +1216,8 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
 	    }
 
 	    /* now where is THIS record? */
-	    cmp = db->compar(KEY(db, &newrecord), newrecord.keylen,
-			     loc->keybuf.s, loc->keybuf.len);
+	    cmp = record_compar(db, &newrecord,
+				loc->keybuf.s, loc->keybuf.len);
 
 	    /* exact match? */
 	    if (cmp == 0) {
@@ -1024,7 +1279,7 @@ static int advance_loc(struct dbengine *db)
 	loc->forwardloc[i] = _getloc(db, &loc->record, i);
 
     /* keep our location */
-    buf_setmap(&loc->keybuf, KEY(db, &loc->record), loc->record.keylen);
+    record_getkey(db, &loc->record, &loc->keybuf);
     loc->is_exactmatch = 1;
 
     /* make sure this record is complete */
@@ -1088,6 +1343,10 @@ static int store_here(struct dbengine *db, const char *val, size_t vallen)
 	level = loc->record.level;
 	db->header.num_records--;
     }
+    else if (db->bloom) {
+	r = bloom_add(db->bloom, loc->keybuf.s, loc->keybuf.len);
+	if (r) return CYRUSDB_IOERROR;
+    }
 
     /* build a new record */
     memset(&newrecord, 0, sizeof(struct skiprecord));
@@ -1097,6 +1356,10 @@ static int store_here(struct dbengine *db, const char *val, size_t vallen)
     newrecord.vallen = vallen;
     for (i = 0; i < newrecord.level; i++)
 	newrecord.nextloc[i+1] = loc->forwardloc[i];
+
+    /* loc->record is the one we replace, or else the one before */
+    if ((db->header.flags & PREFIX) && loc->record.keylen)
+	record_share(db, &newrecord, &loc->record, loc->keybuf.s);
     if (newrecord.level > level)
 	level = newrecord.level;
 
@@ -1141,10 +1404,11 @@ static int delete_here(struct dbengine *db)
     /* build a delete record */
     memset(&newrecord, 0, sizeof(struct skiprecord));
     newrecord.type = DELETE;
+    newrecord.keylen = loc->keybuf.len;
     newrecord.nextloc[0] = nextrecord.offset;
 
-    /* append to the file */
-    r = append_record(db, &newrecord, NULL, NULL);
+    /* append to the file, with the key for checkpoint replay */
+    r = append_record(db, &newrecord, loc->keybuf.s, NULL);
     if (r) return r;
 
     /* get the nextlevel to point here */
@@ -1169,8 +1433,10 @@ static int db_is_clean(struct dbengine *db)
     if (db->header.current_size != SIZE(db))
 	return 0;
 
+    /* a group commit still being synced is fine, so long as someone
+     * is still around to finish it */
     if (db->header.flags & DIRTY)
-	return 0;
+	return (db->header.flags & GROUP) && group_islive(db);
 
     return 1;
 }
@@ -1193,6 +1459,9 @@ static int write_lock(struct dbengine *db)
 	/* recovery checks for consistency */
 	r = recovery(db);
 	if (r) return r;
+
+	r = bloom_refresh(db);
+	if (r) return r;
     }
 
     return 0;
@@ -1219,6 +1488,9 @@ static int read_lock(struct dbengine *db)
 	    unlock(db);
 	    return read_lock(db);
 	}
+
+	r = bloom_refresh(db);
+	if (r) return r;
     }
 
     return 0;
@@ -1256,11 +1528,345 @@ static void dispose_db(struct dbengine *db)
 	mappedfile_close(&db->mf);
     }
 
+    bloom_close(&db->bloom);
+    if (db->group.fd != -1) close(db->group.fd);
     buf_free(&db->loc.keybuf);
 
     free(db);
 }
 
+/************************** BLOOM FILTER ***************************/
+
+/* build a filter of every live key, at fname.  Needs a write lock */
+static int bloom_build(struct dbengine *db, const char *fname,
+		       struct bloom **bp)
+{
+    struct skiprecord record;
+    struct buf keybuf = BUF_INITIALIZER;
+    size_t offset;
+    int r;
+
+    r = bloom_create(fname, db->header.num_records, bp);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: twoskip %s: failed to create %s",
+	       FNAME(db), fname);
+	return CYRUSDB_IOERROR;
+    }
+
+    r = read_onerecord(db, DUMMY_OFFSET, &record);
+
+    for (offset = _getloc(db, &record, 0); !r && offset;
+	 offset = _getloc(db, &record, 0)) {
+	r = read_onerecord(db, offset, &record);
+	if (r) break;
+	if (record.type != RECORD) continue;
+	record_getkey(db, &record, &keybuf);
+	if (bloom_add(*bp, keybuf.s, keybuf.len))
+	    r = CYRUSDB_IOERROR;
+    }
+
+    buf_free(&keybuf);
+
+    if (!r && bloom_commit(*bp))
+	r = CYRUSDB_IOERROR;
+
+    if (r) {
+	bloom_close(bp);
+	unlink(fname);
+    }
+
+    return r;
+}
+
+/* replace the filter with a fresh one built from the records */
+static int bloom_rebuild(struct dbengine *db)
+{
+    char fname[1024];
+    char newfname[sizeof(fname) + 4];	/* fname + ".NEW" */
+    struct bloom *b = NULL;
+    int r;
+
+    assert(mappedfile_iswritelocked(db->mf));
+
+    snprintf(fname, sizeof(fname), "%s.bloom", FNAME(db));
+    snprintf(newfname, sizeof(newfname), "%s.NEW", fname);
+
+    r = bloom_build(db, newfname, &b);
+    if (r) return r;
+
+    if (db->bloom) {
+	bloom_retire(db->bloom);
+	bloom_close(&db->bloom);
+    }
+
+    if (bloom_rename(b, fname)) {
+	bloom_close(&b);
+	unlink(newfname);
+	return CYRUSDB_IOERROR;
+    }
+
+    db->bloom = b;
+
+    return 0;
+}
+
+/* after reading the header: make sure we're using the current filter,
+ * if there is one */
+static int bloom_refresh(struct dbengine *db)
+{
+    char fname[1024];
+
+    if (db->bloom &&
+	(!(db->header.flags & BLOOM) || bloom_isretired(db->bloom)))
+	bloom_close(&db->bloom);
+
+    if (db->bloom || !(db->header.flags & BLOOM))
+	return 0;
+
+    snprintf(fname, sizeof(fname), "%s.bloom", FNAME(db));
+    if (!bloom_open(fname, &db->bloom))
+	return 0;
+
+    /* readers can do without, but anything we store has to go in it */
+    if (!mappedfile_iswritelocked(db->mf))
+	return 0;
+
+    syslog(LOG_NOTICE, "twoskip: rebuilding bloom filter for %s", FNAME(db));
+
+    return bloom_rebuild(db);
+}
+
+/* newdb is about to replace db.  It takes over its own filter if it
+ * built one, otherwise the old one, which covers every key it has */
+static int bloom_handover(struct dbengine *db, struct dbengine *newdb)
+{
+    char fname[1024];
+
+    if (!newdb->bloom) {
+	newdb->bloom = db->bloom;
+	db->bloom = NULL;
+	return 0;
+    }
+
+    /* tell everyone to stop using the old one first - if we don't
+     * make it to the rename, the next writer rebuilds it */
+    if (db->bloom) {
+	if (bloom_retire(db->bloom))
+	    return CYRUSDB_IOERROR;
+	bloom_close(&db->bloom);
+    }
+
+    snprintf(fname, sizeof(fname), "%s.bloom", FNAME(db));
+    if (bloom_rename(newdb->bloom, fname))
+	return CYRUSDB_IOERROR;
+
+    return 0;
+}
+
+/************************** GROUP COMMIT ***************************/
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int group_open(struct dbengine *db, int create)
+{
+    char fname[1024];
+
+    if (db->group.fd != -1) return 0;
+
+    snprintf(fname, sizeof(fname), "%s.group", FNAME(db));
+    db->group.fd = open(fname, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (db->group.fd == -1) return -1;
+
+    return 0;
+}
+
+/* a new file reads as all zeros */
+static int group_read(struct dbengine *db, struct groupstate *gs)
+{
+    ssize_t n = pread(db->group.fd, gs, sizeof(*gs), 0);
+    if (n < 0) return CYRUSDB_IOERROR;
+    if (n < (ssize_t)sizeof(*gs))
+	memset(gs, 0, sizeof(*gs));
+    return 0;
+}
+
+static int group_write(struct dbengine *db, const struct groupstate *gs)
+{
+    ssize_t n = pwrite(db->group.fd, gs, sizeof(*gs), 0);
+    if (n != (ssize_t)sizeof(*gs)) return CYRUSDB_IOERROR;
+    return 0;
+}
+
+/* is anyone still waiting for their group commit to be synced? */
+static int group_islive(struct dbengine *db)
+{
+    if (db->group.pending) return 1;
+
+    if (group_open(db, 0)) return 0;
+
+    /* they all hold it shared until they're done */
+    if (lock_nonblocking(db->group.fd, NULL))
+	return 1;
+
+    lock_unlock(db->group.fd, NULL);
+    return 0;
+}
+
+static void group_leave(struct dbengine *db)
+{
+    if (!db->group.pending) return;
+
+    lock_unlock(db->group.fd, NULL);
+    db->group.pending = 0;
+}
+
+/* join the current batch, with a commit that's just been written.
+ * Needs the write lock */
+static int group_join(struct dbengine *db)
+{
+    struct groupstate gs;
+
+    if (group_open(db, 1)) goto fail;
+
+    if (!db->group.pending) {
+	if (lock_shared(db->group.fd, NULL)) goto fail;
+	db->group.pending = 1;
+    }
+
+    if (group_read(db, &gs)) goto fail;
+
+    /* offsets into an older file mean nothing */
+    if (gs.generation != db->header.generation) {
+	gs.generation = db->header.generation;
+	gs.synced = 0;
+	gs.syncing = 0;
+    }
+
+    gs.commits++;
+
+    if (group_write(db, &gs)) goto fail;
+
+    return 0;
+
+ fail:
+    syslog(LOG_ERR, "IOERROR: twoskip group commit %s: %m", FNAME(db));
+    group_leave(db);
+    return CYRUSDB_IOERROR;
+}
+
+/* wait until everything up to end in this generation is on disk,
+ * syncing it ourselves if nobody else is */
+static int group_sync(struct dbengine *db, uint64_t generation, size_t end)
+{
+    struct groupstate gs;
+    int delay = libcyrus_config_getint(CYRUSOPT_TWOSKIP_GROUP_COMMIT_DELAY);
+    int waited = 0;
+    size_t target;
+    uint64_t commits;
+    int r = 0;
+    int sr;
+
+    for (;;) {
+	/* someone's already syncing - let them finish without bothering
+	 * the lock, then the next sync gets everything since */
+	if (!group_read(db, &gs) && gs.generation == generation
+	    && gs.syncing && now_usec() - gs.started < GROUP_TAKEOVER) {
+	    usleep(GROUP_POLL);
+	    continue;
+	}
+
+	r = write_lock(db);
+	if (r) break;
+
+	r = group_read(db, &gs);
+	if (r) {
+	    unlock(db);
+	    break;
+	}
+
+	/* done for us, by a sync or a checkpoint */
+	if (db->header.generation != generation
+	    || !(db->header.flags & DIRTY)
+	    || (gs.generation == generation && gs.synced >= end)) {
+	    unlock(db);
+	    break;
+	}
+
+	/* beaten to it */
+	if (gs.generation == generation && gs.syncing
+	    && now_usec() - gs.started < GROUP_TAKEOVER) {
+	    unlock(db);
+	    continue;
+	}
+
+	/* give the rest of the batch a chance to turn up */
+	if (delay > 0 && !waited) {
+	    unlock(db);
+	    usleep(delay);
+	    waited = 1;
+	    continue;
+	}
+
+	/* lead: sync everything committed so far, by anyone */
+	target = db->header.current_size;
+	commits = gs.commits;
+	gs.generation = generation;
+	gs.syncing = target;
+	gs.started = now_usec();
+	r = group_write(db, &gs);
+	unlock(db);
+	if (r) break;
+
+	/* the filter first, as always */
+	sr = db->bloom ? bloom_sync(db->bloom) : 0;
+	if (!sr) sr = mappedfile_sync(db->mf);
+
+	r = write_lock(db);
+	if (r) break;
+
+	r = group_read(db, &gs);
+	if (!r && gs.generation == generation) {
+	    if (gs.syncing == target)
+		gs.syncing = 0;
+	    if (!sr) {
+		if (gs.synced < target)
+		    gs.synced = target;
+		gs.syncs++;
+		if (commits - gs.synced_commits > gs.maxbatch)
+		    gs.maxbatch = commits - gs.synced_commits;
+		syslog(LOG_DEBUG, "twoskip: group commit %s synced %llu commit%s",
+		       FNAME(db), (LLU)(commits - gs.synced_commits),
+		       commits - gs.synced_commits == 1 ? "" : "s");
+		gs.synced_commits = commits;
+	    }
+	    r = group_write(db, &gs);
+	}
+
+	/* nobody's committed since, so it's all clean */
+	if (!r && !sr && db->header.generation == generation
+	    && (db->header.flags & DIRTY)
+	    && db->header.current_size == target) {
+	    db->header.flags &= ~(DIRTY|GROUP);
+	    r = commit_header(db);
+	}
+
+	unlock(db);
+
+	if (sr) r = CYRUSDB_IOERROR;
+	break;
+    }
+
+    group_leave(db);
+
+    return r;
+}
+
 /************************************************************/
 
 static int opendb(const char *fname, int flags, struct dbengine **ret)
@@ -1273,11 +1879,12 @@ static int opendb(const char *fname, int flags, struct dbengine **ret)
     assert(ret);
 
     db = (struct dbengine *) xzmalloc(sizeof(struct dbengine));
+    db->group.fd = -1;
 
     if (flags & CYRUSDB_CREATE)
 	mappedfile_flags |= MAPPEDFILE_CREATE;
 
-    db->open_flags = flags & ~CYRUSDB_CREATE;
+    db->open_flags = flags & ~(CYRUSDB_CREATE|CYRUSDB_BLOOM);
     db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare_mbox
 					    : bsearch_ncompare_raw;
 
@@ -1327,7 +1934,7 @@ static int opendb(const char *fname, int flags, struct dbengine **ret)
 	}
 
 	/* create the header */
-	db->header.version = VERSION;
+	db->header.version = VERSION_NOBLOOM;
 	db->header.generation = 1;
 	db->header.repack_size = db->end;
 	db->header.current_size = db->end;
@@ -1353,6 +1960,33 @@ static int opendb(const char *fname, int flags, struct dbengine **ret)
 	if (r) goto done;
     }
 
+    if (libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_PREFIX_COMPRESSION)
+	&& !(db->header.flags & PREFIX)) {
+	/* no going back once anyone might have written a shared prefix */
+	if (!mappedfile_iswritelocked(db->mf))
+	    goto retry_write;
+
+	db->header.flags |= PREFIX;
+	r = commit_header(db);
+	if (r) goto done;
+    }
+
+    if ((flags & CYRUSDB_BLOOM) && !(db->header.flags & BLOOM)) {
+	/* the filter has to be complete before anyone trusts it */
+	if (!mappedfile_iswritelocked(db->mf))
+	    goto retry_write;
+
+	r = bloom_rebuild(db);
+	if (r) goto done;
+
+	db->header.flags |= BLOOM;
+	r = commit_header(db);
+	if (r) goto done;
+    }
+
+    r = bloom_refresh(db);
+    if (r) goto done;
+
     /* unlock the DB */
     unlock(db);
 
@@ -1380,6 +2014,11 @@ static int myopen(const char *fname, int flags, struct dbengine **ret)
     r = opendb(fname, flags, &mydb);
     if (r) return r;
 
+    /* not in opendb, the files checkpoint and recovery build
+     * commit the old fashioned way */
+    mydb->group.enabled =
+	libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_GROUP_COMMIT);
+
     /* track this database in the open list */
     ent = (struct db_list *) xzmalloc(sizeof(struct db_list));
     ent->db = mydb;
@@ -1443,6 +2082,11 @@ static int myfetch(struct dbengine *db,
     if (!tidptr && db->current_txn)
 	tidptr = &db->current_txn;
 
+    /* a definite miss doesn't need the lock or the file at all */
+    if (!tidptr && !fetchnext && db->bloom &&
+	!bloom_test(db->bloom, key, keylen))
+	return CYRUSDB_NOTFOUND;
+
     if (tidptr) {
 	if (!*tidptr) {
 	    r = newtxn(db, tidptr);
@@ -1486,17 +2130,210 @@ done:
     return r;
 }
 
-/* foreach allows for subsidary mailbox operations in 'cb'.
-   if there is a txn, 'cb' must make use of it.
-*/
-static int myforeach(struct dbengine *db,
-		     const char *prefix, size_t prefixlen,
+/************************** SNAPSHOT READS ***************************/
+
+/* the committed database as of one header, see SNAPSHOT READS above */
+struct snapshot {
+    uint64_t generation;
+    size_t end;
+};
+
+/* start a new snapshot.  This takes a read lock to get a clean, current
+ * header; the caller releases it when it's found its place */
+static int snapshot_begin(struct dbengine *db, struct snapshot *snap)
+{
+    int r = read_lock(db);
+    if (r) return r;
+
+    snap->generation = db->header.generation;
+    snap->end = db->header.current_size;
+
+    return 0;
+}
+
+/* is the snapshot still what's on disk?  No lock is held, so anything
+ * read from the map before this says yes was consistent */
+static int snapshot_isvalid(struct dbengine *db, const struct snapshot *snap)
+{
+    char header[HEADER_SIZE];
+    uint32_t crc;
+
+    /* don't let the header read overtake the record reads */
+    __sync_synchronize();
+
+    if (SIZE(db) < HEADER_SIZE)
+	return 0;
+
+    /* take a copy, a writer may be rewriting it under us */
+    memcpy(header, BASE(db), HEADER_SIZE);
+
+    crc = ntohl(*((uint32_t *)(header + OFFSET_CRC32)));
+    if (crc32_map(header, OFFSET_CRC32) != crc)
+	return 0;
+
+    if (ntohll(*((uint64_t *)(header + OFFSET_GENERATION))) != snap->generation)
+	return 0;
+
+    if (ntohll(*((uint64_t *)(header + OFFSET_CURRENT_SIZE))) != snap->end)
+	return 0;
+
+    return 1;
+}
+
+/* like _getloc, but never past the end of the snapshot.  Pointers
+ * above level 0 which have been rewritten since are skipped, the
+ * levels below still get us there */
+static size_t snapshot_getloc(const struct snapshot *snap,
+			      struct skiprecord *record, uint8_t level)
+{
+    size_t offset;
+
+    if (!level)
+	return _getloc0(record, snap->end);
+
+    offset = record->nextloc[level + 1];
+    return offset < snap->end ? offset : 0;
+}
+
+/* find the first record in the snapshot at or after 'key' */
+static int snapshot_find(struct dbengine *db, const struct snapshot *snap,
+			 const char *key, size_t keylen,
+			 struct skiprecord *record)
+{
+    struct skiprecord prevrecord;
+    size_t offset;
+    size_t oldoffset = 0;
+    uint8_t level;
+    int r;
+
+    /* start with the dummy */
+    r = read_onerecord(db, DUMMY_OFFSET, &prevrecord);
+    if (r) return r;
+
+    memset(record, 0, sizeof(struct skiprecord));
+    level = prevrecord.level;
+
+    while (level) {
+	offset = snapshot_getloc(snap, &prevrecord, level-1);
+
+	if (offset != oldoffset) {
+	    oldoffset = offset;
+	    r = read_skipdelete(db, offset, record);
+	    if (r) return r;
+
+	    /* not there?  stay at this level */
+	    if (record->offset &&
+		record_compar(db, record, key, keylen) < 0) {
+		prevrecord = *record;
+		continue;
+	    }
+	}
+
+	level--;
+    }
+
+    if (!record->offset)
+	return 0;
+
+    /* make sure this record is complete */
+    return check_tailcrc(db, record);
+}
+
+/* move to the next record in the snapshot */
+static int snapshot_advance(struct dbengine *db, const struct snapshot *snap,
+			    struct skiprecord *record)
+{
+    int r;
+
+    r = read_skipdelete(db, snapshot_getloc(snap, record, 0), record);
+    if (r) return r;
+
+    if (!record->offset)
+	return 0;
+
+    /* make sure this record is complete */
+    return check_tailcrc(db, record);
+}
+
+/* foreach without a transaction, on a snapshot */
+static int snapshot_foreach(struct dbengine *db,
+			    const char *prefix, size_t prefixlen,
+			    foreach_p *goodp,
+			    foreach_cb *cb, void *rock)
+{
+    struct snapshot snap;
+    struct skiprecord record;
+    struct buf keybuf = BUF_INITIALIZER;
+    const char *val;
+    size_t vallen;
+    int r, r1, cb_r = 0;
+
+    r = snapshot_begin(db, &snap);
+    if (r) return r;
+
+    r = snapshot_find(db, &snap, prefix, prefixlen, &record);
+
+    /* release read lock */
+    r1 = unlock(db);
+    if (!r) r = r1;
+
+    while (!r && record.offset) {
+	/* take a copy of the key, to find our place again in a new
+	 * snapshot if we need to */
+	record_getkey(db, &record, &keybuf);
+
+	/* does it match prefix? */
+	if (prefixlen) {
+	    if (keybuf.len < prefixlen) break;
+	    if (db->compar(keybuf.s, prefixlen, prefix, prefixlen)) break;
+	}
+
+	val = VAL(db, &record);
+	vallen = record.vallen;
+
+	if (!goodp || goodp(rock, keybuf.s, keybuf.len, val, vallen)) {
+	    /* make callback */
+	    cb_r = cb(rock, keybuf.s, keybuf.len, val, vallen);
+	    if (cb_r) break;
+	}
+
+	/* move to the next one.  The callback may even have changed
+	 * this database, so check before reading too */
+	if (snapshot_isvalid(db, &snap)) {
+	    r = snapshot_advance(db, &snap, &record);
+	    if (!r && snapshot_isvalid(db, &snap))
+		continue;
+	}
+
+	/* something has been committed since: carry on after the
+	 * same key in a new snapshot */
+	r = snapshot_begin(db, &snap);
+	if (r) break;
+
+	r = snapshot_find(db, &snap, keybuf.s, keybuf.len, &record);
+	if (!r && record.offset &&
+	    !record_compar(db, &record, keybuf.s, keybuf.len))
+	    r = snapshot_advance(db, &snap, &record);
+
+	r1 = unlock(db);
+	if (!r) r = r1;
+    }
+
+    buf_free(&keybuf);
+
+    return r ? r : cb_r;
+}
+
+/* foreach allows for subsidary mailbox operations in 'cb'.
+   if there is a txn, 'cb' must make use of it.
+*/
+static int myforeach(struct dbengine *db,
+		     const char *prefix, size_t prefixlen,
 		     foreach_p *goodp,
 		     foreach_cb *cb, void *rock,
 		     struct txn **tidptr)
 {
     int r = 0, cb_r = 0;
-    int need_unlock = 0;
     const char *val;
     size_t vallen;
     struct buf keybuf = BUF_INITIALIZER;
@@ -1512,16 +2349,14 @@ static int myforeach(struct dbengine *db,
      */
     if (!tidptr && db->current_txn)
 	tidptr = &db->current_txn;
-    if (tidptr) {
-	if (!*tidptr) {
-	    r = newtxn(db, tidptr);
-	    if (r) return r;
-	}
-    } else {
-	/* grab a r lock */
-	r = read_lock(db);
+
+    /* no transaction: don't hold the lock, walk a snapshot */
+    if (!tidptr)
+	return snapshot_foreach(db, prefix, prefixlen, goodp, cb, rock);
+
+    if (!*tidptr) {
+	r = newtxn(db, tidptr);
 	if (r) return r;
-	need_unlock = 1;
     }
 
     r = find_loc(db, prefix, prefixlen);
@@ -1536,8 +2371,8 @@ static int myforeach(struct dbengine *db,
     while (db->loc.is_exactmatch) {
 	/* does it match prefix? */
 	if (prefixlen) {
-	    if (db->loc.record.keylen < prefixlen) break;
-	    if (db->compar(KEY(db, &db->loc.record), prefixlen, prefix, prefixlen)) break;
+	    if (db->loc.keybuf.len < prefixlen) break;
+	    if (db->compar(db->loc.keybuf.s, prefixlen, prefix, prefixlen)) break;
 	}
 
 	val = VAL(db, &db->loc.record);
@@ -1545,13 +2380,6 @@ static int myforeach(struct dbengine *db,
 
 	if (!goodp || goodp(rock, db->loc.keybuf.s, db->loc.keybuf.len,
 				  val, vallen)) {
-	    if (!tidptr) {
-		/* release read lock */
-		r = unlock(db);
-		if (r) goto done;
-		need_unlock = 0;
-	    }
-
 	    /* take a copy of they key - just in case cb does actions on this database
 	     * and clobbers loc */
 	    buf_copy(&keybuf, &db->loc.keybuf);
@@ -1561,13 +2389,6 @@ static int myforeach(struct dbengine *db,
 			    val, vallen);
 	    if (cb_r) break;
 
-	    if (!tidptr) {
-		/* grab a r lock */
-		r = read_lock(db);
-		if (r) goto done;
-		need_unlock = 1;
-	    }
-
 	    /* should be cheap if we're already here */
 	    r = find_loc(db, keybuf.s, keybuf.len);
 	    if (r) goto done;
@@ -1582,13 +2403,240 @@ static int myforeach(struct dbengine *db,
 
     buf_free(&keybuf);
 
-    if (need_unlock) {
+    return r ? r : cb_r;
+}
+
+/****************************** CURSORS ******************************/
+
+/* find the last record in the snapshot before 'key', or the last of
+ * all if 'key' is NULL.  'record' is left empty if there isn't one */
+static int snapshot_findprev(struct dbengine *db, const struct snapshot *snap,
+			     const char *key, size_t keylen,
+			     struct skiprecord *record)
+{
+    struct skiprecord newrecord;
+    size_t offset;
+    uint8_t level;
+    int r;
+
+    /* start with the dummy */
+    r = read_onerecord(db, DUMMY_OFFSET, record);
+    if (r) return r;
+
+    level = record->level;
+
+    while (level) {
+	offset = snapshot_getloc(snap, record, level-1);
+
+	r = read_skipdelete(db, offset, &newrecord);
+	if (r) return r;
+
+	/* still before?  keep going at this level */
+	if (newrecord.offset &&
+	    (!key || record_compar(db, &newrecord, key, keylen) < 0)) {
+	    *record = newrecord;
+	    continue;
+	}
+
+	level--;
+    }
+
+    if (record->offset == DUMMY_OFFSET) {
+	memset(record, 0, sizeof(struct skiprecord));
+	return 0;
+    }
+
+    /* make sure this record is complete */
+    return check_tailcrc(db, record);
+}
+
+enum {
+    CURSOR_GAP = 0,	/* before keybuf, which might be empty */
+    CURSOR_ON,		/* on keybuf, read into record */
+    CURSOR_END
+};
+
+struct dbcursor {
+    struct dbengine *db;
+    struct txn **tidptr;
+
+    int state;
+    struct buf keybuf;
+
+    /* the record we're on, while this snapshot is current */
+    struct snapshot snap;
+    struct skiprecord record;
+};
+
+/* read the record the cursor moves to into c->record, or leave it
+ * empty if there isn't one.  'cached' says c->record is still valid */
+static int cursor_find(struct dbcursor *c, int forward, int cached)
+{
+    struct dbengine *db = c->db;
+    int r;
+
+    if (!forward) {
+	if (c->state == CURSOR_GAP && !c->keybuf.len) {
+	    memset(&c->record, 0, sizeof(struct skiprecord));
+	    return 0;
+	}
+
+	return snapshot_findprev(db, &c->snap,
+				 c->state == CURSOR_END ? NULL : c->keybuf.s,
+				 c->keybuf.len, &c->record);
+    }
+
+    if (c->state == CURSOR_END) {
+	memset(&c->record, 0, sizeof(struct skiprecord));
+	return 0;
+    }
+
+    if (c->state == CURSOR_ON && cached)
+	return snapshot_advance(db, &c->snap, &c->record);
+
+    r = snapshot_find(db, &c->snap, c->keybuf.s, c->keybuf.len, &c->record);
+    if (r) return r;
+
+    /* already returned this one */
+    if (c->state == CURSOR_ON && c->record.offset &&
+	!record_compar(db, &c->record, c->keybuf.s, c->keybuf.len))
+	r = snapshot_advance(db, &c->snap, &c->record);
+
+    return r;
+}
+
+static int cursor_move(struct dbcursor *c, int forward,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    struct dbengine *db = c->db;
+    struct txn **tidptr = c->tidptr;
+    int cached;
+    int r, r1;
+
+    /* Hacky workaround:
+     *
+     * If no transaction was passed, but we're in a transaction,
+     * then just do the read within that transaction.
+     */
+    if (!tidptr && db->current_txn)
+	tidptr = &db->current_txn;
+
+    if (tidptr) {
+	if (!*tidptr) {
+	    r = newtxn(db, tidptr);
+	    if (r) return r;
+	}
+
+	/* we hold the lock, everything up to the end is ours */
+	cached = (c->snap.generation == db->header.generation &&
+		  c->snap.end == db->end);
+	c->snap.generation = db->header.generation;
+	c->snap.end = db->end;
+
+	r = cursor_find(c, forward, cached);
+	if (r) return r;
+    }
+    else {
+	/* without the lock, only trust what we read if the snapshot
+	 * is still current afterwards */
+	if (c->snap.end && snapshot_isvalid(db, &c->snap)) {
+	    r = cursor_find(c, forward, 1);
+	    if (!r && snapshot_isvalid(db, &c->snap))
+		goto found;
+	}
+
+	r = snapshot_begin(db, &c->snap);
+	if (r) return r;
+
+	r = cursor_find(c, forward, 0);
+
 	/* release read lock */
-	int r1 = unlock(db);
-	if (r1) return r1;
+	r1 = unlock(db);
+	if (!r) r = r1;
+	if (r) return r;
     }
 
-    return r ? r : cb_r;
+ found:
+    if (!c->record.offset) {
+	/* off the end */
+	if (forward) {
+	    c->state = CURSOR_END;
+	}
+	else {
+	    c->state = CURSOR_GAP;
+	    buf_reset(&c->keybuf);
+	}
+	return CYRUSDB_NOTFOUND;
+    }
+
+    record_getkey(db, &c->record, &c->keybuf);
+    c->state = CURSOR_ON;
+
+    if (key) *key = c->keybuf.s;
+    if (keylen) *keylen = c->keybuf.len;
+    if (data) *data = VAL(db, &c->record);
+    if (datalen) *datalen = c->record.vallen;
+
+    return 0;
+}
+
+static int cursor_seek(struct dbcursor *c, const char *key, size_t keylen)
+{
+    if (keylen) assert(key);
+
+    buf_setmap(&c->keybuf, key, keylen);
+    c->state = CURSOR_GAP;
+
+    /* and look at a fresh snapshot next time */
+    memset(&c->snap, 0, sizeof(struct snapshot));
+
+    return 0;
+}
+
+static int cursor_open(struct dbengine *db,
+		       const char *key, size_t keylen,
+		       struct dbcursor **cursorp,
+		       struct txn **tidptr)
+{
+    struct dbcursor *c;
+    int r;
+
+    assert(db);
+
+    if (tidptr && !*tidptr) {
+	r = newtxn(db, tidptr);
+	if (r) return r;
+    }
+
+    c = xzmalloc(sizeof(struct dbcursor));
+    c->db = db;
+    c->tidptr = tidptr;
+    cursor_seek(c, key, keylen);
+
+    *cursorp = c;
+
+    return 0;
+}
+
+static int cursor_next(struct dbcursor *c,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    return cursor_move(c, 1, key, keylen, data, datalen);
+}
+
+static int cursor_prev(struct dbcursor *c,
+		       const char **key, size_t *keylen,
+		       const char **data, size_t *datalen)
+{
+    return cursor_move(c, 0, key, keylen, data, datalen);
+}
+
+static void cursor_close(struct dbcursor *c)
+{
+    buf_free(&c->keybuf);
+    free(c);
 }
 
 /* helper function for all writes - wraps create and delete and the FORCE
@@ -1625,13 +2673,16 @@ static int skipwrite(struct dbengine *db,
 static int mycommit(struct dbengine *db, struct txn *tid)
 {
     struct skiprecord newrecord;
+    uint64_t generation = 0;
+    size_t end = 0;
     int r = 0;
 
     assert(db);
     assert(tid == db->current_txn);
 
-    /* no need to abort if we're not dirty */
-    if (!(db->header.flags & DIRTY))
+    /* no need to abort if we haven't written anything - the header
+     * may be dirty from someone else's group commit */
+    if (db->end == db->header.current_size)
 	goto done;
 
     /* build a commit record */
@@ -1643,6 +2694,31 @@ static int mycommit(struct dbengine *db, struct txn *tid)
     r = append_record(db, &newrecord, NULL, NULL);
     if (r) goto done;
 
+    if (db->group.enabled && !group_join(db)) {
+	size_t old_size = db->header.current_size;
+
+	/* visible to everyone now, the fsyncs come later */
+	db->header.current_size = db->end;
+	r = write_header(db);
+	if (r) {
+	    db->header.current_size = old_size;
+	    group_leave(db);
+	    goto done;
+	}
+	mappedfile_defer(db->mf);
+	if (db->bloom) bloom_defer(db->bloom);
+
+	generation = db->header.generation;
+	end = db->end;
+	goto done;
+    }
+
+    /* the filter must know every key before any record is durable */
+    if (db->bloom && bloom_commit(db->bloom)) {
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
     /* commit ALL outstanding changes first, before
      * rewriting the header */
     r = mappedfile_commit(db->mf);
@@ -1650,7 +2726,7 @@ static int mycommit(struct dbengine *db, struct txn *tid)
 
     /* finally, update the header and commit again */
     db->header.current_size = db->end;
-    db->header.flags &= ~DIRTY;
+    db->header.flags &= ~(DIRTY|GROUP);
     r = commit_header(db);
 
  done:
@@ -1664,8 +2740,12 @@ static int mycommit(struct dbengine *db, struct txn *tid)
 		   FNAME(db));
 	}
     } else {
-	/* consider checkpointing */
 	int diff = db->header.current_size - db->header.repack_size;
+
+	free(tid);
+	db->current_txn = NULL;
+
+	/* consider checkpointing */
 	if (diff > MINREWRITE &&
 	   ((float)diff / (float)db->header.current_size) > REWRITE_RATIO) {
 	    int r2 = mycheckpoint(db);
@@ -1677,8 +2757,8 @@ static int mycommit(struct dbengine *db, struct txn *tid)
 	else
 	    unlock(db);
 
-	free(tid);
-	db->current_txn = NULL;
+	/* and now wait for the disk, with company */
+	if (end) r = group_sync(db, generation, end);
     }
 
     return r;
@@ -1760,32 +2840,140 @@ static int copy_cb(void *rock,
     return mystore(cr->db, key, keylen, val, vallen, &cr->tid, 0);
 }
 
+/* is another process already checkpointing into 'fname'?  It keeps
+ * its new file write locked the whole time it's copying */
+static int checkpoint_inprogress(const char *fname)
+{
+    int fd;
+    int busy;
+
+    fd = open(fname, O_RDWR, 0644);
+    if (fd < 0) return 0;
+
+    busy = (lock_nonblocking(fd, fname) < 0);
+
+    /* closing drops the lock, if we got it */
+    close(fd);
+
+    return busy;
+}
+
+/* apply every change committed to 'db' between 'offset' and the
+ * current end of the file to the new database.  Stores and deletes
+ * are forced, so changes which the copy already has are harmless.
+ * Returns CYRUSDB_NOTFOUND for a DELETE which doesn't say what it
+ * deleted, which can't be replayed */
+static int checkpoint_replay(struct dbengine *db, size_t offset,
+			     struct copy_rock *cr)
+{
+    struct skiprecord record;
+    struct buf keybuf = BUF_INITIALIZER;
+    int r = 0;
+
+    for (; !r && offset < db->header.current_size; offset += record.len) {
+	r = read_onerecord(db, offset, &record);
+	if (r) break;
+
+	switch (record.type) {
+	case RECORD:
+	    record_getkey(db, &record, &keybuf);
+	    r = mystore(cr->db, keybuf.s, keybuf.len,
+			VAL(db, &record), record.vallen, &cr->tid, 1);
+	    break;
+	case DELETE:
+	    /* written by a version which didn't keep the key */
+	    if (!record.keylen) {
+		r = CYRUSDB_NOTFOUND;
+		break;
+	    }
+	    r = mystore(cr->db, KEY(db, &record), record.keylen,
+			NULL, 0, &cr->tid, 1);
+	    break;
+	case COMMIT:
+	    break;
+	default:
+	    r = CYRUSDB_IOERROR;
+	}
+    }
+
+    buf_free(&keybuf);
+
+    return r;
+}
+
+/* Checkpoint while other processes carry on using the database.  The
+ * live records are copied from a snapshot with no lock held, and the
+ * write lock is only taken again to replay whatever was committed
+ * since the copy started and rename the new file into place.  Called
+ * either write locked (after a commit) or unlocked, always returns
+ * unlocked */
 static int mycheckpoint(struct dbengine *db)
 {
-    size_t old_size = db->header.current_size;
+    size_t old_size;
+    size_t replay_from;
+    uint64_t generation;
     char newfname[1024];
-    clock_t start = sclock();
+    char bloomfname[sizeof(newfname) + 6];	/* newfname + ".bloom" */
+    struct timeval start, locked, end;
+    struct groupcommit group;
     struct copy_rock cr;
     int r = 0;
 
-    r = myconsistent(db, db->current_txn);
-    if (r) {
-	syslog(LOG_ERR, "db %s, inconsistent pre-checkpoint, bailing out",
-	       FNAME(db));
-	unlock(db);
-	return r;
+    gettimeofday(&start, NULL);
+
+    if (!mappedfile_iswritelocked(db->mf)) {
+	r = write_lock(db);
+	if (r) return r;
     }
 
+    /* we're not in a transaction, the copy walks a snapshot */
+    assert(!db->current_txn);
+
+    old_size = db->header.current_size;
+    replay_from = db->header.current_size;
+    generation = db->header.generation;
+
     /* open fname.NEW */
     snprintf(newfname, sizeof(newfname), "%s.NEW", FNAME(db));
+    snprintf(bloomfname, sizeof(bloomfname), "%s.bloom", newfname);
+
+    /* only one at a time */
+    if (checkpoint_inprogress(newfname)) {
+	unlock(db);
+	return 0;
+    }
+
     unlink(newfname);
 
     cr.db = NULL;
     cr.tid = NULL;
     r = opendb(newfname, db->open_flags | CYRUSDB_CREATE, &cr.db);
-    if (r) return r;
+    if (r) {
+	unlock(db);
+	return r;
+    }
+
+    /* hold the new file's lock before letting anyone else in, it's what
+     * tells them we're busy */
+    r = newtxn(cr.db, &cr.tid);
+    if (r) goto err;
+
+    /* prefixes stay shared, and the copy is where they share best */
+    cr.db->header.flags |= db->header.flags & PREFIX;
+
+    /* and a fresh filter to go with it, without the deleted keys */
+    if (db->header.flags & BLOOM) {
+	r = bloom_create(bloomfname, db->header.num_records, &cr.db->bloom);
+	if (r) {
+	    r = CYRUSDB_IOERROR;
+	    goto err;
+	}
+    }
 
-    r = myforeach(db, NULL, 0, NULL, copy_cb, &cr, &db->current_txn);
+    unlock(db);
+
+    /* copy everything live in the snapshot, without any lock */
+    r = snapshot_foreach(db, NULL, 0, NULL, copy_cb, &cr);
     if (r) goto err;
 
     r = myconsistent(cr.db, cr.tid);
@@ -1795,13 +2983,41 @@ static int mycheckpoint(struct dbengine *db)
 	goto err;
     }
 
+    /* now stop the world, just long enough to catch up */
+    r = write_lock(db);
+    if (r) goto err;
+
+    gettimeofday(&locked, NULL);
+
+    /* someone else has replaced the file (recovery2), give up */
+    if (db->header.generation != generation) {
+	r = CYRUSDB_AGAIN;
+	goto err;
+    }
+
+    r = checkpoint_replay(db, replay_from, &cr);
+    if (r == CYRUSDB_NOTFOUND) {
+	syslog(LOG_NOTICE, "twoskip: abandoned checkpoint of %s, a DELETE "
+	       "without its key was committed during the copy", FNAME(db));
+	r = CYRUSDB_AGAIN;
+	goto abandon;
+    }
+    if (r) goto err;
+
     /* remember the repack size */
     cr.db->header.repack_size = cr.db->end;
 
     /* increase the generation count */
     cr.db->header.generation = db->header.generation + 1;
 
+    /* they may have been switched on while we were copying */
+    cr.db->header.flags |= db->header.flags & (BLOOM|PREFIX);
+
     r = mycommit(cr.db, cr.tid);
+    cr.tid = NULL;
+    if (r) goto err;
+
+    r = bloom_handover(db, cr.db);
     if (r) goto err;
 
     /* move new file to original file name */
@@ -1811,30 +3027,40 @@ static int mycheckpoint(struct dbengine *db)
     /* OK, we're commmitted now - clean up */
     unlock(db);
 
+    gettimeofday(&end, NULL);
+
+    syslog(LOG_INFO,
+	   "twoskip: checkpointed %s (%llu record%s, %llu => %llu bytes) "
+	   "in %2.3f seconds, locked for %2.3f seconds to replay %llu bytes",
+	   FNAME(db), (LLU)cr.db->header.num_records,
+	   cr.db->header.num_records == 1 ? "" : "s", (LLU)old_size,
+	   (LLU)(cr.db->header.current_size),
+	   timesub(&start, &end), timesub(&locked, &end),
+	   (LLU)(db->header.current_size - replay_from));
+
     /* gotta clean it all up */
     mappedfile_close(&db->mf);
     buf_free(&db->loc.keybuf);
 
+    group = db->group;
     *db = *cr.db;
+    db->group = group;
     free(cr.db); /* leaked? */
 
-    {
-	syslog(LOG_INFO,
-	       "twoskip: checkpointed %s (%llu record%s, %llu => %llu bytes) in %2.3f seconds",
-	       FNAME(db), (LLU)db->header.num_records,
-	       db->header.num_records == 1 ? "" : "s", (LLU)old_size,
-	       (LLU)(db->header.current_size),
-	       (sclock() - start) / (double) CLOCKS_PER_SEC);
-    }
-
     return 0;
 
  err:
-    if (cr.tid) myabort(cr.db, cr.tid);
+    if (r == CYRUSDB_AGAIN)
+	syslog(LOG_NOTICE, "twoskip: abandoned checkpoint of %s, "
+	       "the file changed under it", FNAME(db));
+ abandon:
+    /* still ours while it's locked */
     unlink(FNAME(cr.db));
+    unlink(bloomfname);
+    if (cr.tid) myabort(cr.db, cr.tid);
     dispose_db(cr.db);
     unlock(db);
-    return CYRUSDB_IOERROR;
+    return r == CYRUSDB_AGAIN ? 0 : CYRUSDB_IOERROR;
 }
 
 
@@ -1847,6 +3073,7 @@ static int dump(struct dbengine *db, int detail __attribute__((unused)))
 {
     struct skiprecord record;
     struct buf scratch = BUF_INITIALIZER;
+    struct groupstate gs;
     size_t offset = DUMMY_OFFSET;
     int r = 0;
     int i;
@@ -1858,6 +3085,12 @@ static int dump(struct dbengine *db, int detail __attribute__((unused)))
 	  (LLU)db->header.current_size,
 	  (LLU)db->header.repack_size);
 
+    if (!group_open(db, 0) && !group_read(db, &gs) && gs.syncs) {
+	printf("GROUP: commits=%llu syncs=%llu avgbatch=%.1f maxbatch=%llu\n",
+	      (LLU)gs.commits, (LLU)gs.syncs,
+	      (double)gs.synced_commits / gs.syncs, (LLU)gs.maxbatch);
+    }
+
     while (offset < db->header.current_size) {
 	printf("%08llX ", (LLU)offset);
 
@@ -1879,12 +3112,12 @@ static int dump(struct dbengine *db, int detail __attribute__((unused)))
 
 	case RECORD:
 	case DUMMY:
-	    buf_setmap(&scratch, KEY(db, &record), record.keylen);
+	    record_getkey(db, &record, &scratch);
 	    buf_replace_char(&scratch, '\0', '-');
-	    printf("%s kl=%llu dl=%llu lvl=%d (%s)\n",
+	    printf("%s kl=%llu pl=%llu dl=%llu lvl=%d (%s)\n",
 		   (record.type == RECORD ? "RECORD" : "DUMMY"),
-		   (LLU)record.keylen, (LLU)record.vallen,
-		   record.level, buf_cstring(&scratch));
+		   (LLU)record.keylen, (LLU)record.prefixlen,
+		   (LLU)record.vallen, record.level, buf_cstring(&scratch));
 	    printf("\t");
 	    for (i = 0; i <= record.level; i++) {
 		printf("%08llX ", (LLU)record.nextloc[i]);
@@ -1922,6 +3155,8 @@ static int myconsistent(struct dbengine *db, struct txn *tid)
 {
     struct skiprecord prevrecord;
     struct skiprecord record;
+    struct buf prevkey = BUF_INITIALIZER;
+    struct buf key = BUF_INITIALIZER;
     size_t fwd[MAXLEVEL];
     size_t num_records = 0;
     int r = 0;
@@ -1940,22 +3175,23 @@ static int myconsistent(struct dbengine *db, struct txn *tid)
 
     while (fwd[0]) {
 	r = read_onerecord(db, fwd[0], &record);
-	if (r) return r;
+	if (r) goto done;
 
 	if (record.type == DELETE) {
 	    fwd[0] = record.nextloc[0];
 	    continue;
 	}
 
-	cmp = db->compar(KEY(db, &record), record.keylen,
-			 KEY(db, &prevrecord), prevrecord.keylen);
+	cmp = record_compar(db, &record, prevkey.s, prevkey.len);
 	if (cmp <= 0) {
+	    record_getkey(db, &record, &key);
 	    syslog(LOG_ERR, "DBERROR: twoskip out of order %s: %.*s (%08llX) <= %.*s (%08llX)",
-		   FNAME(db), (int)record.keylen, KEY(db, &record),
+		   FNAME(db), (int)key.len, key.s,
 		   (LLU)record.offset,
-		   (int)prevrecord.keylen, KEY(db, &prevrecord),
+		   (int)prevkey.len, prevkey.s,
 		   (LLU)prevrecord.offset);
-	    return CYRUSDB_INTERNAL;
+	    r = CYRUSDB_INTERNAL;
+	    goto done;
 	}
 
 	for (i = 0; i < record.level; i++) {
@@ -1963,7 +3199,8 @@ static int myconsistent(struct dbengine *db, struct txn *tid)
 	    if (fwd[i] != record.offset) {
 		syslog(LOG_ERR, "DBERROR: twoskip broken linkage %s: %08llX at %d, expected %08llX",
 		       FNAME(db), (LLU)record.offset, i, (LLU)fwd[i]);
-		return CYRUSDB_INTERNAL;
+		r = CYRUSDB_INTERNAL;
+		goto done;
 	    }
 	    /* and advance to the new pointer */
 	    fwd[i] = _getloc(db, &record, i);
@@ -1972,13 +3209,15 @@ static int myconsistent(struct dbengine *db, struct txn *tid)
 	/* keep a copy for comparison purposes */
 	num_records++;
 	prevrecord = record;
+	record_getkey(db, &prevrecord, &prevkey);
     }
 
     for (i = 0; i < MAXLEVEL; i++) {
 	if (fwd[i]) {
 	    syslog(LOG_ERR, "DBERROR: twoskip broken tail %s: %08llX at %d",
 		   FNAME(db), (LLU)fwd[i], i);
-	    return CYRUSDB_INTERNAL;
+	    r = CYRUSDB_INTERNAL;
+	    goto done;
 	}
     }
 
@@ -1987,10 +3226,14 @@ static int myconsistent(struct dbengine *db, struct txn *tid)
     if (num_records != db->header.num_records) {
 	syslog(LOG_ERR, "DBERROR: twoskip record count mismatch %s: %llu should be %llu",
 	       FNAME(db), (LLU)num_records, (LLU)db->header.num_records);
-	return CYRUSDB_INTERNAL;
+	r = CYRUSDB_INTERNAL;
     }
 
-    return 0;
+ done:
+    buf_free(&prevkey);
+    buf_free(&key);
+
+    return r;
 }
 
 static int _copy_commit(struct dbengine *db, struct dbengine *newdb,
@@ -1998,6 +3241,7 @@ static int _copy_commit(struct dbengine *db, struct dbengine *newdb,
 {
     struct txn *tid = NULL;
     struct skiprecord record;
+    struct buf keybuf = BUF_INITIALIZER;
     const char *val;
     size_t offset;
     int r = 0;
@@ -2018,16 +3262,20 @@ static int _copy_commit(struct dbengine *db, struct dbengine *newdb,
 	}
 
 	/* store into the new DB */
-	r = mystore(newdb, KEY(db, &record), record.keylen, val, record.vallen, &tid, 1);
+	record_getkey(db, &record, &keybuf);
+	r = mystore(newdb, keybuf.s, keybuf.len, val, record.vallen, &tid, 1);
 	if (r) goto err;
     }
 
+    buf_free(&keybuf);
+
     if (tid) r = mycommit(newdb, tid);
     if (r) return r;
 
     return 0;
 
 err:
+    buf_free(&keybuf);
     if (tid) myabort(newdb, tid);
     return r;
 }
@@ -2040,6 +3288,7 @@ static int recovery2(struct dbengine *db, int *count)
     uint64_t oldcount = db->header.num_records;
     struct skiprecord record;
     struct dbengine *newdb = NULL;
+    struct groupcommit group;
     char newfname[1024];
     size_t offset;
     int r = 0;
@@ -2054,6 +3303,9 @@ static int recovery2(struct dbengine *db, int *count)
     /* increase the generation count */
     newdb->header.generation = db->header.generation + 1;
 
+    /* and keep sharing prefixes */
+    newdb->header.flags |= db->header.flags & PREFIX;
+
     /* start with the dummy */
     for (offset = DUMMY_OFFSET; offset < SIZE(db); offset += record.len) {
 	r = read_onerecord(db, offset, &record);
@@ -2081,6 +3333,19 @@ static int recovery2(struct dbengine *db, int *count)
 	goto err;
     }
 
+    /* keep the filter, it covers everything we rescued */
+    if (db->header.flags & BLOOM) {
+	r = write_lock(newdb);
+	if (r) goto err;
+	newdb->header.flags |= BLOOM;
+	r = commit_header(newdb);
+	unlock(newdb);
+	if (r) goto err;
+
+	r = bloom_handover(db, newdb);
+	if (r) goto err;
+    }
+
     /* regardless, we had a commit during create, and in any _copy_commit, so
      * rename into place */
 
@@ -2095,7 +3360,9 @@ static int recovery2(struct dbengine *db, int *count)
     mappedfile_close(&db->mf);
     buf_free(&db->loc.keybuf);
 
+    group = db->group;
     *db = *newdb;
+    db->group = group;
     free(newdb); /* leaked? */
 
     syslog(LOG_NOTICE, "twoskip: recovery2 %s - rescued %llu of %llu records",
@@ -2120,6 +3387,8 @@ static int recovery1(struct dbengine *db, int *count)
     struct skiprecord record;
     struct skiprecord prevrecord;
     struct skiprecord fixrecord;
+    struct buf prevkey = BUF_INITIALIZER;
+    struct buf key = BUF_INITIALIZER;
     size_t nextoffset = 0;
     uint64_t num_records = 0;
     int changed = 0;
@@ -2166,7 +3435,7 @@ static int recovery1(struct dbengine *db, int *count)
 
     while (nextoffset) {
 	r = read_onerecord(db, nextoffset, &record);
-	if (r) return r;
+	if (r) goto done;
 
 	/* just skip over delele records */
 	if (record.type == DELETE) {
@@ -2174,15 +3443,16 @@ static int recovery1(struct dbengine *db, int *count)
 	    continue;
 	}
 
-	cmp = db->compar(KEY(db, &record), record.keylen,
-			 KEY(db, &prevrecord), prevrecord.keylen);
+	cmp = record_compar(db, &record, prevkey.s, prevkey.len);
 	if (cmp <= 0) {
+	    record_getkey(db, &record, &key);
 	    syslog(LOG_ERR, "DBERROR: twoskip out of order %s: %.*s (%08llX) <= %.*s (%08llX)",
-		   FNAME(db), (int)record.keylen, KEY(db, &record),
+		   FNAME(db), (int)key.len, key.s,
 		   (LLU)record.offset,
-		   (int)prevrecord.keylen, KEY(db, &prevrecord),
+		   (int)prevkey.len, prevkey.s,
 		   (LLU)prevrecord.offset);
-	    return CYRUSDB_INTERNAL;
+	    r = CYRUSDB_INTERNAL;
+	    goto done;
 	}
 
 	/* check for old offsets needing fixing */
@@ -2190,12 +3460,12 @@ static int recovery1(struct dbengine *db, int *count)
 	    if (next[i] != record.offset) {
 		/* need to fix up the previous record to point here */
 		r = read_onerecord(db, prev[i], &fixrecord);
-		if (r) return r;
+		if (r) goto done;
 
 		/* XXX - optimise adjacent same records */
 		fixrecord.nextloc[i] = record.offset;
 		r = rewrite_record(db, &fixrecord);
-		if (r) return r;
+		if (r) goto done;
 		changed++;
 	    }
 	    prev[i] = record.offset;
@@ -2217,6 +3487,7 @@ static int recovery1(struct dbengine *db, int *count)
 	nextoffset = _getloc(db, &record, 0);
 
 	prevrecord = record;
+	record_getkey(db, &prevrecord, &prevkey);
     }
 
     /* check for remaining offsets needing fixing */
@@ -2224,31 +3495,35 @@ static int recovery1(struct dbengine *db, int *count)
 	if (next[i]) {
 	    /* need to fix up the previous record to point to the end */
 	    r = read_onerecord(db, prev[i], &fixrecord);
-	    if (r) return r;
+	    if (r) goto done;
 
 	    /* XXX - optimise, same as above */
 	    fixrecord.nextloc[i] = 0;
 	    r = rewrite_record(db, &fixrecord);
-	    if (r) return r;
+	    if (r) goto done;
 	    changed++;
 	}
     }
 
     r = mappedfile_truncate(db->mf, db->header.current_size);
-    if (r) return r;
+    if (r) goto done;
 
     r = mappedfile_commit(db->mf);
-    if (r) return r;
+    if (r) goto done;
 
     /* clear the dirty flag */
-    db->header.flags &= ~DIRTY;
+    db->header.flags &= ~(DIRTY|GROUP);
     db->header.num_records = num_records;
     r = commit_header(db);
-    if (r) return r;
+    if (r) goto done;
 
     if (count) *count = changed;
 
-    return 0;
+ done:
+    buf_free(&prevkey);
+    buf_free(&key);
+
+    return r;
 }
 
 static int recovery(struct dbengine *db)
@@ -2261,6 +3536,15 @@ static int recovery(struct dbengine *db)
     if (db_is_clean(db))
 	return 0;
 
+    /* an abandoned group commit may have hit the disk in any order,
+     * so don't trust the pointers, rebuild from the commits */
+    if ((db->header.flags & GROUP) && !group_islive(db)) {
+	r = recovery2(db, &count);
+	if (!r) goto done;
+	syslog(LOG_ERR, "DBERROR: recovery2 failed %s, trying recovery1", FNAME(db));
+	count = 0;
+    }
+
     r = recovery1(db, &count);
     if (r) {
 	syslog(LOG_ERR, "DBERROR: recovery1 failed %s, trying recovery2", FNAME(db));
@@ -2269,6 +3553,7 @@ static int recovery(struct dbengine *db)
 	if (r) return r;
     }
 
+ done:
     {
 	syslog(LOG_INFO,
 	       "twoskip: recovered %s (%llu record%s, %llu bytes) in %2.3f seconds - fixed %d offset%s",
@@ -2362,5 +3647,15 @@ HIDDEN struct cyrusdb_backend cyrusdb_twoskip =
     &dump,
     &consistent,
     &mycheckpoint,
-    &mycompar
+    &mycompar,
+
+    1,				/* sorted */
+
+    &cursor_open,
+    &cursor_next,
+    &cursor_prev,
+    &cursor_seek,
+    &cursor_close,
+
+    1				/* bloom */
 };
@@ -0,0 +1,456 @@
+/* dbsnapshot.c -- read-only sorted snapshots of a cyrusdb
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* File format:
+ *
+ * 64 byte header, all numbers in network byte order:
+ *   0: magic (16 bytes)
+ *  16: version
+ *  20: flags
+ *  24: number of records (64 bit)
+ *  32: offset of the index (64 bit)
+ *  40: size of the file (64 bit)
+ *  48: unused
+ *  60: crc32 of the header up to here
+ * followed by the records in key order, each of them:
+ *   key length, data length, key, data, zero padded to 8 bytes
+ * followed by the index: the offset of each record (64 bit), in the
+ * same order.
+ *
+ * The file is written in one go under a temporary name, fsynced and
+ * renamed into place, so it is never changed once it has a name.  The
+ * header crc and the size catch anything truncated or foreign; the
+ * records are bounds checked as they're read, but not crced, since
+ * that would mean reading the whole file into every process which
+ * maps it.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "assert.h"
+#include "bsearch.h"
+#include "byteorder64.h"
+#include "crc32.h"
+#include "dbsnapshot.h"
+#include "map.h"
+#include "retry.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#define DBSNAPSHOT_MAGIC ("\241\002\213\015db snapshot\0")
+#define DBSNAPSHOT_MAGIC_SIZE (16)
+#define DBSNAPSHOT_VERSION 1
+
+enum {
+    OFFSET_MAGIC = 0,
+    OFFSET_VERSION = 16,
+    OFFSET_FLAGS = 20,
+    OFFSET_COUNT = 24,
+    OFFSET_INDEX = 32,
+    OFFSET_SIZE = 40,
+    OFFSET_CRC32 = 60,
+};
+
+#define HEADER_SIZE 64
+#define RECORD_HEAD 8
+
+#define PAD8(n) (((n) + 7) & ~(size_t)7)
+
+struct dbsnapshot {
+    char *fname;
+
+    /* the file we have mapped, if any */
+    const char *base;
+    size_t len;
+    dev_t dev;
+    ino_t ino;
+
+    uint64_t count;
+    const char *index;
+    int (*compar)(const char *s1, int l1, const char *s2, int l2);
+};
+
+/******************************* WRITING *****************************/
+
+struct write_rock {
+    struct db *db;
+    int fd;
+    uint64_t offset;
+    struct buf prevkey;
+    struct buf index;
+    struct buf out;
+    int r;
+};
+
+/* flush the output buffer once it's big enough, or at the end */
+static int write_flush(struct write_rock *wr, size_t atleast)
+{
+    if (wr->out.len < atleast) return 0;
+
+    if (retry_write(wr->fd, wr->out.s, wr->out.len) < 0) {
+	wr->r = CYRUSDB_IOERROR;
+	return -1;
+    }
+    buf_reset(&wr->out);
+
+    return 0;
+}
+
+static int write_cb(void *rock,
+		    const char *key, size_t keylen,
+		    const char *data, size_t datalen)
+{
+    struct write_rock *wr = (struct write_rock *)rock;
+    static const char zeros[8];
+    uint32_t head[2];
+    uint64_t offset;
+    size_t len;
+
+    /* a hash database doesn't come back sorted */
+    if (wr->prevkey.len &&
+	cyrusdb_compar(wr->db, key, keylen,
+		       wr->prevkey.s, wr->prevkey.len) <= 0) {
+	syslog(LOG_ERR, "DBERROR: dbsnapshot: database is not sorted");
+	wr->r = CYRUSDB_INTERNAL;
+	return -1;
+    }
+    buf_setmap(&wr->prevkey, key, keylen);
+
+    if (keylen > UINT32_MAX || datalen > UINT32_MAX) {
+	wr->r = CYRUSDB_INTERNAL;
+	return -1;
+    }
+
+    offset = htonll(wr->offset);
+    buf_appendmap(&wr->index, (const char *)&offset, 8);
+
+    head[0] = htonl(keylen);
+    head[1] = htonl(datalen);
+    buf_appendmap(&wr->out, (const char *)head, RECORD_HEAD);
+    buf_appendmap(&wr->out, key, keylen);
+    buf_appendmap(&wr->out, data, datalen);
+
+    len = RECORD_HEAD + keylen + datalen;
+    buf_appendmap(&wr->out, zeros, PAD8(len) - len);
+    wr->offset += PAD8(len);
+
+    return write_flush(wr, 65536);
+}
+
+EXPORTED int dbsnapshot_write(struct db *db, const char *fname, int flags)
+{
+    struct write_rock wr;
+    char header[HEADER_SIZE];
+    char *newfname = strconcat(fname, ".NEW", (char *)NULL);
+    int r;
+
+    memset(&wr, 0, sizeof(struct write_rock));
+    wr.db = db;
+    wr.offset = HEADER_SIZE;
+
+    /* nobody else has this name, it's only ever renamed away */
+    unlink(newfname);
+    wr.fd = open(newfname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (wr.fd < 0) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
+    /* the header goes in last, once we know what's in it */
+    memset(header, 0, HEADER_SIZE);
+    buf_appendmap(&wr.out, header, HEADER_SIZE);
+
+    r = cyrusdb_foreach(db, NULL, 0, NULL, write_cb, &wr, NULL);
+    if (wr.r) r = wr.r;
+    if (r) goto done;
+
+    buf_appendmap(&wr.out, wr.index.s, wr.index.len);
+    if (write_flush(&wr, 0)) {
+	r = wr.r;
+	goto done;
+    }
+
+    memcpy(header + OFFSET_MAGIC, DBSNAPSHOT_MAGIC, DBSNAPSHOT_MAGIC_SIZE);
+    *((uint32_t *)(header + OFFSET_VERSION)) = htonl(DBSNAPSHOT_VERSION);
+    *((uint32_t *)(header + OFFSET_FLAGS)) = htonl(flags & CYRUSDB_MBOXSORT);
+    *((uint64_t *)(header + OFFSET_COUNT)) = htonll(wr.index.len / 8);
+    *((uint64_t *)(header + OFFSET_INDEX)) = htonll(wr.offset);
+    *((uint64_t *)(header + OFFSET_SIZE)) = htonll(wr.offset + wr.index.len);
+    *((uint32_t *)(header + OFFSET_CRC32)) =
+	htonl(crc32_map(header, OFFSET_CRC32));
+
+    if (lseek(wr.fd, 0, SEEK_SET) < 0 ||
+	retry_write(wr.fd, header, HEADER_SIZE) < 0 ||
+	fsync(wr.fd) < 0) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
+    if (rename(newfname, fname) < 0) {
+	syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
+ done:
+    if (wr.fd >= 0) close(wr.fd);
+    if (r) unlink(newfname);
+    buf_free(&wr.prevkey);
+    buf_free(&wr.index);
+    buf_free(&wr.out);
+    free(newfname);
+
+    return r;
+}
+
+/******************************* READING *****************************/
+
+static void snapshot_unmap(struct dbsnapshot *snap)
+{
+    if (snap->base) map_free(&snap->base, &snap->len);
+    snap->base = NULL;
+    snap->len = 0;
+    snap->dev = 0;
+    snap->ino = 0;
+    snap->count = 0;
+    snap->index = NULL;
+}
+
+/* map the file at snap->fname, which is known to be 'sbuf' */
+static int snapshot_map(struct dbsnapshot *snap, int fd, struct stat *sbuf)
+{
+    const char *base = NULL;
+    size_t len = 0;
+    uint64_t count, index;
+    uint32_t flags;
+
+    if (sbuf->st_size < HEADER_SIZE) goto bad;
+
+    map_refresh(fd, 1, &base, &len, sbuf->st_size, snap->fname, 0);
+
+    if (memcmp(base + OFFSET_MAGIC, DBSNAPSHOT_MAGIC, DBSNAPSHOT_MAGIC_SIZE) ||
+	ntohl(*((uint32_t *)(base + OFFSET_CRC32))) !=
+	    crc32_map(base, OFFSET_CRC32))
+	goto bad;
+
+    if (ntohl(*((uint32_t *)(base + OFFSET_VERSION))) > DBSNAPSHOT_VERSION) {
+	syslog(LOG_ERR, "DBERROR: %s: unknown snapshot version", snap->fname);
+	goto bad;
+    }
+
+    flags = ntohl(*((uint32_t *)(base + OFFSET_FLAGS)));
+    count = ntohll(*((uint64_t *)(base + OFFSET_COUNT)));
+    index = ntohll(*((uint64_t *)(base + OFFSET_INDEX)));
+
+    if (ntohll(*((uint64_t *)(base + OFFSET_SIZE))) != len ||
+	index < HEADER_SIZE || index > len || (len - index) / 8 != count)
+	goto bad;
+
+    snapshot_unmap(snap);
+
+    snap->base = base;
+    snap->len = len;
+    snap->dev = sbuf->st_dev;
+    snap->ino = sbuf->st_ino;
+    snap->count = count;
+    snap->index = base + index;
+    snap->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare_mbox
+					      : bsearch_ncompare_raw;
+
+    return 0;
+
+ bad:
+    syslog(LOG_ERR, "DBERROR: %s: invalid snapshot", snap->fname);
+    if (base) map_free(&base, &len);
+    return CYRUSDB_IOERROR;
+}
+
+/* make sure we have the file which is at snap->fname now */
+static int snapshot_refresh(struct dbsnapshot *snap)
+{
+    struct stat sbuf;
+    int fd;
+    int r;
+
+    if (stat(snap->fname, &sbuf) < 0) {
+	/* gone, or never there */
+	snapshot_unmap(snap);
+	return CYRUSDB_NOTFOUND;
+    }
+
+    /* still the same file?  Since we have it mapped, the inode can't
+     * have been reused */
+    if (snap->base && sbuf.st_ino == snap->ino && sbuf.st_dev == snap->dev)
+	return 0;
+
+    fd = open(snap->fname, O_RDONLY, 0);
+    if (fd < 0) {
+	snapshot_unmap(snap);
+	return errno == ENOENT ? CYRUSDB_NOTFOUND : CYRUSDB_IOERROR;
+    }
+
+    /* it may have been renamed over again since the stat */
+    if (fstat(fd, &sbuf) < 0) {
+	r = CYRUSDB_IOERROR;
+    }
+    else {
+	r = snapshot_map(snap, fd, &sbuf);
+    }
+    close(fd);
+
+    if (r) snapshot_unmap(snap);
+
+    return r;
+}
+
+EXPORTED int dbsnapshot_open(const char *fname, struct dbsnapshot **snapp)
+{
+    struct dbsnapshot *snap;
+    int r;
+
+    assert(!*snapp);
+
+    snap = xzmalloc(sizeof(struct dbsnapshot));
+    snap->fname = xstrdup(fname);
+
+    /* missing is fine, broken isn't */
+    r = snapshot_refresh(snap);
+    if (r && r != CYRUSDB_NOTFOUND) {
+	dbsnapshot_close(&snap);
+	return r;
+    }
+
+    *snapp = snap;
+
+    return 0;
+}
+
+EXPORTED void dbsnapshot_close(struct dbsnapshot **snapp)
+{
+    struct dbsnapshot *snap = *snapp;
+
+    if (!snap) return;
+
+    snapshot_unmap(snap);
+    free(snap->fname);
+    free(snap);
+
+    *snapp = NULL;
+}
+
+/* the record at 'i' in the index, or NULL if it doesn't fit */
+static const char *snapshot_record(struct dbsnapshot *snap, uint64_t i,
+				   uint32_t *keylen, uint32_t *datalen)
+{
+    uint64_t offset = ntohll(*((uint64_t *)(snap->index + i * 8)));
+    const char *rec;
+
+    if (offset < HEADER_SIZE ||
+	offset + RECORD_HEAD > (uint64_t)(snap->index - snap->base))
+	return NULL;
+
+    rec = snap->base + offset;
+    *keylen = ntohl(*((uint32_t *)rec));
+    *datalen = ntohl(*((uint32_t *)(rec + 4)));
+
+    if (offset + RECORD_HEAD + *keylen + *datalen >
+	(uint64_t)(snap->index - snap->base))
+	return NULL;
+
+    return rec + RECORD_HEAD;
+}
+
+EXPORTED int dbsnapshot_fetch(struct dbsnapshot *snap,
+			      const char *key, size_t keylen,
+			      const char **data, size_t *datalen)
+{
+    uint64_t lo = 0, hi, mid;
+    uint32_t reckeylen, recdatalen;
+    const char *rec;
+    int cmp;
+    int r;
+
+    r = snapshot_refresh(snap);
+    if (r) return r;
+
+    hi = snap->count;
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+
+	rec = snapshot_record(snap, mid, &reckeylen, &recdatalen);
+	if (!rec) {
+	    syslog(LOG_ERR, "DBERROR: %s: bad record %llu", snap->fname,
+		   (unsigned long long)mid);
+	    return CYRUSDB_IOERROR;
+	}
+
+	cmp = snap->compar(rec, reckeylen, key, keylen);
+	if (!cmp) {
+	    if (data) *data = rec + reckeylen;
+	    if (datalen) *datalen = recdatalen;
+	    return 0;
+	}
+
+	if (cmp < 0) lo = mid + 1;
+	else hi = mid;
+    }
+
+    return CYRUSDB_NOTFOUND;
+}
+
+EXPORTED size_t dbsnapshot_count(struct dbsnapshot *snap)
+{
+    if (snapshot_refresh(snap)) return 0;
+
+    return snap->count;
+}
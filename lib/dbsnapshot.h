@@ -0,0 +1,77 @@
+/* dbsnapshot.h -- read-only sorted snapshots of a cyrusdb
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_LIB_DBSNAPSHOT_H__
+#define __CYRUS_LIB_DBSNAPSHOT_H__
+
+#include "cyrusdb.h"
+
+/* An immutable copy of a whole database, as a sorted array of records
+ * with an index of offsets, for binary searching straight out of a
+ * read-only map.  Lookups take no lock and make no system calls beyond
+ * a stat() to notice that the file has been replaced.
+ *
+ * dbsnapshot_write() writes a new file beside the old one and renames
+ * it into place, so readers see either the old snapshot or the new,
+ * never a mixture.  A reader keeps its map of the old file until its
+ * next lookup notices the rename. */
+
+struct dbsnapshot;
+
+/* write a snapshot of everything in 'db' to 'fname'.  'flags' may be
+ * CYRUSDB_MBOXSORT, which must match how 'db' was opened */
+extern int dbsnapshot_write(struct db *db, const char *fname, int flags);
+
+/* start reading the snapshot in 'fname'.  It doesn't have to exist
+ * yet: until it does, every fetch is CYRUSDB_NOTFOUND */
+extern int dbsnapshot_open(const char *fname, struct dbsnapshot **snapp);
+extern void dbsnapshot_close(struct dbsnapshot **snapp);
+
+/* 'data' is valid until the next call on the snapshot */
+extern int dbsnapshot_fetch(struct dbsnapshot *snap,
+			    const char *key, size_t keylen,
+			    const char **data, size_t *datalen);
+
+/* number of records in the current snapshot, or 0 if there isn't one */
+extern size_t dbsnapshot_count(struct dbsnapshot *snap);
+
+#endif /* __CYRUS_LIB_DBSNAPSHOT_H__ */
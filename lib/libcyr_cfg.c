@@ -156,6 +156,18 @@ static struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 1),
       CYRUS_OPT_SWITCH },
 
+    { CYRUSOPT_TWOSKIP_GROUP_COMMIT,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_TWOSKIP_GROUP_COMMIT_DELAY,
+      CFGVAL(long, 0),
+      CYRUS_OPT_INT },
+
+    { CYRUSOPT_TWOSKIP_PREFIX_COMPRESSION,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
     { CYRUSOPT_LAST, { NULL }, CYRUS_OPT_NOTOPT }
 };
 
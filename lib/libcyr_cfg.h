@@ -111,6 +111,12 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* Share fsyncs between concurrent twoskip commits (OFF) */
+    CYRUSOPT_TWOSKIP_GROUP_COMMIT,
+    /* Microseconds a twoskip group commit waits for company (0) */
+    CYRUSOPT_TWOSKIP_GROUP_COMMIT_DELAY,
+    /* Share key prefixes between twoskip records (OFF) */
+    CYRUSOPT_TWOSKIP_PREFIX_COMPRESSION,
 
     CYRUSOPT_LAST
     
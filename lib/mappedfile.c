@@ -102,8 +102,10 @@ struct mappedfile {
 
 static void _ensure_mapped(struct mappedfile *mf, size_t offset, int update)
 {
-    const char *base = NULL;
-    size_t len = 0;
+    /* start from the current map, so map_refresh replaces it rather
+     * than leaking a new mapping on every write */
+    const char *base = mf->map_buf.s;
+    size_t len = mf->map_buf.len;
 
     /* we may be rewriting inside a file, so don't shrink, only extend */
     if (update) {
@@ -331,6 +333,31 @@ EXPORTED int mappedfile_commit(struct mappedfile *mf)
     return 0;
 }
 
+/* the caller has arranged for everything written so far to be synced
+ * later, possibly by another process - so forget about it */
+EXPORTED void mappedfile_defer(struct mappedfile *mf)
+{
+    mf->dirty = 0;
+    mf->was_resized = 0;
+}
+
+/* sync everything written to the file so far, by anyone, whether or
+ * not it was written through this handle */
+EXPORTED int mappedfile_sync(struct mappedfile *mf)
+{
+    assert(mf->fd != -1);
+
+    if (fdatasync(mf->fd) < 0) {
+	syslog(LOG_ERR, "IOERROR: %s fdatasync: %m", mf->fname);
+	return -EIO;
+    }
+
+    mf->dirty = 0;
+    mf->was_resized = 0;
+
+    return 0;
+}
+
 EXPORTED ssize_t mappedfile_pwrite(struct mappedfile *mf,
 				   const char *base, size_t len,
 				   off_t offset)
@@ -52,10 +52,15 @@
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+#include <sys/sendfile.h>
+#define USE_SENDFILE
+#endif
 
 #include "assert.h"
 #include "exitcodes.h"
@@ -94,6 +99,7 @@ EXPORTED struct protstream *prot_new(int fd, int write)
     newstream->write = write;
     newstream->logfd = PROT_NO_FD;
     newstream->big_buffer = PROT_NO_FD;
+    newstream->sendfile_fd = PROT_NO_FD;
     if(write)
 	newstream->cnt = PROT_BUFSIZE;
 
@@ -117,6 +123,7 @@ EXPORTED struct protstream *prot_writebuf(struct buf *buf)
     newstream->fd = PROT_NO_FD;
     newstream->logfd = PROT_NO_FD;
     newstream->big_buffer = PROT_NO_FD;
+    newstream->sendfile_fd = PROT_NO_FD;
 
     return newstream;
 }
@@ -135,6 +142,7 @@ EXPORTED struct protstream *prot_readmap(const char *base, uint32_t len)
     newstream->fd = PROT_NO_FD;
     newstream->logfd = PROT_NO_FD;
     newstream->big_buffer = PROT_NO_FD;
+    newstream->sendfile_fd = PROT_NO_FD;
 
     return newstream;
 }
@@ -296,7 +304,7 @@ EXPORTED int prot_setsasl(struct protstream *s, sasl_conn_t *conn)
 EXPORTED void prot_unsetsasl(struct protstream *s)
 {
     s->conn = NULL;
-    s->maxplain = PROT_BUFSIZE;
+    s->maxplain = s->buf_size;
     s->saslssf = 0;
 }
 
@@ -359,9 +367,11 @@ EXPORTED int prot_setcompress(struct protstream *s)
      * format defined here, the worst case expansion is 5 bytes per 32K-
      * byte block, i.e., a size increase of 0.015% for large data sets.
      *
-     * We say: maxplain can never be bigger than PROT_BUFSIZE, which
-     * is currently 4096, so adding 5 bytes will do it!
-     * 
+     * We say: maxplain starts out at most PROT_BUFSIZE, so adding 5
+     * bytes will do it!  When prot_growbuf() later raises maxplain
+     * (as far as PROT_BUFSIZE_MAX) it reallocs zbuf to the new size
+     * plus the same 6 bytes, so this keeps holding.
+     *
      * Add another spare byte and we'll never totally fill the buffer,
      * which saves a loop.
      *
@@ -428,6 +438,245 @@ EXPORTED int prot_data_boundary(struct protstream *s)
     return 0;
 }
 
+/*
+ * Does output to 's' go to the descriptor exactly as written, i.e.
+ * nothing needs to see or transform the bytes on the way out?
+ */
+static int prot_isplain(struct protstream *s)
+{
+    if (!s->write || s->writetobuf || s->fd == PROT_NO_FD) return 0;
+    if (s->logfd != PROT_NO_FD || s->saslssf) return 0;
+#ifdef HAVE_SSL
+    if (s->tls_conn) return 0;
+#endif /* HAVE_SSL */
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif /* HAVE_ZLIB */
+    return 1;
+}
+
+/*
+ * Can data written to 's' be sent by the kernel straight from a file?
+ */
+EXPORTED int prot_cansendfile(struct protstream *s)
+{
+#ifdef USE_SENDFILE
+    return prot_isplain(s);
+#else
+    (void)s;
+    return 0;
+#endif /* USE_SENDFILE */
+}
+
+EXPORTED int prot_setsendfile(struct protstream *s, int fd,
+			      const char *base, size_t len)
+{
+    if (fd != PROT_NO_FD && prot_cansendfile(s)) {
+	s->sendfile_fd = fd;
+	s->sendfile_base = base;
+	s->sendfile_len = len;
+	return 0;
+    }
+
+    s->sendfile_fd = PROT_NO_FD;
+    s->sendfile_base = NULL;
+    s->sendfile_len = 0;
+
+    return (fd == PROT_NO_FD) ? 0 : -1;
+}
+
+#ifdef USE_SENDFILE
+/*
+ * Send the 'len' bytes at 'buf', which lie within the sendfile mapping,
+ * from the file itself rather than copying them through the buffer.
+ * Returns 1 if the kernel won't do it and the caller should copy.
+ */
+static int prot_sendfile(struct protstream *s, const char *buf, unsigned len)
+{
+    off_t offset = buf - s->sendfile_base;
+    unsigned sent = 0;
+    ssize_t n;
+
+    /* everything buffered so far has to go first.  A forced flush
+     * also leaves the socket blocking, which is what we want here */
+    if (prot_flush_internal(s, 1) == EOF) return EOF;
+
+    while (sent < len) {
+	cmdtime_netstart();
+	n = sendfile(s->fd, s->sendfile_fd, &offset, len - sent);
+	cmdtime_netend();
+	s->syscalls++;
+
+	if (n == -1 && errno == EINTR && !signals_poll())
+	    continue;
+
+	if (n <= 0) {
+	    if (!sent && (n == 0 || errno == EINVAL || errno == ENOSYS)) {
+		/* not supported for these descriptors, don't try again */
+		prot_setsendfile(s, PROT_NO_FD, NULL, 0);
+		return 1;
+	    }
+	    s->error = xstrdup(n ? strerror(errno) : "short sendfile");
+	    return EOF;
+	}
+
+	sent += n;
+    }
+
+    s->flushes++;
+    s->flush_bytes += sent;
+    s->bulk++;
+    return 0;
+}
+#endif /* USE_SENDFILE */
+
+/*
+ * Write what's buffered and then the 'len' bytes at 'buf' in one go,
+ * rather than copying them through the buffer.  The stream must be
+ * plain and blocking, with nothing waiting in the big buffer.
+ */
+static int prot_writev(struct protstream *s, const char *buf, unsigned len)
+{
+    struct iovec iov[2];
+    int i = 0, niov = 0;
+    ssize_t n;
+
+    if (s->eof || s->error) return EOF;
+
+    if (s->dontblock_isset) {
+	nonblock(s->fd, 0);
+	s->dontblock_isset = 0;
+    }
+
+    if (s->ptr != s->buf) {
+	iov[niov].iov_base = s->buf;
+	iov[niov++].iov_len = s->ptr - s->buf;
+    }
+    iov[niov].iov_base = (char *) buf;
+    iov[niov++].iov_len = len;
+
+    s->flushes++;
+    while (i < niov) {
+	cmdtime_netstart();
+	n = writev(s->fd, iov + i, niov - i);
+	cmdtime_netend();
+	s->syscalls++;
+
+	if (n == -1) {
+	    if (errno == EINTR && !signals_poll()) continue;
+	    s->error = xstrdup(strerror(errno));
+	    break;
+	}
+
+	s->flush_bytes += n;
+	while (i < niov && (size_t) n >= iov[i].iov_len)
+	    n -= iov[i++].iov_len;
+	if (i < niov) {
+	    iov[i].iov_base = (char *) iov[i].iov_base + n;
+	    iov[i].iov_len -= n;
+	}
+    }
+
+    s->ptr = s->buf;
+    s->cnt = s->maxplain;
+    s->bulk++;
+
+    return s->error ? EOF : 0;
+}
+
+/*
+ * Grow an output buffer that keeps filling up, so bulk output goes out
+ * in fewer, larger writes.  Returns 0 if it can't get any bigger.
+ */
+static int prot_growbuf(struct protstream *s)
+{
+    unsigned used = s->ptr - s->buf;
+    unsigned size = s->buf_size * 2;
+
+    /* a SASL layer has its own limit on how much it can take */
+    if (s->saslssf || s->buf_size >= PROT_BUFSIZE_MAX) return 0;
+    if (size > PROT_BUFSIZE_MAX) size = PROT_BUFSIZE_MAX;
+
+    s->buf = (unsigned char *) xrealloc(s->buf, size);
+    s->buf_size = size;
+    s->maxplain = size;
+    s->ptr = s->buf + used;
+    s->cnt = size - used;
+
+#ifdef HAVE_ZLIB
+    /* and save prot_flush_encode() growing it piecemeal */
+    if (s->zstrm && s->zbuf_size < size + 6) {
+	s->zbuf_size = size + 6;
+	s->zbuf = (unsigned char *) xrealloc(s->zbuf, s->zbuf_size);
+    }
+#endif /* HAVE_ZLIB */
+
+    return 1;
+}
+
+/*
+ * Drop an empty buffer back to the default size, so that idle
+ * connections don't hang onto memory from their last bulk transfer.
+ */
+static void prot_shrinkbuf(struct protstream *s)
+{
+    if (s->buf_size <= PROT_BUFSIZE) return;
+
+    s->buf = (unsigned char *) xrealloc(s->buf, PROT_BUFSIZE);
+    s->buf_size = PROT_BUFSIZE;
+    if (s->write) {
+	s->ptr = s->buf;
+	if (s->maxplain > PROT_BUFSIZE) s->maxplain = PROT_BUFSIZE;
+	s->cnt = s->maxplain;
+    }
+
+#ifdef HAVE_ZLIB
+    if (s->write && s->zstrm && s->zbuf_size > PROT_BUFSIZE + 6) {
+	s->zbuf_size = PROT_BUFSIZE + 6;
+	s->zbuf = (unsigned char *) xrealloc(s->zbuf, s->zbuf_size);
+    }
+#endif /* HAVE_ZLIB */
+}
+
+/*
+ * Drop the buffer of a stream with nothing pending in it back to the
+ * default size, e.g. when the connection is about to sit idle.
+ */
+EXPORTED void prot_trim(struct protstream *s)
+{
+    if (s->write) {
+	if (s->ptr == s->buf && s->big_buffer == PROT_NO_FD)
+	    prot_shrinkbuf(s);
+	s->bulk = 0;
+    }
+    else if (!s->cnt && !s->fixedsize && s->buf_size > PROT_BUFSIZE) {
+	unsigned char *end = s->buf + s->buf_size;
+
+#ifdef HAVE_ZLIB
+	/* the unread input may still be in the buffer */
+	if (s->zstrm && s->zstrm->avail_in) return;
+#endif /* HAVE_ZLIB */
+
+	if (s->ptr >= s->buf && s->ptr <= end) {
+	    /* keep what prot_ungetc() might want back, up to a
+	     * default buffer's worth */
+	    unsigned keep = s->can_unget;
+	    if (keep > (unsigned) (s->ptr - s->buf))
+		keep = s->ptr - s->buf;
+	    if (keep > PROT_BUFSIZE)
+		keep = PROT_BUFSIZE;
+	    memmove(s->buf, s->ptr - keep, keep);
+	    prot_shrinkbuf(s);
+	    s->ptr = s->buf + keep;
+	    s->can_unget = keep;
+	}
+	else {
+	    /* decoded input lives elsewhere */
+	    prot_shrinkbuf(s);
+	}
+    }
+}
+
 /*
  * Set the read timeout for the stream 's' to 'timeout' seconds.
  * 's' must have been created for reading.
@@ -718,14 +967,15 @@ EXPORTED int prot_fill(struct protstream *s)
 #ifdef HAVE_SSL	  
 	    /* just do a SSL read instead if we're under a tls layer */
 	    if (s->tls_conn != NULL) {
-		n = SSL_read(s->tls_conn, (char *) s->buf, PROT_BUFSIZE);
+		n = SSL_read(s->tls_conn, (char *) s->buf, s->buf_size);
 	    } else {
-		n = read(s->fd, s->buf, PROT_BUFSIZE);
+		n = read(s->fd, s->buf, s->buf_size);
 	    }
 #else  /* HAVE_SSL */
-	    n = read(s->fd, s->buf, PROT_BUFSIZE);
+	    n = read(s->fd, s->buf, s->buf_size);
 #endif /* HAVE_SSL */
 	    cmdtime_netend();
+	    s->syscalls++;
 	} while (n == -1 && errno == EINTR && !signals_poll());
 
 	if (n <= 0) {
@@ -733,7 +983,19 @@ EXPORTED int prot_fill(struct protstream *s)
 	    else s->eof = 1;
 	    return EOF;
 	}
-	
+
+	/* a full buffer means bulk input: take more at a time from now
+	 * on.  Go back to the default size once reads are small again.
+	 * Either way, realloc keeps the 'n' bytes we just read */
+	if ((unsigned) n == s->buf_size && s->buf_size < PROT_BUFSIZE_MAX) {
+	    s->buf_size *= 2;
+	    if (s->buf_size > PROT_BUFSIZE_MAX) s->buf_size = PROT_BUFSIZE_MAX;
+	    s->buf = (unsigned char *) xrealloc(s->buf, s->buf_size);
+	}
+	else if (n < PROT_BUFSIZE) {
+	    prot_shrinkbuf(s);
+	}
+
 	if (s->saslssf) { /* decode it */
 	    if (prot_sasldecode(s, n) == EOF) return EOF;
 	} else {
@@ -934,8 +1196,11 @@ static int prot_flush_writebuffer(struct protstream *s,
 	n = write(s->fd, buf, len);
 #endif /* HAVE_SSL */
 	cmdtime_netend();
+	s->syscalls++;
     } while (n == -1 && errno == EINTR && !signals_poll());
 
+    if (n > 0) s->flush_bytes += n;
+
     return n;
 }
 
@@ -969,6 +1234,9 @@ int prot_flush_internal(struct protstream *s, int force)
     
     /* end protstream setup */
 
+    if (left || s->big_buffer != PROT_NO_FD)
+	s->flushes++;
+
     /* if writing to a buffer, just append the lot.  Always works */
     if (s->writetobuf) {
 	buf_appendmap(s->writetobuf, ptr, left);
@@ -1126,6 +1394,14 @@ int prot_flush_internal(struct protstream *s, int force)
     /* Reset the memory buffer -- should be done on EOF or on success. */
     s->ptr = s->buf;
     s->cnt = s->maxplain;
+
+    /* a forced flush is the end of a response or the start of a wait
+     * for input - if nothing bulky went out since the last one, this
+     * stream is idle enough to give back any extra buffer space */
+    if (force) {
+	if (!s->bulk) prot_shrinkbuf(s);
+	s->bulk = 0;
+    }
         
  done:
     /* are we done with the big buffer? If so, free it. This includes
@@ -1195,9 +1471,30 @@ EXPORTED int prot_write(struct protstream *s, const char *buf, unsigned len)
 	s->boundary = 0;
     }
 
+    s->bytes_out += len;
+
+#ifdef USE_SENDFILE
+    /* large chunks of a file we've been told about go straight out */
+    if (s->sendfile_fd != PROT_NO_FD && len >= PROT_SENDFILE_MIN &&
+	buf >= s->sendfile_base &&
+	buf + len <= s->sendfile_base + s->sendfile_len &&
+	prot_cansendfile(s)) {
+	int r = prot_sendfile(s, buf, len);
+	if (r != 1) return r;
+    }
+#endif /* USE_SENDFILE */
+
+    /* anything that won't fit, on a stream with nothing to transform
+     * it, goes out from where it is along with what's buffered */
+    if (len >= s->cnt && len >= PROT_BUFSIZE && prot_isplain(s) &&
+	!s->dontblock && s->big_buffer == PROT_NO_FD)
+	return prot_writev(s, buf, len);
+
     while (len >= s->cnt) {
-	/* XXX can we manage to write data from 'buf' without copying it
-	   to s->ptr ? */
+	/* bulk output: try taking more at a time before flushing */
+	s->bulk++;
+	if (prot_growbuf(s)) continue;
+
 	memcpy(s->ptr, buf, s->cnt);
 	s->ptr += s->cnt;
 	buf += s->cnt;
@@ -1208,7 +1505,6 @@ EXPORTED int prot_write(struct protstream *s, const char *buf, unsigned len)
     memcpy(s->ptr, buf, len);
     s->ptr += len;
     s->cnt -= len;
-    s->bytes_out += len;
     if (s->error || s->eof) return EOF;
 
     assert(s->cnt > 0);
@@ -64,8 +64,14 @@
 #define PROT_BUFSIZE 4096
 /* #define PROT_BUFSIZE 8192 */
 
+/* buffers grow for bulk transfers up to this, and drop back when idle */
+#define PROT_BUFSIZE_MAX (16 * PROT_BUFSIZE)
+
 #define PROT_NO_FD -1
 
+/* below this, copying through the buffer is cheaper than sendfile() */
+#define PROT_SENDFILE_MIN (4 * PROT_BUFSIZE)
+
 struct protstream;
 struct prot_waitevent;
 
@@ -109,6 +115,11 @@ struct protstream {
     size_t bigbuf_len; /* Length of mapped file */
     size_t bigbuf_pos; /* Current Position */
 
+    /* Sendfile Information */
+    int sendfile_fd;           /* File to send mapped data from (or PROT_NO_FD) */
+    const char *sendfile_base; /* Where the file is mapped */
+    size_t sendfile_len;       /* Length of the mapping */
+
     /* Status Flags */
     int eof;
     int boundary; /* Type of data is about to change */
@@ -130,6 +141,14 @@ struct protstream {
     int bytes_out;
     int isclient;
 
+    /* Adaptive Buffer Sizing */
+    int bulk; /* Times the buffer filled up since last idle */
+
+    /* Statistics */
+    unsigned syscalls;         /* Reads or writes on the descriptor */
+    unsigned flushes;          /* Flushes of buffered output */
+    unsigned long flush_bytes; /* Bytes written by flushes */
+
     /* Events */
     prot_readcallback_t *readcallback_proc;
     void *readcallback_rock;
@@ -197,6 +216,11 @@ extern int prot_bytes_out(struct protstream *s);
 #define prot_bytes_in(s) ((s)->bytes_in)
 #define prot_bytes_out(s) ((s)->bytes_out)
 
+/* Get system call and flush counts */
+#define prot_syscalls(s) ((s)->syscalls)
+#define prot_flushes(s) ((s)->flushes)
+#define prot_flush_bytes(s) ((s)->flush_bytes)
+
 /* Set the SASL options for a protstream (requires authentication to
  * be complete for the given sasl_conn_t */
 extern int prot_setsasl(struct protstream *s, sasl_conn_t *conn);
@@ -220,6 +244,16 @@ int prot_setcompress(struct protstream *s);
 /* Tell the protstream that the type of data is about to change. */
 int prot_data_boundary(struct protstream *s);
 
+/* Let prot_write() send data which lies within 'base' (the mapping of
+ * 'fd') straight from the file when the stream is plaintext.  Returns
+ * -1 if the stream can't do that anyway.  Pass PROT_NO_FD to clear. */
+extern int prot_setsendfile(struct protstream *s, int fd,
+			    const char *base, size_t len);
+extern int prot_cansendfile(struct protstream *s);
+
+/* Give back any extra buffer space while the stream is idle */
+extern void prot_trim(struct protstream *s);
+
 /* Set a timeout for the connection (in seconds) */
 extern int prot_settimeout(struct protstream *s, int timeout);
 
@@ -350,7 +350,7 @@ EXPORTED int cyrus_close_sock(int fd)
     return close(fd);
 }
 
-EXPORTED void cyrus_reset_stdio(void)
+static void reset_stdio(int shut)
 {
     int devnull = open("/dev/null", O_RDWR, 0);
     
@@ -359,20 +359,32 @@ EXPORTED void cyrus_reset_stdio(void)
     }
     
     /* stdin */
-    shutdown(0, SHUT_RD);
+    if (shut) shutdown(0, SHUT_RD);
     dup2(devnull, 0);
     
     /* stdout */
-    shutdown(1, SHUT_RD);
+    if (shut) shutdown(1, SHUT_RD);
     dup2(devnull, 1);
     
     /* stderr */
-    shutdown(2, SHUT_RD);
+    if (shut) shutdown(2, SHUT_RD);
     dup2(devnull, 2);
 
     if (devnull > 2) close(devnull);
 }
 
+EXPORTED void cyrus_reset_stdio(void)
+{
+    reset_stdio(1);
+}
+
+/* like cyrus_reset_stdio(), but leaves the connection itself alone,
+ * for when another process has been given it to carry on with */
+EXPORTED void cyrus_release_stdio(void)
+{
+    reset_stdio(0);
+}
+
 /* Given a directory, create a unique temporary file open for
  * reading and writing and return the file descriptor.
  *
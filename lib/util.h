@@ -176,6 +176,9 @@ extern int cyrus_close_sock(int fd);
 /* Reset stdin/stdout/stderr */
 extern void cyrus_reset_stdio(void);
 
+/* Reset stdin/stdout/stderr without shutting down the connection */
+extern void cyrus_release_stdio(void);
+
 /* Create all parent directories for the given path,
  * up to but not including the basename.
  */